@@ -14,6 +14,10 @@ typedef struct OpenCL {
     cl::Platform platform;
     oul::GarbageCollector * GC;
     oul::Context oulContext;
+    std::string programFilename; // Source and build options of program, for the specialized kernels
+    std::string programBuildOptions;
+    bool useBufferKernels; // Use bufferProgram, the kernels of kernels_buffers.cl, where it has them
+    cl::Program bufferProgram;
 } OpenCL;
 
 #ifdef WIN32
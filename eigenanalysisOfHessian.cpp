@@ -1,7 +1,8 @@
 #include "eigenanalysisOfHessian.hpp"
 #include "SIPL/Types.hpp"
+#include "tubeDirectionField.hpp"
 using namespace SIPL;
-#define MAX(a,b) a > b ? a : b
+#define MAX(a,b) ((a) > (b) ? (a) : (b))
 
 
 
@@ -248,7 +249,7 @@ void tql2(float V[SIZE][SIZE], float d[SIZE], float e[SIZE]) {
   }
 }
 
-void eigen_decomposition(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
+void eigen_decomposition_ql(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
   float e[SIZE];
   for (int i = 0; i < SIZE; i++) {
     for (int j = 0; j < SIZE; j++) {
@@ -259,6 +260,181 @@ void eigen_decomposition(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]
   tql2(V, d, e);
 }
 
+static inline void cross3(const float a[3], const float b[3], float c[3]) {
+  c[0] = a[1]*b[2] - a[2]*b[1];
+  c[1] = a[2]*b[0] - a[0]*b[2];
+  c[2] = a[0]*b[1] - a[1]*b[0];
+}
+
+static inline float dot3(const float a[3], const float b[3]) {
+  return a[0]*b[0] + a[1]*b[1] + a[2]*b[2];
+}
+
+// Eigenvector of a simple eigenvalue, the largest cross product of two rows
+// of A - eigenvalue*I
+static void eigenvectorFromRows(float A[SIZE][SIZE], float eigenvalue, float v[3]) {
+  float rows[3][3];
+  for (int i = 0; i < 3; i++) {
+    for (int j = 0; j < 3; j++) {
+      rows[i][j] = A[i][j] - (i == j ? eigenvalue : 0.0f);
+    }
+  }
+  float c[3][3];
+  cross3(rows[0], rows[1], c[0]);
+  cross3(rows[0], rows[2], c[1]);
+  cross3(rows[1], rows[2], c[2]);
+  int best = 0;
+  float bestLength = dot3(c[0], c[0]);
+  for (int i = 1; i < 3; i++) {
+    const float length = dot3(c[i], c[i]);
+    if (length > bestLength) {
+      best = i;
+      bestLength = length;
+    }
+  }
+  const float invLength = 1.0f / sqrt(bestLength);
+  for (int i = 0; i < 3; i++) {
+    v[i] = c[best][i] * invLength;
+  }
+}
+
+// Eigenvector of the eigenvalue in the plane orthogonal to the unit vector
+// v0, found as the null vector of A - eigenvalue*I restricted to the plane
+static void eigenvectorInPlane(float A[SIZE][SIZE], float eigenvalue, const float v0[3], float v[3]) {
+  float u[3], w[3];
+  if (fabs(v0[0]) > fabs(v0[1])) {
+    const float invLength = 1.0f / sqrt(v0[0]*v0[0] + v0[2]*v0[2]);
+    u[0] = -v0[2] * invLength;
+    u[1] = 0.0f;
+    u[2] = v0[0] * invLength;
+  } else {
+    const float invLength = 1.0f / sqrt(v0[1]*v0[1] + v0[2]*v0[2]);
+    u[0] = 0.0f;
+    u[1] = v0[2] * invLength;
+    u[2] = -v0[1] * invLength;
+  }
+  cross3(v0, u, w);
+  float Au[3], Aw[3];
+  for (int i = 0; i < 3; i++) {
+    Au[i] = dot3(A[i], u) - eigenvalue * u[i];
+    Aw[i] = dot3(A[i], w) - eigenvalue * w[i];
+  }
+  float m00 = dot3(u, Au);
+  float m01 = dot3(u, Aw);
+  float m11 = dot3(w, Aw);
+  float a = 1.0f, b = 0.0f; // v = a*u - b*w
+  if (fabs(m00) >= fabs(m11)) {
+    if (fabs(m00) >= fabs(m01) && m00 != 0.0f) {
+      m01 /= m00;
+      m00 = 1.0f / sqrt(1.0f + m01*m01);
+      a = m01 * m00;
+      b = m00;
+    } else if (m01 != 0.0f) {
+      m00 /= m01;
+      m01 = 1.0f / sqrt(1.0f + m00*m00);
+      a = m01;
+      b = m00 * m01;
+    }
+  } else {
+    if (fabs(m11) >= fabs(m01)) {
+      m01 /= m11;
+      m11 = 1.0f / sqrt(1.0f + m01*m01);
+      a = m11;
+      b = m01 * m11;
+    } else {
+      m11 /= m01;
+      m01 = 1.0f / sqrt(1.0f + m11*m11);
+      a = m11 * m01;
+      b = m01;
+    }
+  }
+  for (int i = 0; i < 3; i++) {
+    v[i] = a * u[i] - b * w[i];
+  }
+}
+
+// Closed form eigen decomposition. The eigenvalues are found with the
+// trigonometric solution of the characteristic equation. The eigenvector of
+// the eigenvalue furthest from the other two is found first, as it is the
+// best conditioned.
+void eigen_decomposition_analytic(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
+  float maxAbs = 0.0f;
+  for (int i = 0; i < SIZE; i++) {
+    for (int j = i; j < SIZE; j++) {
+      maxAbs = MAX(maxAbs, fabs(A[i][j]));
+    }
+  }
+  float B[SIZE][SIZE];
+  float vectors[3][3] = {{1.0f, 0.0f, 0.0f}, {0.0f, 1.0f, 0.0f}, {0.0f, 0.0f, 1.0f}};
+  const float invMaxAbs = maxAbs > 0.0f ? 1.0f / maxAbs : 0.0f;
+  for (int i = 0; i < SIZE; i++) {
+    for (int j = 0; j < SIZE; j++) {
+      B[i][j] = A[i][j] * invMaxAbs;
+    }
+    d[i] = B[i][i];
+  }
+
+  const float offDiagonal = B[0][1]*B[0][1] + B[0][2]*B[0][2] + B[1][2]*B[1][2];
+  if (offDiagonal > 0.0f) {
+    const float q = (B[0][0] + B[1][1] + B[2][2]) / 3.0f;
+    const float b00 = B[0][0] - q;
+    const float b11 = B[1][1] - q;
+    const float b22 = B[2][2] - q;
+    const float p = sqrt((b00*b00 + b11*b11 + b22*b22 + 2.0f*offDiagonal) / 6.0f);
+    const float c00 = b11*b22 - B[1][2]*B[1][2];
+    const float c01 = B[0][1]*b22 - B[1][2]*B[0][2];
+    const float c02 = B[0][1]*B[1][2] - b11*B[0][2];
+    float halfDet = 0.5f * (b00*c00 - B[0][1]*c01 + B[0][2]*c02) / (p*p*p);
+    halfDet = halfDet < -1.0f ? -1.0f : (halfDet > 1.0f ? 1.0f : halfDet);
+    const float angle = acos(halfDet) / 3.0f;
+    const float beta2 = 2.0f * cos(angle);
+    const float beta0 = 2.0f * cos(angle + 2.0943951f);
+    const float beta1 = -(beta0 + beta2);
+    d[0] = q + p * beta0;
+    d[1] = q + p * beta1;
+    d[2] = q + p * beta2;
+    if (halfDet >= 0.0f) {
+      eigenvectorFromRows(B, d[2], vectors[2]);
+      eigenvectorInPlane(B, d[1], vectors[2], vectors[1]);
+      cross3(vectors[1], vectors[2], vectors[0]);
+    } else {
+      eigenvectorFromRows(B, d[0], vectors[0]);
+      eigenvectorInPlane(B, d[1], vectors[0], vectors[1]);
+      cross3(vectors[0], vectors[1], vectors[2]);
+    }
+  }
+
+  // Sort by absolute value like tql2
+  int order[3] = {0, 1, 2};
+  for (int i = 0; i < SIZE-1; i++) {
+    for (int j = i+1; j < SIZE; j++) {
+      if (fabs(d[order[j]]) < fabs(d[order[i]])) {
+        const int k = order[i];
+        order[i] = order[j];
+        order[j] = k;
+      }
+    }
+  }
+  float sorted[3];
+  for (int i = 0; i < SIZE; i++) {
+    sorted[i] = d[order[i]] * maxAbs;
+    for (int j = 0; j < SIZE; j++) {
+      V[j][i] = vectors[order[i]][j];
+    }
+  }
+  for (int i = 0; i < SIZE; i++) {
+    d[i] = sorted[i];
+  }
+}
+
+void eigen_decomposition(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
+#ifdef ANALYTIC_EIGEN
+  eigen_decomposition_analytic(A, V, d);
+#else
+  eigen_decomposition_ql(A, V, d);
+#endif
+}
+
 
 #define POS(pos) pos.x+pos.y*size.x+pos.z*size.x*size.y
 SIPL::float3 gradient(TubeSegmentation &TS, SIPL::int3 pos, int volumeComponent, int dimensions, int3 size) {
@@ -340,7 +516,25 @@ SIPL::float3 gradient(TubeSegmentation &TS, SIPL::int3 pos, int volumeComponent,
 }
 
 
+bool getStoredTubeDirection(TubeSegmentation &T, int3 pos, int3 size, float3 * e1) {
+    if(T.directions == NULL)
+        return false;
+    const int index = getTubeDirectionIndex(T.directionBricks, pos, size);
+    if(index < 0)
+        return false;
+    const short * direction = &T.directions[index*3];
+    if(direction[0] == 0 && direction[1] == 0 && direction[2] == 0)
+        return false;
+    e1->x = direction[0] / 32767.0f;
+    e1->y = direction[1] / 32767.0f;
+    e1->z = direction[2] / 32767.0f;
+    return true;
+}
+
 float3 getTubeDirection(TubeSegmentation &T, int3 pos, int3 size) {
+    float3 stored;
+    if(getStoredTubeDirection(T, pos, size, &stored))
+        return stored;
 
     // Do gradient on Fx, Fy and Fz and normalization
     float3 Fx = gradient(T, pos,0,1,size);
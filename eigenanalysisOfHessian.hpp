@@ -6,6 +6,20 @@ using namespace SIPL;
 
 void doEigen(TubeSegmentation &T, int3 pos, int3 size, float3 * lambda, float3 * e1, float3 * e2, float3 * e3);
 
+// Uses the tube direction field of T if the direction of pos is stored in it
 float3 getTubeDirection(TubeSegmentation &T, int3 pos, int3 size);
 
+// Returns false if T has no tube direction field or pos is not stored in it
+bool getStoredTubeDirection(TubeSegmentation &T, int3 pos, int3 size, float3 * e1);
+
+/*
+ * Eigen decomposition of a symmetric 3x3 matrix. The eigenvalues d are sorted
+ * by increasing absolute value and the eigenvectors are the columns of V.
+ * eigen_decomposition uses the closed form solver if ANALYTIC_EIGEN is
+ * defined and Householder reduction with QL iterations otherwise.
+ */
+void eigen_decomposition(float A[3][3], float V[3][3], float d[3]);
+void eigen_decomposition_ql(float A[3][3], float V[3][3], float d[3]);
+void eigen_decomposition_analytic(float A[3][3], float V[3][3], float d[3]);
+
 #endif
@@ -1,6 +1,13 @@
 #include "gradientVectorFlow.hpp"
 #include <iostream>
 #include <algorithm>
+#include <cmath>
+#include <vector>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#include "SIPL/Exceptions.hpp"
+#include "timing.hpp"
 
 #undef min
 #undef max
@@ -399,239 +406,79 @@ SIPL::int3 calculateNewSize(SIPL::int3 size) {
 
 }
 
-void multigridVcycle(
+/*
+ * Create the sizes of all grids, finest first. The coarsest grid is at least
+ * multigridMinSize voxels wide in each direction.
+ */
+static const int multigridMinSize = 8;
+
+std::vector<SIPL::int3> calculateMultigridSizes(SIPL::int3 size) {
+    std::vector<SIPL::int3> sizes;
+    sizes.push_back(size);
+    while(true) {
+        SIPL::int3 newSize = calculateNewSize(sizes.back());
+        if(newSize.x < multigridMinSize)
+            break;
+        sizes.push_back(newSize);
+    }
+    return sizes;
+}
+
+// The coarsest grid is small, so it is smoothed until it is close to converged
+static const int coarsestGridSmoothing = 20;
+
+void multigridCycle(
         OpenCL &ocl,
         Image3D &r_l,
         Image3D &v_l,
-        Image3D &sqrMag,
+        std::vector<Image3D> &sqrMag,
+        std::vector<SIPL::int3> &sizes,
         int l,
         int v1,
         int v2,
-        int l_max,
+        MultigridCycle cycle,
         float mu,
         float spacing,
-        SIPL::int3 size,
         int imageType,
         int bufferSize,
         bool no3Dwrite
         ) {
+    const int l_max = sizes.size()-1;
+    if(l == l_max) {
+        gaussSeidelSmoothing(ocl,v_l,r_l,sqrMag[l],coarsestGridSmoothing,sizes[l],mu,spacing,imageType,bufferSize,no3Dwrite);
+        return;
+    }
 
     // Pre-smoothing
-    gaussSeidelSmoothing(ocl,v_l,r_l,sqrMag,v1,size,mu,spacing,imageType,bufferSize,no3Dwrite);
-
-    if(l < l_max) {
-        SIPL::int3 newSize = calculateNewSize(size);
-
-        // Compute new residual
-        Image3D p_l = residual(ocl, r_l, v_l, sqrMag, mu, spacing, size,imageType,bufferSize,no3Dwrite);
+    gaussSeidelSmoothing(ocl,v_l,r_l,sqrMag[l],v1,sizes[l],mu,spacing,imageType,bufferSize,no3Dwrite);
 
-        // Restrict residual
-        Image3D r_l_p1 = restrictVolume(ocl, p_l, newSize,imageType,bufferSize,no3Dwrite);
+    // Compute new residual
+    Image3D p_l = residual(ocl, r_l, v_l, sqrMag[l], mu, spacing, sizes[l],imageType,bufferSize,no3Dwrite);
 
-        // Restrict sqrMag
-        Image3D sqrMag_l_p1 = restrictVolume(ocl, sqrMag, newSize,imageType,bufferSize,no3Dwrite);
+    // Restrict residual
+    Image3D r_l_p1 = restrictVolume(ocl, p_l, sizes[l+1],imageType,bufferSize,no3Dwrite);
 
-        // Initialize v_l_p1
-        Image3D v_l_p1 = initSolutionToZero(ocl,newSize,imageType,bufferSize,no3Dwrite);
+    // Initialize v_l_p1
+    Image3D v_l_p1 = initSolutionToZero(ocl,sizes[l+1],imageType,bufferSize,no3Dwrite);
 
-        // Solve recursively
-        multigridVcycle(ocl, r_l_p1, v_l_p1, sqrMag_l_p1, l+1,v1,v2,l_max,mu,spacing*2,newSize,imageType,bufferSize,no3Dwrite);
-
-        // Prolongate
-        v_l = prolongateVolume(ocl, v_l, v_l_p1, size,imageType,bufferSize,no3Dwrite);
-    }
-
-    // Post-smoothing
-    gaussSeidelSmoothing(ocl,v_l,r_l,sqrMag,v2,size,mu,spacing,imageType,bufferSize,no3Dwrite);
-}
-
-/*
-Image3D runMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size) {
-
-    const int GVFIterations = getParam(parameters, "gvf-iterations");
-    const bool no3Dwrite = !getParamBool(parameters, "3d_write");
-    const float MU = getParam(parameters, "gvf-mu");
-    const int totalSize = size.x*size.y*size.z;
-    const bool use16bit = getParamBool(parameters, "16bit-vectors");
-    int imageType;
-    if(use16bit) {
-        imageType = CL_SNORM_INT16;
+    // Solve recursively. A W-cycle visits the coarser grid twice and an
+    // F-cycle does an F-cycle followed by a V-cycle on the coarser grid.
+    if(cycle == MG_V_CYCLE) {
+        multigridCycle(ocl, r_l_p1, v_l_p1, sqrMag, sizes, l+1,v1,v2,MG_V_CYCLE,mu,spacing*2,imageType,bufferSize,no3Dwrite);
+    } else if(cycle == MG_W_CYCLE) {
+        multigridCycle(ocl, r_l_p1, v_l_p1, sqrMag, sizes, l+1,v1,v2,MG_W_CYCLE,mu,spacing*2,imageType,bufferSize,no3Dwrite);
+        multigridCycle(ocl, r_l_p1, v_l_p1, sqrMag, sizes, l+1,v1,v2,MG_W_CYCLE,mu,spacing*2,imageType,bufferSize,no3Dwrite);
     } else {
-        imageType = CL_FLOAT;
-    }
-
-    Kernel initKernel = Kernel(ocl.program, "MGGVFInit");
-
-    int v1 = 2;
-    int v2 = 2;
-    int l_max = 6; // TODO this should be calculated
-    float spacing = 1.0f;
-
-    // create sqrMag
-    Kernel createSqrMagKernel(ocl.program, "createSqrMag");
-    Image3D sqrMag = Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_R, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-
-    createSqrMagKernel.setArg(0, *vectorField);
-    createSqrMagKernel.setArg(1, sqrMag);
-    ocl.queue.enqueueNDRangeKernel(
-            createSqrMagKernel,
-            NullRange,
-            NDRange(size.x,size.y,size.z),
-            NullRange
-    );
-    std::cout << "sqrMag created" << std::endl;
-
-    // create fx and rx
-    Image3D fx = Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_R, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-    Image3D *rx = new Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_R, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-    ocl.GC->addMemoryObject(rx);
-    initKernel.setArg(0, *vectorField);
-    initKernel.setArg(1, fx);
-    initKernel.setArg(2, *rx);
-    initKernel.setArg(3, 1);
-    ocl.queue.enqueueNDRangeKernel(
-            initKernel,
-            NullRange,
-            NDRange(size.x,size.y,size.z),
-            NullRange
-    );
-    std::cout << "fx initialized" << std::endl;
-
-    // X component
-    for(int i = 0; i < GVFIterations; i++) {
-        multigridVcycle(ocl,*rx,fx,sqrMag,0,v1,v2,l_max,MU,spacing,size,imageType);
-        ocl.queue.finish();
-    }
-    std::cout << "fx finished" << std::endl;
-
-    // delete rx
-    ocl.GC->deleteMemoryObject(rx);
-
-    // create fy and ry
-    Image3D fy = Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_R, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-    Image3D *ry = new Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_R, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-    ocl.GC->addMemoryObject(ry);
-    initKernel.setArg(0, *vectorField);
-    initKernel.setArg(1, fy);
-    initKernel.setArg(2, *ry);
-    initKernel.setArg(3, 2);
-    ocl.queue.enqueueNDRangeKernel(
-            initKernel,
-            NullRange,
-            NDRange(size.x,size.y,size.z),
-            NullRange
-    );
-    std::cout << "fy initialized" << std::endl;
-    // Y component
-    for(int i = 0; i < GVFIterations; i++) {
-        multigridVcycle(ocl,*ry,fy,sqrMag,0,v1,v2,l_max,MU,spacing,size,imageType);
-        ocl.queue.finish();
-    }
-    std::cout << "fy finished" << std::endl;
-
-    // delete ry
-    ocl.GC->deleteMemoryObject(ry);
-    // create fz and rz
-    Image3D fz = Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_R, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-    Image3D *rz = new Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_R, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-    ocl.GC->addMemoryObject(rz);
-    initKernel.setArg(0, *vectorField);
-    initKernel.setArg(1, fz);
-    initKernel.setArg(2, *rz);
-    initKernel.setArg(3, 3);
-    ocl.queue.enqueueNDRangeKernel(
-            initKernel,
-            NullRange,
-            NDRange(size.x,size.y,size.z),
-            NullRange
-    );
-    std::cout << "fz initialized" << std::endl;
-    ocl.GC->deleteMemoryObject(vectorField);
-    // Z component
-    for(int i = 0; i < GVFIterations; i++) {
-        multigridVcycle(ocl,*rz,fz,sqrMag,0,v1,v2,l_max,MU,spacing,size,imageType);
-        ocl.queue.finish();
+        multigridCycle(ocl, r_l_p1, v_l_p1, sqrMag, sizes, l+1,v1,v2,MG_F_CYCLE,mu,spacing*2,imageType,bufferSize,no3Dwrite);
+        multigridCycle(ocl, r_l_p1, v_l_p1, sqrMag, sizes, l+1,v1,v2,MG_V_CYCLE,mu,spacing*2,imageType,bufferSize,no3Dwrite);
     }
-    std::cout << "fz finished" << std::endl;
-
-    // delete rz
-    ocl.GC->deleteMemoryObject(rz);
 
+    // Prolongate
+    v_l = prolongateVolume(ocl, v_l, v_l_p1, sizes[l],imageType,bufferSize,no3Dwrite);
 
-    Image3D finalVectorField = Image3D(
-            ocl.context,
-            CL_MEM_READ_WRITE,
-            ImageFormat(CL_RGBA, imageType),
-            size.x,
-            size.y,
-            size.z
-    );
-    Kernel finalizeKernel = Kernel(ocl.program, "MGGVFFinish");
-    finalizeKernel.setArg(0, fx);
-    finalizeKernel.setArg(1, fy);
-    finalizeKernel.setArg(2, fz);
-    finalizeKernel.setArg(3, finalVectorField);
-    ocl.queue.enqueueNDRangeKernel(
-            finalizeKernel,
-            NullRange,
-            NDRange(size.x,size.y,size.z),
-            NullRange
-    );
-    std::cout << "MG GVF finished" << std::endl;
-
-
-    return finalVectorField;
+    // Post-smoothing
+    gaussSeidelSmoothing(ocl,v_l,r_l,sqrMag[l],v2,sizes[l],mu,spacing,imageType,bufferSize,no3Dwrite);
 }
-*/
 
 Image3D computeNewResidual(
         OpenCL &ocl,
@@ -698,44 +545,195 @@ Image3D computeNewResidual(
 
 Image3D fullMultigrid(
         OpenCL &ocl,
-        Image3D &r_l,
-        Image3D &sqrMag,
+        std::vector<Image3D> &r,
+        std::vector<Image3D> &sqrMag,
+        std::vector<SIPL::int3> &sizes,
         int l,
         int v0,
         int v1,
         int v2,
-        int l_max,
+        MultigridCycle cycle,
         float mu,
         float spacing,
-        SIPL::int3 size,
         int imageType,
         int bufferSize,
         bool no3Dwrite
         ) {
+    const int l_max = sizes.size()-1;
     Image3D v_l;
     if(l < l_max) {
-        SIPL::int3 newSize = calculateNewSize(size);
-        Image3D r_l_p1 = restrictVolume(ocl, r_l, newSize, imageType,bufferSize,no3Dwrite);
-        Image3D sqrMag_l = restrictVolume(ocl,sqrMag,newSize,imageType,bufferSize,no3Dwrite);
-        Image3D v_l_p1 = fullMultigrid(ocl,r_l_p1,sqrMag_l,l+1,v0,v1,v2,l_max,mu,spacing*2,newSize, imageType,bufferSize,no3Dwrite);
-        v_l = prolongateVolume2(ocl,v_l_p1, size,imageType,bufferSize,no3Dwrite);
+        Image3D v_l_p1 = fullMultigrid(ocl,r,sqrMag,sizes,l+1,v0,v1,v2,cycle,mu,spacing*2,imageType,bufferSize,no3Dwrite);
+        v_l = prolongateVolume2(ocl,v_l_p1, sizes[l],imageType,bufferSize,no3Dwrite);
     } else {
-        v_l = initSolutionToZero(ocl,size,imageType,bufferSize,no3Dwrite);
+        v_l = initSolutionToZero(ocl,sizes[l],imageType,bufferSize,no3Dwrite);
     }
 
     for(int i = 0; i < v0; i++) {
-        multigridVcycle(ocl,r_l,v_l,sqrMag,l,v1,v2,l_max,mu,spacing,size,imageType,bufferSize,no3Dwrite);
+        multigridCycle(ocl,r[l],v_l,sqrMag,sizes,l,v1,v2,cycle,mu,spacing,imageType,bufferSize,no3Dwrite);
     }
 
     return v_l;
+}
 
+Image3D addImages(
+        OpenCL &ocl,
+        Image3D &a,
+        Image3D &b,
+        SIPL::int3 size,
+        int imageType,
+        int bufferSize,
+        bool no3Dwrite
+        ) {
+    Image3D result = Image3D(
+        ocl.context,
+        CL_MEM_READ_WRITE,
+        ImageFormat(CL_R, imageType),
+        size.x,
+        size.y,
+        size.z
+    );
+    Kernel addKernel(ocl.program, "addTwoImages");
+    addKernel.setArg(0, a);
+    addKernel.setArg(1, b);
+    if(no3Dwrite) {
+        cl::size_t<3> offset;
+		offset[0] = 0;
+		offset[1] = 0;
+		offset[2] = 0;
+		cl::size_t<3> region;
+		region[0] = size.x;
+		region[1] = size.y;
+		region[2] = size.z;
+        Buffer resultBuffer = Buffer(ocl.context, CL_MEM_WRITE_ONLY, bufferSize*size.x*size.y*size.z);
+        addKernel.setArg(2, resultBuffer);
+        ocl.queue.enqueueNDRangeKernel(
+                addKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NDRange(4,4,4)
+        );
+        ocl.queue.enqueueCopyBufferToImage(resultBuffer, result,0,offset,region);
+    } else {
+        addKernel.setArg(2, result);
+        ocl.queue.enqueueNDRangeKernel(
+                addKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NDRange(4,4,4)
+        );
+    }
+    return result;
 }
 
-Image3D runFMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size) {
+template <class T>
+static double sumOfSquares(const std::vector<T> &data, double scale) {
+    double sum = 0.0;
+    const int n = data.size();
+#pragma omp parallel for reduction(+:sum)
+    for(int i = 0; i < n; i++) {
+        const double value = data[i]*scale;
+        sum += value*value;
+    }
+    return sum;
+}
 
-    const int GVFIterations = getParam(parameters, "gvf-iterations");
-    const bool no3Dwrite = !getParamBool(parameters, "3d_write");
+// Root mean square of a residual image
+static float getResidualNorm(OpenCL &ocl, Image3D &r, SIPL::int3 size, bool use16bit) {
+    const int totalSize = size.x*size.y*size.z;
+    cl::size_t<3> offset;
+    offset[0] = 0;
+    offset[1] = 0;
+    offset[2] = 0;
+    cl::size_t<3> region;
+    region[0] = size.x;
+    region[1] = size.y;
+    region[2] = size.z;
+    double sum;
+    if(use16bit) {
+        std::vector<short> data(totalSize);
+        ocl.queue.enqueueReadImage(r, CL_TRUE, offset, region, 0, 0, &data[0]);
+        sum = sumOfSquares(data, 1.0/32767.0);
+    } else {
+        std::vector<float> data(totalSize);
+        ocl.queue.enqueueReadImage(r, CL_TRUE, offset, region, 0, 0, &data[0]);
+        sum = sumOfSquares(data, 1.0);
+    }
+    return (float)sqrt(sum / totalSize);
+}
+
+MultigridCycle getMultigridCycle(paramList &parameters) {
+    std::string cycle = getParamStr(parameters, "gvf-mg-cycle");
+    if(cycle == "v") {
+        return MG_V_CYCLE;
+    } else if(cycle == "w") {
+        return MG_W_CYCLE;
+    } else if(cycle == "f") {
+        return MG_F_CYCLE;
+    } else {
+        return MG_FULL_MULTIGRID;
+    }
+}
+
+/*
+ * Solve the GVF equation of one vector component with defect correction.
+ * Each cycle computes the residual of the current solution on the finest
+ * grid and adds the correction found by multigrid. Stops when the residual is
+ * reduced by the factor gvf-mg-tolerance or after gvf-iterations cycles.
+ */
+static Image3D runMGGVFComponent(
+        OpenCL &ocl,
+        Image3D &vectorField,
+        std::vector<Image3D> &sqrMag,
+        std::vector<SIPL::int3> &sizes,
+        int component,
+        paramList &parameters,
+        int imageType,
+        int bufferSize,
+        bool no3Dwrite
+        ) {
+    const int maxCycles = getParam(parameters, "gvf-iterations");
     const float MU = getParam(parameters, "gvf-mu");
+    const float tolerance = getParam(parameters, "gvf-mg-tolerance");
+    const int smoothing = getParam(parameters, "gvf-mg-smoothing");
+    const bool use16bit = getParamBool(parameters, "16bit-vectors");
+    const MultigridCycle cycle = getMultigridCycle(parameters);
+    const float spacing = 1.0f;
+    const SIPL::int3 size = sizes[0];
+
+    Image3D f = initSolutionToZero(ocl,size,imageType,bufferSize,no3Dwrite);
+    float initialNorm = 0.0f;
+    for(int i = 0; i < maxCycles; i++) {
+        Image3D r = computeNewResidual(ocl,f,vectorField,MU,spacing,component,size,imageType,bufferSize,no3Dwrite);
+        const float norm = getResidualNorm(ocl, r, size, use16bit);
+        if(i == 0)
+            initialNorm = norm;
+        if(norm <= tolerance*initialNorm) {
+            std::cout << "MG GVF converged after " << i << " cycles" << std::endl;
+            break;
+        }
+
+        Image3D e;
+        if(cycle == MG_FULL_MULTIGRID) {
+            // Restrict the residual to all grids
+            std::vector<Image3D> residuals;
+            residuals.push_back(r);
+            for(unsigned int l = 1; l < sizes.size(); l++)
+                residuals.push_back(restrictVolume(ocl,residuals[l-1],sizes[l],imageType,bufferSize,no3Dwrite));
+            e = fullMultigrid(ocl,residuals,sqrMag,sizes,0,1,smoothing,smoothing,MG_V_CYCLE,MU,spacing,imageType,bufferSize,no3Dwrite);
+        } else {
+            e = initSolutionToZero(ocl,size,imageType,bufferSize,no3Dwrite);
+            multigridCycle(ocl,r,e,sqrMag,sizes,0,smoothing,smoothing,cycle,MU,spacing,imageType,bufferSize,no3Dwrite);
+        }
+        f = addImages(ocl,f,e,size,imageType,bufferSize,no3Dwrite);
+    }
+    ocl.queue.finish();
+
+    return f;
+}
+
+Image3D runMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size) {
+
+    const bool no3Dwrite = !getParamBool(parameters, "3d_write");
     const int totalSize = size.x*size.y*size.z;
     const bool use16bit = getParamBool(parameters, "16bit-vectors");
     int imageType, bufferTypeSize;
@@ -747,13 +745,8 @@ Image3D runFMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL
         bufferTypeSize = sizeof(float);
     }
 
-    Kernel initKernel = Kernel(ocl.program, "MGGVFInit");
-
-    int v0 = 1;
-    int v1 = 2;
-    int v2 = 2;
-    int l_max = 2; // TODO this should be calculated
-    float spacing = 1.0f;
+    std::vector<SIPL::int3> sizes = calculateMultigridSizes(size);
+    std::cout << "Running multigrid GVF with " << sizes.size() << " levels" << std::endl;
 
     // create sqrMag
     Kernel createSqrMagKernel(ocl.program, "createSqrMag");
@@ -799,170 +792,33 @@ Image3D runFMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL
                 NDRange(4,4,4)
         );
     }
-    std::cout << "sqrMag created" << std::endl;
 
-    Kernel addKernel(ocl.program, "addTwoImages");
-    Image3D fx = initSolutionToZero(ocl,size,imageType,bufferTypeSize,no3Dwrite);
+    // Restrict sqrMag to all grids once, it is the same for all cycles
+    std::vector<Image3D> sqrMags;
+    sqrMags.push_back(sqrMag);
+    for(unsigned int l = 1; l < sizes.size(); l++)
+        sqrMags.push_back(restrictVolume(ocl,sqrMags[l-1],sizes[l],imageType,bufferTypeSize,no3Dwrite));
+    std::cout << "sqrMag created" << std::endl;
 
-    // X component
-    for(int i = 0; i < GVFIterations; i++) {
-        Image3D rx = computeNewResidual(ocl,fx,*vectorField,MU,spacing,1,size,imageType,bufferTypeSize,no3Dwrite);
-        Image3D fx2 = fullMultigrid(ocl,rx,sqrMag,0,v0,v1,v2,l_max,MU,spacing,size,imageType,bufferTypeSize,no3Dwrite);
+    // The cycles are timed on their own to compare with the GVF iterations
+    const bool timing = getParamBool(parameters, "timing");
+    INIT_TIMER
+    if(timing) {
         ocl.queue.finish();
-        if(no3Dwrite) {
-            Buffer fx3 = Buffer(
-                    ocl.context,
-                    CL_MEM_WRITE_ONLY,
-                    totalSize*bufferTypeSize
-            );
-
-            addKernel.setArg(0,fx);
-            addKernel.setArg(1,fx2);
-            addKernel.setArg(2,fx3);
-            ocl.queue.enqueueNDRangeKernel(
-                    addKernel,
-                    NullRange,
-                    NDRange(size.x,size.y,size.z),
-                    NDRange(4,4,4)
-            );
-            ocl.queue.enqueueCopyBufferToImage(fx3,fx,0,offset,region);
-            ocl.queue.finish();
-        } else {
-            Image3D fx3 = Image3D(
-                ocl.context,
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, imageType),
-                size.x,
-                size.y,
-                size.z
-            );
-
-            addKernel.setArg(0,fx);
-            addKernel.setArg(1,fx2);
-            addKernel.setArg(2,fx3);
-            ocl.queue.enqueueNDRangeKernel(
-                    addKernel,
-                    NullRange,
-                    NDRange(size.x,size.y,size.z),
-                    NDRange(4,4,4)
-            );
-            ocl.queue.finish();
-
-            fx = fx3;
-        }
-
+        START_TIMER
     }
+    Image3D fx = runMGGVFComponent(ocl,*vectorField,sqrMags,sizes,1,parameters,imageType,bufferTypeSize,no3Dwrite);
     std::cout << "fx finished" << std::endl;
-
-    // create fy and ry
-    // Y component
-    Image3D fy = initSolutionToZero(ocl,size,imageType,bufferTypeSize,no3Dwrite);
-    for(int i = 0; i < GVFIterations; i++) {
-        Image3D ry = computeNewResidual(ocl,fy,*vectorField,MU,spacing,2,size,imageType,bufferTypeSize,no3Dwrite);
-        Image3D fy2 = fullMultigrid(ocl,ry,sqrMag,0,v0,v1,v2,l_max,MU,spacing,size,imageType,bufferTypeSize,no3Dwrite);
-        ocl.queue.finish();
-        if(no3Dwrite) {
-            Buffer fy3 = Buffer(
-                    ocl.context,
-                    CL_MEM_WRITE_ONLY,
-                    totalSize*bufferTypeSize
-            );
-
-            addKernel.setArg(0,fy);
-            addKernel.setArg(1,fy2);
-            addKernel.setArg(2,fy3);
-            ocl.queue.enqueueNDRangeKernel(
-                    addKernel,
-                    NullRange,
-                    NDRange(size.x,size.y,size.z),
-                    NDRange(4,4,4)
-            );
-            ocl.queue.enqueueCopyBufferToImage(fy3,fy,0,offset,region);
-            ocl.queue.finish();
-        } else {
-            Image3D fy3 = Image3D(
-                ocl.context,
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, imageType),
-                size.x,
-                size.y,
-                size.z
-            );
-
-            addKernel.setArg(0,fy);
-            addKernel.setArg(1,fy2);
-            addKernel.setArg(2,fy3);
-            ocl.queue.enqueueNDRangeKernel(
-                    addKernel,
-                    NullRange,
-                    NDRange(size.x,size.y,size.z),
-                    NDRange(4,4,4)
-            );
-            ocl.queue.finish();
-
-            fy = fy3;
-        }
-
-    }
-
+    Image3D fy = runMGGVFComponent(ocl,*vectorField,sqrMags,sizes,2,parameters,imageType,bufferTypeSize,no3Dwrite);
     std::cout << "fy finished" << std::endl;
-
-    // create fz and rz
-    // Z component
-    Image3D fz = initSolutionToZero(ocl,size,imageType,bufferTypeSize,no3Dwrite);
-    for(int i = 0; i < GVFIterations; i++) {
-        Image3D rz = computeNewResidual(ocl,fz,*vectorField,MU,spacing,3,size,imageType,bufferTypeSize,no3Dwrite);
-        Image3D fz2 = fullMultigrid(ocl,rz,sqrMag,0,v0,v1,v2,l_max,MU,spacing,size,imageType,bufferTypeSize,no3Dwrite);
-        ocl.queue.finish();
-        if(no3Dwrite) {
-            Buffer fz3 = Buffer(
-                    ocl.context,
-                    CL_MEM_WRITE_ONLY,
-                    totalSize*bufferTypeSize
-            );
-
-            addKernel.setArg(0,fz);
-            addKernel.setArg(1,fz2);
-            addKernel.setArg(2,fz3);
-            ocl.queue.enqueueNDRangeKernel(
-                    addKernel,
-                    NullRange,
-                    NDRange(size.x,size.y,size.z),
-                    NDRange(4,4,4)
-            );
-            ocl.queue.enqueueCopyBufferToImage(fz3,fz,0,offset,region);
-            ocl.queue.finish();
-        } else {
-            Image3D fz3 = Image3D(
-                ocl.context,
-                CL_MEM_READ_WRITE,
-                ImageFormat(CL_R, imageType),
-                size.x,
-                size.y,
-                size.z
-            );
-
-            addKernel.setArg(0,fz);
-            addKernel.setArg(1,fz2);
-            addKernel.setArg(2,fz3);
-            ocl.queue.enqueueNDRangeKernel(
-                    addKernel,
-                    NullRange,
-                    NDRange(size.x,size.y,size.z),
-                    NDRange(4,4,4)
-            );
-            ocl.queue.finish();
-
-            fz = fz3;
-        }
-
+    Image3D fz = runMGGVFComponent(ocl,*vectorField,sqrMags,sizes,3,parameters,imageType,bufferTypeSize,no3Dwrite);
+    std::cout << "fz finished" << std::endl;
+    if(timing) {
+        STOP_TIMER("multigrid GVF cycles")
     }
 
     ocl.GC->deleteMemoryObject(vectorField);
 
-    std::cout << "fz finished" << std::endl;
-
-
     Image3D finalVectorField = Image3D(
             ocl.context,
             CL_MEM_READ_WRITE,
@@ -1009,19 +865,197 @@ Image3D runFMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL
     return finalVectorField;
 }
 
+/*
+ * Find the number of GVF iterations GVF3DIterationBlocked can do in each
+ * launch. The tile of each work group, including a halo of one voxel per
+ * iteration, has to fit in local memory. Returns 1 if the blocked kernel can't
+ * be used.
+ */
+static const int GVFBlockSize[3] = {8,8,4};
+static const int GVFBlockMaxCells = 16; // GVF_BLOCK_MAX_CELLS in the kernels
+
+static int getGVFBlockIterations(OpenCL &ocl, Kernel &kernel, paramList &parameters, SIPL::int3 size) {
+    int steps = getParam(parameters, "gvf-block-iterations");
+    if(steps <= 1)
+        return 1;
+
+    const int groupSize = GVFBlockSize[0]*GVFBlockSize[1]*GVFBlockSize[2];
+    if(kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(ocl.device) < (::size_t)groupSize) {
+        std::cout << "NOTE: Device does not support the work group size of blocked GVF, using 1 iteration per launch." << std::endl;
+        return 1;
+    }
+    // The mirror boundary conditions need the voxel two steps in from the
+    // border to be in the same work group as the border voxel
+    const int sizes[3] = {size.x, size.y, size.z};
+    for(int i = 0; i < 3; i++) {
+        if(sizes[i] < 3 || (sizes[i]-1) % GVFBlockSize[i] < 2) {
+            std::cout << "NOTE: Volume size does not fit blocked GVF, using 1 iteration per launch." << std::endl;
+            return 1;
+        }
+    }
+
+    const cl_ulong localMemorySize = ocl.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+    for(; steps > 1; steps--) {
+        const int cells = (GVFBlockSize[0]+2*steps)*(GVFBlockSize[1]+2*steps)*(GVFBlockSize[2]+2*steps);
+        if(2*3*sizeof(float)*cells <= localMemorySize && (cells+groupSize-1)/groupSize <= GVFBlockMaxCells)
+            break;
+    }
+    return steps;
+}
+
+static void enqueueGVFIteration(OpenCL &ocl, Kernel &iterationKernel, Kernel &blockedKernel, int steps, SIPL::int3 size) {
+    if(steps == 1) {
+        ocl.queue.enqueueNDRangeKernel(
+                iterationKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NDRange(4,4,4)
+        );
+    } else {
+        const int cells = (GVFBlockSize[0]+2*steps)*(GVFBlockSize[1]+2*steps)*(GVFBlockSize[2]+2*steps);
+        blockedKernel.setArg(4, steps);
+        blockedKernel.setArg(6, cl::__local(3*sizeof(float)*cells));
+        blockedKernel.setArg(7, cl::__local(3*sizeof(float)*cells));
+        ocl.queue.enqueueNDRangeKernel(
+                blockedKernel,
+                NullRange,
+                NDRange(
+                    ((size.x+GVFBlockSize[0]-1)/GVFBlockSize[0])*GVFBlockSize[0],
+                    ((size.y+GVFBlockSize[1]-1)/GVFBlockSize[1])*GVFBlockSize[1],
+                    ((size.z+GVFBlockSize[2]-1)/GVFBlockSize[2])*GVFBlockSize[2]
+                ),
+                NDRange(GVFBlockSize[0],GVFBlockSize[1],GVFBlockSize[2])
+        );
+    }
+}
+
+/*
+ * Work list of the sparse GVF. The volume is divided in bricks of
+ * GVFBrickSize^3 voxels. A brick is active if the largest update of its
+ * voxels in the last iteration it was updated is above the threshold. Only
+ * active bricks and their neighbors are iterated. The list is rebuilt every
+ * GVFSparseRebuildInterval iterations, which is not more than the distance
+ * the field can diffuse into a neighbor brick in the meantime.
+ */
+static const int GVFBrickSize = 4; // GVF_BRICK_SIZE in the kernels
+static const int GVFSparseRebuildInterval = 4;
+
+typedef struct SparseGVFBricks {
+    SIPL::int3 bricks;
+    int nrOfBricks;
+    int nrOfActiveBricks;
+    float threshold;
+    Buffer activeBricks;
+    Buffer brickActivity;
+    double updatedBricks; // Sum of active bricks over all iterations
+} SparseGVFBricks;
+
+static SparseGVFBricks createSparseGVFBricks(OpenCL &ocl, SIPL::int3 size, float threshold) {
+    SparseGVFBricks b;
+    b.bricks = SIPL::int3(
+            (size.x+GVFBrickSize-1)/GVFBrickSize,
+            (size.y+GVFBrickSize-1)/GVFBrickSize,
+            (size.z+GVFBrickSize-1)/GVFBrickSize
+    );
+    b.nrOfBricks = b.bricks.x*b.bricks.y*b.bricks.z;
+    b.threshold = threshold;
+    b.updatedBricks = 0;
+
+    // All bricks are active until the first rebuild, so that both vector
+    // field buffers are completely written
+    std::vector<int> list(b.nrOfBricks);
+    for(int i = 0; i < b.nrOfBricks; i++)
+        list[i] = i;
+    std::vector<float> activity(b.nrOfBricks, 0.0f);
+    b.nrOfActiveBricks = b.nrOfBricks;
+    b.activeBricks = Buffer(ocl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(int)*b.nrOfBricks, &list[0]);
+    b.brickActivity = Buffer(ocl.context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, sizeof(float)*b.nrOfBricks, &activity[0]);
+    return b;
+}
+
+static void updateSparseGVFBricks(OpenCL &ocl, SparseGVFBricks &b) {
+    std::vector<float> activity(b.nrOfBricks);
+    ocl.queue.enqueueReadBuffer(b.brickActivity, CL_TRUE, 0, sizeof(float)*b.nrOfBricks, &activity[0]);
+
+    // Schedule active bricks and their 26 neighbors
+    std::vector<char> scheduled(b.nrOfBricks, 0);
+    for(int z = 0; z < b.bricks.z; z++) {
+    for(int y = 0; y < b.bricks.y; y++) {
+    for(int x = 0; x < b.bricks.x; x++) {
+        if(activity[x+y*b.bricks.x+z*b.bricks.x*b.bricks.y] <= b.threshold)
+            continue;
+        for(int c = std::max(0,z-1); c <= std::min(b.bricks.z-1,z+1); c++) {
+        for(int d = std::max(0,y-1); d <= std::min(b.bricks.y-1,y+1); d++) {
+        for(int e = std::max(0,x-1); e <= std::min(b.bricks.x-1,x+1); e++) {
+            scheduled[e+d*b.bricks.x+c*b.bricks.x*b.bricks.y] = 1;
+        }}}
+    }}}
+
+    std::vector<int> list;
+    for(int i = 0; i < b.nrOfBricks; i++) {
+        if(scheduled[i])
+            list.push_back(i);
+    }
+    b.nrOfActiveBricks = list.size();
+    if(b.nrOfActiveBricks > 0)
+        ocl.queue.enqueueWriteBuffer(b.activeBricks, CL_FALSE, 0, sizeof(int)*list.size(), &list[0]);
+}
+
+static void printSparseGVFStatistics(SparseGVFBricks &b, int launches, int iterations) {
+    const double fraction = b.updatedBricks / ((double)b.nrOfBricks*iterations);
+    std::cout << "NOTE: Sparse GVF updated " << fraction*100.0 << " % of the bricks of a dense GVF";
+    if(launches < iterations)
+        std::cout << " and converged after " << launches << " iterations";
+    std::cout << std::endl;
+}
+
+static void enqueueSparseGVFIteration(OpenCL &ocl, Kernel &kernel, SparseGVFBricks &b) {
+    ocl.queue.enqueueNDRangeKernel(
+            kernel,
+            NullRange,
+            NDRange(b.nrOfActiveBricks*GVFBrickSize*GVFBrickSize*GVFBrickSize),
+            NDRange(GVFBrickSize*GVFBrickSize*GVFBrickSize)
+    );
+    b.updatedBricks += b.nrOfActiveBricks;
+}
+
 Image3D runFastGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size) {
 
     const int GVFIterations = getParam(parameters, "gvf-iterations");
     const bool no3Dwrite = !getParamBool(parameters, "3d_write");
     const float MU = getParam(parameters, "gvf-mu");
     const int totalSize = size.x*size.y*size.z;
+    // The iterations are timed on their own to compare dense and sparse GVF
+    const bool timing = getParamBool(parameters, "timing");
+    INIT_TIMER
 
     Kernel GVFInitKernel = Kernel(ocl.program, "GVF3DInit");
     Kernel GVFIterationKernel = Kernel(ocl.program, "GVF3DIteration");
     Kernel GVFFinishKernel = Kernel(ocl.program, "GVF3DFinish");
+    Kernel GVFBlockedKernel = Kernel(ocl.program, "GVF3DIterationBlocked");
+    Kernel GVFSparseKernel = Kernel(ocl.program, "GVF3DIterationSparse");
     Image3D resultVectorField;
+    const float sparseThreshold = getParam(parameters, "gvf-sparse-threshold");
+    const bool sparse = sparseThreshold > 0.0f;
+    const int blockIterations = sparse ? 1 : getGVFBlockIterations(ocl, GVFBlockedKernel, parameters, size);
+    int launches = 0;
+    cl_int4 volumeSize;
+    volumeSize.s[0] = size.x;
+    volumeSize.s[1] = size.y;
+    volumeSize.s[2] = size.z;
+    volumeSize.s[3] = 0;
+    SparseGVFBricks bricks;
+    if(sparse) {
+        bricks = createSparseGVFBricks(ocl, size, sparseThreshold);
+        GVFSparseKernel.setArg(3, MU);
+        GVFSparseKernel.setArg(4, bricks.activeBricks);
+        GVFSparseKernel.setArg(5, bricks.brickActivity);
+        GVFSparseKernel.setArg(6, volumeSize);
+    }
 
     std::cout << "Running GVF with " << GVFIterations << " iterations " << std::endl;
+    if(blockIterations > 1)
+        std::cout << "NOTE: Doing " << blockIterations << " GVF iterations per launch" << std::endl;
     if(no3Dwrite) {
     	int vectorFieldSize = sizeof(float);
     	if(getParamBool(parameters, "16bit-vectors"))
@@ -1052,23 +1086,49 @@ Image3D runFastGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIP
         // Run iterations
         GVFIterationKernel.setArg(0, *vectorField);
         GVFIterationKernel.setArg(3, MU);
+        GVFBlockedKernel.setArg(0, *vectorField);
+        GVFBlockedKernel.setArg(3, MU);
+        GVFBlockedKernel.setArg(5, volumeSize);
+        GVFSparseKernel.setArg(0, *vectorField);
 
-        for(int i = 0; i < GVFIterations; i++) {
-            if(i % 2 == 0) {
-                GVFIterationKernel.setArg(1, *vectorFieldBuffer);
-                GVFIterationKernel.setArg(2, *vectorFieldBuffer1);
+        if(timing) {
+            ocl.queue.finish();
+            START_TIMER
+        }
+        for(int i = 0; i < GVFIterations; i += blockIterations) {
+            const int steps = std::min(blockIterations, GVFIterations-i);
+            if(sparse && i > 0 && i % GVFSparseRebuildInterval == 0) {
+                updateSparseGVFBricks(ocl, bricks);
+                if(bricks.nrOfActiveBricks == 0)
+                    break;
+            }
+            Kernel &kernel = sparse ? GVFSparseKernel : (steps == 1 ? GVFIterationKernel : GVFBlockedKernel);
+            if(launches % 2 == 0) {
+                kernel.setArg(1, *vectorFieldBuffer);
+                kernel.setArg(2, *vectorFieldBuffer1);
             } else {
-                GVFIterationKernel.setArg(1, *vectorFieldBuffer1);
-                GVFIterationKernel.setArg(2, *vectorFieldBuffer);
+                kernel.setArg(1, *vectorFieldBuffer1);
+                kernel.setArg(2, *vectorFieldBuffer);
             }
-                ocl.queue.enqueueNDRangeKernel(
-                        GVFIterationKernel,
-                        NullRange,
-                        NDRange(size.x,size.y,size.z),
-                        NDRange(4,4,4)
-                );
+            if(sparse) {
+                enqueueSparseGVFIteration(ocl, kernel, bricks);
+            } else {
+                enqueueGVFIteration(ocl, GVFIterationKernel, GVFBlockedKernel, steps, size);
+            }
+            launches++;
         }
+        if(sparse)
+            printSparseGVFStatistics(bricks, launches, GVFIterations);
         ocl.queue.finish(); //This finish is necessary
+        if(timing) {
+            STOP_TIMER((sparse ? "sparse GVF iterations" : "GVF iterations"))
+        }
+        // The result is in the buffer written by the last launch
+        if(launches % 2 == 1) {
+            Buffer * tmp = vectorFieldBuffer;
+            vectorFieldBuffer = vectorFieldBuffer1;
+            vectorFieldBuffer1 = tmp;
+        }
         ocl.GC->deleteMemoryObject(vectorFieldBuffer1);
         ocl.GC->deleteMemoryObject(vectorField);
 
@@ -1138,23 +1198,46 @@ Image3D runFastGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIP
         // Run iterations
         GVFIterationKernel.setArg(0, initVectorField);
         GVFIterationKernel.setArg(3, MU);
+        GVFBlockedKernel.setArg(0, initVectorField);
+        GVFBlockedKernel.setArg(3, MU);
+        GVFBlockedKernel.setArg(5, volumeSize);
+        GVFSparseKernel.setArg(0, initVectorField);
 
-        for(int i = 0; i < GVFIterations; i++) {
-            if(i % 2 == 0) {
-                GVFIterationKernel.setArg(1, vectorField1);
-                GVFIterationKernel.setArg(2, *vectorField);
+        if(timing) {
+            ocl.queue.finish();
+            START_TIMER
+        }
+        for(int i = 0; i < GVFIterations; i += blockIterations) {
+            const int steps = std::min(blockIterations, GVFIterations-i);
+            if(sparse && i > 0 && i % GVFSparseRebuildInterval == 0) {
+                updateSparseGVFBricks(ocl, bricks);
+                if(bricks.nrOfActiveBricks == 0)
+                    break;
+            }
+            Kernel &kernel = sparse ? GVFSparseKernel : (steps == 1 ? GVFIterationKernel : GVFBlockedKernel);
+            if(launches % 2 == 0) {
+                kernel.setArg(1, vectorField1);
+                kernel.setArg(2, *vectorField);
             } else {
-                GVFIterationKernel.setArg(1, *vectorField);
-                GVFIterationKernel.setArg(2, vectorField1);
+                kernel.setArg(1, *vectorField);
+                kernel.setArg(2, vectorField1);
             }
-                ocl.queue.enqueueNDRangeKernel(
-                        GVFIterationKernel,
-                        NullRange,
-                        NDRange(size.x,size.y,size.z),
-                        NDRange(4,4,4)
-                );
+            if(sparse) {
+                enqueueSparseGVFIteration(ocl, kernel, bricks);
+            } else {
+                enqueueGVFIteration(ocl, GVFIterationKernel, GVFBlockedKernel, steps, size);
+            }
+            launches++;
         }
+        if(sparse)
+            printSparseGVFStatistics(bricks, launches, GVFIterations);
         ocl.queue.finish();
+        if(timing) {
+            STOP_TIMER((sparse ? "sparse GVF iterations" : "GVF iterations"))
+        }
+        // The result is in the image written by the last launch
+        if(launches % 2 == 1)
+            vectorField1 = *vectorField;
         ocl.GC->deleteMemoryObject(vectorField);
 
         // Copy vector field to image
@@ -1450,6 +1533,244 @@ Image3D runLowMemoryGVF(OpenCL &ocl, Image3D * vectorField, paramList &parameter
 }
 
 
+/*
+ * Native GVF on the host. Each vector component is stored in its own array
+ * (structure of arrays) of floats or 16 bit signed normalized integers, and
+ * computations are done in float. The volume is split in z-slabs, one for
+ * each thread. A thread does blockIterations iterations of its slab for each
+ * pass over the volume: intermediate iterations are kept in rolling buffers of
+ * three planes, so that only the last iteration of a pass is written to the
+ * volume. The rows are vectorized with omp simd.
+ */
+template <class T>
+struct GVFStorage;
+
+template <>
+struct GVFStorage<float> {
+    static inline float load(float v) { return v; };
+    static inline float store(float v) { return v; };
+};
+
+template <>
+struct GVFStorage<short> {
+    static inline float load(short v) { return std::max(v*(1.0f/32767.0f), -1.0f); };
+    static inline short store(float v) {
+        v = std::min(1.0f, std::max(-1.0f, v))*32767.0f;
+        return (short)(v >= 0.0f ? v + 0.5f : v - 0.5f);
+    };
+};
+
+// The mirror boundary conditions of GVF3DIteration
+static inline int gvfMirror(int pos, int size) {
+    if(pos == 0)
+        return 2;
+    if(pos >= size-1)
+        return size-3;
+    return pos;
+}
+
+/*
+ * One GVF iteration of a plane from the three planes below, at and above it.
+ * The border rows and columns are set with the mirror boundary conditions.
+ */
+template <class In, class Out, class T>
+static void gvfIterationPlane(
+        const In * below,
+        const In * center,
+        const In * above,
+        const T * init,
+        const float * sqrMag,
+        Out * out,
+        SIPL::int3 size,
+        float mu
+        ) {
+    const int sx = size.x;
+    for(int y = 1; y < size.y-1; y++) {
+        const In * b = below + y*sx;
+        const In * c = center + y*sx;
+        const In * a = above + y*sx;
+        const T * f = init + y*sx;
+        const float * m = sqrMag + y*sx;
+        Out * o = out + y*sx;
+#if defined(_OPENMP) && _OPENMP >= 201307
+#pragma omp simd
+#endif
+        for(int x = 1; x < sx-1; x++) {
+            const float v = GVFStorage<In>::load(c[x]);
+            const float laplacian =
+                    GVFStorage<In>::load(c[x-1]) + GVFStorage<In>::load(c[x+1]) +
+                    GVFStorage<In>::load(c[x-sx]) + GVFStorage<In>::load(c[x+sx]) +
+                    GVFStorage<In>::load(b[x]) + GVFStorage<In>::load(a[x]) - 6.0f*v;
+            o[x] = GVFStorage<Out>::store(v + mu*laplacian - (v - GVFStorage<T>::load(f[x]))*m[x]);
+        }
+        o[0] = o[2];
+        o[sx-1] = o[sx-3];
+    }
+    std::copy(out + 2*sx, out + 3*sx, out);
+    std::copy(out + (size.y-3)*sx, out + (size.y-2)*sx, out + (size.y-1)*sx);
+}
+
+/*
+ * blockIterations iterations of the planes [z0,z1) of a component. Level j of
+ * the pipeline computes iteration j. Level j is one plane behind level j-1,
+ * so that the three planes it needs from level j-1 are in the rolling buffer.
+ */
+template <class T>
+static void gvfSlab(
+        const T * read,
+        T * write,
+        const T * init,
+        const float * sqrMag,
+        SIPL::int3 size,
+        float mu,
+        int blockIterations,
+        int z0,
+        int z1,
+        std::vector<float> &rings
+        ) {
+    const int planeSize = size.x*size.y;
+    const int k = blockIterations;
+    for(int zt = z0-(k-1); zt < z1+(k-1); zt++) {
+        for(int j = 1; j <= k; j++) {
+            // Plane computed by level j in this step
+            const int z = zt-(j-1);
+            const int low = std::max(1, z0-(k-j));
+            const int high = std::min(size.z-2, z1-1+(k-j));
+            if(z < low || z > high)
+                continue;
+            const int offset = z*planeSize;
+            if(j == 1 && k == 1) {
+                gvfIterationPlane(read+offset-planeSize, read+offset, read+offset+planeSize,
+                        init+offset, sqrMag+offset, write+offset, size, mu);
+                continue;
+            }
+            float * out = j < k ? &rings[((j-1)*3 + z % 3)*planeSize] : NULL;
+            if(j == 1) {
+                gvfIterationPlane(read+offset-planeSize, read+offset, read+offset+planeSize,
+                        init+offset, sqrMag+offset, out, size, mu);
+            } else {
+                const float * ring = &rings[(j-2)*3*planeSize];
+                const float * below = ring + (gvfMirror(z-1, size.z) % 3)*planeSize;
+                const float * center = ring + (z % 3)*planeSize;
+                const float * above = ring + (gvfMirror(z+1, size.z) % 3)*planeSize;
+                if(j < k) {
+                    gvfIterationPlane(below, center, above, init+offset, sqrMag+offset, out, size, mu);
+                } else {
+                    gvfIterationPlane(below, center, above, init+offset, sqrMag+offset, write+offset, size, mu);
+                }
+            }
+        }
+    }
+}
+
+template <class T>
+void runNativeGVF(T * vectorField[3], SIPL::int3 size, float mu, int iterations, int blockIterations) {
+    if(size.x < 4 || size.y < 4 || size.z < 4)
+        throw SIPL::SIPLException("The native GVF needs a volume of at least 4x4x4 voxels", __LINE__, __FILE__);
+    const int totalSize = size.x*size.y*size.z;
+    const int planeSize = size.x*size.y;
+    blockIterations = std::max(1, std::min(blockIterations, size.z));
+
+    std::vector<float> sqrMag(totalSize);
+#pragma omp parallel for
+    for(int i = 0; i < totalSize; i++) {
+        const float x = GVFStorage<T>::load(vectorField[0][i]);
+        const float y = GVFStorage<T>::load(vectorField[1][i]);
+        const float z = GVFStorage<T>::load(vectorField[2][i]);
+        sqrMag[i] = x*x+y*y+z*z;
+    }
+
+    std::vector<T> init(totalSize);
+    std::vector<T> buffer(totalSize);
+    for(int component = 0; component < 3; component++) {
+        T * read = vectorField[component];
+        T * write = &buffer[0];
+        std::copy(read, read+totalSize, init.begin());
+
+        for(int i = 0; i < iterations; i += blockIterations) {
+            const int steps = std::min(blockIterations, iterations-i);
+#pragma omp parallel
+            {
+#ifdef _OPENMP
+                const int nrOfThreads = omp_get_num_threads();
+                const int thread = omp_get_thread_num();
+#else
+                const int nrOfThreads = 1;
+                const int thread = 0;
+#endif
+                // Split the interior planes between the threads
+                const int interior = size.z-2;
+                const int z0 = 1 + (int)((long)interior*thread/nrOfThreads);
+                const int z1 = 1 + (int)((long)interior*(thread+1)/nrOfThreads);
+                std::vector<float> rings(steps > 1 ? (steps-1)*3*planeSize : 0);
+                if(z1 > z0)
+                    gvfSlab(read, write, &init[0], &sqrMag[0], size, mu, steps, z0, z1, rings);
+            }
+            // Mirror the first and last plane
+            std::copy(write + 2*planeSize, write + 3*planeSize, write);
+            std::copy(write + (size.z-3)*planeSize, write + (size.z-2)*planeSize, write + (size.z-1)*planeSize);
+            std::swap(read, write);
+        }
+        if(read != vectorField[component])
+            std::copy(read, read+totalSize, vectorField[component]);
+    }
+}
+
+template void runNativeGVF<float>(float * vectorField[3], SIPL::int3 size, float mu, int iterations, int blockIterations);
+template void runNativeGVF<short>(short * vectorField[3], SIPL::int3 size, float mu, int iterations, int blockIterations);
+
+template <class T>
+static Image3D runNativeGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size, ImageFormat format) {
+    const int totalSize = size.x*size.y*size.z;
+    cl::size_t<3> offset;
+    offset[0] = 0;
+    offset[1] = 0;
+    offset[2] = 0;
+    cl::size_t<3> region;
+    region[0] = size.x;
+    region[1] = size.y;
+    region[2] = size.z;
+
+    std::vector<T> data(4*totalSize);
+    ocl.queue.enqueueReadImage(*vectorField, CL_TRUE, offset, region, 0, 0, &data[0]);
+    ocl.GC->deleteMemoryObject(vectorField);
+
+    std::vector<T> components(3*totalSize);
+    T * fields[3] = {&components[0], &components[totalSize], &components[2*totalSize]};
+#pragma omp parallel for
+    for(int i = 0; i < totalSize; i++) {
+        fields[0][i] = data[i*4];
+        fields[1][i] = data[i*4+1];
+        fields[2][i] = data[i*4+2];
+    }
+
+    runNativeGVF(fields, size, getParam(parameters, "gvf-mu"), getParam(parameters, "gvf-iterations"), getParam(parameters, "gvf-block-iterations"));
+
+#pragma omp parallel for
+    for(int i = 0; i < totalSize; i++) {
+        const float x = GVFStorage<T>::load(fields[0][i]);
+        const float y = GVFStorage<T>::load(fields[1][i]);
+        const float z = GVFStorage<T>::load(fields[2][i]);
+        const float length = sqrt(x*x+y*y+z*z);
+        data[i*4] = fields[0][i];
+        data[i*4+1] = fields[1][i];
+        data[i*4+2] = fields[2][i];
+        data[i*4+3] = GVFStorage<T>::store(length > 0.0f ? length : 1.0f);
+    }
+
+    return Image3D(ocl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, format, size.x, size.y, size.z, 0, 0, &data[0]);
+}
+
+Image3D runNativeGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size) {
+    std::cout << "NOTE: Running native GVF on the host." << std::endl;
+    ImageFormat format = vectorField->getImageInfo<CL_IMAGE_FORMAT>();
+    if(format.image_channel_data_type == CL_SNORM_INT16) {
+        return runNativeGVF<short>(ocl, vectorField, parameters, size, format);
+    } else {
+        return runNativeGVF<float>(ocl, vectorField, parameters, size, format);
+    }
+}
+
 Image3D runGVF(OpenCL &ocl, Image3D * vectorField, paramList &parameters, SIPL::int3 &size, bool useLessMemory) {
 
 	if(useLessMemory) {
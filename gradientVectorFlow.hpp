@@ -1,12 +1,41 @@
-#ifndef GVF_H
-#define GVF_H
+#ifndef GVF_H
+#define GVF_H
 #include "commons.hpp"
 #include "SIPL/Types.hpp"
 #include "parameters.hpp"
+#include <vector>
 using namespace cl;
 
 Image3D runGVF(OpenCL &ocl, Image3D * vectorField, paramList &parameters, SIPL::int3 &size, bool useLessMemory);
 
-Image3D runFMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size);
+/*
+ * GVF with the native multithreaded solver on the host instead of OpenCL.
+ * The result has the same image format as the input vector field.
+ */
+Image3D runNativeGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size);
 
-#endif
+/*
+ * Native GVF on host arrays. vectorField holds the x, y and z components of
+ * the initial vector field, and is overwritten with the result. T is float or
+ * short (16 bit signed normalized). blockIterations iterations are done for
+ * each pass over the volume.
+ */
+template <class T>
+void runNativeGVF(T * vectorField[3], SIPL::int3 size, float mu, int iterations, int blockIterations);
+
+enum MultigridCycle { MG_V_CYCLE, MG_W_CYCLE, MG_F_CYCLE, MG_FULL_MULTIGRID };
+
+// Multigrid cycle selected by the gvf-mg-cycle parameter
+MultigridCycle getMultigridCycle(paramList &parameters);
+
+// Sizes of the multigrid grids, the finest (the volume size) first
+std::vector<SIPL::int3> calculateMultigridSizes(SIPL::int3 size);
+
+/*
+ * Multigrid GVF. Each vector component is solved separately with the cycle
+ * given by gvf-mg-cycle, until the residual is reduced by gvf-mg-tolerance or
+ * gvf-iterations cycles are done.
+ */
+Image3D runMGGVF(OpenCL &ocl, Image3D *vectorField, paramList &parameters, SIPL::int3 &size);
+
+#endif
@@ -1,54 +1,506 @@
 #include "inputOutput.hpp"
 #include <fstream>
+#include <iostream>
+#include <algorithm>
+#include <sstream>
+#include <cstring>
+#include <cmath>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
+#include <boost/iostreams/device/back_inserter.hpp>
 #include "SIPL/Exceptions.hpp"
+#include "timing.hpp"
 using namespace SIPL;
 using namespace cl;
 
-template <typename T>
-void writeToRaw(T * voxels, std::string filename, int SIZE_X, int SIZE_Y, int SIZE_Z) {
-    FILE * file = fopen(filename.c_str(), "wb");
-    fwrite(voxels, sizeof(T), SIZE_X*SIZE_Y*SIZE_Z, file);
-    fclose(file);
+void writeDataToDisk(TSFOutput * output, std::string storageDirectory, std::string name) {
+	TSFWriter::getInstance()->write(output, storageDirectory, name, "raw", false, false, false);
 }
 
-void writeDataToDisk(TSFOutput * output, std::string storageDirectory, std::string name) {
-	SIPL::int3 * size = output->getSize();
-	if(output->hasCenterlineVoxels()) {
-		// Create MHD file
-		std::ofstream file;
-		std::string filename = storageDirectory + name + ".centerline.mhd";
-		file.open(filename.c_str());
-		file << "ObjectType = Image\n";
-		file << "NDims = 3\n";
-		file << "DimSize = " << output->getSize()->x << " " << output->getSize()->y << " " << output->getSize()->z << "\n";
-		file << "ElementSpacing = " << output->getSpacing().x << " " << output->getSpacing().y << " " << output->getSpacing().z << "\n";
-		file << "ElementType = MET_CHAR\n";
-		file << "ElementDataFile = " << name << ".centerline.raw\n";
-		file.close();
-		writeToRaw<char>(output->getCenterlineVoxels(), storageDirectory + name + ".centerline.raw", size->x, size->y, size->z);
-	}
-
-	if(output->hasSegmentation()) {
-		// Create MHD file
-		std::ofstream file;
-		std::string filename = storageDirectory + name + ".segmentation.mhd";
-		file.open(filename.c_str());
-		file << "ObjectType = Image\n";
-		file << "NDims = 3\n";
-		file << "DimSize = " << output->getSize()->x << " " << output->getSize()->y << " " << output->getSize()->z << "\n";
-		file << "ElementSpacing = " << output->getSpacing().x << " " << output->getSpacing().y << " " << output->getSpacing().z << "\n";
-		file << "ElementType = MET_CHAR\n";
-		file << "ElementDataFile = " << name << ".segmentation.raw\n";
-		file.close();
-
-		writeToRaw<char>(output->getSegmentation(), storageDirectory + name + ".segmentation.raw", size->x, size->y, size->z);
-	}
-}
-
-void writeToVtkFile(paramList &parameters, std::vector<int3> vertices, std::vector<SIPL::int2> edges) {
+void writeDataToDisk(TSFOutput * output, paramList &parameters) {
+	TSFWriter * writer = TSFWriter::getInstance();
+	writer->setMaxQueueSize(getParam(parameters, "storage-queue-size"));
+	writer->write(
+			output,
+			getParamStr(parameters, "storage-dir"),
+			getParamStr(parameters, "storage-name"),
+			getParamStr(parameters, "storage-encoding"),
+			getParamBool(parameters, "storage-tdf"),
+			getParamBool(parameters, "storage-radius"),
+			getParamBool(parameters, "storage-async")
+	);
+}
+
+TSFWriter * TSFWriter::getInstance() {
+	static TSFWriter instance;
+	return &instance;
+}
+
+TSFWriter::TSFWriter() {
+	maxQueueSize = 4;
+#ifdef CPP11
+	threadStarted = false;
+	busy = false;
+	stop = false;
+#endif
+}
+
+TSFWriter::~TSFWriter() {
+#ifdef CPP11
+	if(threadStarted) {
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stop = true;
+		}
+		jobAdded.notify_all();
+		thread.join();
+	}
+#endif
+}
+
+void TSFWriter::setMaxQueueSize(int maxQueueSize) {
+	this->maxQueueSize = std::max(1, maxQueueSize);
+}
+
+template <class T>
+static void addVolume(std::vector<TSFWriteJob> &jobs, TSFMappedView<T> view, std::string filename, std::string elementType, std::string encoding, SIPL::float3 spacing) {
+	TSFWriteJob job;
+	job.filename = filename;
+	job.elementType = elementType;
+	job.encoding = encoding;
+	job.size = view.getSize();
+	job.spacing = spacing;
+	job.bitPacked = false;
+	const char * data = (const char *)view.getData();
+	job.data.assign(data, data + sizeof(T)*view.getTotalSize());
+	jobs.push_back(job);
+}
+
+// Convert a mask packed in 32 bit words to the byte aligned rows of the writer
+static void addPackedMask(std::vector<TSFWriteJob> &jobs, const std::vector<unsigned int> &words, SIPL::int3 size, std::string filename, SIPL::float3 spacing) {
+	TSFWriteJob job;
+	job.filename = filename;
+	job.elementType = "MET_CHAR";
+	job.encoding = "bitpacked";
+	job.bitPacked = true;
+	job.size = size;
+	job.spacing = spacing;
+	const int wordsPerRow = getMaskWordsPerRow(size);
+	const int bytesPerRow = (size.x + 7) / 8;
+	job.data.resize((::size_t)bytesPerRow*size.y*size.z);
+#pragma omp parallel for
+	for(int z = 0; z < size.z; z++) {
+		for(int y = 0; y < size.y; y++) {
+			const unsigned int * row = &words[((::size_t)z*size.y + y)*wordsPerRow];
+			char * packedRow = &job.data[((::size_t)z*size.y + y)*bytesPerRow];
+			for(int i = 0; i < bytesPerRow; i++)
+				packedRow[i] = (char)((row[i/4] >> (8*(i % 4))) & 0xFF);
+		}
+	}
+	jobs.push_back(job);
+}
+
+void TSFWriter::write(TSFOutput * output, std::string storageDirectory, std::string name, std::string encoding, bool writeTDF, bool writeRadius, bool async) {
+	if(encoding != "raw" && encoding != "zraw" && encoding != "bitpacked")
+		throw SIPL::SIPLException("Unknown storage encoding", __LINE__, __FILE__);
+
+	// Copy the data on the calling thread, the rest is done by the writer
+	std::vector<TSFWriteJob> jobs;
+	std::string filename = storageDirectory + name;
+	// Masks that are bit packed on the device are written without unpacking them
+	const bool packed = encoding == "bitpacked";
+	if(packed && output->hasPackedCenterlineVoxels()) {
+		addPackedMask(jobs, output->getPackedCenterlineVoxels(), *output->getSize(), filename + ".centerline", output->getSpacing());
+	} else if(output->hasCenterlineVoxels()) {
+		addVolume<char>(jobs, output->mapCenterlineVoxels(), filename + ".centerline", "MET_CHAR", encoding, output->getSpacing());
+	}
+	if(packed && output->hasPackedSegmentation()) {
+		addPackedMask(jobs, output->getPackedSegmentation(), *output->getSize(), filename + ".segmentation", output->getSpacing());
+	} else if(output->hasSegmentation()) {
+		addVolume<char>(jobs, output->mapSegmentation(), filename + ".segmentation", "MET_CHAR", encoding, output->getSpacing());
+	}
+	// Only masks can be bit packed
+	std::string floatEncoding = encoding == "bitpacked" ? "zraw" : encoding;
+	if(writeTDF && output->hasTDF())
+		addVolume<float>(jobs, output->mapTDF(), filename + ".tdf", "MET_FLOAT", floatEncoding, output->getSpacing());
+	if(writeRadius && output->hasRadius())
+		addVolume<float>(jobs, output->mapRadius(), filename + ".radius", "MET_FLOAT", floatEncoding, output->getSpacing());
+
+	for(int i = 0; i < jobs.size(); i++)
+		addJob(jobs[i], async);
+}
+
+void TSFWriter::addJob(TSFWriteJob &job, bool async) {
+#ifdef CPP11
+	if(async) {
+		std::unique_lock<std::mutex> lock(mutex);
+		if(!threadStarted) {
+			thread = std::thread(&TSFWriter::processQueue, this);
+			threadStarted = true;
+		}
+		while(queue.size() >= maxQueueSize)
+			jobRemoved.wait(lock);
+		queue.push_back(std::move(job));
+		jobAdded.notify_one();
+		return;
+	}
+#endif
+	writeJob(job);
+}
+
+void TSFWriter::finish() {
+#ifdef CPP11
+	std::unique_lock<std::mutex> lock(mutex);
+	while(!queue.empty() || busy)
+		jobRemoved.wait(lock);
+#endif
+}
+
+#ifdef CPP11
+void TSFWriter::processQueue() {
+	while(true) {
+		TSFWriteJob job;
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while(queue.empty() && !stop)
+				jobAdded.wait(lock);
+			if(queue.empty())
+				return;
+			job = std::move(queue.front());
+			queue.pop_front();
+			busy = true;
+		}
+		jobRemoved.notify_all();
+		try {
+			writeJob(job);
+		} catch(std::exception &e) {
+			std::cout << "WARNING: Unable to write " << job.filename << ": " << e.what() << std::endl;
+		}
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			busy = false;
+		}
+		jobRemoved.notify_all();
+	}
+}
+#endif
+
+/*
+ * Packs a mask to 1 bit per voxel. Each row in the x direction starts on a
+ * new byte and the first voxel is stored in the least significant bit.
+ */
+static std::vector<char> packBits(const std::vector<char> &data, SIPL::int3 size) {
+	const int bytesPerRow = (size.x + 7) / 8;
+	std::vector<char> packed((::size_t)bytesPerRow*size.y*size.z, 0);
+#pragma omp parallel for
+	for(int z = 0; z < size.z; z++) {
+		for(int y = 0; y < size.y; y++) {
+			const char * row = &data[((::size_t)z*size.y + y)*size.x];
+			char * packedRow = &packed[((::size_t)z*size.y + y)*bytesPerRow];
+			for(int x = 0; x < size.x; x++) {
+				if(row[x] != 0)
+					packedRow[x/8] |= 1 << (x % 8);
+			}
+		}
+	}
+	return packed;
+}
+
+static std::vector<char> compress(const char * data, ::size_t bytes) {
+	std::vector<char> compressed;
+	boost::iostreams::filtering_ostream stream;
+	stream.push(boost::iostreams::zlib_compressor(boost::iostreams::zlib::best_speed));
+	stream.push(boost::iostreams::back_inserter(compressed));
+	stream.write(data, bytes);
+	boost::iostreams::close(stream);
+	return compressed;
+}
+
+void TSFWriter::writeJob(TSFWriteJob &job) {
+	INIT_TIMER
+	std::string elementType = job.elementType;
+	SIPL::int3 dimSize = job.size;
+	std::vector<char> packed;
+	const char * data = &job.data[0];
+	::size_t bytes = job.data.size();
+	if(job.encoding == "bitpacked") {
+		if(!job.bitPacked) {
+			packed = packBits(job.data, job.size);
+			data = &packed[0];
+			bytes = packed.size();
+		}
+		elementType = "MET_UCHAR";
+		dimSize.x = (job.size.x + 7) / 8;
+	}
+	std::vector<char> compressed;
+	std::string rawExtension = ".raw";
+	if(job.encoding == "zraw") {
+		compressed = compress(data, bytes);
+		data = &compressed[0];
+		bytes = compressed.size();
+		rawExtension = ".zraw";
+	}
+
+	// Create MHD file
+	std::string rawFilename = job.filename + rawExtension;
+	std::string name = rawFilename.substr(rawFilename.rfind('/') + 1);
+	std::ofstream file;
+	std::string filename = job.filename + ".mhd";
+	file.open(filename.c_str());
+	if(!file)
+		throw SIPL::IOException(filename.c_str(), __LINE__, __FILE__);
+	file << "ObjectType = Image\n";
+	file << "NDims = 3\n";
+	file << "DimSize = " << dimSize.x << " " << dimSize.y << " " << dimSize.z << "\n";
+	if(job.encoding == "bitpacked")
+		file << "BitPackedDimSize = " << job.size.x << " " << job.size.y << " " << job.size.z << "\n";
+	file << "ElementSpacing = " << job.spacing.x << " " << job.spacing.y << " " << job.spacing.z << "\n";
+	if(job.encoding == "zraw") {
+		file << "CompressedData = True\n";
+		file << "CompressedDataSize = " << bytes << "\n";
+	}
+	file << "ElementType = " << elementType << "\n";
+	file << "ElementDataFile = " << name << "\n";
+	file.close();
+
+	FILE * rawFile = fopen(rawFilename.c_str(), "wb");
+	if(rawFile == NULL)
+		throw SIPL::IOException(rawFilename.c_str(), __LINE__, __FILE__);
+	fwrite(data, 1, bytes, rawFile);
+	fclose(rawFile);
+
+	std::cout << "NOTE: Wrote " << bytes << " bytes to " << rawFilename << std::endl;
+	STOP_TIMER(std::string("writing ") + rawFilename)
+}
+
+TSFRunLengthMask::TSFRunLengthMask(SIPL::int3 size) {
+	this->size = size;
+}
+
+void TSFRunLengthMask::addRun(std::size_t start, unsigned int length) {
+	if(!runs.empty() && runs.back().start + runs.back().length == start) {
+		runs.back().length += length;
+	} else {
+		TSFMaskRun run;
+		run.start = start;
+		run.length = length;
+		runs.push_back(run);
+	}
+}
+
+TSFRunLengthMask TSFRunLengthMask::fromVoxels(const char * voxels, SIPL::int3 size) {
+	TSFRunLengthMask mask(size);
+	const std::size_t totalSize = (std::size_t)size.x*size.y*size.z;
+	std::size_t i = 0;
+	while(i < totalSize) {
+		if(voxels[i] == 0) {
+			i++;
+			continue;
+		}
+		std::size_t start = i;
+		while(i < totalSize && voxels[i] != 0)
+			i++;
+		mask.addRun(start, i - start);
+	}
+	return mask;
+}
+
+TSFRunLengthMask TSFRunLengthMask::fromPackedWords(const unsigned int * words, SIPL::int3 size) {
+	TSFRunLengthMask mask(size);
+	const int wordsPerRow = getMaskWordsPerRow(size);
+	for(int z = 0; z < size.z; z++) {
+	for(int y = 0; y < size.y; y++) {
+		const unsigned int * row = &words[((std::size_t)z*size.y + y)*wordsPerRow];
+		const std::size_t rowStart = ((std::size_t)z*size.y + y)*size.x;
+		for(int w = 0; w < wordsPerRow; w++) {
+			unsigned int word = row[w];
+			// Empty words, which is most of the volume, are skipped right away
+			while(word != 0) {
+				int bit = 0;
+				while(((word >> bit) & 1) == 0)
+					bit++;
+				int end = bit;
+				while(end < 32 && ((word >> end) & 1) == 1)
+					end++;
+				mask.addRun(rowStart + w*32 + bit, end - bit);
+				word = end == 32 ? 0 : word & ~((1u << end) - 1);
+			}
+		}
+	}}
+	return mask;
+}
+
+void TSFRunLengthMask::toVoxels(char * voxels) const {
+	memset(voxels, 0, (std::size_t)size.x*size.y*size.z);
+	for(int i = 0; i < runs.size(); i++)
+		memset(&voxels[runs[i].start], 1, runs[i].length);
+}
+
+std::size_t TSFRunLengthMask::getVoxelCount() const {
+	std::size_t count = 0;
+	for(int i = 0; i < runs.size(); i++)
+		count += runs[i].length;
+	return count;
+}
+
+char * rasterizeCenterline(const std::vector<SIPL::int3> &vertices, const std::vector<SIPL::int2> &edges, SIPL::int3 size) {
+	char * centerline = new char[size.x*size.y*size.z]();
+	for(int i = 0; i < edges.size(); i++) {
+		int3 a = vertices[edges[i].x];
+		int3 b = vertices[edges[i].y];
+		const int n = ceil(a.distance(b));
+		for(int j = 0; j <= n; j++) {
+			const float ratio = n == 0 ? 0.0f : (float)j/n;
+			int3 pos(
+					round(a.x + (b.x-a.x)*ratio),
+					round(a.y + (b.y-a.y)*ratio),
+					round(a.z + (b.z-a.z)*ratio)
+			);
+			if(pos.x < 0 || pos.y < 0 || pos.z < 0 || pos.x >= size.x || pos.y >= size.y || pos.z >= size.z)
+				continue;
+			centerline[pos.x+pos.y*size.x+pos.z*size.x*size.y] = 1;
+		}
+	}
+	return centerline;
+}
+
+std::vector<float> sampleCenterlineRadius(const std::vector<SIPL::int3> &vertices, const float * radius, SIPL::int3 size) {
+	std::vector<float> values(vertices.size());
+	for(int i = 0; i < vertices.size(); i++) {
+		int3 v = vertices[i];
+		values[i] = radius[v.x+v.y*size.x+v.z*size.x*size.y];
+	}
+	return values;
+}
+
+// Legacy VTK files store binary data in big endian byte order
+template <class T>
+static void appendBigEndian(std::vector<char> &buffer, T value) {
+	char bytes[sizeof(T)];
+	memcpy(bytes, &value, sizeof(T));
+	for(int i = sizeof(T)-1; i >= 0; i--)
+		buffer.push_back(bytes[i]);
+}
+
+static void appendString(std::vector<char> &buffer, std::string str) {
+	buffer.insert(buffer.end(), str.begin(), str.end());
+}
+
+static int findComponent(std::vector<int> &parent, int i) {
+	while(parent[i] != i) {
+		parent[i] = parent[parent[i]];
+		i = parent[i];
+	}
+	return i;
+}
+
+// Label the connected components of the centerline graph from 0 and up
+static std::vector<int> findComponents(int nrOfVertices, const std::vector<SIPL::int2> &edges) {
+	std::vector<int> parent(nrOfVertices);
+	for(int i = 0; i < nrOfVertices; i++)
+		parent[i] = i;
+	for(int i = 0; i < edges.size(); i++) {
+		int a = findComponent(parent, edges[i].x);
+		int b = findComponent(parent, edges[i].y);
+		if(a != b)
+			parent[std::max(a, b)] = std::min(a, b);
+	}
+	std::vector<int> labels(nrOfVertices, -1);
+	std::vector<int> components(nrOfVertices);
+	int counter = 0;
+	for(int i = 0; i < nrOfVertices; i++) {
+		int root = findComponent(parent, i);
+		if(labels[root] == -1)
+			labels[root] = counter++;
+		components[i] = labels[root];
+	}
+	return components;
+}
+
+template <class T>
+static void appendPointData(std::vector<char> &buffer, std::string name, std::string type, const std::vector<T> &values) {
+	std::ostringstream header;
+	header << "SCALARS " << name << " " << type << " 1\nLOOKUP_TABLE default\n";
+	appendString(buffer, header.str());
+	for(int i = 0; i < values.size(); i++)
+		appendBigEndian(buffer, values[i]);
+	buffer.push_back('\n');
+}
+
+static std::vector<float> sampleAtVertices(TSFMappedView<float> view, const std::vector<int3> &vertices) {
+	std::vector<float> values(vertices.size());
+	SIPL::int3 size = view.getSize();
+	for(int i = 0; i < vertices.size(); i++) {
+		int3 v = vertices[i];
+		if(v.x < 0 || v.y < 0 || v.z < 0 || v.x >= size.x || v.y >= size.y || v.z >= size.z) {
+			values[i] = 0.0f;
+		} else {
+			values[i] = view.get(v.x, v.y, v.z);
+		}
+	}
+	return values;
+}
+
+/*
+ * Writes the graph as a binary legacy VTK file. The positions are given in
+ * physical coordinates of the original volume, and radius, TDF and connected
+ * component id are added as point data. The whole file is assembled in memory
+ * and written at once.
+ */
+static void writeToBinaryVtkFile(std::string filename, const std::vector<int3> &vertices, const std::vector<SIPL::int2> &edges, TSFOutput * output) {
+	SIPL::float3 spacing(1.0f, 1.0f, 1.0f);
+	SIPL::int3 shiftVector(0, 0, 0);
+	if(output != NULL) {
+		spacing = output->getSpacing();
+		shiftVector = output->getShiftVector();
+	}
+
+	std::vector<char> buffer;
+	buffer.reserve(256 + vertices.size()*(3*sizeof(float) + 3*sizeof(float) + sizeof(int)) + edges.size()*3*sizeof(int));
+	std::ostringstream header;
+	header << "# vtk DataFile Version 3.0\nvtk output\nBINARY\n";
+	header << "DATASET POLYDATA\nPOINTS " << vertices.size() << " float\n";
+	appendString(buffer, header.str());
+	for(int i = 0; i < vertices.size(); i++) {
+		appendBigEndian(buffer, (vertices[i].x + shiftVector.x)*spacing.x);
+		appendBigEndian(buffer, (vertices[i].y + shiftVector.y)*spacing.y);
+		appendBigEndian(buffer, (vertices[i].z + shiftVector.z)*spacing.z);
+	}
+
+	std::ostringstream lines;
+	lines << "\nLINES " << edges.size() << " " << edges.size()*3 << "\n";
+	appendString(buffer, lines.str());
+	for(int i = 0; i < edges.size(); i++) {
+		appendBigEndian(buffer, (int)2);
+		appendBigEndian(buffer, edges[i].x);
+		appendBigEndian(buffer, edges[i].y);
+	}
+
+	std::ostringstream pointData;
+	pointData << "\nPOINT_DATA " << vertices.size() << "\n";
+	appendString(buffer, pointData.str());
+	if(output != NULL && output->hasRadius())
+		appendPointData(buffer, "radius", "float", sampleAtVertices(output->mapRadius(), vertices));
+	if(output != NULL && output->hasTDF())
+		appendPointData(buffer, "tdf", "float", sampleAtVertices(output->mapTDF(), vertices));
+	appendPointData(buffer, "component", "int", findComponents(vertices.size(), edges));
+
+	std::ofstream file(filename.c_str(), std::ios::out | std::ios::binary);
+	if(!file)
+		throw SIPL::IOException(filename.c_str(), __LINE__, __FILE__);
+	file.write(&buffer[0], buffer.size());
+}
+
+void writeToVtkFile(paramList &parameters, std::vector<int3> vertices, std::vector<SIPL::int2> edges, TSFOutput * output) {
+	std::string filename = getParamStr(parameters, "centerline-vtk-file");
+	if(getParamStr(parameters, "centerline-vtk-format") == "binary") {
+		writeToBinaryVtkFile(filename, vertices, edges, output);
+		return;
+	}
+
 	// Write to file
 	std::ofstream file;
-	file.open(getParamStr(parameters, "centerline-vtk-file").c_str());
+	file.open(filename.c_str());
 	file << "# vtk DataFile Version 3.0\nvtk output\nASCII\n";
 	file << "DATASET POLYDATA\nPOINTS " << vertices.size() << " int\n";
 	for(int i = 0; i < vertices.size(); i++) {
@@ -70,21 +522,35 @@ TSFOutput::TSFOutput(oul::DeviceCriteria criteria, SIPL::int3 * size, bool TDFis
     std::vector<cl::Device> validDevices = manager->getDevicesForBestPlatform(
                             criteria, platformDevices);
 
-    this->context = new oul::Context(validDevices,false,false);//TODO:, false, getParamBool(parameters, "timing"));
+    init(new oul::Context(validDevices,false,false), size, TDFis16bit);//TODO:, false, getParamBool(parameters, "timing"));
+}
+
+TSFOutput::TSFOutput(oul::Context * context, SIPL::int3 * size, bool TDFis16bit) {
+	init(context, size, TDFis16bit);
+}
+
+void TSFOutput::init(oul::Context * context, SIPL::int3 * size, bool TDFis16bit) {
+    this->context = context;
 	this->TDFis16bit = TDFis16bit;
     OpenCL * ocl = new OpenCL;
     ocl->context = context->getContext();
 	ocl->platform = context->getPlatform();
 	ocl->queue = context->getQueue(0);
 	ocl->device = context->getDevice(0);
+	ocl->useBufferKernels = false;
 	this->ocl = ocl;
 	this->size = size;
 	hostHasCenterlineVoxels = false;
 	hostHasSegmentation = false;
 	hostHasTDF = false;
+	hostHasRadius = false;
+	deviceHasRadius = false;
 	deviceHasCenterlineVoxels = false;
 	deviceHasSegmentation = false;
 	deviceHasTDF = false;
+	hostHasCenterline = false;
+	deviceHasPackedSegmentation = false;
+	deviceHasPackedCenterlineVoxels = false;
 }
 
 oul::Context * TSFOutput::getContext() {
@@ -100,10 +566,18 @@ TSFOutput::~TSFOutput() {
 		delete[] centerlineVoxels;
 	if(deviceHasTDF)
 		delete oclTDF;
+	if(hostHasRadius)
+		delete[] radius;
+	if(deviceHasRadius)
+		delete oclRadius;
 	if(deviceHasSegmentation)
 		delete oclSegmentation;
 	if(deviceHasCenterlineVoxels)
 		delete oclCenterlineVoxels;
+	if(deviceHasPackedSegmentation)
+		delete oclPackedSegmentation;
+	if(deviceHasPackedCenterlineVoxels)
+		delete oclPackedCenterlineVoxels;
 	delete ocl;
 	delete size;
 }
@@ -118,6 +592,65 @@ void TSFOutput::setTDF(float * data) {
 	TDF = data;
 }
 
+void TSFOutput::setRadius(Image3D * image) {
+	deviceHasRadius = true;
+	oclRadius = image;
+}
+
+void TSFOutput::setRadius(float * data) {
+	hostHasRadius = true;
+	radius = data;
+}
+
+void TSFOutput::setCenterline(std::vector<SIPL::int3> vertices, std::vector<SIPL::int2> edges, std::vector<float> radius) {
+	if(radius.size() != vertices.size())
+		throw SIPL::SIPLException("The centerline must have one radius per vertex", __LINE__, __FILE__);
+	hostHasCenterline = true;
+	centerlineVertices = vertices;
+	centerlineEdges = edges;
+	centerlineRadius = radius;
+}
+
+void TSFOutput::setPackedSegmentation(cl::Buffer * buffer) {
+	deviceHasPackedSegmentation = true;
+	oclPackedSegmentation = buffer;
+}
+
+void TSFOutput::setPackedCenterlineVoxels(cl::Buffer * buffer) {
+	deviceHasPackedCenterlineVoxels = true;
+	oclPackedCenterlineVoxels = buffer;
+}
+
+std::vector<unsigned int> TSFOutput::readPackedMask(cl::Buffer * buffer) {
+	std::vector<unsigned int> words((std::size_t)getMaskWordsPerRow(*size)*size->y*size->z);
+	ocl->queue.enqueueReadBuffer(*buffer, CL_TRUE, 0, sizeof(unsigned int)*words.size(), &words[0]);
+	return words;
+}
+
+std::vector<unsigned int> TSFOutput::getPackedSegmentation() {
+	if(!deviceHasPackedSegmentation)
+		throw SIPL::SIPLException("The segmentation is not bit packed", __LINE__, __FILE__);
+	return readPackedMask(oclPackedSegmentation);
+}
+
+std::vector<unsigned int> TSFOutput::getPackedCenterlineVoxels() {
+	if(!deviceHasPackedCenterlineVoxels)
+		throw SIPL::SIPLException("The centerline voxels are not bit packed", __LINE__, __FILE__);
+	return readPackedMask(oclPackedCenterlineVoxels);
+}
+
+TSFRunLengthMask TSFOutput::getSegmentationRunLength() {
+	if(deviceHasPackedSegmentation && !hostHasSegmentation)
+		return TSFRunLengthMask::fromPackedWords(&getPackedSegmentation()[0], *size);
+	return TSFRunLengthMask::fromVoxels(mapSegmentation().getData(), *size);
+}
+
+TSFRunLengthMask TSFOutput::getCenterlineVoxelsRunLength() {
+	if(deviceHasPackedCenterlineVoxels && !hostHasCenterlineVoxels)
+		return TSFRunLengthMask::fromPackedWords(&getPackedCenterlineVoxels()[0], *size);
+	return TSFRunLengthMask::fromVoxels(mapCenterlineVoxels().getData(), *size);
+}
+
 void TSFOutput::setSegmentation(Image3D * image) {
 	deviceHasSegmentation = true;
 	oclSegmentation = image;
@@ -158,12 +691,12 @@ float * TSFOutput::getTDF() {
 		int totalSize = size->x*size->y*size->z;
 		TDF = new float[totalSize];
 		if(TDFis16bit) {
-			unsigned short * tempTDF = new unsigned short[totalSize];
-			ocl->queue.enqueueReadImage(*oclTDF,CL_TRUE, origin, region, 0, 0, tempTDF);
+			TSFMappedView<unsigned short> tempTDF = mapTDF16bit();
+			const unsigned short * tempData = tempTDF.getData();
+#pragma omp parallel for
 			for(int i = 0; i < totalSize;i++) {
-				TDF[i] = (float)tempTDF[i] / 65535.0f;
+				TDF[i] = (float)tempData[i] / 65535.0f;
 			}
-			delete[] tempTDF;
 		} else {
 			ocl->queue.enqueueReadImage(*oclTDF,CL_TRUE, origin, region, 0, 0, TDF);
 		}
@@ -191,6 +724,12 @@ char * TSFOutput::getSegmentation() {
 		ocl->queue.enqueueReadImage(*oclSegmentation,CL_TRUE, origin, region, 0, 0, segmentation);
 		hostHasSegmentation = true;
 		return segmentation;
+	} else if(deviceHasPackedSegmentation) {
+		// Only the packed mask is transferred
+		segmentation = new char[size->x*size->y*size->z];
+		getSegmentationRunLength().toVoxels(segmentation);
+		hostHasSegmentation = true;
+		return segmentation;
 	} else {
 		throw SIPL::SIPLException("Trying to fetch non existing data from TSFOutput", __LINE__, __FILE__);
 	}
@@ -213,6 +752,70 @@ char * TSFOutput::getCenterlineVoxels() {
 		ocl->queue.enqueueReadImage(*oclCenterlineVoxels,CL_TRUE, origin, region, 0, 0, centerlineVoxels);
 		hostHasCenterlineVoxels = true;
 		return centerlineVoxels;
+	} else if(deviceHasPackedCenterlineVoxels) {
+		centerlineVoxels = new char[size->x*size->y*size->z];
+		getCenterlineVoxelsRunLength().toVoxels(centerlineVoxels);
+		hostHasCenterlineVoxels = true;
+		return centerlineVoxels;
+	} else if(hostHasCenterline) {
+		centerlineVoxels = rasterizeCenterline(centerlineVertices, centerlineEdges, *size);
+		hostHasCenterlineVoxels = true;
+		return centerlineVoxels;
+	} else {
+		throw SIPL::SIPLException("Trying to fetch non existing data from TSFOutput", __LINE__, __FILE__);
+	}
+}
+
+TSFMappedView<char> TSFOutput::mapSegmentation() {
+	if(hostHasSegmentation) {
+		return TSFMappedView<char>(segmentation, *size);
+	} else if(deviceHasSegmentation) {
+		return TSFMappedView<char>(ocl->queue, *oclSegmentation, *size);
+	} else if(deviceHasPackedSegmentation) {
+		return TSFMappedView<char>(getSegmentation(), *size);
+	} else {
+		throw SIPL::SIPLException("Trying to fetch non existing data from TSFOutput", __LINE__, __FILE__);
+	}
+}
+
+TSFMappedView<char> TSFOutput::mapCenterlineVoxels() {
+	if(hostHasCenterlineVoxels) {
+		return TSFMappedView<char>(centerlineVoxels, *size);
+	} else if(deviceHasCenterlineVoxels) {
+		return TSFMappedView<char>(ocl->queue, *oclCenterlineVoxels, *size);
+	} else if(hostHasCenterline || deviceHasPackedCenterlineVoxels) {
+		return TSFMappedView<char>(getCenterlineVoxels(), *size);
+	} else {
+		throw SIPL::SIPLException("Trying to fetch non existing data from TSFOutput", __LINE__, __FILE__);
+	}
+}
+
+TSFMappedView<float> TSFOutput::mapTDF() {
+	if(hostHasTDF) {
+		return TSFMappedView<float>(TDF, *size);
+	} else if(deviceHasTDF && !TDFis16bit) {
+		return TSFMappedView<float>(ocl->queue, *oclTDF, *size);
+	} else if(deviceHasTDF) {
+		// A 16 bit TDF has to be converted to float on the host
+		return TSFMappedView<float>(getTDF(), *size);
+	} else {
+		throw SIPL::SIPLException("Trying to fetch non existing data from TSFOutput", __LINE__, __FILE__);
+	}
+}
+
+TSFMappedView<unsigned short> TSFOutput::mapTDF16bit() {
+	if(deviceHasTDF && TDFis16bit) {
+		return TSFMappedView<unsigned short>(ocl->queue, *oclTDF, *size);
+	} else {
+		throw SIPL::SIPLException("TDF is not stored as 16 bit on the device", __LINE__, __FILE__);
+	}
+}
+
+TSFMappedView<float> TSFOutput::mapRadius() {
+	if(hostHasRadius) {
+		return TSFMappedView<float>(radius, *size);
+	} else if(deviceHasRadius) {
+		return TSFMappedView<float>(ocl->queue, *oclRadius, *size);
 	} else {
 		throw SIPL::SIPLException("Trying to fetch non existing data from TSFOutput", __LINE__, __FILE__);
 	}
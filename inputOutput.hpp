@@ -3,26 +3,205 @@
 
 #include "SIPL/Types.hpp"
 #include <vector>
+#include <cstddef>
+#include <deque>
+#ifdef CPP11
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#endif
 #include "parameters.hpp"
 #include "commons.hpp"
 using namespace SIPL;
 
+/*
+ * Read only view of a result volume. Device results are mapped into host
+ * memory with enqueueMapImage and unmapped when the last copy of the view is
+ * destroyed. On CPU devices this gives direct access to the data without an
+ * extra copy of the volume. If the runtime returns a padded mapping, the view
+ * falls back to reading the image into a host array owned by the view.
+ * Copies of a view can be destroyed on different threads when built with
+ * CPP11, otherwise a view and its copies must stay on one thread.
+ */
+template <class T>
+class TSFMappedView {
+public:
+	TSFMappedView(cl::CommandQueue queue, cl::Image3D image, SIPL::int3 size);
+	TSFMappedView(const T * data, SIPL::int3 size);
+	TSFMappedView(const TSFMappedView<T> &other);
+	TSFMappedView<T> & operator=(const TSFMappedView<T> &other);
+	~TSFMappedView();
+	const T * getData() const { return mapping->data; };
+	const T & operator[](int i) const { return mapping->data[i]; };
+	const T & get(int x, int y, int z) const { return mapping->data[x+y*size.x+z*size.x*size.y]; };
+	SIPL::int3 getSize() const { return size; };
+	int getTotalSize() const { return size.x*size.y*size.z; };
+	bool isMapped() const { return mapping->mapped; };
+private:
+	struct Mapping {
+#ifdef CPP11
+		std::atomic<int> references;
+#else
+		int references;
+#endif
+		cl::CommandQueue queue;
+		cl::Image3D image;
+		T * data;
+		bool mapped;
+		bool ownsData;
+	};
+	void release();
+	Mapping * mapping;
+	SIPL::int3 size;
+};
+
+template <class T>
+TSFMappedView<T>::TSFMappedView(cl::CommandQueue queue, cl::Image3D image, SIPL::int3 size) {
+	this->size = size;
+	mapping = new Mapping;
+	mapping->references = 1;
+	mapping->queue = queue;
+	mapping->image = image;
+	mapping->ownsData = false;
+	cl::size_t<3> origin;
+	origin[0] = 0;
+	origin[1] = 0;
+	origin[2] = 0;
+	cl::size_t<3> region;
+	region[0] = size.x;
+	region[1] = size.y;
+	region[2] = size.z;
+	std::size_t rowPitch, slicePitch;
+	mapping->data = (T *)queue.enqueueMapImage(image, CL_TRUE, CL_MAP_READ, origin, region, &rowPitch, &slicePitch);
+	mapping->mapped = true;
+	if(rowPitch != size.x*sizeof(T) || slicePitch != size.x*size.y*sizeof(T)) {
+		// Padded mapping, make a tightly packed copy instead
+		queue.enqueueUnmapMemObject(image, mapping->data);
+		mapping->mapped = false;
+		mapping->data = new T[size.x*size.y*size.z];
+		mapping->ownsData = true;
+		queue.enqueueReadImage(image, CL_TRUE, origin, region, 0, 0, mapping->data);
+	}
+}
+
+template <class T>
+TSFMappedView<T>::TSFMappedView(const T * data, SIPL::int3 size) {
+	this->size = size;
+	mapping = new Mapping;
+	mapping->references = 1;
+	mapping->data = (T *)data;
+	mapping->mapped = false;
+	mapping->ownsData = false;
+}
+
+template <class T>
+TSFMappedView<T>::TSFMappedView(const TSFMappedView<T> &other) {
+	size = other.size;
+	mapping = other.mapping;
+	mapping->references++;
+}
+
+template <class T>
+TSFMappedView<T> & TSFMappedView<T>::operator=(const TSFMappedView<T> &other) {
+	if(mapping != other.mapping) {
+		release();
+		size = other.size;
+		mapping = other.mapping;
+		mapping->references++;
+	}
+	return *this;
+}
+
+template <class T>
+TSFMappedView<T>::~TSFMappedView() {
+	release();
+}
+
+template <class T>
+void TSFMappedView<T>::release() {
+	if(--mapping->references > 0)
+		return;
+	if(mapping->mapped)
+		mapping->queue.enqueueUnmapMemObject(mapping->image, mapping->data);
+	if(mapping->ownsData)
+		delete[] mapping->data;
+	delete mapping;
+}
+
+// Number of 32 bit words in each row of a bit packed mask
+inline int getMaskWordsPerRow(SIPL::int3 size) { return (size.x + 31) / 32; };
+
+typedef struct TSFMaskRun {
+	std::size_t start; // Linear index of the first voxel
+	unsigned int length;
+} TSFMaskRun;
+
+/*
+ * Run-length encoded binary mask. The runs of non-zero voxels are stored in
+ * increasing order of their linear index.
+ */
+class TSFRunLengthMask {
+public:
+	TSFRunLengthMask(SIPL::int3 size);
+	static TSFRunLengthMask fromVoxels(const char * voxels, SIPL::int3 size);
+	// words is a bit packed mask, see getMaskWordsPerRow
+	static TSFRunLengthMask fromPackedWords(const unsigned int * words, SIPL::int3 size);
+	// voxels must have room for the whole volume
+	void toVoxels(char * voxels) const;
+	const std::vector<TSFMaskRun> & getRuns() const { return runs; };
+	SIPL::int3 getSize() const { return size; };
+	std::size_t getVoxelCount() const;
+private:
+	void addRun(std::size_t start, unsigned int length);
+	std::vector<TSFMaskRun> runs;
+	SIPL::int3 size;
+};
+
 class TSFOutput {
 public:
 	TSFOutput(oul::DeviceCriteria criteria, SIPL::int3 * size, bool TDFis16bit = false);
-	bool hasSegmentation() { return deviceHasSegmentation || hostHasSegmentation; };
-	bool hasCenterlineVoxels() { return deviceHasCenterlineVoxels || hostHasCenterlineVoxels; };
+	// Output on the context of another output, which must outlive it
+	TSFOutput(oul::Context * context, SIPL::int3 * size, bool TDFis16bit = false);
+	bool hasSegmentation() { return deviceHasSegmentation || hostHasSegmentation || deviceHasPackedSegmentation; };
+	bool hasCenterlineVoxels() { return deviceHasCenterlineVoxels || hostHasCenterlineVoxels || deviceHasPackedCenterlineVoxels || hostHasCenterline; };
+	bool hasPackedSegmentation() { return deviceHasPackedSegmentation; };
+	bool hasPackedCenterlineVoxels() { return deviceHasPackedCenterlineVoxels; };
+	bool hasCenterline() { return hostHasCenterline; };
 	bool hasTDF() { return deviceHasTDF || hostHasTDF; };
+	bool hasRadius() { return deviceHasRadius || hostHasRadius; };
 	void setTDF(cl::Image3D *);
+	void setRadius(cl::Image3D *);
+	void setRadius(float *);
 	void setSegmentation(cl::Image3D *);
 	void setCenterlineVoxels(cl::Image3D *);
+	// Bit packed masks created by the packMask kernel
+	void setPackedSegmentation(cl::Buffer *);
+	void setPackedCenterlineVoxels(cl::Buffer *);
 	void setTDF(float *);
 	void setSegmentation(char *);
 	void setCenterlineVoxels(char *);
 	void setSize(SIPL::int3 *);
+	// Sparse centerline graph with the radius of each vertex
+	void setCenterline(std::vector<SIPL::int3> vertices, std::vector<SIPL::int2> edges, std::vector<float> radius);
+	const std::vector<SIPL::int3> & getCenterlineVertices() const { return centerlineVertices; };
+	const std::vector<SIPL::int2> & getCenterlineEdges() const { return centerlineEdges; };
+	const std::vector<float> & getCenterlineRadius() const { return centerlineRadius; };
 	char * getSegmentation();
+	// If only the sparse centerline exists, the voxels are created from it
 	char * getCenterlineVoxels();
 	float * getTDF();
+	std::vector<unsigned int> getPackedSegmentation();
+	std::vector<unsigned int> getPackedCenterlineVoxels();
+	TSFRunLengthMask getSegmentationRunLength();
+	TSFRunLengthMask getCenterlineVoxelsRunLength();
+	// Views of the results that avoid making a host copy when possible
+	TSFMappedView<char> mapSegmentation();
+	TSFMappedView<char> mapCenterlineVoxels();
+	TSFMappedView<float> mapTDF();
+	TSFMappedView<unsigned short> mapTDF16bit();
+	TSFMappedView<float> mapRadius();
+	bool isTDF16bit() const { return TDFis16bit; };
 	SIPL::int3 * getSize();
 	~TSFOutput();
 	SIPL::int3 getShiftVector() const;
@@ -31,10 +210,15 @@ public:
 	void setSpacing(SIPL::float3 spacing);
 	oul::Context *getContext();
 private:
+	void init(oul::Context * context, SIPL::int3 * size, bool TDFis16bit);
+	std::vector<unsigned int> readPackedMask(cl::Buffer *);
 	oul::Context *context;
 	cl::Image3D* oclCenterlineVoxels;
 	cl::Image3D* oclSegmentation;
 	cl::Image3D* oclTDF;
+	cl::Image3D* oclRadius;
+	cl::Buffer* oclPackedSegmentation;
+	cl::Buffer* oclPackedCenterlineVoxels;
 	SIPL::int3* size;
 	SIPL::float3 spacing;
 	SIPL::int3 shiftVector;
@@ -45,14 +229,84 @@ private:
 	bool deviceHasTDF;
 	bool deviceHasCenterlineVoxels;
 	bool deviceHasSegmentation;
+	bool hostHasRadius;
+	bool deviceHasRadius;
+	bool hostHasCenterline;
+	bool deviceHasPackedSegmentation;
+	bool deviceHasPackedCenterlineVoxels;
+	std::vector<SIPL::int3> centerlineVertices;
+	std::vector<SIPL::int2> centerlineEdges;
+	std::vector<float> centerlineRadius;
 	char* segmentation;
 	char* centerlineVoxels;
 	float* TDF;
+	float* radius;
 	OpenCL* ocl;
 };
 
-void writeToVtkFile(paramList &parameters, std::vector<int3> vertices, std::vector<SIPL::int2> edges);
+typedef struct TSFWriteJob {
+	std::string filename; // Without extension
+	std::string elementType; // MET_CHAR or MET_FLOAT
+	std::string encoding; // raw, zraw or bitpacked
+	bool bitPacked; // The data is already bit packed
+	SIPL::int3 size;
+	SIPL::float3 spacing;
+	std::vector<char> data;
+} TSFWriteJob;
+
+/*
+ * Writes result volumes to disk as MetaImage files. The data is copied from
+ * the TSFOutput when it is added, so the output may be deleted right away.
+ * When compiled with C++11, asynchronous jobs are encoded and written by a
+ * background thread so that the next dataset can be processed meanwhile.
+ * At most maxQueueSize jobs wait in the queue, after that adding a job
+ * blocks until there is room.
+ */
+class TSFWriter {
+public:
+	static TSFWriter * getInstance();
+	void write(TSFOutput * output, std::string storageDirectory, std::string name, std::string encoding, bool writeTDF, bool writeRadius, bool async);
+	void setMaxQueueSize(int maxQueueSize);
+	// Wait for all queued jobs to be written
+	void finish();
+	~TSFWriter();
+private:
+	TSFWriter();
+	void addJob(TSFWriteJob &job, bool async);
+	void writeJob(TSFWriteJob &job);
+	std::deque<TSFWriteJob> queue;
+	int maxQueueSize;
+#ifdef CPP11
+	void processQueue();
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable jobAdded;
+	std::condition_variable jobRemoved;
+	bool threadStarted;
+	bool busy;
+	bool stop;
+#endif
+};
+
+/*
+ * Rasterize the edges of a centerline graph to a volume where centerline
+ * voxels are 1. The caller owns the returned array.
+ */
+char * rasterizeCenterline(const std::vector<SIPL::int3> &vertices, const std::vector<SIPL::int2> &edges, SIPL::int3 size);
+
+// Look up the radius of each vertex in a radius volume
+std::vector<float> sampleCenterlineRadius(const std::vector<SIPL::int3> &vertices, const float * radius, SIPL::int3 size);
+
+/*
+ * Write a centerline graph to the file given by centerline-vtk-file. With
+ * centerline-vtk-format binary, output is used for the spacing, shift vector,
+ * radius and TDF of the vertices and may be NULL.
+ */
+void writeToVtkFile(paramList &parameters, std::vector<int3> vertices, std::vector<SIPL::int2> edges, TSFOutput * output = NULL);
 
 void writeDataToDisk(TSFOutput * output, std::string storageDirectory, std::string name);
 
+// Write the results as specified by the storage-* parameters
+void writeDataToDisk(TSFOutput * output, paramList &parameters);
+
 #endif
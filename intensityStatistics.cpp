@@ -0,0 +1,310 @@
+#include "intensityStatistics.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <iomanip>
+#include <limits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sys/stat.h>
+#include "SIPL/Exceptions.hpp"
+
+// Undefine windows crap
+#ifdef WIN32
+#undef min
+#undef max
+#endif
+
+IntensityStatistics::IntensityStatistics() {
+	minimum = 0.0f;
+	maximum = 0.0f;
+	count = 0;
+	histogram = std::vector<unsigned long>(INTENSITY_HISTOGRAM_BINS, 0);
+}
+
+void IntensityStatistics::setLimits(float minimum, float maximum) {
+	this->minimum = minimum;
+	this->maximum = maximum;
+}
+
+void IntensityStatistics::addToHistogram(float value, unsigned long n) {
+	int bin = 0;
+	if(maximum > minimum)
+		bin = (int)((value - minimum) / (maximum - minimum) * INTENSITY_HISTOGRAM_BINS);
+	bin = std::max(0, std::min(INTENSITY_HISTOGRAM_BINS-1, bin));
+	histogram[bin] += n;
+	count += n;
+}
+
+float IntensityStatistics::getPercentile(float p) const {
+	if(count == 0 || p <= 0.0f)
+		return minimum;
+	if(p >= 100.0f)
+		return maximum;
+
+	const double target = (double)p / 100.0 * count;
+	const double binSize = (double)(maximum - minimum) / INTENSITY_HISTOGRAM_BINS;
+	unsigned long cumulative = 0;
+	for(int i = 0; i < INTENSITY_HISTOGRAM_BINS; i++) {
+		if(cumulative + histogram[i] >= target && histogram[i] > 0) {
+			// Interpolate linearly inside the bin
+			const double fraction = (target - cumulative) / histogram[i];
+			return (float)(minimum + (i + fraction)*binSize);
+		}
+		cumulative += histogram[i];
+	}
+	return maximum;
+}
+
+bool IntensityStatistics::load(std::string filename, std::string key) {
+	std::ifstream file(filename.c_str());
+	if(!file)
+		return false;
+	std::string line;
+	std::getline(file, line);
+	if(line != "TSF intensity statistics 1")
+		return false;
+	std::getline(file, line);
+	if(line != key)
+		return false;
+	file >> minimum >> maximum >> count;
+	for(int i = 0; i < INTENSITY_HISTOGRAM_BINS; i++)
+		file >> histogram[i];
+	return !file.fail();
+}
+
+void IntensityStatistics::save(std::string filename, std::string key) const {
+	std::ofstream file(filename.c_str());
+	if(!file) {
+		std::cout << "NOTE: Unable to write intensity statistics to " << filename << std::endl;
+		return;
+	}
+	// Enough digits for the minimum and maximum to be read back exactly
+#ifdef CPP11
+	file << std::setprecision(std::numeric_limits<float>::max_digits10);
+#else
+	file << std::setprecision(9);
+#endif
+	file << "TSF intensity statistics 1\n";
+	file << key << "\n";
+	file << minimum << " " << maximum << " " << count << "\n";
+	for(int i = 0; i < INTENSITY_HISTOGRAM_BINS; i++)
+		file << histogram[i] << (i == INTENSITY_HISTOGRAM_BINS-1 ? "\n" : " ");
+}
+
+/*
+ * Each type is mapped to an order preserving key of at most 16 bits, which
+ * is used to build an exact histogram of the integer types in the same pass
+ * as the minimum and maximum. Floats are keyed on the upper 16 bits of an
+ * order preserving transform of their bit pattern.
+ */
+static inline unsigned int intensityKey(unsigned char v) { return v; }
+static inline unsigned int intensityKey(signed char v) { return (int)v + 128; }
+static inline unsigned int intensityKey(unsigned short v) { return v; }
+static inline unsigned int intensityKey(short v) { return (int)v + 32768; }
+static inline unsigned int intensityKey(float v) {
+	unsigned int bits;
+	memcpy(&bits, &v, sizeof(float));
+	bits = (bits & 0x80000000) ? ~bits : bits | 0x80000000;
+	return bits >> 16;
+}
+
+template <class T>
+static inline float keyToIntensity(unsigned int key);
+template <> inline float keyToIntensity<unsigned char>(unsigned int key) { return (float)key; }
+template <> inline float keyToIntensity<signed char>(unsigned int key) { return (float)key - 128.0f; }
+template <> inline float keyToIntensity<unsigned short>(unsigned int key) { return (float)key; }
+template <> inline float keyToIntensity<short>(unsigned int key) { return (float)key - 32768.0f; }
+template <> inline float keyToIntensity<float>(unsigned int key) {
+	unsigned int bits = key << 16;
+	bits = (bits & 0x80000000) ? bits & 0x7FFFFFFF : ~bits;
+	float v;
+	memcpy(&v, &bits, sizeof(float));
+	return v;
+}
+
+IntensityStatisticsAccumulator::IntensityStatisticsAccumulator(std::string typeName) {
+	this->typeName = typeName;
+	if(typeName != "MET_SHORT" && typeName != "MET_USHORT" && typeName != "MET_CHAR" &&
+			typeName != "MET_UCHAR" && typeName != "MET_FLOAT") {
+		std::string str = "unsupported data type " + typeName;
+		throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
+	}
+	keyHistogram = std::vector<unsigned long>(getElementSize() == 1 ? 256 : 65536, 0);
+	minimum = 0.0f;
+	maximum = 0.0f;
+	empty = true;
+}
+
+size_t IntensityStatisticsAccumulator::getElementSize() const {
+	if(typeName == "MET_SHORT" || typeName == "MET_USHORT") {
+		return sizeof(short);
+	} else if(typeName == "MET_CHAR" || typeName == "MET_UCHAR") {
+		return sizeof(char);
+	} else {
+		return sizeof(float);
+	}
+}
+
+template <class T>
+void IntensityStatisticsAccumulator::addData(const T * data, size_t nrOfElements) {
+	if(nrOfElements == 0)
+		return;
+	const unsigned int nrOfKeys = keyHistogram.size();
+	const long blockSize = 4096;
+	const long nrOfBlocks = (long)((nrOfElements + blockSize - 1) / blockSize);
+	T chunkMinimum = data[0];
+	T chunkMaximum = data[0];
+
+#pragma omp parallel
+	{
+		std::vector<unsigned long> localHistogram(nrOfKeys, 0);
+		T localMinimum = chunkMinimum;
+		T localMaximum = chunkMaximum;
+#pragma omp for schedule(static)
+		for(long block = 0; block < nrOfBlocks; block++) {
+			const size_t start = (size_t)block*blockSize;
+			const size_t end = std::min(start + blockSize, nrOfElements);
+			// The block stays in cache, so the data is only read once from memory
+			T blockMinimum = localMinimum;
+			T blockMaximum = localMaximum;
+#if defined(_OPENMP) && _OPENMP >= 201307
+#pragma omp simd reduction(min:blockMinimum) reduction(max:blockMaximum)
+#endif
+			for(size_t i = start; i < end; i++) {
+				blockMinimum = data[i] < blockMinimum ? data[i] : blockMinimum;
+				blockMaximum = data[i] > blockMaximum ? data[i] : blockMaximum;
+			}
+			localMinimum = blockMinimum;
+			localMaximum = blockMaximum;
+			for(size_t i = start; i < end; i++)
+				localHistogram[intensityKey(data[i])]++;
+		}
+#pragma omp critical
+		{
+			chunkMinimum = std::min(chunkMinimum, localMinimum);
+			chunkMaximum = std::max(chunkMaximum, localMaximum);
+			for(unsigned int i = 0; i < nrOfKeys; i++)
+				keyHistogram[i] += localHistogram[i];
+		}
+	}
+
+	if(empty) {
+		minimum = (float)chunkMinimum;
+		maximum = (float)chunkMaximum;
+		empty = false;
+	} else {
+		minimum = std::min(minimum, (float)chunkMinimum);
+		maximum = std::max(maximum, (float)chunkMaximum);
+	}
+}
+
+void IntensityStatisticsAccumulator::add(const void * data, size_t nrOfElements) {
+	if(typeName == "MET_SHORT") {
+		addData<short>((const short *)data, nrOfElements);
+	} else if(typeName == "MET_USHORT") {
+		addData<unsigned short>((const unsigned short *)data, nrOfElements);
+	} else if(typeName == "MET_CHAR") {
+		addData<signed char>((const signed char *)data, nrOfElements);
+	} else if(typeName == "MET_UCHAR") {
+		addData<unsigned char>((const unsigned char *)data, nrOfElements);
+	} else {
+		addData<float>((const float *)data, nrOfElements);
+	}
+}
+
+template <class T>
+IntensityStatistics IntensityStatisticsAccumulator::createStatistics() const {
+	IntensityStatistics statistics;
+	statistics.setLimits(minimum, maximum);
+	for(unsigned int key = 0; key < keyHistogram.size(); key++) {
+		if(keyHistogram[key] == 0)
+			continue;
+		const float value = keyToIntensity<T>(key);
+		if(value != value) // NaN
+			continue;
+		statistics.addToHistogram(value, keyHistogram[key]);
+	}
+	return statistics;
+}
+
+IntensityStatistics IntensityStatisticsAccumulator::getStatistics() const {
+	if(typeName == "MET_SHORT") {
+		return createStatistics<short>();
+	} else if(typeName == "MET_USHORT") {
+		return createStatistics<unsigned short>();
+	} else if(typeName == "MET_CHAR") {
+		return createStatistics<signed char>();
+	} else if(typeName == "MET_UCHAR") {
+		return createStatistics<unsigned char>();
+	} else {
+		return createStatistics<float>();
+	}
+}
+
+IntensityStatistics computeIntensityStatistics(const void * data, std::string typeName, size_t totalSize) {
+	IntensityStatisticsAccumulator accumulator(typeName);
+	accumulator.add(data, totalSize);
+	return accumulator.getStatistics();
+}
+
+std::string getIntensityStatisticsCacheKey(std::string rawFilename, std::string typeName) {
+	struct stat fileInfo;
+	if(stat(rawFilename.c_str(), &fileInfo) != 0)
+		return "";
+	std::ostringstream key;
+	key << (long long)fileInfo.st_size << " " << (long long)fileInfo.st_mtime << " " << typeName;
+	return key.str();
+}
+
+static bool isPercentile(std::string value) {
+	return value.size() > 1 && value[0] == 'p';
+}
+
+bool isFixedIntensityLimit(std::string value) {
+	return value != "off" && !isPercentile(value);
+}
+
+bool needsIntensityStatistics(paramList &parameters) {
+	std::string minimum = getParamStr(parameters, "minimum");
+	std::string maximum = getParamStr(parameters, "maximum");
+	return minimum == "off" || maximum == "off" ||
+			isPercentile(minimum) || isPercentile(maximum) ||
+			getParamStr(parameters, "intensity-percentiles") != "off";
+}
+
+static float getIntensityLimit(std::string value, std::string name, const IntensityStatistics * statistics, bool isMinimum) {
+	if(value == "off" || isPercentile(value)) {
+		if(statistics == NULL)
+			throw SIPL::SIPLException("Intensity statistics are required to find the intensity limits", __LINE__, __FILE__);
+		float limit;
+		if(value == "off") {
+			std::cout << "NOTE: " << name << " parameter not set, finding " << name << " automatically." << std::endl;
+			limit = isMinimum ? statistics->getMinimum() : statistics->getMaximum();
+		} else {
+			limit = statistics->getPercentile(atof(value.substr(1).c_str()));
+		}
+		std::cout << "NOTE: " << name << " found to be " << limit << std::endl;
+		return limit;
+	} else {
+		return atof(value.c_str());
+	}
+}
+
+void getIntensityLimits(paramList &parameters, const IntensityStatistics * statistics, float * minimum, float * maximum) {
+	*minimum = getIntensityLimit(getParamStr(parameters, "minimum"), "minimum", statistics, true);
+	*maximum = getIntensityLimit(getParamStr(parameters, "maximum"), "maximum", statistics, false);
+
+	// Report requested percentiles
+	std::string percentiles = getParamStr(parameters, "intensity-percentiles");
+	if(percentiles != "off" && statistics != NULL) {
+		std::istringstream stream(percentiles);
+		std::string percentile;
+		while(std::getline(stream, percentile, ',')) {
+			float p = atof(percentile.c_str());
+			std::cout << "NOTE: intensity percentile " << p << " is " << statistics->getPercentile(p) << std::endl;
+		}
+	}
+}
@@ -0,0 +1,86 @@
+#ifndef INTENSITY_STATISTICS_H
+#define INTENSITY_STATISTICS_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include "parameters.hpp"
+
+#define INTENSITY_HISTOGRAM_BINS 4096
+
+/*
+ * Minimum, maximum and histogram of the intensities of a dataset. The
+ * histogram has INTENSITY_HISTOGRAM_BINS bins spread evenly between the
+ * minimum and maximum.
+ */
+class IntensityStatistics {
+public:
+	IntensityStatistics();
+	float getMinimum() const { return minimum; };
+	float getMaximum() const { return maximum; };
+	unsigned long getCount() const { return count; };
+	const std::vector<unsigned long> & getHistogram() const { return histogram; };
+	// p is given in percent (0 to 100)
+	float getPercentile(float p) const;
+	bool load(std::string filename, std::string key);
+	void save(std::string filename, std::string key) const;
+	void setLimits(float minimum, float maximum);
+	void addToHistogram(float value, unsigned long n);
+private:
+	float minimum;
+	float maximum;
+	unsigned long count;
+	std::vector<unsigned long> histogram;
+};
+
+/*
+ * Accumulates the statistics of a dataset that arrives in chunks, such as
+ * when it is decompressed. typeName is a MetaImage element type.
+ */
+class IntensityStatisticsAccumulator {
+public:
+	IntensityStatisticsAccumulator(std::string typeName);
+	void add(const void * data, std::size_t nrOfElements);
+	IntensityStatistics getStatistics() const;
+	std::size_t getElementSize() const;
+private:
+	template <class T>
+	void addData(const T * data, std::size_t nrOfElements);
+	template <class T>
+	IntensityStatistics createStatistics() const;
+	std::string typeName;
+	std::vector<unsigned long> keyHistogram;
+	float minimum;
+	float maximum;
+	bool empty;
+};
+
+/*
+ * Compute the statistics in a single parallel pass over the data. typeName
+ * is a MetaImage element type.
+ */
+IntensityStatistics computeIntensityStatistics(const void * data, std::string typeName, std::size_t totalSize);
+
+/*
+ * Returns the key used to validate the statistics cache of a raw file: the
+ * size and modification time of the file and the element type.
+ */
+std::string getIntensityStatisticsCacheKey(std::string rawFilename, std::string typeName);
+
+/*
+ * Whether the minimum, maximum or intensity-percentiles parameters need the
+ * statistics of the dataset.
+ */
+bool needsIntensityStatistics(paramList &parameters);
+
+/*
+ * Sets the intensity limits from the minimum and maximum parameters. These can
+ * be a value, "off" to use the minimum/maximum of the dataset, or a
+ * percentile such as "p0.5". statistics may be NULL if they are not needed.
+ */
+void getIntensityLimits(paramList &parameters, const IntensityStatistics * statistics, float * minimum, float * maximum);
+
+// Whether a minimum or maximum parameter is a value and not found from the statistics
+bool isFixedIntensityLimit(std::string value);
+
+#endif
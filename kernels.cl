@@ -8,6 +8,9 @@ __constant sampler_t hpSampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP
 
 #define LPOS(pos) pos.x+pos.y*get_global_size(0)+pos.z*get_global_size(0)*get_global_size(1)
 
+// Kernels of a specialized program replace some run constant arguments
+// with -D defines, see specializedKernels.hpp
+
 #ifdef VECTORS_16BIT
 #define UNORM16_TO_FLOAT(v) (float)v / 65535.0f
 #define FLOAT_TO_UNORM16(v) convert_ushort_sat_rte(v * 65535.0f)
@@ -817,6 +820,9 @@ __kernel void cropDatasetThreshold(
         __private float threshold,
         __private int type
     ) {
+#ifdef DATASET_TYPE
+    type = DATASET_TYPE;
+#endif
 	int sliceNr = get_global_id(0);
     short scanLines = 0;
     int scanLineSize, scanLineElementSize;
@@ -874,6 +880,9 @@ __kernel void cropDatasetLung(
         __private int sliceDirection,
         __private int type
     ) {
+#ifdef DATASET_TYPE
+    type = DATASET_TYPE;
+#endif
     short HUlimit = -150;
     if(type == 2)
     	HUlimit += 1024;
@@ -986,6 +995,41 @@ __kernel void erode(
     }
 }
 
+// Pack a mask to 1 bit per voxel. Each work item creates one 32 voxel word
+// along x and each row starts on a new word. The first voxel of a word is
+// stored in the least significant bit.
+__kernel void packMask(
+        __read_only image3d_t mask,
+        __global uint * packed,
+        __private int isUnsigned
+        ) {
+    const int wordX = get_global_id(0);
+    const int y = get_global_id(1);
+    const int z = get_global_id(2);
+    const int width = get_image_width(mask);
+
+    uint word = 0;
+    for(int i = 0; i < 32; i++) {
+        const int4 pos = {wordX*32+i, y, z, 0};
+        if(pos.x >= width)
+            break;
+        const int value = isUnsigned ? read_imageui(mask, sampler, pos).x : read_imagei(mask, sampler, pos).x;
+        if(value != 0)
+            word |= 1u << i;
+    }
+    packed[wordX + (y + z*get_global_size(1))*get_global_size(0)] = word;
+}
+
+__kernel void unpackMask(
+        __global const uint * packed,
+        __write_only image3d_t mask,
+        __private int wordsPerRow
+        ) {
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    const uint word = packed[pos.x/32 + (pos.y + pos.z*get_global_size(1))*wordsPerRow];
+    write_imagei(mask, pos, (word >> (pos.x % 32)) & 1);
+}
+
 __kernel void toFloat(
         __read_only image3d_t volume,
         __write_only image3d_t processedVolume,
@@ -993,6 +1037,9 @@ __kernel void toFloat(
         __private float maximum,
         __private int type
         ) {
+#ifdef DATASET_TYPE
+    type = DATASET_TYPE;
+#endif
     int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
     
     float v;
@@ -1020,6 +1067,9 @@ __kernel void blurVolumeWithGaussian(
         __private int maskSize,
         __constant float * mask
     ) {
+#ifdef BLUR_MASK_SIZE
+    maskSize = BLUR_MASK_SIZE;
+#endif
 
     int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
     int size = maskSize*2+1;
@@ -1068,15 +1118,52 @@ void eigen_decomposition(float M[3][3], float V[3][3], float e[3]);
 __constant float cosValues[32] = {1.0f, 0.540302f, -0.416147f, -0.989992f, -0.653644f, 0.283662f, 0.96017f, 0.753902f, -0.1455f, -0.91113f, -0.839072f, 0.0044257f, 0.843854f, 0.907447f, 0.136737f, -0.759688f, -0.957659f, -0.275163f, 0.660317f, 0.988705f, 0.408082f, -0.547729f, -0.999961f, -0.532833f, 0.424179f, 0.991203f, 0.646919f, -0.292139f, -0.962606f, -0.748058f, 0.154251f, 0.914742f};
 __constant float sinValues[32] = {0.0f, 0.841471f, 0.909297f, 0.14112f, -0.756802f, -0.958924f, -0.279415f, 0.656987f, 0.989358f, 0.412118f, -0.544021f, -0.99999f, -0.536573f, 0.420167f, 0.990607f, 0.650288f, -0.287903f, -0.961397f, -0.750987f, 0.149877f, 0.912945f, 0.836656f, -0.00885131f, -0.84622f, -0.905578f, -0.132352f, 0.762558f, 0.956376f, 0.270906f, -0.663634f, -0.988032f, -0.404038f};
 
-__kernel void circleFittingTDF(
+// Mean inward component of the vector field on a circle around floatPos in the plane of e2 and e3
+float circleFittingRingSum(
         __read_only image3d_t vectorField,
-        __global TDF_TYPE * T,
-        __global float * Radius,
-        __private float rMin,
-        __private float rMax,
-        __private float rStep
+        float4 floatPos,
+        float3 e2,
+        float3 e3,
+        float radius,
+        int reducedSamples
+    ) {
+    int samples = 32;
+    int stride = 1;
+    if(reducedSamples) {
+        if(radius < 3) {
+            samples = 8;
+            stride = 4;
+        } else if(radius < 6) {
+            samples = 16;
+            stride = 2;
+        }
+    }
+    float radiusSum = 0.0f;
+    for(int j = 0; j < samples; j++) {
+        float3 V_alpha = cosValues[j*stride]*e3 + sinValues[j*stride]*e2;
+        float4 position = floatPos + radius*V_alpha.xyzz;
+        float3 V = -read_imagef(vectorField, interpolationSampler, position).xyz;
+        radiusSum += dot(V, V_alpha);
+    }
+    return radiusSum / samples;
+}
+
+/*
+ * Circle fitting TDF response of one voxel. The radius of the best circle is
+ * stored in maxRadiusResult. With a coarseStep above 1 only every coarseStep
+ * radius is scanned and the best one is refined. reducedSamples uses 8 and 16
+ * samples for circles with a radius below 3 and 6.
+ */
+float circleFittingTDFResponse(
+        __read_only image3d_t vectorField,
+        int4 pos,
+        float rMin,
+        float rMax,
+        float rStep,
+        int coarseStep,
+        int reducedSamples,
+        float * maxRadiusResult
     ) {
-    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
 
     // Find Hessian Matrix
     float3 Fx, Fy, Fz;
@@ -1116,46 +1203,163 @@ __kernel void circleFittingTDF(
     // Circle Fitting
     float maxSum = 0.0f;
     float maxRadius = 0.0f;
-    const float4 floatPos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
-    for(float radius = rMin; radius <= rMax; radius += rStep) {
-        float radiusSum = 0.0f;
-        int samples = 32;
-        int stride = 1;
-        //int negatives = 0;
-        /*
-        if(radius < 3) {
-            samples = 8;
-            stride = 4;
-        } else if(radius < 6) {
-            samples = 16;
-            stride = 2;
+    const float4 floatPos = convert_float4(pos);
+    if(coarseStep <= 1) {
+        // All radii up to the first radius that does not improve the fit
+        for(float radius = rMin; radius <= rMax; radius += rStep) {
+            const float radiusSum = circleFittingRingSum(vectorField, floatPos, e2, e3, radius, reducedSamples);
+            if(radiusSum > maxSum) {
+                maxSum = radiusSum;
+                maxRadius = radius;
+            } else {
+                break;
+            }
         }
-        */
-
-        for(int j = 0; j < samples; j++) {
-            float3 V_alpha = cosValues[j*stride]*e3 + sinValues[j*stride]*e2;
-            float4 position = floatPos + radius*V_alpha.xyzz;
-            float3 V = -read_imagef(vectorField, interpolationSampler, position).xyz;
-            radiusSum += dot(V, V_alpha);
-            //if(dot(normalize(V), normalize(V_alpha)) < 0.0f)
-            //	negatives++;
+    } else {
+        // Every coarseStep radius up to the first one that does not improve
+        // the fit, then the best radius is refined with halved steps
+        const int radii = (int)floor((rMax - rMin) / rStep) + 1;
+        int best = -1;
+        for(int i = 0; i < radii; i += coarseStep) {
+            const float radiusSum = circleFittingRingSum(vectorField, floatPos, e2, e3, rMin + i*rStep, reducedSamples);
+            if(radiusSum > maxSum) {
+                maxSum = radiusSum;
+                best = i;
+            } else {
+                break;
+            }
         }
-        //if(negatives > 0)
-        //	continue;
-        radiusSum /= samples;
-        if(radiusSum > maxSum) {
-            maxSum = radiusSum;
-            maxRadius = radius;
-        } else {
-            break;
+        if(best >= 0) {
+            int step = coarseStep;
+            do {
+                step = (step + 1) / 2;
+                const int center = best;
+                for(int i = center - step; i <= center + step; i += 2*step) {
+                    if(i < 0 || i >= radii)
+                        continue;
+                    const float radiusSum = circleFittingRingSum(vectorField, floatPos, e2, e3, rMin + i*rStep, reducedSamples);
+                    if(radiusSum > maxSum) {
+                        maxSum = radiusSum;
+                        best = i;
+                    }
+                }
+            } while(step > 1);
+            maxRadius = rMin + best*rStep;
         }
     }
 
-	// Store result
+    *maxRadiusResult = maxRadius;
+    return maxSum;
+}
+
+__kernel void circleFittingTDF(
+        __read_only image3d_t vectorField,
+        __global TDF_TYPE * T,
+        __global float * Radius,
+        __private float rMin,
+        __private float rMax,
+        __private float rStep,
+        __private int coarseStep,
+        __private int reducedSamples
+    ) {
+#ifdef TDF_RADIUS_MIN
+    rMin = TDF_RADIUS_MIN;
+#endif
+#ifdef TDF_RADIUS_MAX
+    rMax = TDF_RADIUS_MAX;
+#endif
+#ifdef TDF_RADIUS_STEP
+    rStep = TDF_RADIUS_STEP;
+#endif
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    float maxRadius;
+    const float maxSum = circleFittingTDFResponse(vectorField, pos, rMin, rMax, rStep, coarseStep, reducedSamples, &maxRadius);
+
+    // Store result
     T[LPOS(pos)] = FLOAT_TO_UNORM16(maxSum);
     Radius[LPOS(pos)] = maxRadius;
 }
 
+/*
+ * Circle fitting TDF of both the small and the large scale in one pass. The
+ * response with the highest TDF is kept, as in the combine kernel.
+ */
+__kernel void circleFittingTDFMultiScale(
+        __read_only image3d_t vectorFieldSmall,
+        __read_only image3d_t vectorFieldLarge,
+        __global TDF_TYPE * T,
+        __global float * Radius,
+        __private float rMinSmall,
+        __private float rMaxSmall,
+        __private float rStepSmall,
+        __private float rMinLarge,
+        __private float rMaxLarge,
+        __private float rStepLarge,
+        __private int coarseStep,
+        __private int reducedSamples
+    ) {
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    float maxRadius, maxRadiusSmall;
+    float maxSum = circleFittingTDFResponse(vectorFieldLarge, pos, rMinLarge, rMaxLarge, rStepLarge, coarseStep, reducedSamples, &maxRadius);
+    const float maxSumSmall = circleFittingTDFResponse(vectorFieldSmall, pos, rMinSmall, rMaxSmall, rStepSmall, coarseStep, reducedSamples, &maxRadiusSmall);
+    if(maxSum < maxSumSmall) {
+        maxSum = maxSumSmall;
+        maxRadius = maxRadiusSmall;
+    }
+
+    // Store result
+    T[LPOS(pos)] = FLOAT_TO_UNORM16(maxSum);
+    Radius[LPOS(pos)] = maxRadius;
+}
+
+/*
+ * Marks the voxels where the TDF is worth evaluating and clears the TDF and
+ * radius. The divergence of the vector field is the sum of the eigenvalues of
+ * its Jacobian. The vectors converge towards the centerline of a tube, so it
+ * is clearly negative inside tubes and close to zero in the background.
+ */
+__kernel void markPlausibleTubeVoxels(
+        __read_only image3d_t vectorField,
+        __write_only image3d_t plausible,
+        __global TDF_TYPE * T,
+        __global float * Radius,
+        __private float threshold
+    ) {
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    const float divergence = 0.5f*(
+        read_imagef(vectorField, sampler, pos + (int4)(1,0,0,0)).x - read_imagef(vectorField, sampler, pos - (int4)(1,0,0,0)).x +
+        read_imagef(vectorField, sampler, pos + (int4)(0,1,0,0)).y - read_imagef(vectorField, sampler, pos - (int4)(0,1,0,0)).y +
+        read_imagef(vectorField, sampler, pos + (int4)(0,0,1,0)).z - read_imagef(vectorField, sampler, pos - (int4)(0,0,1,0)).z
+    );
+    write_imagei(plausible, pos, divergence < -threshold ? 1 : 0);
+    T[LPOS(pos)] = FLOAT_TO_UNORM16(0.0f);
+    Radius[LPOS(pos)] = 0.0f;
+}
+
+// Circle fitting TDF of a compacted list of voxels
+__kernel void circleFittingTDFSparse(
+        __read_only image3d_t vectorField,
+        __global TDF_TYPE * T,
+        __global float * Radius,
+        __private float rMin,
+        __private float rMax,
+        __private float rStep,
+        __private int coarseStep,
+        __private int reducedSamples,
+        __global const int * positions,
+        __private int sum
+    ) {
+    const int id = get_global_id(0);
+    if(id >= sum)
+        return;
+    const int4 pos = (int4)(vload3(id, positions), 0);
+    float maxRadius;
+    const float maxSum = circleFittingTDFResponse(vectorField, pos, rMin, rMax, rStep, coarseStep, reducedSamples, &maxRadius);
+    const int index = pos.x + (pos.y + pos.z*get_image_height(vectorField))*get_image_width(vectorField);
+    T[index] = FLOAT_TO_UNORM16(maxSum);
+    Radius[index] = maxRadius;
+}
+
 __kernel void splineTDF(
         __read_only image3d_t vectorField,
         __global TDF_TYPE * T,
@@ -1263,6 +1467,9 @@ __kernel void dd(
     __write_only image3d_t centerpoints,
     __private int cubeSize
     ) {
+#ifdef DD_CUBE_SIZE
+    cubeSize = DD_CUBE_SIZE;
+#endif
 
     int4 bestPos;
     float bestGVF = 0.0f;
@@ -1293,6 +1500,77 @@ __kernel void dd(
 
 
 
+#define TUBE_DIRECTION_BRICK_SIZE 4
+
+// Index of the direction of pos in the tube direction field, or -1 if its brick is not stored
+int getTubeDirectionIndex(__global const int * brickTable, int4 pos, int4 size) {
+    const int4 bricks = (size + TUBE_DIRECTION_BRICK_SIZE - 1) / TUBE_DIRECTION_BRICK_SIZE;
+    const int4 brickPos = pos / TUBE_DIRECTION_BRICK_SIZE;
+    const int slot = brickTable[brickPos.x + (brickPos.y + brickPos.z*bricks.y)*bricks.x];
+    if(slot < 0)
+        return -1;
+    const int4 voxel = pos - brickPos*TUBE_DIRECTION_BRICK_SIZE;
+    return slot*TUBE_DIRECTION_BRICK_SIZE*TUBE_DIRECTION_BRICK_SIZE*TUBE_DIRECTION_BRICK_SIZE +
+        voxel.x + (voxel.y + voxel.z*TUBE_DIRECTION_BRICK_SIZE)*TUBE_DIRECTION_BRICK_SIZE;
+}
+
+// The stored tube direction, or zero if it is not stored
+float3 readTubeDirection(__global const int * brickTable, __global const short * directions, int4 pos, int4 size) {
+    const int index = getTubeDirectionIndex(brickTable, pos, size);
+    if(index < 0)
+        return (float3)(0.0f, 0.0f, 0.0f);
+    return convert_float3(vload3(index, directions)) / 32767.0f;
+}
+
+__kernel void markTubeDirectionBricks(
+        __read_only image3d_t TDF,
+        __global int * brickTable,
+        __private float threshold
+    ) {
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    if(read_imagef(TDF, sampler, pos).x >= threshold) {
+        const int4 brickPos = pos / TUBE_DIRECTION_BRICK_SIZE;
+        const int4 bricks = ((int4)(get_image_width(TDF), get_image_height(TDF), get_image_depth(TDF), 1) +
+            TUBE_DIRECTION_BRICK_SIZE - 1) / TUBE_DIRECTION_BRICK_SIZE;
+        brickTable[brickPos.x + (brickPos.y + brickPos.z*bricks.y)*bricks.x] = 1;
+    }
+}
+
+__kernel void createTubeDirectionField(
+        __read_only image3d_t vectorField,
+        __read_only image3d_t TDF,
+        __global const int * brickTable,
+        __global short * directions,
+        __private float threshold
+    ) {
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    const int4 size = {get_image_width(TDF), get_image_height(TDF), get_image_depth(TDF), 1};
+    const int index = getTubeDirectionIndex(brickTable, pos, size);
+    if(index < 0)
+        return;
+
+    float3 e1 = {0.0f, 0.0f, 0.0f};
+    if(read_imagef(TDF, sampler, pos).x >= threshold) {
+        const float3 Fx = gradientNormalized(vectorField, pos, 0, 1);
+        const float3 Fy = gradientNormalized(vectorField, pos, 1, 2);
+        const float3 Fz = gradientNormalized(vectorField, pos, 2, 3);
+        float Hessian[3][3] = {
+            {Fx.x, Fy.x, Fz.x},
+            {Fy.x, Fy.y, Fz.y},
+            {Fz.x, Fz.y, Fz.z}
+        };
+        float eigenValues[3];
+        float eigenVectors[3][3];
+        eigen_decomposition(Hessian, eigenVectors, eigenValues);
+
+        // Ridge traversal chooses among all the eigenvectors if all
+        // eigenvalues are negative, so the direction is not stored
+        if(eigenValues[0] >= 0.0f || eigenValues[1] >= 0.0f || eigenValues[2] >= 0.0f)
+            e1 = (float3)(eigenVectors[0][0], eigenVectors[1][0], eigenVectors[2][0]);
+    }
+    vstore3(convert_short3_sat_rte(e1 * 32767.0f), index, directions);
+}
+
 __kernel void findCandidateCenterpoints(
     __read_only image3d_t TDF,
     __write_only image3d_t centerpoints,
@@ -1311,6 +1589,9 @@ __kernel void findCandidateCenterpoints2(
     __read_only image3d_t radius,
     __read_only image3d_t vectorField,
     __write_only image3d_t centerpoints,
+    __global const int * directionBricks,
+    __global const short * directions,
+    __private int useDirectionField,
     __private int HP_SIZE,
     __private int sum,
         __read_only image3d_t hp0, // Largest HP
@@ -1334,23 +1615,30 @@ __kernel void findCandidateCenterpoints2(
     const int maxD = max(min(round(radii), 8.0f), 1.0f);
     bool invalid = false;
 
-    // Find Hessian Matrix
-    float3 Fx, Fy, Fz;
-    Fx = gradientNormalized(vectorField, pos, 0, 1);
-    Fy = gradientNormalized(vectorField, pos, 1, 2);
-    Fz = gradientNormalized(vectorField, pos, 2, 3);
-
-    float Hessian[3][3] = {
-        {Fx.x, Fy.x, Fz.x},
-        {Fy.x, Fy.y, Fz.y},
-        {Fz.x, Fz.y, Fz.z}
-    };
-    
-    // Eigen decomposition
-    float eigenValues[3];
-    float eigenVectors[3][3];
-    eigen_decomposition(Hessian, eigenVectors, eigenValues);
-    const float3 e1 = {eigenVectors[0][0], eigenVectors[1][0], eigenVectors[2][0]};
+    float3 e1 = {0.0f, 0.0f, 0.0f};
+    if(useDirectionField) {
+        const int4 directionSize = {get_image_width(TDF), get_image_height(TDF), get_image_depth(TDF), 1};
+        e1 = readTubeDirection(directionBricks, directions, pos, directionSize);
+    }
+    if(e1.x == 0.0f && e1.y == 0.0f && e1.z == 0.0f) {
+        // Find Hessian Matrix
+        float3 Fx, Fy, Fz;
+        Fx = gradientNormalized(vectorField, pos, 0, 1);
+        Fy = gradientNormalized(vectorField, pos, 1, 2);
+        Fz = gradientNormalized(vectorField, pos, 2, 3);
+
+        float Hessian[3][3] = {
+            {Fx.x, Fy.x, Fz.x},
+            {Fy.x, Fy.y, Fz.y},
+            {Fz.x, Fz.y, Fz.z}
+        };
+
+        // Eigen decomposition
+        float eigenValues[3];
+        float eigenVectors[3][3];
+        eigen_decomposition(Hessian, eigenVectors, eigenValues);
+        e1 = (float3)(eigenVectors[0][0], eigenVectors[1][0], eigenVectors[2][0]);
+    }
 
     for(int a = -maxD; a <= maxD; a++) {
     for(int b = -maxD; b <= maxD; b++) {
@@ -1492,6 +1780,120 @@ __kernel void GVF3DIteration(__read_only image3d_t init_vector_field, __read_onl
     write_imagef(write_vector_field, writePos, v);
 }
 
+#include "kernels_common.cl"
+
+// Temporally blocked GVF, see gvfBlockedIterations
+__kernel void GVF3DIterationBlocked(
+        __read_only image3d_t init_vector_field,
+        __read_only image3d_t read_vector_field,
+        __write_only image3d_t write_vector_field,
+        __private float mu,
+        __private int steps,
+        __private int4 size,
+        __local float * localVector,
+        __local float * localInit
+        ) {
+    const int3 groupSize = {get_local_size(0), get_local_size(1), get_local_size(2)};
+    const int3 tileSize = groupSize + 2*steps;
+    const int3 tileOrigin = (int3)(get_group_id(0), get_group_id(1), get_group_id(2))*groupSize - steps;
+    const int nrOfCells = tileSize.x*tileSize.y*tileSize.z;
+    const int nrOfItems = groupSize.x*groupSize.y*groupSize.z;
+    const int localID = get_local_id(0) + (get_local_id(1) + get_local_id(2)*groupSize.y)*groupSize.x;
+
+    // Load tile and halo. Positions outside the volume are clamped by the sampler.
+    for(int cell = localID; cell < nrOfCells; cell += nrOfItems) {
+        const int3 pos = tileOrigin + gvfTilePosition(cell, tileSize);
+        const float4 v = read_imagef(read_vector_field, sampler, (int4)(pos, 0));
+        const float2 init = read_imagef(init_vector_field, sampler, (int4)(pos, 0)).xy;
+        vstore3(v.xyz, cell, localVector);
+        vstore3((float3)(init.x, init.y, v.w), cell, localInit);
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    gvfBlockedIterations(localVector, localInit, mu, steps, size.xyz, tileOrigin, tileSize);
+
+    // Write back the inner tile
+    const int3 writePos = {get_global_id(0), get_global_id(1), get_global_id(2)};
+    if(all(writePos < size.xyz)) {
+        const int cell = TILE_INDEX(writePos - tileOrigin, tileSize);
+        const int mirrorCell = TILE_INDEX(gvfMirror(writePos, size.xyz) - tileOrigin, tileSize);
+        float4 v;
+        v.xyz = vload3(cell, localVector);
+        v.w = localInit[mirrorCell*3+2];
+        write_imagef(write_vector_field, (int4)(writePos, 0), v);
+    }
+}
+
+/*
+ * blurVolumeWithGaussian and createVectorField in one pass. Each work group
+ * loads the volume around its block to local memory, blurs the block and a
+ * border of one voxel, and computes the gradient from the blurred tile, so
+ * the blurred volume is never stored.
+ */
+__kernel void createBlurredVectorField(
+        __read_only image3d_t volume,
+        __write_only image3d_t vectorField,
+        __private float Fmax,
+        __private int vsign,
+        __private int maskSize,
+        __constant float * mask,
+        __local float * localVolume,
+        __local float * localBlurred
+        ) {
+#ifdef BLUR_MASK_SIZE
+    maskSize = BLUR_MASK_SIZE;
+#endif
+    float4 F = blurredVectorFieldValue(volume, Fmax, vsign, maskSize, mask, localVolume, localBlurred);
+
+    // Store vector field
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    write_imagef(vectorField, pos, F);
+}
+
+// Sparse GVF, see gvfBrickVoxel
+__kernel void GVF3DIterationSparse(
+        __read_only image3d_t init_vector_field,
+        __read_only image3d_t read_vector_field,
+        __write_only image3d_t write_vector_field,
+        __private float mu,
+        __global const int * activeBricks,
+        __global uint * brickActivity,
+        __private int4 size
+        ) {
+    __local uint maxUpdate;
+    const int brick = activeBricks[get_group_id(0)];
+    const int4 writePos = gvfBrickVoxel(brick, size);
+    if(get_local_id(0) == 0)
+        maxUpdate = 0;
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    if(all(writePos.xyz < size.xyz)) {
+        // Enforce mirror boundary conditions
+        int4 pos = writePos;
+        pos = select(pos, (int4)(2,2,2,0), pos == (int4)(0,0,0,0));
+        pos = select(pos, size-3, pos >= size-1);
+
+        float2 init_vector = read_imagef(init_vector_field, sampler, pos).xy;
+        float4 v = read_imagef(read_vector_field, sampler, pos);
+        float3 fx1 = read_imagef(read_vector_field, sampler, pos + (int4)(1,0,0,0)).xyz;
+        float3 fy1 = read_imagef(read_vector_field, sampler, pos + (int4)(0,1,0,0)).xyz;
+        float3 fz1 = read_imagef(read_vector_field, sampler, pos + (int4)(0,0,1,0)).xyz;
+        float3 fx_1 = read_imagef(read_vector_field, sampler, pos - (int4)(1,0,0,0)).xyz;
+        float3 fy_1 = read_imagef(read_vector_field, sampler, pos - (int4)(0,1,0,0)).xyz;
+        float3 fz_1 = read_imagef(read_vector_field, sampler, pos - (int4)(0,0,1,0)).xyz;
+
+        float3 laplacian = -6*v.xyz + fx1 + fx_1 + fy1 + fy_1 + fz1 + fz_1;
+        float3 update = mu * laplacian - (v.xyz - (float3)(init_vector.x, init_vector.y, v.w))*(init_vector.x*init_vector.x+init_vector.y*init_vector.y+v.w*v.w);
+        v.xyz += update;
+
+        write_imagef(write_vector_field, writePos, v);
+        atomic_max(&maxUpdate, as_uint(length(update)));
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+    if(get_local_id(0) == 0)
+        brickActivity[brick] = maxUpdate;
+}
+
 __kernel void GVF3DInit(__read_only image3d_t initVectorField, __write_only image3d_t vectorField, __write_only image3d_t newInitVectorField) {
     const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
     float4 value = read_imagef(initVectorField, sampler, pos);
@@ -1761,7 +2163,7 @@ void tql2(float V[SIZE][SIZE], float d[SIZE], float e[SIZE]) {
   }
 }
 
-void eigen_decomposition(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
+void eigen_decomposition_ql(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
   float e[SIZE];
   for (int i = 0; i < SIZE; i++) {
     for (int j = 0; j < SIZE; j++) {
@@ -1772,6 +2174,147 @@ void eigen_decomposition(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]
   tql2(V, d, e);
 }
 
+// Eigenvector of a simple eigenvalue, the largest cross product of two rows
+// of A - eigenvalue*I
+float3 eigenvectorFromRows(float3 row0, float3 row1, float3 row2) {
+  const float3 c01 = cross(row0, row1);
+  const float3 c02 = cross(row0, row2);
+  const float3 c12 = cross(row1, row2);
+  float3 v = c01;
+  float length = dot(c01, c01);
+  if (dot(c02, c02) > length) {
+    v = c02;
+    length = dot(c02, c02);
+  }
+  if (dot(c12, c12) > length) {
+    v = c12;
+    length = dot(c12, c12);
+  }
+  return v * rsqrt(length);
+}
+
+// Eigenvector of the eigenvalue in the plane orthogonal to the unit vector
+// v0, found as the null vector of A - eigenvalue*I restricted to the plane
+float3 eigenvectorInPlane(float3 row0, float3 row1, float3 row2, float3 v0) {
+  float3 u;
+  if (fabs(v0.x) > fabs(v0.y)) {
+    u = (float3)(-v0.z, 0.0f, v0.x) * rsqrt(v0.x*v0.x + v0.z*v0.z);
+  } else {
+    u = (float3)(0.0f, v0.z, -v0.y) * rsqrt(v0.y*v0.y + v0.z*v0.z);
+  }
+  const float3 w = cross(v0, u);
+  const float3 Au = (float3)(dot(row0, u), dot(row1, u), dot(row2, u));
+  const float3 Aw = (float3)(dot(row0, w), dot(row1, w), dot(row2, w));
+  float m00 = dot(u, Au);
+  float m01 = dot(u, Aw);
+  float m11 = dot(w, Aw);
+  float a = 1.0f, b = 0.0f; // v = a*u - b*w
+  if (fabs(m00) >= fabs(m11)) {
+    if (fabs(m00) >= fabs(m01) && m00 != 0.0f) {
+      m01 /= m00;
+      m00 = rsqrt(1.0f + m01*m01);
+      a = m01 * m00;
+      b = m00;
+    } else if (m01 != 0.0f) {
+      m00 /= m01;
+      m01 = rsqrt(1.0f + m00*m00);
+      a = m01;
+      b = m00 * m01;
+    }
+  } else {
+    if (fabs(m11) >= fabs(m01)) {
+      m01 /= m11;
+      m11 = rsqrt(1.0f + m01*m01);
+      a = m11;
+      b = m01 * m11;
+    } else {
+      m11 /= m01;
+      m01 = rsqrt(1.0f + m11*m11);
+      a = m11 * m01;
+      b = m01;
+    }
+  }
+  return a * u - b * w;
+}
+
+// Closed form eigen decomposition with the same output as
+// eigen_decomposition_ql. The eigenvalues are found with the trigonometric
+// solution of the characteristic equation and the eigenvector of the
+// eigenvalue furthest from the other two is found first.
+void eigen_decomposition_analytic(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
+  const float maxAbs = max(max(max(fabs(A[0][0]), fabs(A[0][1])), max(fabs(A[0][2]), fabs(A[1][1]))),
+      max(fabs(A[1][2]), fabs(A[2][2])));
+  const float scale = maxAbs > 0.0f ? 1.0f / maxAbs : 0.0f;
+  float3 row0 = (float3)(A[0][0], A[0][1], A[0][2]) * scale;
+  float3 row1 = (float3)(A[0][1], A[1][1], A[1][2]) * scale;
+  float3 row2 = (float3)(A[0][2], A[1][2], A[2][2]) * scale;
+  float3 eigenvalues = (float3)(row0.x, row1.y, row2.z);
+  float3 v0 = (float3)(1.0f, 0.0f, 0.0f);
+  float3 v1 = (float3)(0.0f, 1.0f, 0.0f);
+  float3 v2 = (float3)(0.0f, 0.0f, 1.0f);
+
+  const float offDiagonal = row0.y*row0.y + row0.z*row0.z + row1.z*row1.z;
+  if (offDiagonal > 0.0f) {
+    const float q = (row0.x + row1.y + row2.z) / 3.0f;
+    const float b00 = row0.x - q;
+    const float b11 = row1.y - q;
+    const float b22 = row2.z - q;
+    const float p = sqrt((b00*b00 + b11*b11 + b22*b22 + 2.0f*offDiagonal) / 6.0f);
+    const float c00 = b11*b22 - row1.z*row1.z;
+    const float c01 = row0.y*b22 - row1.z*row0.z;
+    const float c02 = row0.y*row1.z - b11*row0.z;
+    const float halfDet = clamp(0.5f * (b00*c00 - row0.y*c01 + row0.z*c02) / (p*p*p), -1.0f, 1.0f);
+    const float angle = acos(halfDet) / 3.0f;
+    const float beta2 = 2.0f * cos(angle);
+    const float beta0 = 2.0f * cos(angle + 2.0943951f);
+    eigenvalues = q + p * (float3)(beta0, -(beta0 + beta2), beta2);
+    if (halfDet >= 0.0f) {
+      v2 = eigenvectorFromRows(row0 - (float3)(eigenvalues.z, 0.0f, 0.0f),
+          row1 - (float3)(0.0f, eigenvalues.z, 0.0f), row2 - (float3)(0.0f, 0.0f, eigenvalues.z));
+      v1 = eigenvectorInPlane(row0 - (float3)(eigenvalues.y, 0.0f, 0.0f),
+          row1 - (float3)(0.0f, eigenvalues.y, 0.0f), row2 - (float3)(0.0f, 0.0f, eigenvalues.y), v2);
+      v0 = cross(v1, v2);
+    } else {
+      v0 = eigenvectorFromRows(row0 - (float3)(eigenvalues.x, 0.0f, 0.0f),
+          row1 - (float3)(0.0f, eigenvalues.x, 0.0f), row2 - (float3)(0.0f, 0.0f, eigenvalues.x));
+      v1 = eigenvectorInPlane(row0 - (float3)(eigenvalues.y, 0.0f, 0.0f),
+          row1 - (float3)(0.0f, eigenvalues.y, 0.0f), row2 - (float3)(0.0f, 0.0f, eigenvalues.y), v0);
+      v2 = cross(v0, v1);
+    }
+  }
+  eigenvalues *= maxAbs;
+
+  // Sort by absolute value like tql2
+  float3 t;
+  float s;
+  if (fabs(eigenvalues.y) < fabs(eigenvalues.x)) {
+    s = eigenvalues.x; eigenvalues.x = eigenvalues.y; eigenvalues.y = s;
+    t = v0; v0 = v1; v1 = t;
+  }
+  if (fabs(eigenvalues.z) < fabs(eigenvalues.y)) {
+    s = eigenvalues.y; eigenvalues.y = eigenvalues.z; eigenvalues.z = s;
+    t = v1; v1 = v2; v2 = t;
+  }
+  if (fabs(eigenvalues.y) < fabs(eigenvalues.x)) {
+    s = eigenvalues.x; eigenvalues.x = eigenvalues.y; eigenvalues.y = s;
+    t = v0; v0 = v1; v1 = t;
+  }
+  d[0] = eigenvalues.x;
+  d[1] = eigenvalues.y;
+  d[2] = eigenvalues.z;
+  V[0][0] = v0.x; V[1][0] = v0.y; V[2][0] = v0.z;
+  V[0][1] = v1.x; V[1][1] = v1.y; V[2][1] = v1.z;
+  V[0][2] = v2.x; V[1][2] = v2.y; V[2][2] = v2.z;
+}
+
+void eigen_decomposition(float A[SIZE][SIZE], float V[SIZE][SIZE], float d[SIZE]) {
+#ifdef ANALYTIC_EIGEN
+  eigen_decomposition_analytic(A, V, d);
+#else
+  eigen_decomposition_ql(A, V, d);
+#endif
+}
+
 __kernel void GVFgaussSeidel(
         __read_only image3d_t r,
         __read_only image3d_t sqrMag,
@@ -0,0 +1,221 @@
+__constant sampler_t sampler = CLK_NORMALIZED_COORDS_FALSE | CLK_ADDRESS_CLAMP_TO_EDGE | CLK_FILTER_NEAREST;
+
+/*
+ * Buffer versions of the kernels of kernels_no_3d_write.cl that are used on
+ * CPU devices, where images are emulated. The kernels have the same names as
+ * the ones they replace. Volumes are linear buffers in x, y, z order and the
+ * global size is the size of the volume. Reads outside the volume are clamped
+ * to the edge like the sampler does for images. Vector fields and the radius
+ * made by other stages are still read from images.
+ */
+
+#define LPOS(pos) pos.x+pos.y*get_global_size(0)+pos.z*get_global_size(0)*get_global_size(1)
+
+#ifdef VECTORS_16BIT
+#define FLOAT_TO_SNORM16_4(vector) convert_short4_sat_rte(vector * 32767.0f)
+#define VECTOR_FIELD_TYPE short
+#else
+#define FLOAT_TO_SNORM16_4(vector) vector
+#define VECTOR_FIELD_TYPE float
+#endif
+
+int4 clampToVolume(int4 pos) {
+    const int4 maxPos = {get_global_size(0)-1, get_global_size(1)-1, get_global_size(2)-1, 0};
+    return clamp(pos, (int4)(0,0,0,0), maxPos);
+}
+
+// Value of a char volume with clamping
+char readClamped(__global const char * volume, int4 pos) {
+    const int4 p = clampToVolume(pos);
+    return volume[LPOS(p)];
+}
+
+__kernel void initGrowing(
+	__global const char * centerline,
+	__global char * initSegmentation,
+	__read_only image3d_t avgRadius
+	) {
+    int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    if(centerline[LPOS(pos)] == 1) {
+    	float radius = read_imagef(avgRadius, sampler, pos).x;
+    	int N = min(max(1, (int)round(radius/2.0f)), 4);
+
+        for(int a = -N; a < N+1; a++) {
+        for(int b = -N; b < N+1; b++) {
+        for(int c = -N; c < N+1; c++) {
+            int4 n;
+            n.x = pos.x + a;
+            n.y = pos.y + b;
+            n.z = pos.z + c;
+            if(n.x >= 0 && n.y >= 0 && n.z >= 0 &&
+                n.x < get_global_size(0) && n.y < get_global_size(1) && n.z < get_global_size(2) &&
+                centerline[LPOS(n)] == 0)
+                initSegmentation[LPOS(n)] = 2;
+        }}}
+    }
+}
+
+__kernel void grow(
+	__global const char * currentSegmentation,
+	__read_only image3d_t gvf,
+	__global char * nextSegmentation,
+	__global int * stop
+	) {
+
+    int4 X = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    char value = currentSegmentation[LPOS(X)];
+    // value of 2, means to check it, 1 means it is already accepted
+    if(value == 1) {
+        nextSegmentation[LPOS(X)] = 1;
+    } else if(value == 2) {
+        float FNXw = read_imagef(gvf, sampler, X).w;
+
+        bool continueGrowing = false;
+        for(int a = -1; a < 2; a++) {
+        for(int b = -1; b < 2; b++) {
+        for(int c = -1; c < 2; c++) {
+            if(a == 0 && b == 0 && c == 0)
+                continue;
+
+            int4 Y = X + (int4)(a,b,c,0);
+            char valueY = readClamped(currentSegmentation, Y);
+            if(valueY != 1) {
+                float4 FNY = read_imagef(gvf, sampler, Y);
+                FNY.x /= FNY.w;
+                FNY.y /= FNY.w;
+                FNY.z /= FNY.w;
+                if(FNY.w > FNXw) {
+                    int4 Z;
+                    float maxDotProduct = -2.0f;
+                    for(int a2 = -1; a2 < 2; a2++) {
+                    for(int b2 = -1; b2 < 2; b2++) {
+                    for(int c2 = -1; c2 < 2; c2++) {
+                        if(a2 == 0 && b2 == 0 && c2 == 0)
+                            continue;
+                        float3 YZ = normalize((float3)(a2,b2,c2));
+                        const float v = FNY.x*YZ.x+FNY.y*YZ.y+FNY.z*YZ.z;
+                        if(v > maxDotProduct) {
+                            maxDotProduct = v;
+                            Z = Y + (int4)(a2,b2,c2,0);
+                        }
+                    }}}
+
+                    if(Z.x == X.x && Z.y == X.y && Z.z == X.z) {
+                        nextSegmentation[LPOS(X)] = 1;
+                        // Check if in bounds
+                        if(Y.x >= 0 && Y.y >= 0 && Y.z >= 0 &&
+                            Y.x < get_global_size(0) && Y.y < get_global_size(1) && Y.z < get_global_size(2)) {
+                            nextSegmentation[LPOS(Y)] = 2;
+                            continueGrowing = true;
+                        }
+                    }
+                }
+            }
+        }}}
+
+        if(continueGrowing) {
+            // Added new items to list (values of 2)
+            stop[0] = 0;
+        } else {
+            // X was not accepted
+            nextSegmentation[LPOS(X)] = 0;
+        }
+    }
+}
+
+// Gathers instead of scattering, so the result needs no initialization
+__kernel void dilate(
+        __global const char * volume,
+        __global char * result
+        ) {
+    int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+
+    char value = 0;
+    for(int a = -1; a < 2 ; a++) {
+        for(int b = -1; b < 2 ; b++) {
+            for(int c = -1; c < 2 ; c++) {
+                if(readClamped(volume, pos + (int4)(a,b,c,0)) == 1)
+                    value = 1;
+            }
+        }
+    }
+    result[LPOS(pos)] = value;
+}
+
+__kernel void erode(
+        __global const char * volume,
+        __global char * result
+        ) {
+    int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+
+    bool keep = volume[LPOS(pos)] == 1;
+    for(int a = -1; a < 2 && keep; a++) {
+        for(int b = -1; b < 2 ; b++) {
+            for(int c = -1; c < 2 ; c++) {
+                keep = (readClamped(volume, pos + (int4)(a,b,c,0)) == 1 && keep);
+            }
+        }
+    }
+    result[LPOS(pos)] = keep ? 1 : 0;
+}
+
+__kernel void blurVolumeWithGaussian(
+        __global const float * volume,
+        __global float * blurredVolume,
+        __private int maskSize,
+        __constant float * mask
+    ) {
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    const int width = get_global_size(0);
+    const int height = get_global_size(1);
+    const int depth = get_global_size(2);
+
+    // The offsets of the clamped rows and slices are computed once per row
+    float sum = 0.0f;
+    for(int c = -maskSize; c < maskSize+1; c++) {
+        const int sliceOffset = clamp(pos.z+c, 0, depth-1)*width*height;
+        for(int b = -maskSize; b < maskSize+1; b++) {
+            const int rowOffset = sliceOffset + clamp(pos.y+b, 0, height-1)*width;
+            __constant float * maskRow = mask + (b+maskSize)*(maskSize*2+1)+(c+maskSize)*(maskSize*2+1)*(maskSize*2+1);
+            for(int a = -maskSize; a < maskSize+1; a++) {
+                sum += maskRow[a+maskSize]*volume[rowOffset + clamp(pos.x+a, 0, width-1)];
+            }
+        }
+    }
+
+    blurredVolume[LPOS(pos)] = sum;
+}
+
+#define SELECT_BUFFER(vec1,vec2,z,maxZ) z < maxZ ? vec1:vec2
+#define SELECT_POS(pos,maxZ) pos.z < maxZ ?  pos.x+pos.y*get_global_size(0)+pos.z*get_global_size(0)*get_global_size(1) : pos.x + pos.y*get_global_size(0) + (pos.z-maxZ)*get_global_size(0)*get_global_size(1)
+
+__kernel void createVectorField(
+        __global const float * volume,
+        __global VECTOR_FIELD_TYPE * vectorField,
+        __global VECTOR_FIELD_TYPE * vectorField2,
+        __private float Fmax,
+        __private int vectorSign,
+        __private int maxZ
+        ) {
+    const int4 pos = {get_global_id(0), get_global_id(1), get_global_id(2), 0};
+    const int width = get_global_size(0);
+    const int slice = width*get_global_size(1);
+    const int4 previous = clampToVolume(pos - (int4)(1,1,1,0));
+    const int4 next = clampToVolume(pos + (int4)(1,1,1,0));
+    const int center = LPOS(pos);
+
+    // Gradient of volume
+    float4 F;
+    F.x = 0.5f*(volume[center + next.x - pos.x] - volume[center + previous.x - pos.x]);
+    F.y = 0.5f*(volume[center + (next.y - pos.y)*width] - volume[center + (previous.y - pos.y)*width]);
+    F.z = 0.5f*(volume[center + (next.z - pos.z)*slice] - volume[center + (previous.z - pos.z)*slice]);
+    F.w = 0.0f;
+    F.xyz = (float)vectorSign*F.xyz;
+
+    // Fmax normalization
+    const float l = length(F);
+    F = l < Fmax ? F/(Fmax) : F / (l);
+    F.w = 1.0f;
+
+    vstore4(FLOAT_TO_SNORM16_4(F), SELECT_POS(pos,maxZ), SELECT_BUFFER(vectorField,vectorField2,pos.z,maxZ));
+}
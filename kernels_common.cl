@@ -0,0 +1,152 @@
+/*
+ * Helpers and the fused blur kernel body shared by kernels.cl and
+ * kernels_no_3d_write.cl. Included after the samplers are defined.
+ */
+
+// Temporally blocked GVF. Each work group loads its part of the vector field
+// and a halo of width steps into local memory, and performs steps Jacobi
+// iterations there before the result is written back. The valid part of the
+// tile shrinks by one voxel per iteration, leaving the inner tile of the size
+// of the work group at the end. The host limits steps so that each work item
+// updates at most GVF_BLOCK_MAX_CELLS cells.
+#define GVF_BLOCK_MAX_CELLS 16
+#define TILE_INDEX(p, tileSize) ((p).x + ((p).y + (p).z*(tileSize).y)*(tileSize).x)
+
+int3 gvfTilePosition(int cell, int3 tileSize) {
+    return (int3)(cell % tileSize.x, (cell / tileSize.x) % tileSize.y, cell / (tileSize.x*tileSize.y));
+}
+
+// The mirror boundary conditions of GVF3DIteration
+int3 gvfMirror(int3 pos, int3 size) {
+    pos = select(pos, (int3)(2,2,2), pos == (int3)(0,0,0));
+    return select(pos, size-3, pos >= size-1);
+}
+
+void gvfBlockedIterations(
+        __local float * localVector,
+        __local const float * localInit,
+        float mu,
+        int steps,
+        int3 size,
+        int3 tileOrigin,
+        int3 tileSize
+        ) {
+    const int nrOfCells = tileSize.x*tileSize.y*tileSize.z;
+    const int nrOfItems = get_local_size(0)*get_local_size(1)*get_local_size(2);
+    const int localID = get_local_id(0) + (get_local_id(1) + get_local_id(2)*get_local_size(1))*get_local_size(0);
+    const int strideY = tileSize.x;
+    const int strideZ = tileSize.x*tileSize.y;
+    float3 newValues[GVF_BLOCK_MAX_CELLS];
+
+    for(int step = 0; step < steps; step++) {
+        int i = 0;
+        for(int cell = localID; cell < nrOfCells; cell += nrOfItems) {
+            const int3 pos = tileOrigin + gvfTilePosition(cell, tileSize);
+            const int3 m = gvfMirror(pos, size) - tileOrigin;
+            float3 value = vload3(cell, localVector);
+            // Cells at the edge of the tile are not updated, they are not
+            // needed by the inner tile
+            if(all(pos >= (int3)(0,0,0)) && all(pos < size) &&
+                    all(m >= (int3)(1,1,1)) && all(m < tileSize-1)) {
+                const int c = TILE_INDEX(m, tileSize);
+                const float3 v = vload3(c, localVector);
+                const float3 init = vload3(c, localInit);
+                const float3 laplacian = -6*v +
+                    vload3(c+1, localVector) + vload3(c-1, localVector) +
+                    vload3(c+strideY, localVector) + vload3(c-strideY, localVector) +
+                    vload3(c+strideZ, localVector) + vload3(c-strideZ, localVector);
+                value = v + (mu*laplacian - (v - init)*dot(init, init));
+            }
+            newValues[i] = value;
+            i++;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+        i = 0;
+        for(int cell = localID; cell < nrOfCells; cell += nrOfItems) {
+            vstore3(newValues[i], cell, localVector);
+            i++;
+        }
+        barrier(CLK_LOCAL_MEM_FENCE);
+    }
+}
+
+/*
+ * Loading, blur and gradient of createBlurredVectorField, which each kernel
+ * set stores in its own vector field format. Returns the normalized vector
+ * of the voxel of the work item.
+ */
+float4 blurredVectorFieldValue(
+        __read_only image3d_t volume,
+        float Fmax,
+        int vectorSign,
+        int maskSize,
+        __constant float * mask,
+        __local float * localVolume,
+        __local float * localBlurred
+        ) {
+    const int3 size = {get_global_size(0), get_global_size(1), get_global_size(2)};
+    const int3 groupSize = {get_local_size(0), get_local_size(1), get_local_size(2)};
+    const int3 groupOrigin = (int3)(get_group_id(0), get_group_id(1), get_group_id(2))*groupSize;
+    const int nrOfItems = groupSize.x*groupSize.y*groupSize.z;
+    const int localID = get_local_id(0) + (get_local_id(1) + get_local_id(2)*groupSize.y)*groupSize.x;
+    const int maskWidth = maskSize*2+1;
+
+    // Load the volume with a halo of maskSize+1 voxels. Positions outside the volume are clamped by the sampler.
+    const int3 volumeTileSize = groupSize + 2*(maskSize+1);
+    const int3 volumeTileOrigin = groupOrigin - (maskSize+1);
+    const int volumeCells = volumeTileSize.x*volumeTileSize.y*volumeTileSize.z;
+    for(int cell = localID; cell < volumeCells; cell += nrOfItems) {
+        const int3 pos = volumeTileOrigin + gvfTilePosition(cell, volumeTileSize);
+        localVolume[cell] = read_imagef(volume, sampler, (int4)(pos, 0)).x;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Blur the block with a halo of one voxel. Halo voxels outside the volume
+    // get the blurred value at the edge, as the sampler gives createVectorField.
+    const int3 blurredTileSize = groupSize + 2;
+    const int blurredCells = blurredTileSize.x*blurredTileSize.y*blurredTileSize.z;
+    for(int cell = localID; cell < blurredCells; cell += nrOfItems) {
+        const int3 pos = clamp(groupOrigin - 1 + gvfTilePosition(cell, blurredTileSize), (int3)(0,0,0), size - 1);
+        const int3 center = pos - volumeTileOrigin;
+        float sum = 0.0f;
+        for(int c = -maskSize; c < maskSize+1; c++) {
+            for(int b = -maskSize; b < maskSize+1; b++) {
+                for(int a = -maskSize; a < maskSize+1; a++) {
+                    const int3 n = center + (int3)(a,b,c);
+                    sum += mask[a+maskSize+(b+maskSize)*maskWidth+(c+maskSize)*maskWidth*maskWidth]*
+                        localVolume[TILE_INDEX(n, volumeTileSize)];
+                }
+            }
+        }
+        localBlurred[cell] = sum;
+    }
+    barrier(CLK_LOCAL_MEM_FENCE);
+
+    // Gradient of the blurred volume
+    const int3 center = (int3)(get_local_id(0), get_local_id(1), get_local_id(2)) + 1;
+    float4 F;
+    F.x = 0.5f*(localBlurred[TILE_INDEX(center + (int3)(1,0,0), blurredTileSize)] - localBlurred[TILE_INDEX(center - (int3)(1,0,0), blurredTileSize)]);
+    F.y = 0.5f*(localBlurred[TILE_INDEX(center + (int3)(0,1,0), blurredTileSize)] - localBlurred[TILE_INDEX(center - (int3)(0,1,0), blurredTileSize)]);
+    F.z = 0.5f*(localBlurred[TILE_INDEX(center + (int3)(0,0,1), blurredTileSize)] - localBlurred[TILE_INDEX(center - (int3)(0,0,1), blurredTileSize)]);
+    F.xyz = vectorSign*F.xyz;
+    F.w = 0.0f;
+
+    // Fmax normalization
+    const float l = length(F);
+    F = l < Fmax ? F/(Fmax) : F / (l);
+    F.w = 1.0f;
+    return F;
+}
+
+// Sparse GVF. Each work group updates one brick of GVF_BRICK_SIZE^3 voxels
+// from the list of active bricks and stores the largest update magnitude of
+// the brick in brickActivity (as float bits, which order like uints).
+#define GVF_BRICK_SIZE 4
+
+int4 gvfBrickVoxel(int brick, int4 size) {
+    const int3 bricks = (size.xyz + GVF_BRICK_SIZE-1) / GVF_BRICK_SIZE;
+    const int3 brickPos = {brick % bricks.x, (brick / bricks.x) % bricks.y, brick / (bricks.x*bricks.y)};
+    const int id = get_local_id(0);
+    const int3 voxel = {id % GVF_BRICK_SIZE, (id / GVF_BRICK_SIZE) % GVF_BRICK_SIZE, id / (GVF_BRICK_SIZE*GVF_BRICK_SIZE)};
+    return (int4)(brickPos*GVF_BRICK_SIZE + voxel, 0);
+}
@@ -1,6 +1,39 @@
 #include "tube-segmentation.hpp"
 #include "SIPL/Core.hpp"
 #include "tsf-config.h"
+#include "tubeValidation.hpp"
+#include <fstream>
+#include <cstring>
+
+int runSweep(std::string filename, paramList &parameters) {
+    TSFParameterGrid grid = TSFParameterGrid::fromString(getParamStr(parameters, "sweep-grid"));
+    ValidationScorer * scorer = NULL;
+    if(getParamStr(parameters, "sweep-reference-segmentation") != "off") {
+        if(getParamStr(parameters, "sweep-reference-centerline") == "off") {
+            std::cout << "The sweep-reference-centerline parameter must be set to score the sweep" << std::endl;
+            return -1;
+        }
+        scorer = new ValidationScorer(getParamStr(parameters, "sweep-reference-segmentation"), getParamStr(parameters, "sweep-reference-centerline"));
+    }
+
+    std::vector<TSFSweepResult> results;
+    try {
+        results = runParameterSweep(filename, parameters, grid, std::string(KERNELS_DIR), scorer);
+    } catch(SIPL::SIPLException &e) {
+        std::cout << e.what() << std::endl;
+        return -1;
+    }
+
+    if(getParamStr(parameters, "sweep-table") != "off") {
+        std::ofstream table(getParamStr(parameters, "sweep-table").c_str());
+        writeSweepTable(table, grid, results, scorer);
+    } else {
+        writeSweepTable(std::cout, grid, results, scorer);
+    }
+    delete scorer;
+    TSFWriter::getInstance()->finish();
+    return 0;
+}
 
 
 int main(int argc, char ** argv) {
@@ -34,6 +67,8 @@ int main(int argc, char ** argv) {
     paramList parameters = getParameters(argc, argv);
     std::string filename = argv[1];
 
+    if(getParamStr(parameters, "sweep-grid") != "off")
+        return runSweep(filename, parameters);
 
     TSFOutput * output;
     try {
@@ -73,5 +108,8 @@ int main(int argc, char ** argv) {
     // free data
     output->~TSFOutput();
 
+    // Wait for results that are still being written
+    TSFWriter::getInstance()->finish();
+
     return 0;
 }
@@ -12,6 +12,8 @@
 #include "inputOutput.hpp"
 #include "OpenCLUtilityLibrary/HistogramPyramids.hpp"
 #include "eigenanalysisOfHessian.hpp"
+#include "tubeDirectionField.hpp"
+#include "specializedKernels.hpp"
 #ifdef CPP11
 #include <unordered_set>
 using std::unordered_set;
@@ -327,7 +329,7 @@ char * createCenterlineVoxels(
 
 	return centerlines;
 }
-Image3D runNewCenterlineAlgWithoutOpenCL(OpenCL &ocl, SIPL::int3 size, paramList &parameters, Image3D &vectorField, Image3D &TDF, Image3D &radius) {
+Image3D runNewCenterlineAlgWithoutOpenCL(OpenCL &ocl, SIPL::int3 size, paramList &parameters, Image3D &vectorField, Image3D &TDF, Image3D &radius, TSFOutput * output) {
     const int totalSize = size.x*size.y*size.z;
 	const bool no3Dwrite = !getParamBool(parameters, "3d_write");
     const int cubeSize = getParam(parameters, "cube-size");
@@ -387,6 +389,8 @@ Image3D runNewCenterlineAlgWithoutOpenCL(OpenCL &ocl, SIPL::int3 size, paramList
     }
     T.radius = new float[totalSize];
     ocl.queue.enqueueReadImage(radius, CL_TRUE, offset, region, 0, 0, T.radius);
+    TubeDirectionField directionField = createTubeDirectionField(ocl, size, parameters, vectorField, TDF);
+    transferTubeDirectionField(ocl, size, directionField, &T.directionBricks, &T.directions);
 
     // Get candidate points
     std::vector<int3> candidatePoints;
@@ -631,6 +635,7 @@ Image3D runNewCenterlineAlgWithoutOpenCL(OpenCL &ocl, SIPL::int3 size, paramList
 
     ocl.queue.finish();
     char * centerlinesData = createCenterlineVoxels(vertices, edges, T.radius, size);
+    output->setCenterline(vertices, edges, sampleCenterlineRadius(vertices, T.radius, size));
     Image3D centerlines= Image3D(
         ocl.context,
         CL_MEM_READ_WRITE,
@@ -656,7 +661,7 @@ Image3D runNewCenterlineAlgWithoutOpenCL(OpenCL &ocl, SIPL::int3 size, paramList
     );
 
     if(getParamStr(parameters, "centerline-vtk-file") != "off") {
-        writeToVtkFile(parameters, vertices, edges);
+        writeToVtkFile(parameters, vertices, edges, output);
     }
 
     ocl.queue.finish();
@@ -666,15 +671,17 @@ Image3D runNewCenterlineAlgWithoutOpenCL(OpenCL &ocl, SIPL::int3 size, paramList
     delete[] T.Fy;
     delete[] T.Fz;
     delete[] T.radius;
+    delete[] T.directionBricks;
+    delete[] T.directions;
     delete[] centerlinesData;
 
     return centerlines;
 }
 
-Image3D runNewCenterlineAlg(OpenCL &ocl, SIPL::int3 size, paramList &parameters, Image3D &vectorField, Image3D &TDF, Image3D &radius) {
+Image3D runNewCenterlineAlg(OpenCL &ocl, SIPL::int3 size, paramList &parameters, Image3D &vectorField, Image3D &TDF, Image3D &radius, TSFOutput * output) {
     if(ocl.platform.getInfo<CL_PLATFORM_VENDOR>().substr(0,5) == "Apple") {
         std::cout << "Apple platform detected. Running centerline extraction without OpenCL." << std::endl;
-        return runNewCenterlineAlgWithoutOpenCL(ocl,size,parameters,vectorField,TDF,radius);
+        return runNewCenterlineAlgWithoutOpenCL(ocl,size,parameters,vectorField,TDF,radius,output);
     }
     const int totalSize = size.x*size.y*size.z;
 	const bool no3Dwrite = !getParamBool(parameters, "3d_write");
@@ -693,16 +700,19 @@ Image3D runNewCenterlineAlg(OpenCL &ocl, SIPL::int3 size, paramList &parameters,
     region[1] = size.y;
     region[2] = size.z;
 
-    Kernel candidatesKernel(ocl.program, "findCandidateCenterpoints");
-    Kernel candidates2Kernel(ocl.program, "findCandidateCenterpoints2");
-    Kernel ddKernel(ocl.program, "dd");
-    Kernel initCharBuffer(ocl.program, "initCharBuffer");
-
+    // The tube direction field is part of the centerpoint extraction runtime
     cl::Event startEvent, endEvent;
     cl_ulong start, end;
     if(getParamBool(parameters, "timing")) {
         ocl.queue.enqueueMarker(&startEvent);
     }
+    TubeDirectionField directionField = createTubeDirectionField(ocl, size, parameters, vectorField, TDF);
+    Kernel candidatesKernel(ocl.program, "findCandidateCenterpoints");
+    Kernel candidates2Kernel(ocl.program, "findCandidateCenterpoints2");
+    setTubeDirectionFieldArgs(ocl, candidates2Kernel, 4, directionField);
+    Kernel ddKernel = getSpecializedKernel(ocl, "dd", getKernelDefine("DD_CUBE_SIZE", cubeSize), parameters);
+    Kernel initCharBuffer(ocl.program, "initCharBuffer");
+
     Image3D * centerpointsImage2 = new Image3D(
             ocl.context,
             CL_MEM_READ_WRITE,
@@ -756,7 +766,7 @@ Image3D runNewCenterlineAlg(OpenCL &ocl, SIPL::int3 size, paramList &parameters,
         if(hp3.getSum() <= 0 || hp3.getSum() > 0.5*totalSize) {
         	throw SIPL::SIPLException("The number of candidate voxels is too low or too high. Something went wrong... Wrong parameters? Out of memory?", __LINE__, __FILE__);
         }
-        hp3.traverse(candidates2Kernel, 4);
+        hp3.traverse(candidates2Kernel, 7);
         ocl.queue.finish();
         hp3.deleteHPlevels();
         ocl.GC->deleteMemoryObject(centerpoints);
@@ -851,7 +861,7 @@ Image3D runNewCenterlineAlg(OpenCL &ocl, SIPL::int3 size, paramList &parameters,
         }
 
         candidates2Kernel.setArg(3, *centerpointsImage2);
-        hp3.traverse(candidates2Kernel, 4);
+        hp3.traverse(candidates2Kernel, 7);
         ocl.queue.finish();
         hp3.deleteHPlevels();
         ocl.GC->deleteMemoryObject(centerpointsImage);
@@ -1239,6 +1249,7 @@ if(getParamBool(parameters, "timing")) {
 
     	ocl.queue.finish();
     	char * centerlinesData = createCenterlineVoxels(vertices, edges, radiusB, size);
+    	output->setCenterline(vertices, edges, sampleCenterlineRadius(vertices, radiusB, size));
     	ocl.queue.enqueueWriteImage(
     			centerlines,
     			CL_FALSE,
@@ -1257,7 +1268,7 @@ if(getParamBool(parameters, "timing")) {
 		);
 
 		if(getParamStr(parameters, "centerline-vtk-file") != "off")
-			writeToVtkFile(parameters, vertices, edges);
+			writeToVtkFile(parameters, vertices, edges, output);
 
     	delete[] verticesArray;
     	delete[] edgesArray;
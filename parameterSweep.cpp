@@ -0,0 +1,77 @@
+#include "parameterSweep.hpp"
+#include <sstream>
+#include "SIPL/Exceptions.hpp"
+
+void TSFParameterGrid::add(std::string name, std::vector<std::string> values) {
+	if(values.size() == 0) {
+		std::string str = "No values given for sweep parameter " + name;
+		throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
+	}
+	names.push_back(name);
+	this->values.push_back(values);
+}
+
+TSFParameterGrid TSFParameterGrid::fromString(std::string grid) {
+	TSFParameterGrid result;
+	std::istringstream stream(grid);
+	std::string dimension;
+	while(std::getline(stream, dimension, ';')) {
+		if(dimension == "")
+			continue;
+		const int pos = dimension.find('=');
+		if(pos <= 0) {
+			std::string str = "Invalid sweep parameter " + dimension;
+			throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
+		}
+		std::vector<std::string> values;
+		std::istringstream valueStream(dimension.substr(pos+1));
+		std::string value;
+		while(std::getline(valueStream, value, ','))
+			values.push_back(value);
+		result.add(dimension.substr(0, pos), values);
+	}
+	return result;
+}
+
+int TSFParameterGrid::getNrOfPoints() const {
+	int points = 1;
+	for(unsigned int i = 0; i < values.size(); i++)
+		points *= values[i].size();
+	return points;
+}
+
+// The first parameter varies slowest
+std::string TSFParameterGrid::getValue(int point, int parameter) const {
+	int stride = 1;
+	for(unsigned int i = parameter+1; i < values.size(); i++)
+		stride *= values[i].size();
+	return values[parameter][(point / stride) % values[parameter].size()];
+}
+
+paramList TSFParameterGrid::getPoint(paramList parameters, int point) const {
+	for(unsigned int i = 0; i < names.size(); i++)
+		setParameter(parameters, names[i], getValue(point, i));
+	return parameters;
+}
+
+void writeSweepTable(std::ostream &stream, const TSFParameterGrid &grid, const std::vector<TSFSweepResult> &results, TSFSweepScorer * scorer) {
+	for(int i = 0; i < grid.getNrOfParameters(); i++)
+		stream << grid.getName(i) << "\t";
+	if(scorer != NULL) {
+		std::vector<std::string> names = scorer->getNames();
+		for(unsigned int i = 0; i < names.size(); i++)
+			stream << names[i] << "\t";
+	}
+	stream << "upstream-runtime-ms\truntime-ms\n";
+	for(unsigned int i = 0; i < results.size(); i++) {
+		for(int j = 0; j < grid.getNrOfParameters(); j++)
+			stream << grid.getValue(results[i].point, j) << "\t";
+		if(results[i].failed) {
+			stream << "failed\n";
+			continue;
+		}
+		for(unsigned int j = 0; j < results[i].measures.size(); j++)
+			stream << results[i].measures[j] << "\t";
+		stream << results[i].upstreamRuntime << "\t" << results[i].runtime << "\n";
+	}
+}
@@ -0,0 +1,54 @@
+#ifndef PARAMETER_SWEEP_H
+#define PARAMETER_SWEEP_H
+
+#include <string>
+#include <vector>
+#include <ostream>
+#include "parameters.hpp"
+
+class TSFOutput;
+
+/*
+ * A grid of parameter values. Each point of the grid is one combination of
+ * the values of all the parameters.
+ */
+class TSFParameterGrid {
+public:
+	void add(std::string name, std::vector<std::string> values);
+	// Parse a list such as "tdf-high=0.4,0.5;min-tree-length=5,10"
+	static TSFParameterGrid fromString(std::string grid);
+	int getNrOfPoints() const;
+	int getNrOfParameters() const { return names.size(); };
+	std::string getName(int parameter) const { return names[parameter]; };
+	std::string getValue(int point, int parameter) const;
+	// The base parameters with the values of a point of the grid
+	paramList getPoint(paramList parameters, int point) const;
+private:
+	std::vector<std::string> names;
+	std::vector<std::vector<std::string> > values;
+};
+
+/*
+ * Quality measures of the result of one point of the sweep, such as the
+ * measures of getValidationMeasures in tubeValidation.hpp. score may
+ * be called from several threads at once.
+ */
+class TSFSweepScorer {
+public:
+	virtual std::vector<std::string> getNames() = 0;
+	virtual std::vector<float> score(TSFOutput * output) = 0;
+	virtual ~TSFSweepScorer() {};
+};
+
+typedef struct TSFSweepResult {
+	int point;
+	double upstreamRuntime; // ms, shared by all points with the same upstream stages
+	double runtime; // ms of centerline extraction and segmentation
+	bool failed;
+	std::vector<float> measures;
+} TSFSweepResult;
+
+// Write the results as a tab separated table with one row per point
+void writeSweepTable(std::ostream &stream, const TSFParameterGrid &grid, const std::vector<TSFSweepResult> &results, TSFSweepScorer * scorer);
+
+#endif
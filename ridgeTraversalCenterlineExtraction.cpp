@@ -1,29 +1,16 @@
 #include "ridgeTraversalCenterlineExtraction.hpp"
-#include <queue>
 #include <vector>
 #include <list>
+#include <algorithm>
+#include <omp.h>
 #include "eigenanalysisOfHessian.hpp"
 #include "timing.hpp"
-#ifdef CPP11
-#include <unordered_set>
-using std::unordered_set;
-#else
-#include <boost/unordered_set.hpp>
-using boost::unordered_set;
-#endif
 
 typedef struct point {
     float value;
     int x,y,z;
 } point;
 
-class PointComparison {
-    public:
-    bool operator() (const point &lhs, const point &rhs) const {
-        return (lhs.value < rhs.value);
-    }
-};
-
 float sign(float a) {
     return a < 0 ? -1.0f: 1.0f;
 }
@@ -34,7 +21,293 @@ float sign(float a) {
 #define SQR_MAG(pos) sqrt(pow(T.Fx[pos.x+pos.y*size.x+pos.z*size.x*size.y],2.0f) + pow(T.Fy[pos.x+pos.y*size.x+pos.z*size.x*size.y],2.0f) + pow(T.Fz[pos.x+pos.y*size.x+pos.z*size.x*size.y],2.0f))
 #define SQR_MAG_SMALL(pos) sqrt(pow(T.FxSmall[pos.x+pos.y*size.x+pos.z*size.x*size.y],2.0f) + pow(T.FySmall[pos.x+pos.y*size.x+pos.z*size.x*size.y],2.0f) + pow(T.FzSmall[pos.x+pos.y*size.x+pos.z*size.x*size.y],2.0f))
 
-char * runRidgeTraversal(TubeSegmentation &T, SIPL::int3 size, paramList &parameters, std::stack<CenterlinePoint> centerlineStack) {
+// Returns the vertex of a voxel index, adding it if it does not exist
+static int getVertex(int index, SIPL::int3 size, unordered_map<int, int> &vertexIndices, std::vector<int3> &vertices) {
+    unordered_map<int, int>::iterator it = vertexIndices.find(index);
+    if(it != vertexIndices.end())
+        return it->second;
+    const int vertex = vertices.size();
+    vertices.push_back(int3(index % size.x, (index / size.x) % size.y, index / (size.x*size.y)));
+    vertexIndices[index] = vertex;
+    return vertex;
+}
+
+// Start points are traced in the order of decreasing TDF. Ties are broken
+// by position so that the order does not depend on the threads.
+class PointComparison {
+    public:
+    SIPL::int3 size;
+    bool operator() (const point &lhs, const point &rhs) const {
+        if(lhs.value != rhs.value)
+            return lhs.value > rhs.value;
+        return LPOS(lhs.x,lhs.y,lhs.z) < LPOS(rhs.x,rhs.y,rhs.z);
+    }
+};
+
+/*
+ * Set of voxel indices that is emptied in constant time, so that its memory
+ * can be reused for the next trace. Open addressing where a slot is used if
+ * its stamp is the current generation.
+ */
+class VoxelSet {
+    public:
+    VoxelSet() : generation(1) {
+        keys.resize(256);
+        stamps.resize(256, 0);
+    }
+    void clear() {
+        voxels.clear();
+        generation++;
+        if(generation == 0) {
+            std::fill(stamps.begin(), stamps.end(), 0);
+            generation = 1;
+        }
+    }
+    bool contains(int voxel) const {
+        const unsigned int mask = keys.size()-1;
+        for(unsigned int slot = hash(voxel) & mask; stamps[slot] == generation; slot = (slot+1) & mask) {
+            if(keys[slot] == voxel)
+                return true;
+        }
+        return false;
+    }
+    void insert(int voxel) {
+        if(contains(voxel))
+            return;
+        if(2*(voxels.size()+1) > keys.size()) {
+            // Grow and insert the voxels again
+            keys.assign(keys.size()*2, 0);
+            stamps.assign(stamps.size()*2, 0);
+            generation = 1;
+            for(unsigned int i = 0; i < voxels.size(); i++)
+                put(voxels[i]);
+        }
+        put(voxel);
+        voxels.push_back(voxel);
+    }
+    // The voxels in the order they were inserted
+    const std::vector<int> & getVoxels() const { return voxels; };
+    private:
+    static unsigned int hash(int voxel) {
+        return (unsigned int)voxel * 2654435761u;
+    }
+    void put(int voxel) {
+        const unsigned int mask = keys.size()-1;
+        unsigned int slot = hash(voxel) & mask;
+        while(stamps[slot] == generation)
+            slot = (slot+1) & mask;
+        keys[slot] = voxel;
+        stamps[slot] = generation;
+    }
+    std::vector<int> keys;
+    std::vector<unsigned int> stamps;
+    std::vector<int> voxels;
+    unsigned int generation;
+};
+
+/*
+ * A centerline traced from one start point, before it is added to the
+ * centerlines. The connections to existing centerlines are stored as the
+ * voxels that were hit, so that they can be looked up when it is added.
+ * The traces are reused, which keeps their memory.
+ */
+typedef struct RidgeTrace {
+    VoxelSet voxels;
+    std::vector<SIPL::int2> edges;
+    std::vector<CenterlinePoint> points;
+    int distance;
+    float meanTube;
+    int hits[2]; // Voxel of an existing centerline hit in each direction, or -1
+    std::vector<int> freeVoxels; // Voxels that were not part of a centerline when traced
+    bool traced;
+} RidgeTrace;
+
+// Parallel traversal traces this many start points per thread at a time
+static const int ridgeTraversalPointsPerThread = 4;
+
+// The voxels that are part of a centerline are marked in a bitmap with one
+// bit per voxel
+static inline bool isClaimed(const std::vector<unsigned int> &claimed, int voxel) {
+    return (claimed[voxel >> 5] >> (voxel & 31)) & 1;
+}
+
+static inline void claim(std::vector<unsigned int> &claimed, int voxel) {
+    claimed[voxel >> 5] |= 1u << (voxel & 31);
+}
+
+/*
+ * Segment of a voxel that is part of a centerline. Merged segments point to
+ * the segment they were merged into, instead of relabeling their voxels.
+ */
+static int getSegment(int voxel, const unordered_map<int, int> &voxelSegments, std::vector<int> &segmentParents) {
+    int segment = voxelSegments.find(voxel)->second;
+    while(segmentParents[segment] != segment) {
+        segmentParents[segment] = segmentParents[segmentParents[segment]];
+        segment = segmentParents[segment];
+    }
+    return segment;
+}
+
+static void traceCenterline(TubeSegmentation &T, SIPL::int3 size, const std::vector<unsigned int> &claimed, point p, float Mlow, float Tlow, int maxBelowTlow, RidgeTrace &trace) {
+    trace.voxels.clear();
+    trace.edges.clear();
+    trace.points.clear();
+    trace.freeVoxels.clear();
+    trace.hits[0] = -1;
+    trace.hits[1] = -1;
+    trace.traced = true;
+
+    trace.voxels.insert(LPOS(p.x,p.y,p.z));
+    trace.distance = 1;
+    trace.meanTube = T.TDF[LPOS(p.x,p.y,p.z)];
+
+    CenterlinePoint startPoint;
+    startPoint.pos.x = p.x;
+    startPoint.pos.y = p.y;
+    startPoint.pos.z = p.z;
+
+    trace.points.push_back(startPoint);
+
+    // For each direction
+    for(int direction = -1; direction < 3; direction += 2) {
+        int belowTlow = 0;
+        int3 position(p.x,p.y,p.z);
+        int previous = LPOS(p.x,p.y,p.z);
+        float3 t_i = getTubeDirection(T, position, size);
+        t_i.x *= direction;
+        t_i.y *= direction;
+        t_i.z *= direction;
+        float3 t_i_1;
+        t_i_1.x = t_i.x;
+        t_i_1.y = t_i.y;
+        t_i_1.z = t_i.z;
+
+
+        // Traverse
+        while(true) {
+            int3 maxPoint(0,0,0);
+
+            // Check for out of bounds
+            if(position.x < 3 || position.x > size.x-3 || position.y < 3 || position.y > size.y-3 || position.z < 3 || position.z > size.z-3)
+                break;
+
+            // Try to find next point from all neighbors
+            for(int a = -1; a < 2; a++) {
+                for(int b = -1; b < 2; b++) {
+                    for(int c = -1; c < 2; c++) {
+                        int3 n(position.x+a,position.y+b,position.z+c);
+                        if((a == 0 && b == 0 && c == 0) || T.TDF[POS(n)] == 0.0f)
+                            continue;
+
+                        float3 dir((float)(n.x-position.x),(float)(n.y-position.y),(float)(n.z-position.z));
+                        dir = dir.normalize();
+                        if( (dir.x*t_i.x+dir.y*t_i.y+dir.z*t_i.z) <= 0.1)
+                            continue;
+
+                        if(T.radius[POS(n)] >= 1.5f) {
+                            if(M(n.x,n.y,n.z) > M(maxPoint.x,maxPoint.y,maxPoint.z))
+                            maxPoint = n;
+                        } else {
+                            if(T.TDF[LPOS(n.x,n.y,n.z)]*M(n.x,n.y,n.z) > T.TDF[POS(maxPoint)]*M(maxPoint.x,maxPoint.y,maxPoint.z))
+                            maxPoint = n;
+                        }
+
+                    }
+                }
+            }
+
+            if(maxPoint.x+maxPoint.y+maxPoint.z > 0) {
+                // New maxpoint found, check it!
+                if(isClaimed(claimed, LPOS(maxPoint.x,maxPoint.y,maxPoint.z))) {
+                    // Hit an existing centerline
+                    trace.edges.push_back(SIPL::int2(previous, LPOS(maxPoint.x,maxPoint.y,maxPoint.z)));
+                    trace.hits[(direction+1)/2] = LPOS(maxPoint.x,maxPoint.y,maxPoint.z);
+                    break;
+                }
+                trace.freeVoxels.push_back(LPOS(maxPoint.x,maxPoint.y,maxPoint.z));
+                if(M(maxPoint.x,maxPoint.y,maxPoint.z) < Mlow || (belowTlow > maxBelowTlow && T.TDF[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)] < Tlow)) {
+                    // New point is below thresholds
+                    break;
+                } else if(trace.voxels.contains(LPOS(maxPoint.x,maxPoint.y,maxPoint.z))) {
+                    // Loop detected!
+                    break;
+                } else {
+                    // Point is OK, proceed to add it and continue
+                    if(T.TDF[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)] < Tlow) {
+                        belowTlow++;
+                    } else {
+                        belowTlow = 0;
+                    }
+
+                    // Update direction
+                    //float3 e1 = getTubeDirection(T, maxPoint,size.x,size.y,size.z);
+
+                    //TODO: check if all eigenvalues are negative, if so find the egeinvector that best matches
+                    float3 lambda, e1, e2, e3;
+                    // The tube direction field has no direction where all eigenvalues are negative
+                    if(!getStoredTubeDirection(T, maxPoint, size, &e1)) {
+                        doEigen(T, maxPoint, size, &lambda, &e1, &e2, &e3);
+                        if((lambda.x < 0 && lambda.y < 0 && lambda.z < 0)) {
+                            if(fabs(t_i.dot(e3)) > fabs(t_i.dot(e2))) {
+                                if(fabs(t_i.dot(e3)) > fabs(t_i.dot(e1))) {
+                                    e1 = e3;
+                                }
+                            } else if(fabs(t_i.dot(e2)) > fabs(t_i.dot(e1))) {
+                                e1 = e2;
+                            }
+                        }
+                    }
+
+
+                    float maintain_dir = sign(e1.dot(t_i));
+                    float3 vec_sum;
+                    vec_sum.x = maintain_dir*e1.x + t_i.x + t_i_1.x;
+                    vec_sum.y = maintain_dir*e1.y + t_i.y + t_i_1.y;
+                    vec_sum.z = maintain_dir*e1.z + t_i.z + t_i_1.z;
+                    vec_sum = vec_sum.normalize();
+                    t_i_1 = t_i;
+                    t_i = vec_sum;
+
+                    // update position
+                    position = maxPoint;
+                    trace.distance ++;
+                    trace.voxels.insert(LPOS(maxPoint.x,maxPoint.y,maxPoint.z));
+                    trace.edges.push_back(SIPL::int2(previous, LPOS(maxPoint.x,maxPoint.y,maxPoint.z)));
+                    previous = LPOS(maxPoint.x,maxPoint.y,maxPoint.z);
+                    trace.meanTube += T.TDF[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)];
+
+                    // Create centerline point
+                    CenterlinePoint p;
+                    p.pos = position;
+                    p.next = &(trace.points.back()); // add previous
+                    if(T.radius[POS(p.pos)] > 3.0f) {
+                        p.large = true;
+                    } else {
+                        p.large = false;
+                    }
+
+                    trace.points.push_back(p);
+                }
+            } else {
+                // No maxpoint found, stop!
+                break;
+            }
+
+        } // End traversal
+    } // End for each direction
+}
+
+// A trace is the same as tracing it now if no centerline has been added
+// where it was free
+static bool isTraceValid(const RidgeTrace &trace, const std::vector<unsigned int> &claimed) {
+    for(unsigned int i = 0; i < trace.freeVoxels.size(); i++) {
+        if(isClaimed(claimed, trace.freeVoxels[i]))
+            return false;
+    }
+    return true;
+}
+
+void runRidgeTraversal(TubeSegmentation &T, SIPL::int3 size, paramList &parameters, std::stack<CenterlinePoint> centerlineStack, TSFOutput * output) {
 
     float Thigh = getParam(parameters, "tdf-high"); // 0.6
     int Dmin = getParam(parameters, "min-distance");
@@ -43,16 +316,15 @@ char * runRidgeTraversal(TubeSegmentation &T, SIPL::int3 size, paramList &parame
     int maxBelowTlow = getParam(parameters, "max-below-tdf-low"); // 2
     float minMeanTube = getParam(parameters, "min-mean-tdf"); //0.6
     int TreeMin = getParam(parameters, "min-tree-length"); // 200
+    const bool parallel = getParamBool(parameters, "parallel-ridge-traversal");
     const int totalSize = size.x*size.y*size.z;
 
-    int * centerlines = new int[totalSize]();
+    std::vector<unsigned int> claimed((totalSize+31)/32, 0);
     INIT_TIMER
 
-    // Create queue
-    std::priority_queue<point, std::vector<point>, PointComparison> queue;
-
     START_TIMER
-    // Collect all valid start points
+    // Collect all valid start points, one list per slice
+    std::vector<std::vector<point> > slicePoints(size.z);
     #pragma omp parallel for
     for(int z = 2; z < size.z-2; z++) {
         for(int y = 2; y < size.y-2; y++) {
@@ -80,15 +352,21 @@ char * runRidgeTraversal(TubeSegmentation &T, SIPL::int3 size, paramList &parame
                     p.x = x;
                     p.y = y;
                     p.z = z;
-                    #pragma omp critical
-                    queue.push(p);
+                    slicePoints[z].push_back(p);
                 }
             }
         }
     }
-
-    std::cout << "Processing " << queue.size() << " valid start points" << std::endl;
-    if(queue.size() == 0) {
+    std::vector<point> startPoints;
+    for(int z = 0; z < size.z; z++)
+        startPoints.insert(startPoints.end(), slicePoints[z].begin(), slicePoints[z].end());
+    slicePoints.clear();
+    PointComparison comparison;
+    comparison.size = size;
+    std::sort(startPoints.begin(), startPoints.end(), comparison);
+
+    std::cout << "Processing " << startPoints.size() << " valid start points" << std::endl;
+    if(startPoints.size() == 0) {
     	throw SIPL::SIPLException("no valid start points found", __LINE__, __FILE__);
     }
     STOP_TIMER("finding start points")
@@ -99,271 +377,157 @@ char * runRidgeTraversal(TubeSegmentation &T, SIPL::int3 size, paramList &parame
     T.Fy[0] = 0;
     T.Fz[0] = 0;
 
+    // The segment of each voxel of the centerlines
+    unordered_map<int, int> voxelSegments;
+
+    // The distances, points and edges of the segments, indexed by segment
+    // id. The edges are given as pairs of voxel indices. Segment 0 is not
+    // used and a segment that has been merged into another has distance 0.
+    std::vector<int> segmentDistances(1, 0);
+    std::vector<int> segmentParents(1, 0);
+    std::vector<std::vector<CenterlinePoint> > segmentPoints(1);
+    std::vector<std::vector<SIPL::int2> > segmentEdges(1);
+
+    // In parallel mode a batch of start points is traced speculatively on
+    // all threads. They are then added in priority order, and the ones that
+    // went where a centerline was added by an earlier one are traced again.
+    const int batchSize = parallel ? ridgeTraversalPointsPerThread*omp_get_max_threads() : 1;
+    std::vector<RidgeTrace> traces(batchSize);
+    int retraced = 0;
+    for(int batchStart = 0; batchStart < (int)startPoints.size(); batchStart += batchSize) {
+        const int batchEnd = std::min(batchStart + batchSize, (int)startPoints.size());
+        if(parallel) {
+            // Start points on a centerline are traced when they are added,
+            // if they need to be
+            #pragma omp parallel for schedule(dynamic)
+            for(int i = batchStart; i < batchEnd; i++) {
+                const point p = startPoints[i];
+                traces[i-batchStart].traced = false;
+                if(!isClaimed(claimed, LPOS(p.x,p.y,p.z)))
+                    traceCenterline(T, size, claimed, p, Mlow, Tlow, maxBelowTlow, traces[i-batchStart]);
+            }
+        }
 
-    // Create a map of centerline distances
-    unordered_map<int, int> centerlineDistances;
-
-    // Create a map of centerline stacks
-    unordered_map<int, std::stack<CenterlinePoint> > centerlineStacks;
-
-    while(!queue.empty()) {
-        // Traverse from new start point
-        point p = queue.top();
-        queue.pop();
-
-        // Has it been handled before?
-        if(centerlines[LPOS(p.x,p.y,p.z)] == 1)
-            continue;
-
-        unordered_set<int> newCenterlines;
-        newCenterlines.insert(LPOS(p.x,p.y,p.z));
-        int distance = 1;
-        int connections = 0;
-        int prevConnection = -1;
-        int secondConnection = -1;
-        float meanTube = T.TDF[LPOS(p.x,p.y,p.z)];
-
-        // Create new stack for this centerline
-        std::stack<CenterlinePoint> stack;
-        CenterlinePoint startPoint;
-        startPoint.pos.x = p.x;
-        startPoint.pos.y = p.y;
-        startPoint.pos.z = p.z;
-
-        stack.push(startPoint);
-
-        // For each direction
-        for(int direction = -1; direction < 3; direction += 2) {
-            int belowTlow = 0;
-            int3 position(p.x,p.y,p.z);
-            float3 t_i = getTubeDirection(T, position, size);
-            t_i.x *= direction;
-            t_i.y *= direction;
-            t_i.z *= direction;
-            float3 t_i_1;
-            t_i_1.x = t_i.x;
-            t_i_1.y = t_i.y;
-            t_i_1.z = t_i.z;
-
-
-            // Traverse
-            while(true) {
-                int3 maxPoint(0,0,0);
-
-                // Check for out of bounds
-                if(position.x < 3 || position.x > size.x-3 || position.y < 3 || position.y > size.y-3 || position.z < 3 || position.z > size.z-3)
-                    break;
-
-                // Try to find next point from all neighbors
-                for(int a = -1; a < 2; a++) {
-                    for(int b = -1; b < 2; b++) {
-                        for(int c = -1; c < 2; c++) {
-                            int3 n(position.x+a,position.y+b,position.z+c);
-                            if((a == 0 && b == 0 && c == 0) || T.TDF[POS(n)] == 0.0f)
-                                continue;
-
-                            float3 dir((float)(n.x-position.x),(float)(n.y-position.y),(float)(n.z-position.z));
-                            dir = dir.normalize();
-                            if( (dir.x*t_i.x+dir.y*t_i.y+dir.z*t_i.z) <= 0.1)
-                                continue;
-
-                            if(T.radius[POS(n)] >= 1.5f) {
-                                if(M(n.x,n.y,n.z) > M(maxPoint.x,maxPoint.y,maxPoint.z))
-                                maxPoint = n;
-                            } else {
-                                if(T.TDF[LPOS(n.x,n.y,n.z)]*M(n.x,n.y,n.z) > T.TDF[POS(maxPoint)]*M(maxPoint.x,maxPoint.y,maxPoint.z))
-                                maxPoint = n;
-                            }
-
-                        }
-                    }
-                }
-
-                if(maxPoint.x+maxPoint.y+maxPoint.z > 0) {
-                    // New maxpoint found, check it!
-                    if(centerlines[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)] > 0) {
-                        // Hit an existing centerline
-                        if(prevConnection == -1) {
-                            prevConnection = centerlines[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)];
-                        } else {
-                            if(prevConnection ==centerlines[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)]) {
-                                // A loop has occured, reject this centerline
-                                connections = 5;
-                            } else {
-                                secondConnection = centerlines[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)];
-                            }
-                        }
-                        break;
-                    } else if(M(maxPoint.x,maxPoint.y,maxPoint.z) < Mlow || (belowTlow > maxBelowTlow && T.TDF[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)] < Tlow)) {
-                        // New point is below thresholds
-                        break;
-                    } else if(newCenterlines.count(LPOS(maxPoint.x,maxPoint.y,maxPoint.z)) > 0) {
-                        // Loop detected!
-                        break;
-                    } else {
-                        // Point is OK, proceed to add it and continue
-                        if(T.TDF[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)] < Tlow) {
-                            belowTlow++;
-                        } else {
-                            belowTlow = 0;
-                        }
-
-                        // Update direction
-                        //float3 e1 = getTubeDirection(T, maxPoint,size.x,size.y,size.z);
-
-                        //TODO: check if all eigenvalues are negative, if so find the egeinvector that best matches
-                        float3 lambda, e1, e2, e3;
-                        doEigen(T, maxPoint, size, &lambda, &e1, &e2, &e3);
-                        if((lambda.x < 0 && lambda.y < 0 && lambda.z < 0)) {
-                            if(fabs(t_i.dot(e3)) > fabs(t_i.dot(e2))) {
-                                if(fabs(t_i.dot(e3)) > fabs(t_i.dot(e1))) {
-                                    e1 = e3;
-                                }
-                            } else if(fabs(t_i.dot(e2)) > fabs(t_i.dot(e1))) {
-                                e1 = e2;
-                            }
-                        }
-
+        for(int i = batchStart; i < batchEnd; i++) {
+            // Traverse from new start point
+            point p = startPoints[i];
 
-                        float maintain_dir = sign(e1.dot(t_i));
-                        float3 vec_sum;
-                        vec_sum.x = maintain_dir*e1.x + t_i.x + t_i_1.x;
-                        vec_sum.y = maintain_dir*e1.y + t_i.y + t_i_1.y;
-                        vec_sum.z = maintain_dir*e1.z + t_i.z + t_i_1.z;
-                        vec_sum = vec_sum.normalize();
-                        t_i_1 = t_i;
-                        t_i = vec_sum;
-
-                        // update position
-                        position = maxPoint;
-                        distance ++;
-                        newCenterlines.insert(LPOS(maxPoint.x,maxPoint.y,maxPoint.z));
-                        meanTube += T.TDF[LPOS(maxPoint.x,maxPoint.y,maxPoint.z)];
-
-                        // Create centerline point
-                        CenterlinePoint p;
-                        p.pos = position;
-                        p.next = &(stack.top()); // add previous
-                        if(T.radius[POS(p.pos)] > 3.0f) {
-                            p.large = true;
-                        } else {
-                            p.large = false;
-                        }
+            // Has it been handled before?
+            if(isClaimed(claimed, LPOS(p.x,p.y,p.z)) && getSegment(LPOS(p.x,p.y,p.z), voxelSegments, segmentParents) == 1)
+                continue;
 
-                        // Add point to stack
-                        stack.push(p);
-                    }
+            RidgeTrace &trace = traces[i-batchStart];
+            if(!parallel) {
+                traceCenterline(T, size, claimed, p, Mlow, Tlow, maxBelowTlow, trace);
+            } else if(!trace.traced || !isTraceValid(trace, claimed)) {
+                traceCenterline(T, size, claimed, p, Mlow, Tlow, maxBelowTlow, trace);
+                retraced++;
+            }
+            const int distance = trace.distance;
+            const float meanTube = trace.meanTube;
+
+            // Connections to existing centerlines
+            int connections = 0;
+            int prevConnection = -1;
+            int secondConnection = -1;
+            for(int direction = 0; direction < 2; direction++) {
+                if(trace.hits[direction] == -1)
+                    continue;
+                const int connection = getSegment(trace.hits[direction], voxelSegments, segmentParents);
+                if(prevConnection == -1) {
+                    prevConnection = connection;
+                } else if(prevConnection == connection) {
+                    // A loop has occured, reject this centerline
+                    connections = 5;
                 } else {
-                    // No maxpoint found, stop!
-                    break;
+                    secondConnection = connection;
                 }
+            }
 
-            } // End traversal
-        } // End for each direction
-
-        // Check to see if new traversal can be added
-        //std::cout << "Finished. Distance " << distance << " meanTube: " << meanTube/distance << std::endl;
-        if(distance > Dmin && meanTube/distance > minMeanTube && connections < 2) {
+            // Check to see if new traversal can be added
             //std::cout << "Finished. Distance " << distance << " meanTube: " << meanTube/distance << std::endl;
-            //std::cout << "------------------- New centerlines added #" << counter << " -------------------------" << std::endl;
-
-            unordered_set<int>::iterator usit;
-            if(prevConnection == -1) {
-                // No connections
-                for(usit = newCenterlines.begin(); usit != newCenterlines.end(); usit++) {
-                    centerlines[*usit] = counter;
+            if(distance > Dmin && meanTube/distance > minMeanTube && connections < 2) {
+                //std::cout << "Finished. Distance " << distance << " meanTube: " << meanTube/distance << std::endl;
+                //std::cout << "------------------- New centerlines added #" << counter << " -------------------------" << std::endl;
+
+                int segment = prevConnection;
+                if(prevConnection == -1) {
+                    // No connections
+                    segment = counter;
+                    segmentDistances.push_back(0);
+                    segmentParents.push_back(segment);
+                    segmentPoints.push_back(std::vector<CenterlinePoint>());
+                    segmentEdges.push_back(std::vector<SIPL::int2>());
+                    counter ++;
                 }
-                centerlineDistances[counter] = distance;
-                centerlineStacks[counter] = stack;
-                counter ++;
-            } else {
-                // The first connection
-
-                std::stack<CenterlinePoint> prevConnectionStack = centerlineStacks[prevConnection];
-                while(!stack.empty()) {
-                    prevConnectionStack.push(stack.top());
-                    stack.pop();
+                const std::vector<int> &voxels = trace.voxels.getVoxels();
+                for(unsigned int j = 0; j < voxels.size(); j++) {
+                    claim(claimed, voxels[j]);
+                    voxelSegments[voxels[j]] = segment;
                 }
-
-                for(usit = newCenterlines.begin(); usit != newCenterlines.end(); usit++) {
-                    centerlines[*usit] = prevConnection;
-                }
-                centerlineDistances[prevConnection] += distance;
+                segmentDistances[segment] += distance;
+                segmentPoints[segment].insert(segmentPoints[segment].end(), trace.points.begin(), trace.points.end());
+                segmentEdges[segment].insert(segmentEdges[segment].end(), trace.edges.begin(), trace.edges.end());
                 if(secondConnection != -1) {
                     // Two connections, move secondConnection to prevConnection
-                    std::stack<CenterlinePoint> secondConnectionStack = centerlineStacks[secondConnection];
-                    centerlineStacks.erase(secondConnection);
-                    while(!secondConnectionStack.empty()) {
-                        prevConnectionStack.push(secondConnectionStack.top());
-                        secondConnectionStack.pop();
-                    }
-
-                    #pragma omp parallel for
-                    for(int i = 0; i < totalSize;i++) {
-                        if(centerlines[i] == secondConnection)
-                            centerlines[i] = prevConnection;
-                    }
-                    centerlineDistances[prevConnection] += centerlineDistances[secondConnection];
-                    centerlineDistances.erase(secondConnection);
+                    segmentParents[secondConnection] = prevConnection;
+                    segmentDistances[prevConnection] += segmentDistances[secondConnection];
+                    segmentDistances[secondConnection] = 0;
+                    segmentPoints[prevConnection].insert(segmentPoints[prevConnection].end(), segmentPoints[secondConnection].begin(), segmentPoints[secondConnection].end());
+                    std::vector<CenterlinePoint>().swap(segmentPoints[secondConnection]);
+                    segmentEdges[prevConnection].insert(segmentEdges[prevConnection].end(), segmentEdges[secondConnection].begin(), segmentEdges[secondConnection].end());
+                    std::vector<SIPL::int2>().swap(segmentEdges[secondConnection]);
                 }
-
-                centerlineStacks[prevConnection] = prevConnectionStack;
-            }
-        } // end if new point can be added
-    } // End while queue is not empty
+            } // end if new point can be added
+        } // End for each start point of the batch
+    } // End for each batch
+    if(parallel)
+        std::cout << "Traced " << retraced << " of " << startPoints.size() << " start points again after a conflict" << std::endl;
     std::cout << "Finished traversal" << std::endl;
     STOP_TIMER("traversal")
     START_TIMER
 
-    if(centerlineDistances.size() == 0) {
+    if(counter == 1) {
         //throw SIPL::SIPLException("no centerlines were extracted");
-        char * returnCenterlines = new char[totalSize]();
-        return returnCenterlines;
+        output->setCenterline(std::vector<int3>(), std::vector<SIPL::int2>(), std::vector<float>());
+        return;
     }
 
     // Find largest connected tree and all trees above a certain size
-    unordered_map<int, int>::iterator it;
-    int max = centerlineDistances.begin()->first;
+    int max = -1;
     std::list<int> trees;
-    for(it = centerlineDistances.begin(); it != centerlineDistances.end(); it++) {
-        if(it->second > centerlineDistances[max])
-            max = it->first;
-        if(it->second > TreeMin)
-            trees.push_back(it->first);
+    for(int segment = 1; segment < counter; segment++) {
+        if(segmentDistances[segment] == 0)
+            continue;
+        if(max == -1 || segmentDistances[segment] > segmentDistances[max])
+            max = segment;
+        if(segmentDistances[segment] > TreeMin)
+            trees.push_back(segment);
     }
     std::list<int>::iterator it2;
     // TODO: if use the method with TreeMin have to add them to centerlineStack also
-    centerlineStack = centerlineStacks[max];
+    centerlineStack = std::stack<CenterlinePoint>();
+    for(unsigned int i = 0; i < segmentPoints[max].size(); i++)
+        centerlineStack.push(segmentPoints[max][i]);
     for(it2 = trees.begin(); it2 != trees.end(); it2++) {
-        while(!centerlineStacks[*it2].empty()) {
-            centerlineStack.push(centerlineStacks[*it2].top());
-            centerlineStacks[*it2].pop();
-        }
+        for(unsigned int i = 0; i < segmentPoints[*it2].size(); i++)
+            centerlineStack.push(segmentPoints[*it2][i]);
     }
 
-    char * returnCenterlines = new char[totalSize]();
-    // Mark largest tree with 1, and rest with 0
-    #pragma omp parallel for
-    for(int i = 0; i < totalSize;i++) {
-        if(centerlines[i] == max) {
-        //if(centerlines[i] > 0) {
-            returnCenterlines[i] = 1;
-        } else {
-            bool valid = false;
-            for(it2 = trees.begin(); it2 != trees.end(); it2++) {
-                if(centerlines[i] == *it2) {
-                    returnCenterlines[i] = 1;
-                    valid = true;
-                    break;
-                }
-            }
-            if(!valid)
-                returnCenterlines[i] = 0;
-
+    // Create the graph of the largest tree and the trees above a certain size
+    std::set<int> selectedTrees(trees.begin(), trees.end());
+    selectedTrees.insert(max);
+    unordered_map<int, int> vertexIndices;
+    std::vector<int3> vertices;
+    std::vector<SIPL::int2> edges;
+    for(std::set<int>::iterator it3 = selectedTrees.begin(); it3 != selectedTrees.end(); it3++) {
+        std::vector<SIPL::int2> &treeEdges = segmentEdges[*it3];
+        for(int i = 0; i < treeEdges.size(); i++) {
+            int a = getVertex(treeEdges[i].x, size, vertexIndices, vertices);
+            int b = getVertex(treeEdges[i].y, size, vertexIndices, vertices);
+            edges.push_back(SIPL::int2(a, b));
         }
     }
+    output->setCenterline(vertices, edges, sampleCenterlineRadius(vertices, T.radius, size));
     STOP_TIMER("finding largest tree")
-
-	delete[] centerlines;
-    return returnCenterlines;
 }
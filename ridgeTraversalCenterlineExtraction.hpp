@@ -12,6 +12,9 @@ typedef struct CenterlinePoint {
     CenterlinePoint * next;
 } CenterlinePoint;
 
-char * runRidgeTraversal(TubeSegmentation &T, SIPL::int3 size, paramList &parameters, std::stack<CenterlinePoint> centerlineStack);
+/*
+ * The extracted centerline is stored in output as a sparse graph
+ */
+void runRidgeTraversal(TubeSegmentation &T, SIPL::int3 size, paramList &parameters, std::stack<CenterlinePoint> centerlineStack, TSFOutput * output);
 
 #endif
@@ -1,5 +1,6 @@
 #include "segmentation.hpp"
 #include <iostream>
+#include "HelperFunctions.hpp"
 using namespace cl;
 
 Image3D runInverseGradientSegmentation(OpenCL &ocl, Image3D &centerline, Image3D &vectorField, Image3D &radius, SIPL::int3 size, paramList parameters) {
@@ -11,10 +12,13 @@ Image3D runInverseGradientSegmentation(OpenCL &ocl, Image3D &centerline, Image3D
         ocl.queue.enqueueMarker(&startEvent);
     }
 
-    Kernel dilateKernel = Kernel(ocl.program, "dilate");
-    Kernel erodeKernel = Kernel(ocl.program, "erode");
-    Kernel initGrowKernel = Kernel(ocl.program, "initGrowing");
-    Kernel growKernel = Kernel(ocl.program, "grow");
+    // The buffer kernels keep the segmentation in buffers until it is done
+    const bool useBufferKernels = no3Dwrite && ocl.useBufferKernels;
+    Program &program = useBufferKernels ? ocl.bufferProgram : ocl.program;
+    Kernel dilateKernel = Kernel(program, "dilate");
+    Kernel erodeKernel = Kernel(program, "erode");
+    Kernel initGrowKernel = Kernel(program, "initGrowing");
+    Kernel growKernel = Kernel(program, "grow");
 
     cl::size_t<3> offset;
     offset[0] = 0;
@@ -27,7 +31,8 @@ Image3D runInverseGradientSegmentation(OpenCL &ocl, Image3D &centerline, Image3D
 
 
 	Image3D volume = Image3D(ocl.context, CL_MEM_READ_WRITE, ImageFormat(CL_R, CL_SIGNED_INT8), size.x, size.y, size.z);
-	ocl.queue.enqueueCopyImage(centerline, volume, offset, offset, region);
+	if(!useBufferKernels)
+		ocl.queue.enqueueCopyImage(centerline, volume, offset, offset, region);
 
     int stopGrowing = 0;
     Buffer stop = Buffer(ocl.context, CL_MEM_WRITE_ONLY, sizeof(int));
@@ -38,7 +43,43 @@ Image3D runInverseGradientSegmentation(OpenCL &ocl, Image3D &centerline, Image3D
 
     int i = 0;
     int minimumIterations = 0;
-    if(no3Dwrite) {
+    Buffer current, next;
+    if(useBufferKernels) {
+        current = Buffer(ocl.context, CL_MEM_READ_WRITE, sizeof(char)*totalSize);
+        next = Buffer(ocl.context, CL_MEM_READ_WRITE, sizeof(char)*totalSize);
+        ocl.queue.enqueueCopyImageToBuffer(centerline, current, offset, region, 0);
+        ocl.queue.enqueueCopyBuffer(current, next, 0, 0, sizeof(char)*totalSize);
+        initGrowKernel.setArg(0, current);
+        initGrowKernel.setArg(1, next);
+        initGrowKernel.setArg(2, radius);
+        ocl.queue.enqueueNDRangeKernel(
+            initGrowKernel,
+            NullRange,
+            NDRange(size.x, size.y, size.z),
+            NullRange
+        );
+        ocl.queue.enqueueCopyBuffer(next, current, 0, 0, sizeof(char)*totalSize);
+        growKernel.setArg(0, current);
+        growKernel.setArg(2, next);
+        while(stopGrowing == 0) {
+            if(i > minimumIterations) {
+                stopGrowing = 1;
+                ocl.queue.enqueueWriteBuffer(stop, CL_TRUE, 0, sizeof(int), &stopGrowing);
+            }
+
+            ocl.queue.enqueueNDRangeKernel(
+                    growKernel,
+                    NullRange,
+                    NDRange(size.x, size.y, size.z),
+                    NullRange
+            );
+            if(i > minimumIterations)
+                ocl.queue.enqueueReadBuffer(stop, CL_TRUE, 0, sizeof(int), &stopGrowing);
+            i++;
+            // grow only writes some of the voxels of next
+            ocl.queue.enqueueCopyBuffer(next, current, 0, 0, sizeof(char)*totalSize);
+        }
+    } else if(no3Dwrite) {
         Buffer volume2 = Buffer(
                 ocl.context,
                 CL_MEM_READ_WRITE,
@@ -133,7 +174,32 @@ Image3D runInverseGradientSegmentation(OpenCL &ocl, Image3D &centerline, Image3D
 
     std::cout << "segmentation result grown in " << i << " iterations" << std::endl;
 
-    if(no3Dwrite) {
+    if(useBufferKernels) {
+        dilateKernel.setArg(0, current);
+        dilateKernel.setArg(1, next);
+        ocl.queue.enqueueNDRangeKernel(
+            dilateKernel,
+            NullRange,
+            NDRange(size.x, size.y, size.z),
+            NullRange
+        );
+
+        erodeKernel.setArg(0, next);
+        erodeKernel.setArg(1, current);
+        ocl.queue.enqueueNDRangeKernel(
+            erodeKernel,
+            NullRange,
+            NDRange(size.x, size.y, size.z),
+            NullRange
+        );
+        ocl.queue.enqueueCopyBufferToImage(
+            current,
+            volume,
+            0,
+            offset,
+            region
+        );
+    } else if(no3Dwrite) {
         Buffer volumeBuffer = Buffer(
                 ocl.context,
                 CL_MEM_WRITE_ONLY,
@@ -306,3 +372,67 @@ Image3D runSphereSegmentation(OpenCL ocl, Image3D &centerline, Image3D &radius,
 
 }
 
+
+Buffer packMask(OpenCL &ocl, Image3D &mask, SIPL::int3 size) {
+	const int wordsPerRow = getMaskWordsPerRow(size);
+	Buffer packed = Buffer(
+			ocl.context,
+			CL_MEM_READ_WRITE,
+			sizeof(cl_uint)*wordsPerRow*size.y*size.z
+	);
+	const bool isUnsigned = mask.getImageInfo<CL_IMAGE_FORMAT>().image_channel_data_type == CL_UNSIGNED_INT8;
+	Kernel packKernel = Kernel(ocl.program, "packMask");
+	packKernel.setArg(0, mask);
+	packKernel.setArg(1, packed);
+	packKernel.setArg(2, isUnsigned ? 1 : 0);
+	ocl.queue.enqueueNDRangeKernel(
+			packKernel,
+			NullRange,
+			NDRange(wordsPerRow, size.y, size.z),
+			NullRange
+	);
+	return packed;
+}
+
+Image3D unpackMask(OpenCL &ocl, Buffer &packed, SIPL::int3 size, paramList &parameters) {
+	const bool no3Dwrite = !getParamBool(parameters, "3d_write");
+	Image3D mask = Image3D(
+			ocl.context,
+			CL_MEM_READ_WRITE,
+			ImageFormat(CL_R, CL_SIGNED_INT8),
+			size.x, size.y, size.z
+	);
+	Kernel unpackKernel = Kernel(ocl.program, "unpackMask");
+	unpackKernel.setArg(0, packed);
+	unpackKernel.setArg(2, getMaskWordsPerRow(size));
+	if(no3Dwrite) {
+		Buffer maskBuffer = Buffer(
+				ocl.context,
+				CL_MEM_WRITE_ONLY,
+				sizeof(char)*size.x*size.y*size.z
+		);
+		unpackKernel.setArg(1, maskBuffer);
+		ocl.queue.enqueueNDRangeKernel(
+				unpackKernel,
+				NullRange,
+				NDRange(size.x, size.y, size.z),
+				NullRange
+		);
+		ocl.queue.enqueueCopyBufferToImage(
+				maskBuffer,
+				mask,
+				0,
+				oul::createOrigoRegion(),
+				oul::createRegion(size.x, size.y, size.z)
+		);
+	} else {
+		unpackKernel.setArg(1, mask);
+		ocl.queue.enqueueNDRangeKernel(
+				unpackKernel,
+				NullRange,
+				NDRange(size.x, size.y, size.z),
+				NullRange
+		);
+	}
+	return mask;
+}
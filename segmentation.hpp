@@ -3,10 +3,20 @@
 
 #include "commons.hpp"
 #include "parameters.hpp"
+#include "inputOutput.hpp"
 using namespace cl;
 
 Image3D runInverseGradientSegmentation(OpenCL &ocl, Image3D &centerline, Image3D &vectorField, Image3D &radius, SIPL::int3 size, paramList parameters);
 
 Image3D runSphereSegmentation(OpenCL ocl, Image3D &centerline, Image3D &radius, SIPL::int3 size, paramList parameters);
 
+/*
+ * Pack a mask image to 1 bit per voxel in 32 bit words. Each row in the x
+ * direction starts on a new word, see getMaskWordsPerRow.
+ */
+Buffer packMask(OpenCL &ocl, Image3D &mask, SIPL::int3 size);
+
+// Unpack a mask created by packMask to a signed 8 bit image
+Image3D unpackMask(OpenCL &ocl, Buffer &packed, SIPL::int3 size, paramList &parameters);
+
 #endif
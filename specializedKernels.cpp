@@ -0,0 +1,34 @@
+#include "specializedKernels.hpp"
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include "timing.hpp"
+
+Kernel getSpecializedKernel(OpenCL &ocl, std::string name, std::string defines, paramList &parameters) {
+    if(!getParamBool(parameters, "specialize-kernels") || defines == "")
+        return Kernel(ocl.program, name.c_str());
+
+    // The program name is the build options, which has all the defines
+    const std::string buildOptions = ocl.programBuildOptions + defines;
+    if(!ocl.oulContext.hasProgram(buildOptions)) {
+        INIT_TIMER
+        ocl.oulContext.createProgramFromSourceWithName(buildOptions, ocl.programFilename, buildOptions);
+        if(getParamBool(parameters, "timing")) {
+            std::cout << "Specialized program:" << defines << std::endl;
+            STOP_TIMER("specialized program build")
+        }
+    }
+    return Kernel(ocl.oulContext.getProgram(buildOptions), name.c_str());
+}
+
+std::string getKernelDefine(std::string name, int value) {
+    std::ostringstream define;
+    define << " -D " << name << "=" << value;
+    return define.str();
+}
+
+std::string getKernelDefine(std::string name, float value) {
+    std::ostringstream define;
+    define << " -D " << name << "=" << std::setprecision(9) << std::showpoint << value << "f";
+    return define.str();
+}
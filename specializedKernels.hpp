@@ -0,0 +1,22 @@
+#ifndef SPECIALIZED_KERNELS_H
+#define SPECIALIZED_KERNELS_H
+#include <string>
+#include "commons.hpp"
+#include "parameters.hpp"
+using namespace cl;
+
+/*
+ * Kernels built with values that are constant for a run, such as the data
+ * type of the dataset or the size of the blur mask, as -D defines. A kernel
+ * replaces the argument with the define if it is set, so the arguments stay
+ * the same and the compiler can unroll the loops and remove the branches
+ * that depend on it. Each set of defines is built once per context, which has
+ * one device. Without specialize-kernels the generic kernel is returned.
+ */
+Kernel getSpecializedKernel(OpenCL &ocl, std::string name, std::string defines, paramList &parameters);
+
+// A -D define for getSpecializedKernel
+std::string getKernelDefine(std::string name, int value);
+std::string getKernelDefine(std::string name, float value);
+
+#endif
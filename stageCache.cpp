@@ -0,0 +1,220 @@
+#include "stageCache.hpp"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include "SIPL/Exceptions.hpp"
+
+StageCacheFile::StageCacheFile() {
+}
+
+static std::size_t alignStageCacheOffset(std::size_t offset) {
+	return (offset + STAGE_CACHE_ALIGNMENT - 1) / STAGE_CACHE_ALIGNMENT * STAGE_CACHE_ALIGNMENT;
+}
+
+bool StageCacheFile::open(std::string filename, std::string key) {
+	close();
+	struct stat fileInfo;
+	if(stat(filename.c_str(), &fileInfo) != 0)
+		return false;
+	try {
+		file.open(filename);
+	} catch(std::exception &e) {
+		return false;
+	}
+	if(!file.is_open())
+		return false;
+
+	std::istringstream header(std::string(file.data(), std::min(file.size(), (std::size_t)1 << 16)));
+	std::string line;
+	std::getline(header, line);
+	if(line != "TSF stage cache 1") {
+		close();
+		return false;
+	}
+	std::getline(header, line);
+	if(line != key) {
+		close();
+		return false;
+	}
+	int nrOfVolumes = 0;
+	header >> size.x >> size.y >> size.z;
+	header >> shiftVector.x >> shiftVector.y >> shiftVector.z;
+	header >> spacing.x >> spacing.y >> spacing.z;
+	header >> nrOfVolumes;
+	const std::size_t totalSize = (std::size_t)size.x*size.y*size.z;
+	for(int i = 0; i < nrOfVolumes && !header.fail(); i++) {
+		StageCacheVolume volume;
+		std::size_t offset;
+		header >> volume.channelOrder >> volume.channelType >> volume.elementSize >> offset;
+		if(offset + volume.elementSize*totalSize > file.size())
+			break;
+		volume.data = file.data() + offset;
+		volumes.push_back(volume);
+	}
+	if(header.fail() || (int)volumes.size() != nrOfVolumes) {
+		close();
+		return false;
+	}
+	return true;
+}
+
+void StageCacheFile::close() {
+	volumes.clear();
+	if(file.is_open())
+		file.close();
+}
+
+void StageCacheFile::write(std::string filename, std::string key, SIPL::int3 size, SIPL::int3 shiftVector, SIPL::float3 spacing, const std::vector<StageCacheVolume> &volumes) {
+	const std::size_t totalSize = (std::size_t)size.x*size.y*size.z;
+
+	// The offsets have a fixed width so that the length of the header is
+	// known before they are computed
+	std::ostringstream header;
+	header << "TSF stage cache 1\n" << key << "\n";
+	header << size.x << " " << size.y << " " << size.z << "\n";
+	header << shiftVector.x << " " << shiftVector.y << " " << shiftVector.z << "\n";
+	header << std::setprecision(9) << spacing.x << " " << spacing.y << " " << spacing.z << "\n";
+	header << volumes.size() << "\n";
+	const std::size_t headerSize = header.str().size() + volumes.size()*(3*11 + 21);
+	std::vector<std::size_t> offsets;
+	std::size_t offset = alignStageCacheOffset(headerSize);
+	for(unsigned int i = 0; i < volumes.size(); i++) {
+		offsets.push_back(offset);
+		header << std::setw(10) << volumes[i].channelOrder << " " << std::setw(10) << volumes[i].channelType << " " <<
+				std::setw(10) << volumes[i].elementSize << " " << std::setw(20) << offset << "\n";
+		offset = alignStageCacheOffset(offset + volumes[i].elementSize*totalSize);
+	}
+
+	std::string temporaryFilename = filename + ".tmp";
+	std::ofstream file(temporaryFilename.c_str(), std::ios::out | std::ios::binary);
+	if(!file) {
+		std::cout << "NOTE: Unable to write stage cache file " << filename << std::endl;
+		return;
+	}
+	const std::vector<char> padding(STAGE_CACHE_ALIGNMENT, '\n');
+	std::string headerString = header.str();
+	file.write(headerString.c_str(), headerString.size());
+	std::size_t position = headerString.size();
+	for(unsigned int i = 0; i < volumes.size(); i++) {
+		file.write(&padding[0], offsets[i] - position);
+		file.write((const char *)volumes[i].data, volumes[i].elementSize*totalSize);
+		position = offsets[i] + volumes[i].elementSize*totalSize;
+	}
+	file.close();
+	if(file.fail() || std::rename(temporaryFilename.c_str(), filename.c_str()) != 0) {
+		std::remove(temporaryFilename.c_str());
+		std::cout << "NOTE: Unable to write stage cache file " << filename << std::endl;
+	}
+}
+
+/*
+ * 64 bit FNV-1a applied to 8 byte words, which is fast enough to hash
+ * a volume in about the time it takes to read it from disk.
+ */
+static unsigned long long hashStageCacheData(unsigned long long hash, const void * data, std::size_t bytes) {
+	const unsigned long long prime = 1099511628211ULL;
+	const unsigned char * bytePointer = (const unsigned char *)data;
+	const std::size_t words = bytes / 8;
+	for(std::size_t i = 0; i < words; i++) {
+		unsigned long long word;
+		memcpy(&word, bytePointer + i*8, 8);
+		hash = (hash ^ word) * prime;
+	}
+	for(std::size_t i = words*8; i < bytes; i++)
+		hash = (hash ^ bytePointer[i]) * prime;
+	return hash;
+}
+
+static std::string toHex(unsigned long long hash) {
+	std::ostringstream stream;
+	stream << std::hex << std::setw(16) << std::setfill('0') << hash;
+	return stream.str();
+}
+
+static const unsigned long long stageCacheHashBasis = 14695981039346656037ULL;
+
+std::string getStageCacheDataHash(const void * data, std::size_t bytes) {
+	return toHex(hashStageCacheData(stageCacheHashBasis, data, bytes));
+}
+
+std::string getStageCacheFileHash(std::string cacheDirectory, std::string filename) {
+	struct stat fileInfo;
+	if(stat(filename.c_str(), &fileInfo) != 0)
+		throw SIPL::IOException(filename.c_str(), __LINE__, __FILE__);
+	std::ostringstream fileKey;
+	fileKey << filename << " " << (long long)fileInfo.st_size << " " << (long long)fileInfo.st_mtime;
+
+	std::string hashFilename = cacheDirectory + "/source-" + getStageCacheDataHash(filename.c_str(), filename.size()) + ".hash";
+	std::ifstream hashFile(hashFilename.c_str());
+	std::string line, hash;
+	if(hashFile && std::getline(hashFile, line) && line == fileKey.str() && std::getline(hashFile, hash) && hash.size() == 16)
+		return hash;
+
+	std::ifstream file(filename.c_str(), std::ios::in | std::ios::binary);
+	if(!file)
+		throw SIPL::IOException(filename.c_str(), __LINE__, __FILE__);
+	std::vector<char> buffer(1 << 20);
+	unsigned long long value = stageCacheHashBasis;
+	while(file) {
+		file.read(&buffer[0], buffer.size());
+		value = hashStageCacheData(value, &buffer[0], file.gcount());
+	}
+	hash = toHex(value);
+
+	std::ofstream output(hashFilename.c_str());
+	if(output)
+		output << fileKey.str() << "\n" << hash << "\n";
+	return hash;
+}
+
+static bool stageDependsOn(std::string name, std::string group, StageCacheStage stage) {
+	if(group == "cropping" || name == "minimum" || name == "maximum" || name == "parameters")
+		return true;
+	if(stage == STAGE_CACHE_DATASET)
+		return false;
+	if(name == "tdf-only")
+		return false;
+	return group == "gradient-vector-flow" || group == "tube-detection-filter" ||
+			name == "fmax" || name == "mode" || name == "small-blur" || name == "large-blur" ||
+			name == "16bit-vectors" || name == "32bit-vectors" || name == "3d_write" ||
+			name == "fused-vector-field";
+}
+
+std::string getStageCacheKey(std::string source, paramList &parameters, StageCacheStage stage) {
+	// The parameters are sorted as the order of the maps is unspecified
+	std::vector<std::string> values;
+	unordered_map<std::string, BoolParameter>::iterator bIt;
+	unordered_map<std::string, NumericParameter>::iterator nIt;
+	unordered_map<std::string, StringParameter>::iterator sIt;
+	for(bIt = parameters.bools.begin(); bIt != parameters.bools.end(); ++bIt) {
+		if(stageDependsOn(bIt->first, bIt->second.getGroup(), stage))
+			values.push_back(bIt->first + "=" + (bIt->second.get() ? "true" : "false"));
+	}
+	for(nIt = parameters.numerics.begin(); nIt != parameters.numerics.end(); ++nIt) {
+		if(stageDependsOn(nIt->first, nIt->second.getGroup(), stage)) {
+			std::ostringstream value;
+			value << std::setprecision(9) << nIt->second.get();
+			values.push_back(nIt->first + "=" + value.str());
+		}
+	}
+	for(sIt = parameters.strings.begin(); sIt != parameters.strings.end(); ++sIt) {
+		if(stageDependsOn(sIt->first, sIt->second.getGroup(), stage))
+			values.push_back(sIt->first + "=" + sIt->second.get());
+	}
+	std::sort(values.begin(), values.end());
+
+	std::string key = source;
+	for(unsigned int i = 0; i < values.size(); i++)
+		key += ";" + values[i];
+	return key;
+}
+
+std::string getStageCacheFilename(std::string cacheDirectory, std::string key, StageCacheStage stage) {
+	std::string name = stage == STAGE_CACHE_DATASET ? "dataset" : "tdf";
+	return cacheDirectory + "/" + name + "-" + getStageCacheDataHash(key.c_str(), key.size()) + ".tsfcache";
+}
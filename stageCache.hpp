@@ -0,0 +1,69 @@
+#ifndef STAGE_CACHE_H
+#define STAGE_CACHE_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+#include <boost/iostreams/device/mapped_file.hpp>
+#include "SIPL/Types.hpp"
+#include "parameters.hpp"
+
+/*
+ * Content addressed cache of the results of the pipeline stages. The key of
+ * a stage is the hash of the source data and the parameters that the stage
+ * and the stages before it depend on, so changing a downstream parameter
+ * such as tdf-high or min-tree-length keeps the cached results valid.
+ */
+enum StageCacheStage {
+	STAGE_CACHE_DATASET, // The cropped dataset converted to float
+	STAGE_CACHE_TDF // Vector field, TDF and radius
+};
+
+typedef struct StageCacheVolume {
+	unsigned int channelOrder; // cl_channel_order
+	unsigned int channelType; // cl_channel_type
+	unsigned int elementSize; // Bytes per voxel
+	const void * data;
+} StageCacheVolume;
+
+/*
+ * A cache file is a text header followed by the volumes. The header and each
+ * volume start at a multiple of STAGE_CACHE_ALIGNMENT bytes so that the file
+ * can be memory mapped and the volumes used directly.
+ */
+#define STAGE_CACHE_ALIGNMENT 4096
+
+class StageCacheFile {
+public:
+	StageCacheFile();
+	// Returns false if the file is missing, damaged or has another key
+	bool open(std::string filename, std::string key);
+	void close();
+	int getNrOfVolumes() const { return volumes.size(); };
+	const StageCacheVolume & getVolume(int i) const { return volumes[i]; };
+	SIPL::int3 getSize() const { return size; };
+	SIPL::int3 getShiftVector() const { return shiftVector; };
+	SIPL::float3 getSpacing() const { return spacing; };
+	// The file is written to a temporary file first, so readers never see a partial file
+	static void write(std::string filename, std::string key, SIPL::int3 size, SIPL::int3 shiftVector, SIPL::float3 spacing, const std::vector<StageCacheVolume> &volumes);
+private:
+	boost::iostreams::mapped_file_source file;
+	std::vector<StageCacheVolume> volumes;
+	SIPL::int3 size;
+	SIPL::int3 shiftVector;
+	SIPL::float3 spacing;
+};
+
+std::string getStageCacheDataHash(const void * data, std::size_t bytes);
+
+/*
+ * Hash of the content of a file. The hash is memoized in the cache directory
+ * together with the size and modification time of the file.
+ */
+std::string getStageCacheFileHash(std::string cacheDirectory, std::string filename);
+
+std::string getStageCacheKey(std::string source, paramList &parameters, StageCacheStage stage);
+
+std::string getStageCacheFilename(std::string cacheDirectory, std::string key, StageCacheStage stage);
+
+#endif
@@ -70,3 +70,110 @@ TEST(TSFOutputTest, ShiftVector) {
 	EXPECT_EQ(2, output.getShiftVector().z);
 }
 
+
+TEST(TSFOutputTest, MapHostData) {
+	TSFOutput output(oul::DeviceCriteria(), new SIPL::int3(3, 1, 1));
+	EXPECT_THROW(output.mapSegmentation(), SIPL::SIPLException);
+	char * data = new char[3];
+	data[0] = 1;
+	data[1] = 0;
+	data[2] = 1;
+	output.setSegmentation(data);
+	TSFMappedView<char> view = output.mapSegmentation();
+	EXPECT_FALSE(view.isMapped());
+	EXPECT_EQ(3, view.getTotalSize());
+	EXPECT_EQ(1, view[0]);
+	EXPECT_EQ(0, view[1]);
+	EXPECT_EQ(1, view.get(2, 0, 0));
+	EXPECT_THROW(output.mapTDF16bit(), SIPL::SIPLException);
+}
+
+TEST(TSFOutputTest, SparseCenterline) {
+	TSFOutput output(oul::DeviceCriteria(), new SIPL::int3(5, 3, 1));
+	EXPECT_FALSE(output.hasCenterline());
+	std::vector<SIPL::int3> vertices;
+	vertices.push_back(SIPL::int3(0, 1, 0));
+	vertices.push_back(SIPL::int3(4, 1, 0));
+	std::vector<SIPL::int2> edges;
+	edges.push_back(SIPL::int2(0, 1));
+	std::vector<float> radius(1, 2.0f);
+	EXPECT_THROW(output.setCenterline(vertices, edges, radius), SIPL::SIPLException);
+	radius.push_back(3.0f);
+	output.setCenterline(vertices, edges, radius);
+	EXPECT_TRUE(output.hasCenterline());
+	EXPECT_TRUE(output.hasCenterlineVoxels());
+	EXPECT_EQ(2, output.getCenterlineVertices().size());
+	EXPECT_EQ(1, output.getCenterlineEdges().size());
+	EXPECT_EQ(3.0f, output.getCenterlineRadius()[1]);
+
+	// The voxels are created from the graph
+	char * voxels = output.getCenterlineVoxels();
+	for(int x = 0; x < 5; x++) {
+		EXPECT_EQ(0, voxels[x]);
+		EXPECT_EQ(1, voxels[x+5]);
+		EXPECT_EQ(0, voxels[x+10]);
+	}
+}
+
+TEST(TSFOutputTest, RunLengthMask) {
+	SIPL::int3 size(40, 2, 2);
+	char * voxels = new char[size.x*size.y*size.z]();
+	unsigned int * words = new unsigned int[getMaskWordsPerRow(size)*size.y*size.z]();
+	// A run crossing a word boundary, a run at the end of a row that continues
+	// on the next row and a single voxel
+	for(int x = 30; x < 35; x++)
+		voxels[x] = 1;
+	for(int x = 38; x < 42; x++)
+		voxels[x] = 1;
+	voxels[3*size.x+7] = 1;
+	for(int i = 0; i < size.x*size.y*size.z; i++) {
+		if(voxels[i] == 1) {
+			int x = i % size.x;
+			int row = i / size.x;
+			words[row*getMaskWordsPerRow(size) + x/32] |= 1u << (x % 32);
+		}
+	}
+
+	TSFRunLengthMask fromVoxels = TSFRunLengthMask::fromVoxels(voxels, size);
+	TSFRunLengthMask fromWords = TSFRunLengthMask::fromPackedWords(words, size);
+	ASSERT_EQ(3, fromVoxels.getRuns().size());
+	ASSERT_EQ(3, fromWords.getRuns().size());
+	EXPECT_EQ(10, fromVoxels.getVoxelCount());
+	for(int i = 0; i < 3; i++) {
+		EXPECT_EQ(fromVoxels.getRuns()[i].start, fromWords.getRuns()[i].start);
+		EXPECT_EQ(fromVoxels.getRuns()[i].length, fromWords.getRuns()[i].length);
+	}
+	EXPECT_EQ(38, fromWords.getRuns()[1].start);
+	EXPECT_EQ(4, fromWords.getRuns()[1].length);
+
+	char * result = new char[size.x*size.y*size.z];
+	fromWords.toVoxels(result);
+	for(int i = 0; i < size.x*size.y*size.z; i++)
+		EXPECT_EQ(voxels[i], result[i]);
+	delete[] voxels;
+	delete[] words;
+	delete[] result;
+}
+
+class PackedMaskTest : public OpenCLTest {
+protected:
+	// A width that is not a multiple of the 32 voxel words
+	PackedMaskTest() : OpenCLTest(SIPL::int3(40,3,2)) {};
+};
+
+TEST_F(PackedMaskTest, RoundTrip) {
+	const int totalSize = size.x*size.y*size.z;
+	char * voxels = new char[totalSize];
+	for(int i = 0; i < totalSize; i++)
+		voxels[i] = (i % 3 == 0 || i % 7 == 0) ? 1 : 0;
+	Image3D mask(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_R, CL_SIGNED_INT8), size.x, size.y, size.z, 0, 0, voxels);
+
+	Buffer packed = packMask(*ocl, mask, size);
+	Image3D unpacked = unpackMask(*ocl, packed, size, parameters);
+	char * result = new char[totalSize];
+	ocl->queue.enqueueReadImage(unpacked, CL_TRUE, oul::createOrigoRegion(), oul::createRegion(size.x, size.y, size.z), 0, 0, result);
+	for(int i = 0; i < totalSize; i++)
+		EXPECT_EQ(voxels[i], result[i]);
+	delete[] voxels;
+	delete[] result;
+}
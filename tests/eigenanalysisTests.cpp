@@ -0,0 +1,123 @@
+#include "tests.hpp"
+#include <ctime>
+
+// Tests for the closed form eigen solver of the Hessian
+
+// Hessian of the intensity of synthetic dataset 1 in every voxel where it is not zero
+static std::vector<float> getSyntheticHessians() {
+	Volume<float> * volume = new Volume<float>((std::string(TESTDATA_DIR) + std::string("/synthetic/dataset_1/noisy.mhd")).c_str());
+	std::vector<float> hessians;
+	for(int z = 1; z < volume->getDepth()-1; z++) {
+	for(int y = 1; y < volume->getHeight()-1; y++) {
+	for(int x = 1; x < volume->getWidth()-1; x++) {
+		const float center = volume->get(x,y,z);
+		float H[6] = {
+			volume->get(x+1,y,z) - 2*center + volume->get(x-1,y,z),
+			(volume->get(x+1,y+1,z) - volume->get(x+1,y-1,z) - volume->get(x-1,y+1,z) + volume->get(x-1,y-1,z))*0.25f,
+			(volume->get(x+1,y,z+1) - volume->get(x+1,y,z-1) - volume->get(x-1,y,z+1) + volume->get(x-1,y,z-1))*0.25f,
+			volume->get(x,y+1,z) - 2*center + volume->get(x,y-1,z),
+			(volume->get(x,y+1,z+1) - volume->get(x,y+1,z-1) - volume->get(x,y-1,z+1) + volume->get(x,y-1,z-1))*0.25f,
+			volume->get(x,y,z+1) - 2*center + volume->get(x,y,z-1)
+		};
+		if(H[0] != 0 || H[1] != 0 || H[2] != 0 || H[3] != 0 || H[4] != 0 || H[5] != 0)
+			hessians.insert(hessians.end(), H, H+6);
+	}}}
+	delete volume;
+	return hessians;
+}
+
+static void toMatrix(const float * H, float A[3][3]) {
+	A[0][0] = H[0]; A[0][1] = H[1]; A[0][2] = H[2];
+	A[1][0] = H[1]; A[1][1] = H[3]; A[1][2] = H[4];
+	A[2][0] = H[2]; A[2][1] = H[4]; A[2][2] = H[5];
+}
+
+TEST(EigenanalysisTest, AnalyticSolverMatchesQL) {
+	std::vector<float> hessians = getSyntheticHessians();
+	ASSERT_GT(hessians.size(), 0u);
+	int compared = 0, eigenvalueErrors = 0, eigenvectorErrors = 0;
+	for(unsigned int i = 0; i < hessians.size(); i += 6) {
+		float A[3][3], Vql[3][3], dql[3], Van[3][3], dan[3];
+		toMatrix(&hessians[i], A);
+		eigen_decomposition_ql(A, Vql, dql);
+		toMatrix(&hessians[i], A);
+		eigen_decomposition_analytic(A, Van, dan);
+
+		// The order is undefined when two eigenvalues have almost the same magnitude
+		const float maxEigenvalue = fabs(dql[2]);
+		if(fabs(dql[1])-fabs(dql[0]) < 1e-3f*maxEigenvalue || fabs(dql[2])-fabs(dql[1]) < 1e-3f*maxEigenvalue)
+			continue;
+		compared++;
+		for(int j = 0; j < 3; j++) {
+			if(fabs(dql[j]-dan[j]) > 1e-4f*maxEigenvalue)
+				eigenvalueErrors++;
+			// Eigenvectors are only defined up to sign and when the eigenvalue is well separated
+			const float gap = std::min(fabs(dql[j]-dql[(j+1)%3]), fabs(dql[j]-dql[(j+2)%3]));
+			if(gap < 1e-2f*maxEigenvalue)
+				continue;
+			const float cosine = Vql[0][j]*Van[0][j] + Vql[1][j]*Van[1][j] + Vql[2][j]*Van[2][j];
+			if(fabs(cosine) < 0.999f)
+				eigenvectorErrors++;
+		}
+	}
+	EXPECT_GT(compared, (int)hessians.size()/6/2);
+	EXPECT_EQ(0, eigenvalueErrors);
+	EXPECT_EQ(0, eigenvectorErrors);
+}
+
+TEST(EigenanalysisTest, AnalyticSolverDegenerateMatrices) {
+	float zero[3][3] = {{0,0,0},{0,0,0},{0,0,0}};
+	float diagonal[3][3] = {{-3,0,0},{0,1,0},{0,0,2}};
+	float repeated[3][3] = {{2,1,1},{1,2,1},{1,1,2}}; // Eigenvalues 1, 1 and 4
+	float V[3][3], d[3];
+
+	eigen_decomposition_analytic(zero, V, d);
+	EXPECT_EQ(0.0f, d[0]);
+	EXPECT_EQ(1.0f, V[0][0]);
+
+	eigen_decomposition_analytic(diagonal, V, d);
+	EXPECT_FLOAT_EQ(1.0f, d[0]);
+	EXPECT_FLOAT_EQ(2.0f, d[1]);
+	EXPECT_FLOAT_EQ(-3.0f, d[2]);
+	EXPECT_FLOAT_EQ(1.0f, V[1][0]);
+	EXPECT_FLOAT_EQ(1.0f, V[0][2]);
+
+	eigen_decomposition_analytic(repeated, V, d);
+	EXPECT_NEAR(1.0f, d[0], 1e-5f);
+	EXPECT_NEAR(1.0f, d[1], 1e-5f);
+	EXPECT_NEAR(4.0f, d[2], 1e-5f);
+	for(int i = 0; i < 3; i++) {
+		for(int j = 0; j < 3; j++) {
+			const float product = V[0][i]*V[0][j] + V[1][i]*V[1][j] + V[2][i]*V[2][j];
+			EXPECT_NEAR(i == j ? 1.0f : 0.0f, product, 1e-5f);
+		}
+	}
+}
+
+// Voxels per second of both solvers, printed if the timing parameter is set
+TEST(EigenanalysisTest, SolverThroughput) {
+	paramList parameters = initParameters(PARAMETERS_DIR);
+	std::vector<float> hessians = getSyntheticHessians();
+	ASSERT_GT(hessians.size(), 0u);
+	const int voxels = hessians.size()/6;
+	for(int solver = 0; solver < 2; solver++) {
+		float sum = 0.0f;
+		std::clock_t start = std::clock();
+		for(int i = 0; i < voxels; i++) {
+			float A[3][3], V[3][3], d[3];
+			toMatrix(&hessians[i*6], A);
+			if(solver == 0) {
+				eigen_decomposition_ql(A, V, d);
+			} else {
+				eigen_decomposition_analytic(A, V, d);
+			}
+			sum += d[0] + V[0][0];
+		}
+		const double seconds = (double)(std::clock() - start) / CLOCKS_PER_SEC;
+		EXPECT_FALSE(sum != sum);
+		if(getParamBool(parameters, "timing")) {
+			std::cout << "RUNTIME of " << (solver == 0 ? "QL" : "closed form") << " eigen solver: " <<
+					voxels << " voxels, " << (seconds > 0 ? voxels / seconds : 0) << " voxels/s" << std::endl;
+		}
+	}
+}
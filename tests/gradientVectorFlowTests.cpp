@@ -0,0 +1,150 @@
+#include "tests.hpp"
+
+// Tests for the GVF solvers
+
+// Direct implementation of the GVF3DIteration kernel
+static void referenceGVF(std::vector<float> field[3], SIPL::int3 size, float mu, int iterations) {
+	const int totalSize = size.x*size.y*size.z;
+	std::vector<float> init[3] = {field[0], field[1], field[2]};
+	for(int i = 0; i < iterations; i++) {
+		std::vector<float> result[3] = {field[0], field[1], field[2]};
+		for(int z = 0; z < size.z; z++) {
+		for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			int px = x == 0 ? 2 : (x >= size.x-1 ? size.x-3 : x);
+			int py = y == 0 ? 2 : (y >= size.y-1 ? size.y-3 : y);
+			int pz = z == 0 ? 2 : (z >= size.z-1 ? size.z-3 : z);
+			int p = px+py*size.x+pz*size.x*size.y;
+			float sqrMag = init[0][p]*init[0][p]+init[1][p]*init[1][p]+init[2][p]*init[2][p];
+			for(int c = 0; c < 3; c++) {
+				std::vector<float> &v = field[c];
+				float laplacian = v[p+1]+v[p-1]+v[p+size.x]+v[p-size.x]+
+						v[p+size.x*size.y]+v[p-size.x*size.y]-6*v[p];
+				result[c][x+y*size.x+z*size.x*size.y] = v[p] + mu*laplacian - (v[p]-init[c][p])*sqrMag;
+			}
+		}}}
+		for(int c = 0; c < 3; c++)
+			field[c] = result[c];
+	}
+}
+
+static std::vector<float> createRandomComponent(int totalSize, int seed) {
+	std::vector<float> component(totalSize);
+	srand(seed);
+	for(int i = 0; i < totalSize; i++)
+		component[i] = (rand() % 2000 - 1000) / 2000.0f;
+	return component;
+}
+
+TEST(GradientVectorFlowTest, NativeGVFMatchesKernel) {
+	SIPL::int3 size(12, 10, 9);
+	const int totalSize = size.x*size.y*size.z;
+	std::vector<float> reference[3];
+	for(int c = 0; c < 3; c++)
+		reference[c] = createRandomComponent(totalSize, c);
+	std::vector<float> blocked[3] = {reference[0], reference[1], reference[2]};
+	std::vector<float> unblocked[3] = {reference[0], reference[1], reference[2]};
+
+	referenceGVF(reference, size, 0.1f, 7);
+	float * blockedFields[3] = {&blocked[0][0], &blocked[1][0], &blocked[2][0]};
+	runNativeGVF(blockedFields, size, 0.1f, 7, 3);
+	float * unblockedFields[3] = {&unblocked[0][0], &unblocked[1][0], &unblocked[2][0]};
+	runNativeGVF(unblockedFields, size, 0.1f, 7, 1);
+
+	for(int c = 0; c < 3; c++) {
+		for(int i = 0; i < totalSize; i++) {
+			ASSERT_NEAR(reference[c][i], blocked[c][i], 1e-5f);
+			ASSERT_NEAR(reference[c][i], unblocked[c][i], 1e-5f);
+		}
+	}
+}
+
+TEST(GradientVectorFlowTest, NativeGVF16bit) {
+	SIPL::int3 size(8, 8, 8);
+	const int totalSize = size.x*size.y*size.z;
+	std::vector<float> reference[3];
+	std::vector<short> fields16bit[3];
+	for(int c = 0; c < 3; c++) {
+		reference[c] = createRandomComponent(totalSize, c+3);
+		fields16bit[c] = std::vector<short>(totalSize);
+		for(int i = 0; i < totalSize; i++)
+			fields16bit[c][i] = (short)(reference[c][i]*32767.0f);
+	}
+
+	referenceGVF(reference, size, 0.05f, 10);
+	short * fields[3] = {&fields16bit[0][0], &fields16bit[1][0], &fields16bit[2][0]};
+	runNativeGVF(fields, size, 0.05f, 10, 2);
+
+	for(int c = 0; c < 3; c++) {
+		for(int i = 0; i < totalSize; i++)
+			ASSERT_NEAR(reference[c][i], fields16bit[c][i]/32767.0f, 1e-3f);
+	}
+}
+
+// Runs the OpenCL GVF solvers on the vector field of a tube along z
+class GradientVectorFlowTube : public OpenCLTest {
+protected:
+	GradientVectorFlowTube() : OpenCLTest(SIPL::int3(16,16,16)) {};
+	virtual void setParameters() {
+		setParameter(parameters, "gvf-mu", "0.15");
+		setParameter(parameters, "gvf-iterations", "1000");
+	};
+	// GVF of the gradient of a Gaussian tube, as float4 per voxel
+	std::vector<float> runTubeGVF(bool multigrid) {
+		const int totalSize = size.x*size.y*size.z;
+		const float sigma = 2.0f;
+		std::vector<float> field(4*totalSize, 0.0f);
+		for(int z = 0; z < size.z; z++) {
+		for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			const float dx = x - size.x/2 + 0.5f;
+			const float dy = y - size.y/2 + 0.5f;
+			const float intensity = exp(-(dx*dx+dy*dy)/(2*sigma*sigma));
+			const int i = x+y*size.x+z*size.x*size.y;
+			field[i*4] = -intensity*dx/(sigma*sigma);
+			field[i*4+1] = -intensity*dy/(sigma*sigma);
+		}}}
+		// The solvers delete the initial vector field
+		Image3D * vectorField = new Image3D(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_RGBA, CL_FLOAT), size.x, size.y, size.z, 0, 0, &field[0]);
+		ocl->GC->addMemoryObject(vectorField);
+		Image3D result;
+		if(multigrid) {
+			result = runMGGVF(*ocl, vectorField, parameters, size);
+		} else {
+			result = runGVF(*ocl, vectorField, parameters, size, false);
+		}
+		ocl->queue.enqueueReadImage(result, CL_TRUE, oul::createOrigoRegion(), oul::createRegion(size.x, size.y, size.z), 0, 0, &field[0]);
+		return field;
+	}
+};
+
+TEST_F(GradientVectorFlowTube, SparseGVFMatchesDense) {
+	std::vector<float> dense = runTubeGVF(false);
+	const float threshold = 0.00001f;
+	setParameter(parameters, "gvf-sparse-threshold", "0.00001");
+	std::vector<float> sparse = runTubeGVF(false);
+
+	// A skipped brick misses updates below the threshold in each iteration
+	const float tolerance = threshold*getParam(parameters, "gvf-iterations");
+	for(unsigned int i = 0; i < dense.size(); i += 4) {
+		for(int c = 0; c < 3; c++)
+			ASSERT_NEAR(dense[i+c], sparse[i+c], tolerance);
+	}
+}
+
+TEST_F(GradientVectorFlowTube, MultigridGVFMatchesIterations) {
+	// 1000 iterations have converged for this size and mu
+	std::vector<float> iterative = runTubeGVF(false);
+	setParameter(parameters, "gvf-iterations", "20");
+	setParameter(parameters, "gvf-mg-tolerance", "0.001");
+	std::vector<float> multigrid = runTubeGVF(true);
+
+	// The border voxels are excluded, as the solvers handle the border differently
+	for(int z = 1; z < size.z-1; z++) {
+	for(int y = 1; y < size.y-1; y++) {
+	for(int x = 1; x < size.x-1; x++) {
+		const int i = 4*(x+y*size.x+z*size.x*size.y);
+		for(int c = 0; c < 3; c++)
+			ASSERT_NEAR(iterative[i+c], multigrid[i+c], 0.01f);
+	}}}
+}
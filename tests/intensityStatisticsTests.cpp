@@ -0,0 +1,59 @@
+#include "tests.hpp"
+
+// Tests for the intensity statistics used to find the intensity limits
+
+TEST(IntensityStatisticsTest, MinimumMaximumAndPercentiles) {
+	short * data = new short[2001];
+	for(int i = 0; i < 2001; i++)
+		data[i] = i - 1000;
+	IntensityStatistics statistics = computeIntensityStatistics(data, "MET_SHORT", 2001);
+	EXPECT_EQ(-1000.0f, statistics.getMinimum());
+	EXPECT_EQ(1000.0f, statistics.getMaximum());
+	EXPECT_EQ(2001, statistics.getCount());
+	EXPECT_NEAR(0.0f, statistics.getPercentile(50), 1.0f);
+	EXPECT_NEAR(-980.0f, statistics.getPercentile(1), 1.0f);
+	EXPECT_EQ(-1000.0f, statistics.getPercentile(0));
+	EXPECT_EQ(1000.0f, statistics.getPercentile(100));
+	delete[] data;
+}
+
+TEST(IntensityStatisticsTest, PercentileLimits) {
+	paramList parameters = initParameters(PARAMETERS_DIR);
+	unsigned char * data = new unsigned char[256];
+	for(int i = 0; i < 256; i++)
+		data[i] = i;
+	IntensityStatistics statistics = computeIntensityStatistics(data, "MET_UCHAR", 256);
+	setParameter(parameters, "minimum", "p0");
+	setParameter(parameters, "maximum", "off");
+	EXPECT_TRUE(needsIntensityStatistics(parameters));
+	float minimum, maximum;
+	getIntensityLimits(parameters, &statistics, &minimum, &maximum);
+	EXPECT_EQ(0.0f, minimum);
+	EXPECT_EQ(255.0f, maximum);
+	EXPECT_FALSE(isFixedIntensityLimit("p0"));
+	EXPECT_FALSE(isFixedIntensityLimit("off"));
+	EXPECT_TRUE(isFixedIntensityLimit("-1024"));
+
+	setParameter(parameters, "minimum", "10");
+	setParameter(parameters, "maximum", "20");
+	EXPECT_FALSE(needsIntensityStatistics(parameters));
+	getIntensityLimits(parameters, NULL, &minimum, &maximum);
+	EXPECT_EQ(10.0f, minimum);
+	EXPECT_EQ(20.0f, maximum);
+	delete[] data;
+}
+
+TEST(IntensityStatisticsTest, SaveAndLoadKeepLimitsExact) {
+	float data[3] = {-0.123456789f, 3.14159274f, 1234.56789f};
+	IntensityStatistics statistics = computeIntensityStatistics(data, "MET_FLOAT", 3);
+	std::string filename = "intensityStatisticsTest.txt";
+	statistics.save(filename, "key");
+
+	IntensityStatistics loaded;
+	EXPECT_FALSE(loaded.load(filename, "another key"));
+	ASSERT_TRUE(loaded.load(filename, "key"));
+	EXPECT_EQ(statistics.getMinimum(), loaded.getMinimum());
+	EXPECT_EQ(statistics.getMaximum(), loaded.getMaximum());
+	EXPECT_EQ(3, loaded.getCount());
+	std::remove(filename.c_str());
+}
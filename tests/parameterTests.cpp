@@ -79,3 +79,18 @@ TEST(ParameterTest, Group) {
 	EXPECT_EQ("general", parameters.strings["mode"].getGroup());
 	EXPECT_EQ("tube-detection-filter", parameters.numerics["radius-min"].getGroup());
 }
+
+TEST(ParameterTest, ParameterGrid) {
+	TSFParameterGrid grid = TSFParameterGrid::fromString("tdf-high=0.4,0.5,0.6;min-tree-length=5,10");
+	ASSERT_EQ(2, grid.getNrOfParameters());
+	EXPECT_EQ(6, grid.getNrOfPoints());
+	EXPECT_EQ("0.4", grid.getValue(1, 0));
+	EXPECT_EQ("10", grid.getValue(1, 1));
+	EXPECT_EQ("0.6", grid.getValue(5, 0));
+
+	paramList parameters = initParameters(PARAMETERS_DIR);
+	paramList point = grid.getPoint(parameters, 3);
+	EXPECT_FLOAT_EQ(0.5, getParam(point, "tdf-high"));
+	EXPECT_FLOAT_EQ(10, getParam(point, "min-tree-length"));
+	EXPECT_THROW(TSFParameterGrid::fromString("tdf-high"), SIPL::SIPLException);
+}
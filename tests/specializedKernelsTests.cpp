@@ -0,0 +1,111 @@
+#include "tests.hpp"
+
+// Tests and benchmarks of the specialized kernels against the generic ones
+
+class SpecializedKernelsTest : public OpenCLTest {
+protected:
+	SpecializedKernelsTest() : OpenCLTest(SIPL::int3(64,64,64)) {};
+	virtual void setParameters() {
+		setParameter(parameters, "buffers-only", "true");
+		setParameter(parameters, "specialize-kernels", "true");
+	};
+	virtual void SetUp() {
+		OpenCLTest::SetUp();
+		const int totalSize = size.x*size.y*size.z;
+		volumeData.resize(totalSize*4);
+		srand(0);
+		for(unsigned int i = 0; i < volumeData.size(); i++)
+			volumeData[i] = (rand() % 2000 - 1000) / 1000.0f;
+		volume = Image3D(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_R, CL_FLOAT), size.x, size.y, size.z, 0, 0, &volumeData[0]);
+		vectorField = Image3D(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_RGBA, CL_FLOAT), size.x, size.y, size.z, 0, 0, &volumeData[0]);
+	};
+	// Mean runtime in ms of a number of launches of a kernel
+	double getRuntime(Kernel &kernel, int launches) {
+		cl::Event startEvent, endEvent;
+		cl_ulong start, end;
+		ocl->queue.finish();
+		ocl->queue.enqueueMarker(&startEvent);
+		for(int i = 0; i < launches; i++)
+			ocl->queue.enqueueNDRangeKernel(kernel, NullRange, NDRange(size.x,size.y,size.z), NDRange(4,4,4));
+		ocl->queue.enqueueMarker(&endEvent);
+		ocl->queue.finish();
+		startEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &start);
+		endEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &end);
+		return (end-start)*1.0e-6 / launches;
+	}
+	// Runs the generic and the specialized kernel and compares the float buffer
+	// written as argument resultArgument. The runtimes are printed if timing is set.
+	void compare(Kernel &generic, Kernel &specialized, int resultArgument, std::string name) {
+		const int totalSize = size.x*size.y*size.z;
+		Buffer genericResult(ocl->context, CL_MEM_READ_WRITE, sizeof(float)*totalSize);
+		Buffer specializedResult(ocl->context, CL_MEM_READ_WRITE, sizeof(float)*totalSize);
+		generic.setArg(resultArgument, genericResult);
+		specialized.setArg(resultArgument, specializedResult);
+		if(getParamBool(parameters, "timing")) {
+			const double genericRuntime = getRuntime(generic, 10);
+			const double specializedRuntime = getRuntime(specialized, 10);
+			std::cout << "RUNTIME of " << name << ": generic " << genericRuntime << " ms specialized " << specializedRuntime << " ms" << std::endl;
+		} else {
+			ocl->queue.enqueueNDRangeKernel(generic, NullRange, NDRange(size.x,size.y,size.z), NDRange(4,4,4));
+			ocl->queue.enqueueNDRangeKernel(specialized, NullRange, NDRange(size.x,size.y,size.z), NDRange(4,4,4));
+		}
+
+		std::vector<float> genericData(totalSize), specializedData(totalSize);
+		ocl->queue.enqueueReadBuffer(genericResult, CL_TRUE, 0, sizeof(float)*totalSize, &genericData[0]);
+		ocl->queue.enqueueReadBuffer(specializedResult, CL_TRUE, 0, sizeof(float)*totalSize, &specializedData[0]);
+		for(int i = 0; i < totalSize; i++)
+			ASSERT_NEAR(genericData[i], specializedData[i], 1e-5f);
+	}
+	std::vector<float> volumeData;
+	Image3D volume;
+	Image3D vectorField;
+};
+
+TEST_F(SpecializedKernelsTest, ToFloat) {
+	Kernel generic(ocl->program, "toFloat");
+	Kernel specialized = getSpecializedKernel(*ocl, "toFloat", getKernelDefine("DATASET_TYPE", 3), parameters);
+	Kernel * kernels[2] = {&generic, &specialized};
+	for(int i = 0; i < 2; i++) {
+		kernels[i]->setArg(0, volume);
+		kernels[i]->setArg(2, -0.5f);
+		kernels[i]->setArg(3, 0.5f);
+		kernels[i]->setArg(4, 3);
+	}
+	compare(generic, specialized, 1, "toFloat");
+}
+
+TEST_F(SpecializedKernelsTest, BlurVolumeWithGaussian) {
+	int maskSize = 1;
+	float * mask = createBlurMask(1.0f, &maskSize);
+	Buffer blurMask(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*(maskSize*2+1)*(maskSize*2+1)*(maskSize*2+1), mask);
+	Kernel generic(ocl->program, "blurVolumeWithGaussian");
+	Kernel specialized = getSpecializedKernel(*ocl, "blurVolumeWithGaussian", getKernelDefine("BLUR_MASK_SIZE", maskSize), parameters);
+	Kernel * kernels[2] = {&generic, &specialized};
+	for(int i = 0; i < 2; i++) {
+		kernels[i]->setArg(0, volume);
+		kernels[i]->setArg(2, maskSize);
+		kernels[i]->setArg(3, blurMask);
+	}
+	compare(generic, specialized, 1, "blurVolumeWithGaussian");
+	delete[] mask;
+}
+
+TEST_F(SpecializedKernelsTest, CircleFittingTDF) {
+	const int totalSize = size.x*size.y*size.z;
+	Kernel generic(ocl->program, "circleFittingTDF");
+	Kernel specialized = getSpecializedKernel(*ocl, "circleFittingTDF",
+			getKernelDefine("TDF_RADIUS_MIN", 0.5f) + getKernelDefine("TDF_RADIUS_MAX", 3.0f) + getKernelDefine("TDF_RADIUS_STEP", 0.5f),
+			parameters);
+	Buffer radius(ocl->context, CL_MEM_READ_WRITE, sizeof(float)*totalSize);
+	Kernel * kernels[2] = {&generic, &specialized};
+	for(int i = 0; i < 2; i++) {
+		kernels[i]->setArg(0, vectorField);
+		kernels[i]->setArg(2, radius);
+		kernels[i]->setArg(3, 0.5f);
+		kernels[i]->setArg(4, 3.0f);
+		kernels[i]->setArg(5, 0.5f);
+		kernels[i]->setArg(6, 1);
+		kernels[i]->setArg(7, 0);
+	}
+	compare(generic, specialized, 1, "circleFittingTDF");
+}
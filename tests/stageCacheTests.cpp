@@ -0,0 +1,62 @@
+#include "tests.hpp"
+
+// Tests for the stage cache of the vector field, TDF and radius
+
+TEST(StageCacheTest, WriteAndOpen) {
+	SIPL::int3 size(5,4,3);
+	std::vector<float> radius(size.x*size.y*size.z);
+	std::vector<short> vectorField(size.x*size.y*size.z*4);
+	for(unsigned int i = 0; i < radius.size(); i++)
+		radius[i] = i*0.5f;
+	for(unsigned int i = 0; i < vectorField.size(); i++)
+		vectorField[i] = i - 100;
+	std::vector<StageCacheVolume> volumes(2);
+	volumes[0].channelOrder = CL_RGBA;
+	volumes[0].channelType = CL_SNORM_INT16;
+	volumes[0].elementSize = 4*sizeof(short);
+	volumes[0].data = &vectorField[0];
+	volumes[1].channelOrder = CL_R;
+	volumes[1].channelType = CL_FLOAT;
+	volumes[1].elementSize = sizeof(float);
+	volumes[1].data = &radius[0];
+	std::string filename = "stageCacheTest.tsfcache";
+	StageCacheFile::write(filename, "key", size, SIPL::int3(1,2,3), SIPL::float3(0.5f,1.0f,2.0f), volumes);
+
+	StageCacheFile file;
+	EXPECT_FALSE(file.open(filename, "another key"));
+	ASSERT_TRUE(file.open(filename, "key"));
+	ASSERT_EQ(2, file.getNrOfVolumes());
+	EXPECT_EQ(3, file.getSize().z);
+	EXPECT_EQ(2, file.getShiftVector().y);
+	EXPECT_EQ(2.0f, file.getSpacing().z);
+	EXPECT_EQ(0, (long)file.getVolume(0).data % STAGE_CACHE_ALIGNMENT);
+	EXPECT_EQ((unsigned int)CL_SNORM_INT16, file.getVolume(0).channelType);
+	EXPECT_EQ(0, memcmp(&vectorField[0], file.getVolume(0).data, vectorField.size()*sizeof(short)));
+	EXPECT_EQ(0, memcmp(&radius[0], file.getVolume(1).data, radius.size()*sizeof(float)));
+	file.close();
+	std::remove(filename.c_str());
+}
+
+TEST(StageCacheTest, KeyDependsOnUpstreamParametersOnly) {
+	paramList parameters = initParameters(PARAMETERS_DIR);
+	std::string datasetKey = getStageCacheKey("source", parameters, STAGE_CACHE_DATASET);
+	std::string tdfKey = getStageCacheKey("source", parameters, STAGE_CACHE_TDF);
+	EXPECT_NE(datasetKey, tdfKey);
+	EXPECT_NE(tdfKey, getStageCacheKey("another source", parameters, STAGE_CACHE_TDF));
+
+	setParameter(parameters, "tdf-high", "0.8");
+	setParameter(parameters, "min-tree-length", "20");
+	setParameter(parameters, "tdf-only", "true");
+	EXPECT_EQ(tdfKey, getStageCacheKey("source", parameters, STAGE_CACHE_TDF));
+
+	setParameter(parameters, "fused-vector-field", "true");
+	EXPECT_EQ(datasetKey, getStageCacheKey("source", parameters, STAGE_CACHE_DATASET));
+	EXPECT_NE(tdfKey, getStageCacheKey("source", parameters, STAGE_CACHE_TDF));
+
+	setParameter(parameters, "gvf-mu", "0.1");
+	EXPECT_EQ(datasetKey, getStageCacheKey("source", parameters, STAGE_CACHE_DATASET));
+	EXPECT_NE(tdfKey, getStageCacheKey("source", parameters, STAGE_CACHE_TDF));
+
+	setParameter(parameters, "cropping", "lung");
+	EXPECT_NE(datasetKey, getStageCacheKey("source", parameters, STAGE_CACHE_DATASET));
+}
@@ -3,6 +3,12 @@
 // Include all the tests here
 #include "TSFOutputTests.cpp"
 #include "parameterTests.cpp"
+#include "intensityStatisticsTests.cpp"
+#include "gradientVectorFlowTests.cpp"
+#include "tubeDetectionFilterTests.cpp"
+#include "stageCacheTests.cpp"
+#include "eigenanalysisTests.cpp"
+#include "specializedKernelsTests.cpp"
 #include "tubeSegmentationTests.cpp"
 #include "clinicalTests.cpp"
 
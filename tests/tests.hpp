@@ -6,7 +6,34 @@
 #include "../tube-segmentation.cpp"
 #include "../parameters.hpp"
 #include "../SIPL/Exceptions.hpp"
-#include "tubeValidation.cpp"
+#include "../tubeValidation.hpp"
 #include "tsf-config.h"
 
+/*
+ * Fixture of the tests that run the OpenCL parts directly on a volume of the
+ * given size. Vector fields are 32 bit and timing is enabled. Parameters that
+ * change the OpenCL setup are set in setParameters.
+ */
+class OpenCLTest : public ::testing::Test {
+protected:
+	OpenCLTest(SIPL::int3 size) : size(size) {};
+	virtual void SetUp() {
+		parameters = initParameters(PARAMETERS_DIR);
+		setParameter(parameters, "16bit-vectors", "false");
+		setParameter(parameters, "timing", "true");
+		setParameters();
+		output = new TSFOutput(getDeviceCriteria(parameters), new SIPL::int3(size));
+		ocl = setupOpenCL(output, parameters, KERNELS_DIR);
+	};
+	virtual void TearDown() {
+		delete ocl;
+		delete output;
+	};
+	virtual void setParameters() {};
+	paramList parameters;
+	SIPL::int3 size;
+	TSFOutput * output;
+	OpenCL * ocl;
+};
+
 #endif /* TESTS_HPP_ */
@@ -0,0 +1,85 @@
+#include "tests.hpp"
+
+// Tests for the circle fitting TDF
+
+class CircleFittingTDFTest : public OpenCLTest {
+protected:
+	CircleFittingTDFTest() : OpenCLTest(SIPL::int3(32,32,32)) {};
+	virtual void SetUp() {
+		OpenCLTest::SetUp();
+
+		// Vector field of a Gaussian tube along z, normalized like createVectorField does
+		const int totalSize = size.x*size.y*size.z;
+		const float sigma = 3.0f;
+		const float Fmax = getParam(parameters, "fmax");
+		field.resize(4*totalSize);
+		for(int z = 0; z < size.z; z++) {
+		for(int y = 0; y < size.y; y++) {
+		for(int x = 0; x < size.x; x++) {
+			const float dx = x - size.x/2 + 0.5f;
+			const float dy = y - size.y/2 + 0.5f;
+			const float intensity = exp(-(dx*dx+dy*dy)/(2*sigma*sigma));
+			float F[2] = {-intensity*dx/(sigma*sigma), -intensity*dy/(sigma*sigma)};
+			const float length = sqrt(F[0]*F[0]+F[1]*F[1]);
+			const float scale = length < Fmax ? 1.0f/Fmax : 1.0f/length;
+			const int i = x+y*size.x+z*size.x*size.y;
+			field[i*4] = F[0]*scale;
+			field[i*4+1] = F[1]*scale;
+			field[i*4+2] = 0.0f;
+			field[i*4+3] = 1.0f;
+		}}}
+		vectorField = Image3D(ocl->context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_RGBA, CL_FLOAT), size.x, size.y, size.z, 0, 0, &field[0]);
+	};
+	// Component c of the vector field with the position clamped to the volume like the sampler does
+	float getField(int x, int y, int z, int c) {
+		x = std::min(std::max(x, 0), size.x-1);
+		y = std::min(std::max(y, 0), size.y-1);
+		z = std::min(std::max(z, 0), size.z-1);
+		return field[4*(x+y*size.x+z*size.x*size.y)+c];
+	}
+	std::vector<float> field;
+	Image3D vectorField;
+};
+
+TEST_F(CircleFittingTDFTest, SparseMatchesDenseOnPlausibleVoxels) {
+	const int totalSize = size.x*size.y*size.z;
+	const float threshold = 0.01f;
+	Buffer TDF[2], radius[2];
+	for(int i = 0; i < 2; i++) {
+		TDF[i] = Buffer(ocl->context, CL_MEM_READ_WRITE, sizeof(float)*totalSize);
+		radius[i] = Buffer(ocl->context, CL_MEM_READ_WRITE, sizeof(float)*totalSize);
+	}
+	runCircleFittingTDF(*ocl, size, &vectorField, &TDF[0], &radius[0], 0.5f, 6.0f, 0.5f, parameters);
+	setParameter(parameters, "tdf-sparse-threshold", "0.01");
+	runSparseCircleFittingTDF(*ocl, size, &vectorField, &TDF[1], &radius[1], 0.5f, 6.0f, 0.5f, parameters);
+	std::vector<float> denseTDF(totalSize), sparseTDF(totalSize), denseRadius(totalSize), sparseRadius(totalSize);
+	ocl->queue.enqueueReadBuffer(TDF[0], CL_TRUE, 0, sizeof(float)*totalSize, &denseTDF[0]);
+	ocl->queue.enqueueReadBuffer(TDF[1], CL_TRUE, 0, sizeof(float)*totalSize, &sparseTDF[0]);
+	ocl->queue.enqueueReadBuffer(radius[0], CL_TRUE, 0, sizeof(float)*totalSize, &denseRadius[0]);
+	ocl->queue.enqueueReadBuffer(radius[1], CL_TRUE, 0, sizeof(float)*totalSize, &sparseRadius[0]);
+
+	// A voxel is plausible if the divergence of the vector field is below -threshold
+	int plausibleVoxels = 0;
+	for(int z = 0; z < size.z; z++) {
+	for(int y = 0; y < size.y; y++) {
+	for(int x = 0; x < size.x; x++) {
+		const float divergence = 0.5f*(
+				getField(x+1,y,z,0) - getField(x-1,y,z,0) +
+				getField(x,y+1,z,1) - getField(x,y-1,z,1) +
+				getField(x,y,z+1,2) - getField(x,y,z-1,2));
+		// Rounding on the device may decide voxels at the threshold differently
+		if(fabs(divergence + threshold) < 1e-5f)
+			continue;
+		const int i = x+y*size.x+z*size.x*size.y;
+		if(divergence < -threshold) {
+			EXPECT_EQ(denseTDF[i], sparseTDF[i]);
+			EXPECT_EQ(denseRadius[i], sparseRadius[i]);
+			plausibleVoxels++;
+		} else {
+			EXPECT_EQ(0.0f, sparseTDF[i]);
+			EXPECT_EQ(0.0f, sparseRadius[i]);
+		}
+	}}}
+	EXPECT_LT(0, plausibleVoxels);
+	EXPECT_GT(totalSize, plausibleVoxels);
+}
@@ -6,6 +6,65 @@ TEST(TubeSegmentation, WrongFilenameException) {
 	ASSERT_THROW(run("somefilethatdoesntexist.mhd", parameters, KERNELS_DIR), SIPL::IOException);
 }
 
+TEST(TubeSegmentation, InMemoryUnsupportedTypeException) {
+	paramList parameters = initParameters(PARAMETERS_DIR);
+	float * voxels = new float[4*4*4]();
+	ASSERT_THROW(run(voxels, SIPL::int3(4,4,4), SIPL::float3(1,1,1), "MET_DOUBLE", parameters, KERNELS_DIR), SIPL::SIPLException);
+	delete[] voxels;
+}
+
+TEST(TubeSegmentation, ReadZlibCompressedDataset) {
+	// A zlib compressed copy of the synthetic data gives the same dataset
+	std::string path = std::string(TESTDATA_DIR) + "/synthetic/dataset_1/";
+	std::string compressedFilename = std::string(TESTTEMP_DIR) + "/compressedDatasetTest.zraw";
+	std::string mhdFilename = std::string(TESTTEMP_DIR) + "/compressedDatasetTest.mhd";
+	{
+		std::ifstream rawFile((path + "noisy0.raw").c_str(), std::ios_base::in | std::ios_base::binary);
+		std::ofstream compressedFile(compressedFilename.c_str(), std::ios_base::out | std::ios_base::binary);
+		boost::iostreams::filtering_ostream stream;
+		stream.push(boost::iostreams::zlib_compressor());
+		stream.push(compressedFile);
+		stream << rawFile.rdbuf();
+	}
+	{
+		std::ofstream mhdFile(mhdFilename.c_str());
+		mhdFile << "NDims = 3" << std::endl;
+		mhdFile << "DimSize = 100 100 100" << std::endl;
+		mhdFile << "ElementType = MET_UCHAR" << std::endl;
+		mhdFile << "CompressedData = True" << std::endl;
+		mhdFile << "ElementDataFile = compressedDatasetTest.zraw" << std::endl;
+	}
+
+	paramList parameters = initParameters(PARAMETERS_DIR);
+	// Don't write statistics next to the test data
+	setParameter(parameters, "intensity-statistics-cache", "false");
+	TSFOutput output(getDeviceCriteria(parameters), new SIPL::int3);
+	OpenCL * ocl = setupOpenCL(&output, parameters, KERNELS_DIR);
+	SIPL::int3 size, compressedSize;
+	Image3D dataset = readDatasetAndTransfer(*ocl, path + "noisy.mhd", parameters, &size, &output);
+	SIPL::int3 shiftVector = output.getShiftVector();
+	Image3D compressedDataset = readDatasetAndTransfer(*ocl, mhdFilename, parameters, &compressedSize, &output);
+	ASSERT_EQ(size.x, compressedSize.x);
+	ASSERT_EQ(size.y, compressedSize.y);
+	ASSERT_EQ(size.z, compressedSize.z);
+	EXPECT_EQ(shiftVector.x, output.getShiftVector().x);
+	EXPECT_EQ(shiftVector.y, output.getShiftVector().y);
+	EXPECT_EQ(shiftVector.z, output.getShiftVector().z);
+
+	const int totalSize = size.x*size.y*size.z;
+	float * data = new float[totalSize];
+	float * compressedData = new float[totalSize];
+	ocl->queue.enqueueReadImage(dataset, CL_FALSE, oul::createOrigoRegion(), oul::createRegion(size.x, size.y, size.z), 0, 0, data);
+	ocl->queue.enqueueReadImage(compressedDataset, CL_FALSE, oul::createOrigoRegion(), oul::createRegion(size.x, size.y, size.z), 0, 0, compressedData);
+	ocl->queue.finish();
+	EXPECT_EQ(0, memcmp(data, compressedData, sizeof(float)*totalSize));
+	delete[] data;
+	delete[] compressedData;
+	delete ocl;
+	std::remove(mhdFilename.c_str());
+	std::remove(compressedFilename.c_str());
+}
+
 
 class TubeSegmentationPCE : public ::testing::Test {
 protected:
@@ -54,6 +113,98 @@ TubeValidation runSyntheticData(paramList parameters) {
 }
 
 
+TubeValidation runSyntheticDataFromMemory(paramList parameters) {
+	std::string datasetNr = "1";
+	Volume<float> * volume = new Volume<float>((std::string(TESTDATA_DIR) + std::string("/synthetic/dataset_") + datasetNr + std::string("/noisy.mhd")).c_str());
+	TSFOutput * output;
+	output = run(volume->getData(), volume->getSize(), SIPL::float3(1,1,1), "MET_FLOAT", parameters, KERNELS_DIR);
+	delete volume;
+
+	TubeValidation result = validateTube(
+			output,
+			std::string(TESTDATA_DIR) + std::string("/synthetic/dataset_") + datasetNr + std::string("/original.mhd"),
+			std::string(TESTDATA_DIR) + std::string("/synthetic/dataset_") + datasetNr + std::string("/real_centerline.mhd")
+	);
+
+	delete output;
+	return result;
+}
+
+// The quality every configuration of the pipeline should reach on the synthetic data
+void expectSyntheticDataQuality(TubeValidation result, float maxDistance = 1.5f, float minRecall = 0.7f) {
+	EXPECT_GT(maxDistance, result.averageDistanceFromCenterline);
+	EXPECT_LT(75.0, result.percentageExtractedCenterlines);
+	EXPECT_LT(0.7, result.precision);
+	EXPECT_LT(minRecall, result.recall);
+}
+
+typedef std::vector<std::pair<std::string, std::string> > ParameterChanges;
+
+typedef struct SyntheticDataDifference {
+	float TDF; // Mean absolute difference
+	float radius; // Mean absolute difference in voxels
+	float segmentation; // Differing voxels relative to the reference segmentation size
+} SyntheticDataDifference;
+
+/*
+ * Difference between the results of a reference run and a run with the
+ * parameter changes, over the voxels where the TDF of the reference run is
+ * above tdf-high. The runs are tdf-only unless the segmentation is compared.
+ */
+SyntheticDataDifference getSyntheticDataDifference(paramList parameters, const ParameterChanges &changes, bool compareSegmentation = false) {
+	std::string filename = std::string(TESTDATA_DIR) + "/synthetic/dataset_1/noisy.mhd";
+	setParameter(parameters, "tdf-only", compareSegmentation ? "false" : "true");
+	setParameter(parameters, "storage-radius", "true");
+	TSFOutput * reference = run(filename, parameters, KERNELS_DIR);
+	for(unsigned int i = 0; i < changes.size(); i++)
+		setParameter(parameters, changes[i].first, changes[i].second);
+	TSFOutput * output = run(filename, parameters, KERNELS_DIR);
+
+	const float * referenceTDF = reference->getTDF();
+	const float * TDF = output->getTDF();
+	TSFMappedView<float> referenceRadius = reference->mapRadius();
+	TSFMappedView<float> radius = output->mapRadius();
+	const float tdfHigh = getParam(parameters, "tdf-high");
+	double tdfDifference = 0.0, radiusDifference = 0.0;
+	int tubeVoxels = 0;
+	for(int i = 0; i < referenceRadius.getTotalSize(); i++) {
+		if(referenceTDF[i] < tdfHigh)
+			continue;
+		tdfDifference += fabs(referenceTDF[i] - TDF[i]);
+		radiusDifference += fabs(referenceRadius[i] - radius[i]);
+		tubeVoxels++;
+	}
+	EXPECT_LT(0, tubeVoxels);
+	SyntheticDataDifference difference;
+	difference.TDF = tubeVoxels > 0 ? tdfDifference / tubeVoxels : 0.0f;
+	difference.radius = tubeVoxels > 0 ? radiusDifference / tubeVoxels : 0.0f;
+	difference.segmentation = 0.0f;
+	if(compareSegmentation) {
+		const char * referenceSegmentation = reference->getSegmentation();
+		const char * segmentation = output->getSegmentation();
+		int segmentationVoxels = 0, differentVoxels = 0;
+		for(int i = 0; i < referenceRadius.getTotalSize(); i++) {
+			if(referenceSegmentation[i] != 0)
+				segmentationVoxels++;
+			if(referenceSegmentation[i] != segmentation[i])
+				differentVoxels++;
+		}
+		EXPECT_LT(0, segmentationVoxels);
+		difference.segmentation = segmentationVoxels > 0 ? (float)differentVoxels / segmentationVoxels : 0.0f;
+	}
+	delete reference;
+	delete output;
+	return difference;
+}
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataFromMemory) {
+	// Volume given as a host buffer instead of a file
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	result = runSyntheticDataFromMemory(parameters);
+	expectSyntheticDataQuality(result);
+}
+
 TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataNormal) {
 	// Normal execution
 	setParameter(parameters, "buffers-only", "false");
@@ -98,6 +249,130 @@ TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticData16bitBuffers) {
 	EXPECT_LT(0.7, result.recall);
 }
 
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataMultigridGVF) {
+	// Multigrid GVF should give the same quality as the Jacobi GVF
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	setParameter(parameters, "use-fmg-gvf", "true");
+	setParameter(parameters, "gvf-iterations", "10");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+}
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataMultigridGVF16bitBuffers) {
+	// Multigrid GVF with V-cycles and 16 bit buffers
+	setParameter(parameters, "buffers-only", "true");
+	setParameter(parameters, "32bit-vectors", "false");
+	setParameter(parameters, "use-fmg-gvf", "true");
+	setParameter(parameters, "gvf-mg-cycle", "v");
+	setParameter(parameters, "gvf-iterations", "10");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+}
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataSparseGVF) {
+	// Sparse GVF should stay close to the dense GVF
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	setParameter(parameters, "gvf-sparse-threshold", "0.0001");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+}
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataSparseTDF) {
+	// The TDF is only computed where the vector field converges
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	setParameter(parameters, "tdf-sparse-threshold", "0.01");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+}
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataFusedScales) {
+	// Small and large scale TDF computed in one pass after GVF
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	setParameter(parameters, "tdf-fused-scales", "true");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+}
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataFusedVectorField) {
+	// Blur and vector field creation in one kernel
+	setParameter(parameters, "fused-vector-field", "true");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+}
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataBufferKernels) {
+	// Blur, vector field and segmentation with the buffer kernels
+	setParameter(parameters, "buffer-kernels", "true");
+	setParameter(parameters, "32bit-vectors", "true");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+}
+
+TEST_F(TubeSegmentationPCE, CoarseToFineTDFErrorWithSyntheticData) {
+	// TDF and radius of the coarse to fine radius search compared to testing all radii
+	ParameterChanges changes;
+	changes.push_back(std::make_pair("tdf-coarse-radius-step", "4"));
+	changes.push_back(std::make_pair("tdf-reduced-samples", "true"));
+	SyntheticDataDifference error = getSyntheticDataDifference(parameters, changes);
+	std::cout << "Mean TDF error: " << error.TDF << " mean radius error: " << error.radius << " voxels" << std::endl;
+	EXPECT_GT(0.05, error.TDF);
+	EXPECT_GT(0.5, error.radius);
+}
+
+// A parameter that computes the same results in another way
+typedef struct EquivalentParameter {
+	const char * name;
+	const char * value;
+	const char * vectors32bit; // 32bit-vectors of both runs
+	bool compareSegmentation; // The parameter also changes the segmentation kernels
+} EquivalentParameter;
+
+class TubeSegmentationPCEEquivalence : public TubeSegmentationPCE, public ::testing::WithParamInterface<EquivalentParameter> {
+};
+
+TEST_P(TubeSegmentationPCEEquivalence, SameResultsWithSyntheticData) {
+	const EquivalentParameter equivalent = GetParam();
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", equivalent.vectors32bit);
+	ParameterChanges changes;
+	changes.push_back(std::make_pair(equivalent.name, equivalent.value));
+	SyntheticDataDifference difference = getSyntheticDataDifference(parameters, changes, equivalent.compareSegmentation);
+	EXPECT_GT(0.01, difference.TDF);
+	EXPECT_GT(0.1, difference.radius);
+	EXPECT_GT(0.01, difference.segmentation);
+}
+
+static const EquivalentParameter equivalentParameters[] = {
+	// The fused kernel takes the best response of both scales like the separate TDF volumes
+	{"tdf-fused-scales", "true", "false", false},
+	// The blur and vector field are the same, only computed in one kernel
+	{"fused-vector-field", "true", "false", false},
+	// The buffer kernels replace the blur, vector field and segmentation kernels
+	{"buffer-kernels", "true", "true", true}
+};
+
+INSTANTIATE_TEST_CASE_P(TubeSegmentationPCE, TubeSegmentationPCEEquivalence, ::testing::ValuesIn(equivalentParameters));
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataTubeDirectionField) {
+	// Candidate filtering with the precomputed tube directions. The runtime
+	// of the centerpoint extraction with and without the field is reported.
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	setParameter(parameters, "timing", "true");
+	TubeValidation lazyResult = runSyntheticData(parameters);
+	setParameter(parameters, "tube-direction-field", "true");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result);
+	// The stored directions are only rounded to 16 bit
+	EXPECT_NEAR(lazyResult.averageDistanceFromCenterline, result.averageDistanceFromCenterline, 0.1);
+	EXPECT_NEAR(lazyResult.recall, result.recall, 0.02);
+	EXPECT_NEAR(lazyResult.precision, result.precision, 0.02);
+}
+
 TEST_F(TubeSegmentationRidge, SystemTestWithSyntheticDataNormal) {
 	// Normal execution
 	setParameter(parameters, "buffers-only", "false");
@@ -142,3 +417,72 @@ TEST_F(TubeSegmentationRidge, SystemTestWithSyntheticData16bitBuffers) {
 	EXPECT_LT(0.6, result.recall);
 }
 
+TEST_F(TubeSegmentationRidge, SystemTestWithSyntheticDataTubeDirectionField) {
+	// Ridge traversal with the precomputed tube directions
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	setParameter(parameters, "tube-direction-field", "true");
+	result = runSyntheticData(parameters);
+	expectSyntheticDataQuality(result, 0.5f, 0.6f);
+}
+
+TEST_F(TubeSegmentationRidge, ParallelTraversalMatchesSerial) {
+	// Speculative parallel traversal gives the same centerline graph
+	std::string filename = std::string(TESTDATA_DIR) + std::string("/synthetic/dataset_1/noisy.mhd");
+	setParameter(parameters, "parallel-ridge-traversal", "false");
+	TSFOutput * serial = run(filename, parameters, KERNELS_DIR);
+	setParameter(parameters, "parallel-ridge-traversal", "true");
+	TSFOutput * parallel = run(filename, parameters, KERNELS_DIR);
+
+	const std::vector<SIPL::int3> &serialVertices = serial->getCenterlineVertices();
+	const std::vector<SIPL::int3> &parallelVertices = parallel->getCenterlineVertices();
+	ASSERT_EQ(serialVertices.size(), parallelVertices.size());
+	for(unsigned int i = 0; i < serialVertices.size(); i++) {
+		EXPECT_EQ(serialVertices[i].x, parallelVertices[i].x);
+		EXPECT_EQ(serialVertices[i].y, parallelVertices[i].y);
+		EXPECT_EQ(serialVertices[i].z, parallelVertices[i].z);
+	}
+	const std::vector<SIPL::int2> &serialEdges = serial->getCenterlineEdges();
+	const std::vector<SIPL::int2> &parallelEdges = parallel->getCenterlineEdges();
+	ASSERT_EQ(serialEdges.size(), parallelEdges.size());
+	for(unsigned int i = 0; i < serialEdges.size(); i++) {
+		EXPECT_EQ(serialEdges[i].x, parallelEdges[i].x);
+		EXPECT_EQ(serialEdges[i].y, parallelEdges[i].y);
+	}
+	delete serial;
+	delete parallel;
+}
+
+
+class SyntheticDataScorer : public TSFSweepScorer {
+public:
+	std::vector<std::string> getNames() {
+		return std::vector<std::string>(1, "recall");
+	};
+	std::vector<float> score(TSFOutput * output) {
+		std::string datasetPath = std::string(TESTDATA_DIR) + std::string("/synthetic/dataset_1/");
+		TubeValidation result = validateTube(output, datasetPath + "original.mhd", datasetPath + "real_centerline.mhd");
+		return std::vector<float>(1, result.recall);
+	};
+};
+
+TEST_F(TubeSegmentationPCE, SystemTestWithSyntheticDataSweep) {
+	// Both points share the GVF and TDF and should match a normal run
+	setParameter(parameters, "buffers-only", "false");
+	setParameter(parameters, "32bit-vectors", "false");
+	SyntheticDataScorer scorer;
+	std::vector<TSFSweepResult> results = runParameterSweep(
+			std::string(TESTDATA_DIR) + std::string("/synthetic/dataset_1/noisy.mhd"),
+			parameters,
+			TSFParameterGrid::fromString("min-tree-length=5,10"),
+			KERNELS_DIR,
+			&scorer
+	);
+	ASSERT_EQ(2, results.size());
+	for(int i = 0; i < 2; i++) {
+		EXPECT_FALSE(results[i].failed);
+		ASSERT_EQ(1, results[i].measures.size());
+		EXPECT_LT(0.7, results[i].measures[0]);
+		EXPECT_EQ(results[0].upstreamRuntime, results[i].upstreamRuntime);
+	}
+}
@@ -1,13 +1,21 @@
 //#define USE_SIPL_VISUALIZATION
 #include <algorithm>
 #include <boost/iostreams/device/mapped_file.hpp>
+#include <boost/iostreams/filtering_stream.hpp>
+#include <boost/iostreams/filter/zlib.hpp>
 #include <queue>
 #include <stack>
 #include <list>
 #include <cstdio>
 #include <limits>
 #include <fstream>
+#include <sstream>
 #include <cmath>
+#include <ctime>
+#ifdef CPP11
+#include <thread>
+#include <mutex>
+#endif
 #include "tube-segmentation.hpp"
 #ifdef USE_SIPL_VISUALIZATION
 #include "SIPL/Core.hpp"
@@ -23,6 +31,11 @@
 #include "SIPL/Types.hpp"
 #include "timing.hpp"
 #include "HelperFunctions.hpp"
+#include "intensityStatistics.hpp"
+#include "stageCache.hpp"
+#include "parameterSweep.hpp"
+#include "tubeDirectionField.hpp"
+#include "specializedKernels.hpp"
 
 // Undefine windows crap
 #ifdef WIN32
@@ -50,10 +63,127 @@ void print(paramList parameters){
 	}
 }
 
+/*
+ * Stage cache. The source of the dataset is identified by the hash of its
+ * raw file or buffer, which is kept in the hidden stage-cache-source
+ * parameter while the dataset is processed. It is empty if the cache is off.
+ */
+static void readMetaImageHeader(std::string filename, std::string &typeName, std::string &rawFilename, SIPL::int3 * size, SIPL::float3 &spacing, bool &compressed);
+void runCircleFittingMethod(OpenCL &ocl, cl::Image3D * dataset, SIPL::int3 size, paramList &parameters, cl::Image3D &vectorField, cl::Image3D &TDF, cl::Image3D &radiusImage);
+
+static std::string getStageCacheSource(paramList &parameters) {
+    if(parameters.strings.count("stage-cache-source") == 0)
+        return "";
+    return parameters.strings["stage-cache-source"].get();
+}
+
+static void setStageCacheSource(paramList &parameters, std::string filename, const void * voxels, SIPL::int3 size, SIPL::float3 spacing, std::string elementType) {
+    std::string cacheDirectory = getParamStr(parameters, "stage-cache-dir");
+    std::ostringstream source;
+    if(cacheDirectory != "off") {
+        std::string hash;
+        if(voxels == NULL) {
+            std::string rawFilename;
+            bool compressed;
+            readMetaImageHeader(filename, elementType, rawFilename, &size, spacing, compressed);
+            hash = getStageCacheFileHash(cacheDirectory, rawFilename);
+        } else {
+            ::size_t elementSize = elementType == "MET_FLOAT" ? sizeof(float) : (elementType == "MET_SHORT" || elementType == "MET_USHORT" ? sizeof(short) : sizeof(char));
+            hash = getStageCacheDataHash(voxels, (::size_t)size.x*size.y*size.z*elementSize);
+        }
+        source << hash << " " << elementType << " " << size.x << " " << size.y << " " << size.z << " " << spacing.x << " " << spacing.y << " " << spacing.z;
+    }
+    StringParameter v = parameters.strings["stage-cache-source"];
+    v.setWithoutValidation(source.str());
+    parameters.strings["stage-cache-source"] = v;
+}
+
+static cl::Image3D createImageFromStageCache(OpenCL &ocl, const StageCacheFile &file, int i) {
+    const StageCacheVolume &volume = file.getVolume(i);
+    SIPL::int3 size = file.getSize();
+    return cl::Image3D(ocl.context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR,
+            cl::ImageFormat(volume.channelOrder, volume.channelType),
+            size.x, size.y, size.z, 0, 0, (void *)volume.data);
+}
+
+static void writeStageCache(OpenCL &ocl, paramList &parameters, StageCacheStage stage, std::vector<cl::Image3D> images, SIPL::int3 size, TSFOutput * output) {
+    const std::string key = getStageCacheKey(getStageCacheSource(parameters), parameters, stage);
+    const std::string filename = getStageCacheFilename(getParamStr(parameters, "stage-cache-dir"), key, stage);
+    cl::size_t<3> offset;
+    offset[0] = 0;
+    offset[1] = 0;
+    offset[2] = 0;
+    cl::size_t<3> region;
+    region[0] = size.x;
+    region[1] = size.y;
+    region[2] = size.z;
+    std::vector<std::vector<char> > data(images.size());
+    std::vector<StageCacheVolume> volumes(images.size());
+    for(unsigned int i = 0; i < images.size(); i++) {
+        cl::ImageFormat format = images[i].getImageInfo<CL_IMAGE_FORMAT>();
+        volumes[i].channelOrder = format.image_channel_order;
+        volumes[i].channelType = format.image_channel_data_type;
+        volumes[i].elementSize = images[i].getImageInfo<CL_IMAGE_ELEMENT_SIZE>();
+        data[i].resize((::size_t)volumes[i].elementSize*size.x*size.y*size.z);
+        ocl.queue.enqueueReadImage(images[i], CL_TRUE, offset, region, 0, 0, &data[i][0]);
+        volumes[i].data = &data[i][0];
+    }
+    StageCacheFile::write(filename, key, size, output->getShiftVector(), output->getSpacing(), volumes);
+}
+
+/*
+ * Resume from the deepest stage found in the cache. If the vector field, TDF
+ * and radius are cached, the dataset is not needed and is left empty.
+ */
+static bool resumeFromStageCache(OpenCL &ocl, cl::Image3D * dataset, SIPL::int3 * size, paramList &parameters, TSFOutput * output) {
+    const std::string source = getStageCacheSource(parameters);
+    if(source == "")
+        return false;
+    const std::string cacheDirectory = getParamStr(parameters, "stage-cache-dir");
+    StageCacheFile file;
+    std::string key = getStageCacheKey(source, parameters, STAGE_CACHE_TDF);
+    if(file.open(getStageCacheFilename(cacheDirectory, key, STAGE_CACHE_TDF), key)) {
+        std::cout << "NOTE: Using cached vector field, TDF and radius from " << cacheDirectory << std::endl;
+    } else {
+        key = getStageCacheKey(source, parameters, STAGE_CACHE_DATASET);
+        if(!file.open(getStageCacheFilename(cacheDirectory, key, STAGE_CACHE_DATASET), key))
+            return false;
+        std::cout << "NOTE: Using cached dataset from " << cacheDirectory << std::endl;
+        *dataset = createImageFromStageCache(ocl, file, 0);
+    }
+    *size = file.getSize();
+    output->setShiftVector(file.getShiftVector());
+    output->setSpacing(file.getSpacing());
+    return true;
+}
+
+// Run the circle fitting method or load its results from the stage cache
+static void runCircleFittingStage(OpenCL &ocl, cl::Image3D * dataset, SIPL::int3 size, paramList &parameters, TSFOutput * output, cl::Image3D &vectorField, cl::Image3D &TDF, cl::Image3D &radiusImage) {
+    const std::string source = getStageCacheSource(parameters);
+    if(source == "") {
+        runCircleFittingMethod(ocl, dataset, size, parameters, vectorField, TDF, radiusImage);
+        return;
+    }
+    const std::string key = getStageCacheKey(source, parameters, STAGE_CACHE_TDF);
+    StageCacheFile file;
+    if(file.open(getStageCacheFilename(getParamStr(parameters, "stage-cache-dir"), key, STAGE_CACHE_TDF), key) && file.getNrOfVolumes() == 3) {
+        vectorField = createImageFromStageCache(ocl, file, 0);
+        TDF = createImageFromStageCache(ocl, file, 1);
+        radiusImage = createImageFromStageCache(ocl, file, 2);
+        return;
+    }
+    runCircleFittingMethod(ocl, dataset, size, parameters, vectorField, TDF, radiusImage);
+    std::vector<cl::Image3D> images;
+    images.push_back(vectorField);
+    images.push_back(TDF);
+    images.push_back(radiusImage);
+    writeStageCache(ocl, parameters, STAGE_CACHE_TDF, images, size, output);
+}
+
 int runCounter = 0;
-TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_dir) {
 
-    INIT_TIMER
+// Select the device type. CPU devices don't use 16 bit vector fields.
+static oul::DeviceCriteria getDeviceCriteria(paramList &parameters) {
     oul::DeviceCriteria criteria;
     criteria.setDeviceCountCriteria(1);
     if(parameters.strings["device"].get() == "gpu") {
@@ -62,18 +192,22 @@ TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_
         setParameter(parameters, "16bit-vectors", "false");
         criteria.setTypeCriteria(oul::DEVICE_TYPE_CPU);
     }
-    
+    return criteria;
+}
 
-    SIPL::int3 * size = new SIPL::int3();
-    TSFOutput * output = new TSFOutput(criteria, size, getParamBool(parameters, "16bit-vectors"));
+/*
+ * Set up the OpenCL objects for the context of an output and compile the
+ * kernels. Sets 3d_write and may turn off 16bit-vectors for the platform.
+ */
+static OpenCL * setupOpenCL(TSFOutput * output, paramList &parameters, std::string kernel_dir) {
     oul::Context * c = output->getContext();
 
     OpenCL * ocl = new OpenCL;
     ocl->context = c->getContext();
 	ocl->platform = c->getPlatform();
-	ocl->queue = c->getQueue(0);
-	ocl->device = c->getDevice(0);
-	ocl->GC = c->getGarbageCollector();
+    ocl->queue = c->getQueue(0);
+    ocl->device = c->getDevice(0);
+    ocl->GC = c->getGarbageCollector();
     ocl->oulContext = *c;
 
     // Select first device
@@ -88,19 +222,32 @@ TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_
     if(ocl->platform.getInfo<CL_PLATFORM_VENDOR>().substr(0,5) == "Apple")
         setParameter(parameters, "16bit-vectors", "false");
 
+    // The buffer kernels are opt-in. They replace the blur, vector field and
+    // segmentation kernels, and imply the no 3D write kernel set.
+    const bool has3DWrite = (int)ocl->device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_3d_image_writes") > -1;
+    ocl->useBufferKernels = getParamBool(parameters, "buffer-kernels");
+
     // Compile and create program
-    if(!getParamBool(parameters, "buffers-only") && (int)ocl->device.getInfo<CL_DEVICE_EXTENSIONS>().find("cl_khr_3d_image_writes") > -1) {
+    if(!ocl->useBufferKernels && !getParamBool(parameters, "buffers-only") && has3DWrite) {
     	std::string filename = kernel_dir+"/kernels.cl";
         std::string buildOptions = "";
         if(getParamBool(parameters, "16bit-vectors")) {
         	buildOptions = "-D VECTORS_16BIT";
         }
+#ifdef ANALYTIC_EIGEN
+        buildOptions += " -D ANALYTIC_EIGEN";
+#endif
+        // For kernels_common.cl
+        buildOptions += " -I \"" + kernel_dir + "\"";
         c->createProgramFromSource(filename, buildOptions);
+        ocl->programFilename = filename;
+        ocl->programBuildOptions = buildOptions;
         BoolParameter v = parameters.bools["3d_write"];
         v.set(true);
         parameters.bools["3d_write"] = v;
     } else {
-        std::cout << "NOTE: Writing to 3D textures is not supported on the selected device." << std::endl;
+        if(!ocl->useBufferKernels)
+            std::cout << "NOTE: Writing to 3D textures is not supported on the selected device." << std::endl;
         BoolParameter v = parameters.bools["3d_write"];
         v.set(false);
         parameters.bools["3d_write"] = v;
@@ -110,10 +257,64 @@ TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_
         	buildOptions = "-D VECTORS_16BIT";
         	std::cout << "NOTE: Forcing the use of 16 bit buffers. This is slow, but uses half the memory." << std::endl;
         }
+#ifdef ANALYTIC_EIGEN
+        buildOptions += " -D ANALYTIC_EIGEN";
+#endif
+        // For kernels_common.cl
+        buildOptions += " -I \"" + kernel_dir + "\"";
         c->createProgramFromSource(filename, buildOptions);
+        ocl->programFilename = filename;
+        ocl->programBuildOptions = buildOptions;
+        if(ocl->useBufferKernels) {
+            std::cout << "NOTE: Using the buffer kernels." << std::endl;
+            if(!c->hasProgram("buffers"))
+                c->createProgramFromSourceWithName("buffers", kernel_dir+"/kernels_buffers.cl", buildOptions);
+            ocl->bufferProgram = c->getProgram("buffers");
+        }
     }
     std::cout << "program compiled" << std::endl;
     ocl->program = c->getProgram(0);
+    return ocl;
+}
+
+/*
+ * Read the dataset and transfer it to the device, or resume from the stage
+ * cache. If voxels is NULL the dataset is read from the .mhd file.
+ */
+static void readDataset(OpenCL * ocl, cl::Image3D * dataset, std::string filename, const void * voxels, SIPL::int3 voxelsSize, SIPL::float3 spacing, std::string elementType, paramList &parameters, SIPL::int3 * size, TSFOutput * output) {
+    setStageCacheSource(parameters, filename, voxels, voxelsSize, spacing, elementType);
+    if(resumeFromStageCache(*ocl, dataset, size, parameters, output))
+        return;
+    if(voxels == NULL) {
+        *dataset = readDatasetAndTransfer(*ocl, filename, parameters, size, output);
+    } else {
+        *size = voxelsSize;
+        *dataset = transferDataset(*ocl, voxels, elementType, spacing, parameters, size, output);
+    }
+    if(getStageCacheSource(parameters) != "")
+        writeStageCache(*ocl, parameters, STAGE_CACHE_DATASET, std::vector<cl::Image3D>(1, *dataset), *size, output);
+}
+
+/*
+ * Shared implementation of the two public run functions. If voxels is NULL
+ * the dataset is read from the .mhd file given by filename, otherwise the
+ * caller owned buffer is used directly.
+ */
+static TSFOutput * runFromSource(
+        std::string filename,
+        const void * voxels,
+        SIPL::int3 voxelsSize,
+        SIPL::float3 spacing,
+        std::string elementType,
+        paramList &parameters,
+        std::string kernel_dir) {
+
+    INIT_TIMER
+    oul::DeviceCriteria criteria = getDeviceCriteria(parameters);
+    SIPL::int3 * size = new SIPL::int3();
+    TSFOutput * output = new TSFOutput(criteria, size, getParamBool(parameters, "16bit-vectors"));
+    OpenCL * ocl = setupOpenCL(output, parameters, kernel_dir);
+    const unsigned int memorySize = ocl->device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
 
     if(getParamBool(parameters, "timer-total")) {
 		START_TIMER
@@ -122,7 +323,7 @@ TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_
         // Read dataset and transfer to device
         cl::Image3D * dataset = new cl::Image3D;
         ocl->GC->addMemoryObject(dataset);
-        *dataset = readDatasetAndTransfer(*ocl, filename, parameters, size, output);
+        readDataset(ocl, dataset, filename, voxels, voxelsSize, spacing, elementType, parameters, size, output);
 
         // Calculate maximum memory usage
         double totalSize = size->x*size->y*size->z;
@@ -150,7 +351,7 @@ TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_
         if(e.err() == CL_INVALID_COMMAND_QUEUE && runCounter < 2) {
             std::cout << "OpenCL error: Invalid Command Queue. Retrying..." << std::endl;
             runCounter++;
-            return run(filename,parameters,kernel_dir);
+            return runFromSource(filename,voxels,voxelsSize,spacing,elementType,parameters,kernel_dir);
         }
 
         //throw SIPL::SIPLException(str.c_str());
@@ -164,6 +365,188 @@ TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_
     return output;
 }
 
+TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_dir) {
+    return runFromSource(filename, NULL, SIPL::int3(), SIPL::float3(1,1,1), "", parameters, kernel_dir);
+}
+
+TSFOutput * run(const void * voxels, SIPL::int3 size, SIPL::float3 spacing, std::string elementType, paramList &parameters, std::string kernel_dir) {
+    if(voxels == NULL)
+    	throw SIPL::SIPLException("No voxel data given to run", __LINE__, __FILE__);
+    return runFromSource("", voxels, size, spacing, elementType, parameters, kernel_dir);
+}
+
+// Wall clock time in ms
+static double getSweepTime() {
+#ifdef CPP11
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count()*1.0e-3;
+#else
+    return (double)clock()*1000.0/CLOCKS_PER_SEC;
+#endif
+}
+
+/*
+ * Points of a parameter sweep that share the vector field, TDF and radius.
+ * The points are handed out to the workers one at a time.
+ */
+typedef struct SweepGroup {
+    std::vector<int> points;
+    std::vector<paramList> * parameters;
+    std::vector<TSFSweepResult> * results;
+    TSFSweepScorer * scorer;
+    TSFOutput * upstream;
+    cl::Image3D vectorField;
+    cl::Image3D TDF;
+    cl::Image3D radius;
+    double upstreamRuntime;
+    int next;
+#ifdef CPP11
+    std::mutex mutex;
+#endif
+} SweepGroup;
+
+static TSFSweepResult runSweepPoint(OpenCL * ocl, SweepGroup * group, int point) {
+    paramList &parameters = (*group->parameters)[point];
+    TSFSweepResult result;
+    result.point = point;
+    result.upstreamRuntime = group->upstreamRuntime;
+    result.failed = false;
+    const double start = getSweepTime();
+    TSFOutput * output = new TSFOutput(group->upstream->getContext(), new SIPL::int3(*group->upstream->getSize()), group->upstream->isTDF16bit());
+    output->setShiftVector(group->upstream->getShiftVector());
+    output->setSpacing(group->upstream->getSpacing());
+    try {
+        if(getParamStr(parameters, "centerline-method") == "ridge") {
+            runRidgeTraversalAndSegmentation(ocl, output->getSize(), parameters, output, group->vectorField, new Image3D(group->TDF), group->radius);
+        } else if(getParamStr(parameters, "centerline-method") == "gpu") {
+            runNewCenterlineAlgAndSegmentation(ocl, output->getSize(), parameters, output, group->vectorField, new Image3D(group->TDF), group->radius);
+        } else {
+            throw SIPL::SIPLException("The test centerline method can not be used in a parameter sweep", __LINE__, __FILE__);
+        }
+        ocl->queue.finish();
+        result.runtime = getSweepTime() - start;
+        if(group->scorer != NULL)
+            result.measures = group->scorer->score(output);
+    } catch(cl::Error &e) {
+        std::cout << "WARNING: OpenCL error " << e.err() << " in " << e.what() << " for sweep point " << point << std::endl;
+        result.failed = true;
+    } catch(SIPL::SIPLException &e) {
+        std::cout << "WARNING: " << e.what() << " for sweep point " << point << std::endl;
+        result.failed = true;
+    }
+    delete output;
+    return result;
+}
+
+// Each worker has its own command queue so that the points run concurrently
+static void runSweepWorker(OpenCL * ocl, SweepGroup * group) {
+    OpenCL workerOcl = *ocl;
+#ifdef CPP11
+    workerOcl.queue = cl::CommandQueue(ocl->context, ocl->device, CL_QUEUE_PROFILING_ENABLE);
+#endif
+    workerOcl.GC = new oul::GarbageCollector;
+    while(true) {
+        int point;
+        {
+#ifdef CPP11
+            std::lock_guard<std::mutex> lock(group->mutex);
+#endif
+            if(group->next == (int)group->points.size())
+                break;
+            point = group->points[group->next];
+            group->next++;
+        }
+        (*group->results)[point] = runSweepPoint(&workerOcl, group, point);
+        workerOcl.GC->deleteAllMemoryObjects();
+    }
+    delete workerOcl.GC;
+}
+
+std::vector<TSFSweepResult> runParameterSweep(std::string filename, paramList &parameters, const TSFParameterGrid &grid, std::string kernel_dir, TSFSweepScorer * scorer) {
+    // These decide how the kernels are compiled, so all points must share them
+    for(int i = 0; i < grid.getNrOfParameters(); i++) {
+        const std::string name = grid.getName(i);
+        if(name == "device" || name == "buffers-only" || name == "buffer-kernels" || name == "16bit-vectors" || name == "parameters") {
+            std::string str = "The parameter " + name + " can not be swept";
+            throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
+        }
+    }
+    const int nrOfPoints = grid.getNrOfPoints();
+    oul::DeviceCriteria criteria = getDeviceCriteria(parameters);
+    TSFOutput * upstream = new TSFOutput(criteria, new SIPL::int3(), getParamBool(parameters, "16bit-vectors"));
+    OpenCL * ocl = setupOpenCL(upstream, parameters, kernel_dir);
+
+    // Order the points so that points with the same dataset and circle
+    // fitting parameters follow each other
+    std::vector<paramList> points(nrOfPoints);
+    std::vector<std::pair<std::pair<std::string, std::string>, int> > order(nrOfPoints);
+    for(int i = 0; i < nrOfPoints; i++) {
+        points[i] = grid.getPoint(parameters, i);
+        order[i].first.first = getStageCacheKey("", points[i], STAGE_CACHE_DATASET);
+        order[i].first.second = getStageCacheKey("", points[i], STAGE_CACHE_TDF);
+        order[i].second = i;
+    }
+    std::sort(order.begin(), order.end());
+
+    std::vector<TSFSweepResult> results(nrOfPoints);
+    // The circle fitting method deletes its input, so each group gets its own
+    // copy of the dataset that was read for the first group using it
+    cl::Image3D source;
+    std::string datasetKey = "";
+    int i = 0;
+    while(i < nrOfPoints) {
+        SweepGroup group;
+        group.parameters = &points;
+        group.results = &results;
+        group.scorer = scorer;
+        group.upstream = upstream;
+        group.next = 0;
+        for(int j = i; j < nrOfPoints && order[j].first == order[i].first; j++)
+            group.points.push_back(order[j].second);
+        paramList &upstreamParameters = points[group.points[0]];
+
+        // The dataset is left empty if the results of the circle fitting
+        // method were found in the stage cache
+        const double start = getSweepTime();
+        if(order[i].first.first != datasetKey)
+            source = cl::Image3D();
+        if(source() == NULL) {
+            readDataset(ocl, &source, filename, NULL, SIPL::int3(), SIPL::float3(1,1,1), "", upstreamParameters, upstream->getSize(), upstream);
+            datasetKey = order[i].first.first;
+        }
+        cl::Image3D * dataset = new cl::Image3D;
+        ocl->GC->addMemoryObject(dataset);
+        if(source() != NULL) {
+            SIPL::int3 size = *upstream->getSize();
+            *dataset = cl::Image3D(ocl->context, CL_MEM_READ_ONLY, source.getImageInfo<CL_IMAGE_FORMAT>(), size.x, size.y, size.z);
+            ocl->queue.enqueueCopyImage(source, *dataset, oul::createOrigoRegion(), oul::createOrigoRegion(), oul::createRegion(size.x, size.y, size.z));
+        }
+        runCircleFittingStage(*ocl, dataset, *upstream->getSize(), upstreamParameters, upstream, group.vectorField, group.TDF, group.radius);
+        ocl->queue.finish();
+        group.upstreamRuntime = getSweepTime() - start;
+        std::cout << "NOTE: Sweeping " << group.points.size() << " points with the same vector field and TDF" << std::endl;
+
+        const int nrOfWorkers = std::min((int)group.points.size(), (int)getParam(parameters, "sweep-threads"));
+#ifdef CPP11
+        std::vector<std::thread> workers;
+        for(int j = 0; j < nrOfWorkers; j++)
+            workers.push_back(std::thread(runSweepWorker, ocl, &group));
+        for(int j = 0; j < nrOfWorkers; j++)
+            workers[j].join();
+#else
+        runSweepWorker(ocl, &group);
+#endif
+        i += group.points.size();
+    }
+
+    ocl->queue.finish();
+    source = cl::Image3D();
+    ocl->GC->deleteAllMemoryObjects();
+    delete ocl;
+    delete upstream;
+    return results;
+}
+
 
 
 using SIPL::float3;
@@ -211,6 +594,82 @@ float * createBlurMask(float sigma, int * maskSizePointer) {
 
     return mask;
 }
+// Work group size of createBlurredVectorField
+static const int fusedVectorFieldGroupSize = 4;
+
+/*
+ * Sets up createVectorFieldKernel as createBlurredVectorField, which blurs
+ * the volume itself, if fused-vector-field is set and the tiles fit in local
+ * memory. Otherwise it is set up as createVectorField. firstMaskArg is the
+ * index of the maskSize argument, blurMask must be kept until the kernel has
+ * been enqueued.
+ */
+static bool setupFusedVectorField(OpenCL &ocl, paramList &parameters, float blurSigma, int firstMaskArg, Kernel &createVectorFieldKernel, Buffer &blurMask) {
+    createVectorFieldKernel = Kernel(ocl.program, "createVectorField");
+    if(!getParamBool(parameters, "fused-vector-field") || blurSigma <= 0)
+        return false;
+    int maskSize = 1;
+    float * mask = createBlurMask(blurSigma, &maskSize);
+    const int volumeTileSize = fusedVectorFieldGroupSize + 2*(maskSize+1);
+    const int blurredTileSize = fusedVectorFieldGroupSize + 2;
+    const cl_ulong volumeTileBytes = sizeof(float)*volumeTileSize*volumeTileSize*volumeTileSize;
+    const cl_ulong blurredTileBytes = sizeof(float)*blurredTileSize*blurredTileSize*blurredTileSize;
+    if(volumeTileBytes + blurredTileBytes > ocl.device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>()) {
+        std::cout << "NOTE: Blur mask does not fit in local memory. Blurring in a separate pass." << std::endl;
+        delete[] mask;
+        return false;
+    }
+    blurMask = Buffer(ocl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*(maskSize*2+1)*(maskSize*2+1)*(maskSize*2+1), mask);
+    blurMask.setDestructorCallback((void (__stdcall *)(cl_mem,void *))(freeData<float>), (void *)mask);
+    createVectorFieldKernel = getSpecializedKernel(ocl, "createBlurredVectorField", getKernelDefine("BLUR_MASK_SIZE", maskSize), parameters);
+    createVectorFieldKernel.setArg(firstMaskArg, maskSize);
+    createVectorFieldKernel.setArg(firstMaskArg+1, blurMask);
+    createVectorFieldKernel.setArg(firstMaskArg+2, cl::__local(volumeTileBytes));
+    createVectorFieldKernel.setArg(firstMaskArg+3, cl::__local(blurredTileBytes));
+    return true;
+}
+
+/*
+ * Blurs the dataset and creates the vector field with the buffer kernels.
+ * The arguments of the vector field buffers are the same as for the
+ * createVectorField kernel of kernels_no_3d_write.cl.
+ */
+static void runBufferVectorField(OpenCL &ocl, Buffer &datasetBuffer, SIPL::int3 size, float blurSigma, float Fmax, int vectorSign, int maxZ, Buffer &vectorFieldBuffer, Buffer &vectorFieldBuffer2) {
+    Buffer volume = datasetBuffer;
+    if(blurSigma > 0) {
+        int maskSize = 1;
+        float * mask = createBlurMask(blurSigma, &maskSize);
+        Buffer blurMask = Buffer(ocl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*(maskSize*2+1)*(maskSize*2+1)*(maskSize*2+1), mask);
+        blurMask.setDestructorCallback((void (__stdcall *)(cl_mem,void *))(freeData<float>), (void *)mask);
+        volume = Buffer(ocl.context, CL_MEM_READ_WRITE, sizeof(float)*size.x*size.y*size.z);
+        Kernel blurVolumeWithGaussianKernel(ocl.bufferProgram, "blurVolumeWithGaussian");
+        blurVolumeWithGaussianKernel.setArg(0, datasetBuffer);
+        blurVolumeWithGaussianKernel.setArg(1, volume);
+        blurVolumeWithGaussianKernel.setArg(2, maskSize);
+        blurVolumeWithGaussianKernel.setArg(3, blurMask);
+        ocl.queue.enqueueNDRangeKernel(
+                blurVolumeWithGaussianKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NullRange
+        );
+    }
+
+    Kernel createVectorFieldKernel(ocl.bufferProgram, "createVectorField");
+    createVectorFieldKernel.setArg(0, volume);
+    createVectorFieldKernel.setArg(1, vectorFieldBuffer);
+    createVectorFieldKernel.setArg(2, vectorFieldBuffer2);
+    createVectorFieldKernel.setArg(3, Fmax);
+    createVectorFieldKernel.setArg(4, vectorSign);
+    createVectorFieldKernel.setArg(5, maxZ);
+    ocl.queue.enqueueNDRangeKernel(
+            createVectorFieldKernel,
+            NullRange,
+            NDRange(size.x,size.y,size.z),
+            NullRange
+    );
+}
+
 void runCircleFittingMethod(OpenCL &ocl, Image3D * dataset, SIPL::int3 size, paramList &parameters, Image3D &vectorField, Image3D &TDF, Image3D &radiusImage) {
     // Set up parameters
     const float radiusMin = getParam(parameters, "radius-min");
@@ -233,9 +692,19 @@ void runCircleFittingMethod(OpenCL &ocl, Image3D * dataset, SIPL::int3 size, par
     region[1] = size.y;
     region[2] = size.z;
 
+    // The buffer kernels blur the dataset from a buffer, which is copied once
+    // for both scales, and the blurred volumes are never copied to images
+    const bool useBufferKernels = no3Dwrite && ocl.useBufferKernels;
+    Buffer datasetBuffer;
+    if(useBufferKernels) {
+        datasetBuffer = Buffer(ocl.context, CL_MEM_READ_ONLY, sizeof(float)*totalSize);
+        ocl.queue.enqueueCopyImageToBuffer(*dataset, datasetBuffer, offset, region, 0);
+    }
+
     // Create kernels
     Kernel blurVolumeWithGaussianKernel(ocl.program, "blurVolumeWithGaussian");
-    Kernel createVectorFieldKernel(ocl.program, "createVectorField");
+    Kernel createVectorFieldKernel;
+    Buffer fusedBlurMask;
     Kernel combineKernel = Kernel(ocl.program, "combine");
 
     cl::Event startEvent, endEvent;
@@ -243,14 +712,39 @@ void runCircleFittingMethod(OpenCL &ocl, Image3D * dataset, SIPL::int3 size, par
     INIT_TIMER
     void * TDFsmall;
     float * radiusSmall;
+    // The small and large scale TDF are computed by one kernel after GVF
+    bool fusedScales = getParamBool(parameters, "tdf-fused-scales") &&
+            radiusMin < 2.5f && radiusMax >= 2.5f &&
+            !getParamBool(parameters, "use-spline-tdf") &&
+            getParam(parameters, "tdf-sparse-threshold") == 0;
+    if(fusedScales) {
+        // The small scale vector field stays on the device during GVF. Use
+        // the separate scales if it does not fit next to the peak memory
+        // usage estimated in runFromSource.
+        const bool smallField16bit = no3Dwrite ? getParamBool(parameters, "16bit-vectors") : !getParamBool(parameters, "32bit-vectors");
+        const double vectorTypeSize = getParamBool(parameters, "16bit-vectors") ? sizeof(short):sizeof(float);
+        const double peakSize = (double)totalSize*10.0*vectorTypeSize +
+                (double)totalSize*4*(smallField16bit ? sizeof(short):sizeof(float));
+        if(peakSize > (double)ocl.device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>()) {
+            std::cout << "NOTE: Not enough device memory to keep the small scale vector field during GVF. Computing the TDF scales separately." << std::endl;
+            fusedScales = false;
+        }
+    }
+    // Runtime of the small and large scale TDF, including transfers
+    double TDFRuntime = 0.0;
+    Image3D * vectorFieldSmall = NULL;
     if(radiusMin < 2.5f) {
-        Image3D * blurredVolume = new Image3D(ocl.context, CL_MEM_READ_WRITE, ImageFormat(CL_R, CL_FLOAT), size.x, size.y, size.z);
+        const bool fusedBlur = setupFusedVectorField(ocl, parameters, smallBlurSigma, no3Dwrite ? 6 : 4, createVectorFieldKernel, fusedBlurMask);
+        const bool bufferVectorField = useBufferKernels && !fusedBlur;
+        Image3D * blurredVolume = dataset;
+    if(smallBlurSigma > 0 && !fusedBlur && !bufferVectorField) {
+        blurredVolume = new Image3D(ocl.context, CL_MEM_READ_WRITE, ImageFormat(CL_R, CL_FLOAT), size.x, size.y, size.z);
         ocl.GC->addMemoryObject(blurredVolume);
-    if(smallBlurSigma > 0) {
     	int maskSize = 1;
 		float * mask = createBlurMask(smallBlurSigma, &maskSize);
 		Buffer blurMask = Buffer(ocl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*(maskSize*2+1)*(maskSize*2+1)*(maskSize*2+1), mask);
         blurMask.setDestructorCallback((void (__stdcall *)(cl_mem,void *))(freeData<float>), (void *)mask);
+        blurVolumeWithGaussianKernel = getSpecializedKernel(ocl, "blurVolumeWithGaussian", getKernelDefine("BLUR_MASK_SIZE", maskSize), parameters);
     	if(no3Dwrite) {
 			// Create auxillary buffer
 			Buffer blurredVolumeBuffer = Buffer(
@@ -292,14 +786,11 @@ void runCircleFittingMethod(OpenCL &ocl, Image3D * dataset, SIPL::int3 size, par
 					NullRange
 			);
     	}
-    } else {
-        blurredVolume = dataset;
     }
 
 if(getParamBool(parameters, "timing")) {
     ocl.queue.enqueueMarker(&startEvent);
 }
-    Image3D * vectorFieldSmall;
     if(no3Dwrite) {
     	bool usingTwoBuffers = false;
     	int maxZ = size.z;
@@ -335,6 +826,9 @@ if(getParamBool(parameters, "timing")) {
         }
 
         // Run create vector field
+        if(bufferVectorField) {
+            runBufferVectorField(ocl, datasetBuffer, size, smallBlurSigma, Fmax, vectorSign, maxZ, vectorFieldBuffer, vectorFieldBuffer2);
+        } else {
         createVectorFieldKernel.setArg(0, *blurredVolume);
         createVectorFieldKernel.setArg(1, vectorFieldBuffer);
         createVectorFieldKernel.setArg(2, vectorFieldBuffer2);
@@ -347,10 +841,11 @@ if(getParamBool(parameters, "timing")) {
                 createVectorFieldKernel,
                 NullRange,
                 NDRange(size.x,size.y,size.z),
-                NullRange
+                fusedBlur ? NDRange(fusedVectorFieldGroupSize,fusedVectorFieldGroupSize,fusedVectorFieldGroupSize) : NullRange
         );
+        }
 
-        if(smallBlurSigma > 0) {
+        if(blurredVolume != dataset) {
             ocl.queue.finish();
             ocl.GC->deleteMemoryObject(blurredVolume);
         }
@@ -438,7 +933,7 @@ if(getParamBool(parameters, "timing")) {
                 NDRange(4,4,4)
         );
 
-    if(smallBlurSigma > 0) {
+    if(blurredVolume != dataset) {
         ocl.queue.finish();
         ocl.GC->deleteMemoryObject(blurredVolume);
     }
@@ -452,6 +947,7 @@ if(getParamBool(parameters, "timing")) {
     endEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &end);
     std::cout << "RUNTIME of Create vector field: " << (end-start)*1.0e-6 << " ms" << std::endl;
 }
+    if(!fusedScales) {
 if(getParamBool(parameters, "timing")) {
     ocl.queue.enqueueMarker(&startEvent);
 }
@@ -465,7 +961,11 @@ if(getParamBool(parameters, "timing")) {
     ocl.GC->addMemoryObject(TDFsmallBuffer);
     Buffer * radiusSmallBuffer = new Buffer(ocl.context, CL_MEM_WRITE_ONLY, sizeof(float)*totalSize);
     ocl.GC->addMemoryObject(radiusSmallBuffer);
-    runCircleFittingTDF(ocl,size,vectorFieldSmall,TDFsmallBuffer,radiusSmallBuffer,radiusMin,3.0f,0.5f);
+    if(getParam(parameters, "tdf-sparse-threshold") > 0) {
+        runSparseCircleFittingTDF(ocl,size,vectorFieldSmall,TDFsmallBuffer,radiusSmallBuffer,radiusMin,3.0f,0.5f,parameters);
+    } else {
+        runCircleFittingTDF(ocl,size,vectorFieldSmall,TDFsmallBuffer,radiusSmallBuffer,radiusMin,3.0f,0.5f,parameters);
+    }
 
 
     if(radiusMax < 2.5) {
@@ -525,7 +1025,9 @@ if(getParamBool(parameters, "timing")) {
     startEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &start);
     endEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &end);
     std::cout << "RUNTIME of TDF small: " << (end-start)*1.0e-6 << " ms" << std::endl;
+    TDFRuntime += (end-start)*1.0e-6;
     }
+    } // end if !fusedScales
 
     } // end if radiusMin < 2.5
 
@@ -535,13 +1037,17 @@ if(getParamBool(parameters, "timing")) {
 if(getParamBool(parameters, "timing")) {
     ocl.queue.enqueueMarker(&startEvent);
 }
-    Image3D * blurredVolume = new Image3D(ocl.context, CL_MEM_READ_WRITE, ImageFormat(CL_R, CL_FLOAT), size.x, size.y, size.z);
-    ocl.GC->addMemoryObject(blurredVolume);
-    if(largeBlurSigma > 0) {
+    const bool fusedBlur = setupFusedVectorField(ocl, parameters, largeBlurSigma, no3Dwrite ? 6 : 4, createVectorFieldKernel, fusedBlurMask);
+    const bool bufferVectorField = useBufferKernels && !fusedBlur;
+    Image3D * blurredVolume = dataset;
+    if(largeBlurSigma > 0 && !fusedBlur && !bufferVectorField) {
+        blurredVolume = new Image3D(ocl.context, CL_MEM_READ_WRITE, ImageFormat(CL_R, CL_FLOAT), size.x, size.y, size.z);
+        ocl.GC->addMemoryObject(blurredVolume);
     	int maskSize = 1;
 		float * mask = createBlurMask(largeBlurSigma, &maskSize);
 	    Buffer blurMask = Buffer(ocl.context, CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR, sizeof(float)*(maskSize*2+1)*(maskSize*2+1)*(maskSize*2+1), mask);
         blurMask.setDestructorCallback((void (__stdcall *)(cl_mem,void *))(freeData<float>), (void *)mask);
+        blurVolumeWithGaussianKernel = getSpecializedKernel(ocl, "blurVolumeWithGaussian", getKernelDefine("BLUR_MASK_SIZE", maskSize), parameters);
     	if(no3Dwrite) {
 			// Create auxillary buffer
 			Buffer blurredVolumeBuffer = Buffer(
@@ -583,10 +1089,8 @@ if(getParamBool(parameters, "timing")) {
 					NullRange
 			);
     	}
-    } else {
-        blurredVolume = dataset;
     }
-    if(largeBlurSigma > 0) {
+    if(blurredVolume != dataset) {
         ocl.queue.finish();
         ocl.GC->deleteMemoryObject(dataset);
     }
@@ -642,6 +1146,9 @@ if(getParamBool(parameters, "timing")) {
         }
 
         // Run create vector field
+        if(bufferVectorField) {
+            runBufferVectorField(ocl, datasetBuffer, size, largeBlurSigma, Fmax, vectorSign, maxZ, vectorFieldBuffer, vectorFieldBuffer2);
+        } else {
         createVectorFieldKernel.setArg(0, *blurredVolume);
         createVectorFieldKernel.setArg(1, vectorFieldBuffer);
         createVectorFieldKernel.setArg(2, vectorFieldBuffer2);
@@ -654,8 +1161,10 @@ if(getParamBool(parameters, "timing")) {
                 createVectorFieldKernel,
                 NullRange,
                 NDRange(size.x,size.y,size.z),
-                NullRange
+                fusedBlur ? NDRange(fusedVectorFieldGroupSize,fusedVectorFieldGroupSize,fusedVectorFieldGroupSize) : NullRange
         );
+        }
+        datasetBuffer = Buffer();
 
         ocl.queue.finish();
         ocl.GC->deleteMemoryObject(blurredVolume);
@@ -756,7 +1265,9 @@ if(getParamBool(parameters, "timing")) {
 		}
 	}
     if(getParamBool(parameters, "use-fmg-gvf")) {
-        vectorField = runFMGGVF(ocl,initVectorField,parameters,size);
+        vectorField = runMGGVF(ocl,initVectorField,parameters,size);
+    } else if(getParamStr(parameters, "gvf-solver") == "native") {
+        vectorField = runNativeGVF(ocl,initVectorField,parameters,size);
     } else if(useSlowGVF) {
 		vectorField = runGVF(ocl, initVectorField, parameters, size, true);
 	} else {
@@ -784,10 +1295,16 @@ if(getParamBool(parameters, "timing")) {
     }
     Buffer radiusLarge = Buffer(ocl.context, CL_MEM_WRITE_ONLY, sizeof(float)*totalSize);
 
-    if(getParamBool(parameters,"use-spline-tdf")) {
+    if(fusedScales) {
+        runMultiScaleCircleFittingTDF(ocl,size,vectorFieldSmall,&vectorField,&TDFlarge,&radiusLarge,radiusMin,3.0f,0.5f,std::max(2.5f, radiusMin),radiusMax,radiusStep,(int)getParam(parameters,"tdf-coarse-radius-step"),getParamBool(parameters,"tdf-reduced-samples"));
+        ocl.queue.finish();
+        ocl.GC->deleteMemoryObject(vectorFieldSmall);
+    } else if(getParamBool(parameters,"use-spline-tdf")) {
         runSplineTDF(ocl,size,&vectorField,&TDFlarge,&radiusLarge,std::max(1.5f, radiusMin),radiusMax,radiusStep);
+    } else if(getParam(parameters, "tdf-sparse-threshold") > 0) {
+        runSparseCircleFittingTDF(ocl,size,&vectorField,&TDFlarge,&radiusLarge,std::max(2.5f, radiusMin),radiusMax,radiusStep,parameters);
     } else {
-        runCircleFittingTDF(ocl,size,&vectorField,&TDFlarge,&radiusLarge,std::max(2.5f, radiusMin),radiusMax,radiusStep);
+        runCircleFittingTDF(ocl,size,&vectorField,&TDFlarge,&radiusLarge,std::max(2.5f, radiusMin),radiusMax,radiusStep,parameters);
     }
 std::cout << "TDF finished" << std::endl;
 
@@ -797,11 +1314,12 @@ if(getParamBool(parameters, "timing")) {
     startEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &start);
     endEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &end);
     std::cout << "RUNTIME of TDF large: " << (end-start)*1.0e-6 << " ms" << std::endl;
+    TDFRuntime += (end-start)*1.0e-6;
 }
 if(getParamBool(parameters, "timing")) {
     ocl.queue.enqueueMarker(&startEvent);
 }
-	if(radiusMin < 2.5f) {
+	if(radiusMin < 2.5f && !fusedScales) {
         Buffer TDFsmall2;
         if(getParamBool(parameters, "16bit-vectors")) {
             TDFsmall2 = Buffer(ocl.context, CL_MEM_READ_ONLY, sizeof(short)*totalSize);
@@ -854,6 +1372,9 @@ if(getParamBool(parameters, "timing")) {
     startEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &start);
     endEvent.getProfilingInfo<cl_ulong>(CL_PROFILING_COMMAND_START, &end);
     std::cout << "RUNTIME of combine: " << (end-start)*1.0e-6 << " ms" << std::endl;
+    TDFRuntime += (end-start)*1.0e-6;
+    if(radiusMin < 2.5f)
+        std::cout << "RUNTIME of TDF with " << (fusedScales ? "fused" : "separate") << " scales: " << TDFRuntime << " ms" << std::endl;
 }
 #ifdef USE_SIPL_VISUALIZATION
 //if(getParamBool(parameters, "show-vector-field")) {
@@ -864,6 +1385,8 @@ if(getParamBool(parameters, "timing")) {
     T.Fx = new float[totalSize];
     T.Fy =new float[totalSize];
     T.Fz =new float[totalSize];
+    T.directionBricks = NULL;
+    T.directions = NULL;
     float *tdfData = new float[totalSize];
     if((!getParamBool(parameters, "16bit-vectors"))) {
      // 32 bit vector fields
@@ -942,10 +1465,32 @@ radius->show(40, 80);
 
 
 
+// The radius is kept in the output if it is stored or written to the centerline file
+static bool outputNeedsRadius(paramList &parameters) {
+	return getParamBool(parameters, "storage-radius") ||
+			(getParamStr(parameters, "centerline-vtk-file") != "off" &&
+			getParamStr(parameters, "centerline-vtk-format") == "binary");
+}
+
+// Final masks are kept bit packed on the device if packed-masks is set
+static void setSegmentationOutput(OpenCL * ocl, Image3D * segmentation, SIPL::int3 * size, paramList &parameters, TSFOutput * output) {
+	if(getParamBool(parameters, "packed-masks")) {
+		output->setPackedSegmentation(new Buffer(packMask(*ocl, *segmentation, *size)));
+		delete segmentation;
+	} else {
+		output->setSegmentation(segmentation);
+	}
+}
+
 void runCircleFittingAndNewCenterlineAlg(OpenCL * ocl, cl::Image3D * dataset, SIPL::int3 * size, paramList &parameters, TSFOutput * output) {
-    INIT_TIMER
     Image3D vectorField, radius;
     Image3D * TDF = new Image3D;
+    runCircleFittingStage(*ocl, dataset, *size, parameters, output, vectorField, *TDF, radius);
+    runNewCenterlineAlgAndSegmentation(ocl, size, parameters, output, vectorField, TDF, radius);
+}
+
+void runNewCenterlineAlgAndSegmentation(OpenCL * ocl, SIPL::int3 * size, paramList &parameters, TSFOutput * output, Image3D &vectorField, Image3D * TDF, Image3D &radius) {
+    INIT_TIMER
     const int totalSize = size->x*size->y*size->z;
 	const bool no3Dwrite = !getParamBool(parameters, "3d_write");
 
@@ -958,14 +1503,14 @@ void runCircleFittingAndNewCenterlineAlg(OpenCL * ocl, cl::Image3D * dataset, SI
     region[1] = size->y;
     region[2] = size->z;
 
-    runCircleFittingMethod(*ocl, dataset, *size, parameters, vectorField, *TDF, radius);
     output->setTDF(TDF);
+    if(outputNeedsRadius(parameters))
+        output->setRadius(new Image3D(radius));
     if(getParamBool(parameters, "tdf-only"))
     	return;
 
     Image3D * centerline = new Image3D;
-    *centerline = runNewCenterlineAlg(*ocl, *size, parameters, vectorField, *TDF, radius);
-    output->setCenterlineVoxels(centerline);
+    *centerline = runNewCenterlineAlg(*ocl, *size, parameters, vectorField, *TDF, radius, output);
 
     Image3D * segmentation = new Image3D;
     if(!getParamBool(parameters, "no-segmentation")) {
@@ -974,11 +1519,17 @@ void runCircleFittingAndNewCenterlineAlg(OpenCL * ocl, cl::Image3D * dataset, SI
     	} else {
 			*segmentation = runSphereSegmentation(*ocl, *centerline, radius, *size, parameters);
     	}
-    	output->setSegmentation(segmentation);
+    	setSegmentationOutput(ocl, segmentation, size, parameters, output);
+    }
+    if(getParamBool(parameters, "packed-masks")) {
+    	output->setPackedCenterlineVoxels(new Buffer(packMask(*ocl, *centerline, *size)));
+    	delete centerline;
+    } else {
+    	output->setCenterlineVoxels(centerline);
     }
 
 	if(getParamStr(parameters, "storage-dir") != "off") {
-		writeDataToDisk(output, getParamStr(parameters, "storage-dir"), getParamStr(parameters, "storage-name"));
+		writeDataToDisk(output, parameters);
     }
 
 }
@@ -1038,7 +1589,9 @@ void runCircleFittingAndTest(OpenCL * ocl, cl::Image3D * dataset, SIPL::int3 * s
     region[1] = size->y;
     region[2] = size->z;
 
-    runCircleFittingMethod(*ocl, dataset, *size, parameters, vectorField, *TDF, radius);
+    runCircleFittingStage(*ocl, dataset, *size, parameters, output, vectorField, *TDF, radius);
+    if(outputNeedsRadius(parameters))
+        output->setRadius(new Image3D(radius));
 
 
     // Transfer from device to host
@@ -1117,9 +1670,19 @@ void runCircleFittingAndTest(OpenCL * ocl, cl::Image3D * dataset, SIPL::int3 * s
     output->setTDF(TS.TDF);
     ocl->queue.enqueueReadImage(radius, CL_TRUE, offset, region, 0, 0, TS.radius);
     //ocl->queue.enqueueReadImage(dataset, CL_TRUE, offset, region, 0, 0, TS.intensity);
+    if(getParamBool(parameters, "timing")) {
+        START_TIMER
+    }
+    TubeDirectionField directionField = createTubeDirectionField(*ocl, *size, parameters, vectorField, *TDF);
+    transferTubeDirectionField(*ocl, *size, directionField, &TS.directionBricks, &TS.directions);
 
     // Create pairs of voxels with high TDF
     std::vector<CrossSection *> crossSections = createGraph(TS, *size);
+    delete[] TS.directionBricks;
+    delete[] TS.directions;
+    if(getParamBool(parameters, "timing")) {
+        STOP_TIMER("creating pairs (including the tube direction field)")
+    }
 
     // Display pairs
 	#ifdef USE_SIPL_VISUALIZATION
@@ -1185,7 +1748,6 @@ void runCircleFittingAndTest(OpenCL * ocl, cl::Image3D * dataset, SIPL::int3 * s
     visualizeSegments(finalSegments, *size);
 	#endif
 
-    char * centerline = new char[totalSize]();
     std::vector<int3> vertices;
     std::vector<SIPL::int2> edges;
     int counter = 0;
@@ -1203,14 +1765,6 @@ void runCircleFittingAndTest(OpenCL * ocl, cl::Image3D * dataset, SIPL::int3 * s
     		//std::cout << a->index << " " << b->index << std::endl;
     		counter += 2;
     		edges.push_back(SIPL::int2(a->index, b->index));
-			int distance = ceil(a->pos.distance(b->pos));
-			float3 direction(b->pos.x-a->pos.x,b->pos.y-a->pos.y,b->pos.z-a->pos.z);
-			for(int i = 0; i < distance; i++) {
-				float frac = (float)i/distance;
-				float3 n = a->pos + frac*direction;
-				int3 in(round(n.x),round(n.y),round(n.z));
-				centerline[in.x+in.y*size->x+in.z*size->x*size->y] = 1;
-			}
 		}
     	for(int i = 0; i < s->connections.size(); i++) {
     		Connection * c = s->connections[i];
@@ -1222,53 +1776,50 @@ void runCircleFittingAndTest(OpenCL * ocl, cl::Image3D * dataset, SIPL::int3 * s
     		b->index = counter+1;
     		counter += 2;
     		edges.push_back(SIPL::int2(a->index, b->index));
-			int distance = ceil(a->pos.distance(b->pos));
-			float3 direction(b->pos.x-a->pos.x,b->pos.y-a->pos.y,b->pos.z-a->pos.z);
-			for(int i = 0; i < distance; i++) {
-				float frac = (float)i/distance;
-				float3 n = a->pos + frac*direction;
-				int3 in(round(n.x),round(n.y),round(n.z));
-				centerline[in.x+in.y*size->x+in.z*size->x*size->y] = 1;
-			}
-
 		}
     }
-    output->setCenterlineVoxels(centerline);
+    // The centerline voxels are only created if they are needed
+    output->setCenterline(vertices, edges, sampleCenterlineRadius(vertices, TS.radius, *size));
     if(getParamStr(parameters, "centerline-vtk-file") != "off") {
-    	writeToVtkFile(parameters, vertices, edges);
+    	writeToVtkFile(parameters, vertices, edges, output);
     }
 
 
     Image3D * volume = new Image3D;
     if(!getParamBool(parameters, "no-segmentation")) {
-        *volume = Image3D(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_R, CL_SIGNED_INT8), size->x, size->y, size->z, 0, 0, centerline);
+        *volume = Image3D(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_R, CL_SIGNED_INT8), size->x, size->y, size->z, 0, 0, output->getCenterlineVoxels());
 		if(!getParamBool(parameters, "sphere-segmentation")) {
 			*volume = runInverseGradientSegmentation(*ocl, *volume, vectorField, radius, *size, parameters);
     	} else {
 			*volume = runSphereSegmentation(*ocl,*volume, radius, *size, parameters);
     	}
-		output->setSegmentation(volume);
+		setSegmentationOutput(ocl, volume, size, parameters, output);
     }
 
 
 
 	if(getParamStr(parameters, "storage-dir") != "off") {
-        writeDataToDisk(output, getParamStr(parameters, "storage-dir"), getParamStr(parameters, "storage-name"));
+        writeDataToDisk(output, parameters);
     }
 
 }
 
 
 void runCircleFittingAndRidgeTraversal(OpenCL * ocl, Image3D * dataset, SIPL::int3 * size, paramList &parameters, TSFOutput * output) {
-    
+    Image3D vectorField, radius;
+    Image3D * TDF = new Image3D;
+    runCircleFittingStage(*ocl, dataset, *size, parameters, output, vectorField, *TDF, radius);
+    runRidgeTraversalAndSegmentation(ocl, size, parameters, output, vectorField, TDF, radius);
+}
+
+void runRidgeTraversalAndSegmentation(OpenCL * ocl, SIPL::int3 * size, paramList &parameters, TSFOutput * output, Image3D &vectorField, Image3D * TDF, Image3D &radius) {
     INIT_TIMER
     cl::Event startEvent, endEvent;
     cl_ulong start, end;
-    Image3D vectorField, radius,vectorFieldSmall;
-    Image3D * TDF = new Image3D;
     TubeSegmentation TS;
-    runCircleFittingMethod(*ocl, dataset, *size, parameters, vectorField, *TDF, radius);
     output->setTDF(TDF);
+    if(outputNeedsRadius(parameters))
+        output->setRadius(new Image3D(radius));
     const int totalSize = size->x*size->y*size->z;
 	const bool no3Dwrite = !getParamBool(parameters, "3d_write");
 
@@ -1323,9 +1874,12 @@ void runCircleFittingAndRidgeTraversal(OpenCL * ocl, Image3D * dataset, SIPL::in
     TS.radius = new float[totalSize];
     output->setTDF(TS.TDF);
     ocl->queue.enqueueReadImage(radius, CL_TRUE, offset, region, 0, 0, TS.radius);
+    TubeDirectionField directionField = createTubeDirectionField(*ocl, *size, parameters, vectorField, *TDF);
+    transferTubeDirectionField(*ocl, *size, directionField, &TS.directionBricks, &TS.directions);
     std::stack<CenterlinePoint> centerlineStack;
-    TS.centerline = runRidgeTraversal(TS, *size, parameters, centerlineStack);
-    output->setCenterlineVoxels(TS.centerline);
+    runRidgeTraversal(TS, *size, parameters, centerlineStack, output);
+    delete[] TS.directionBricks;
+    delete[] TS.directions;
 
     if(getParamBool(parameters, "timing")) {
         ocl->queue.finish();
@@ -1335,18 +1889,18 @@ void runCircleFittingAndRidgeTraversal(OpenCL * ocl, Image3D * dataset, SIPL::in
 
     Image3D * volume = new Image3D;
     if(!getParamBool(parameters, "no-segmentation")) {
-        *volume = Image3D(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_R, CL_SIGNED_INT8), size->x, size->y, size->z, 0, 0, TS.centerline);
+        *volume = Image3D(ocl->context, CL_MEM_READ_WRITE | CL_MEM_COPY_HOST_PTR, ImageFormat(CL_R, CL_SIGNED_INT8), size->x, size->y, size->z, 0, 0, output->getCenterlineVoxels());
 		if(!getParamBool(parameters, "sphere-segmentation")) {
 			*volume = runInverseGradientSegmentation(*ocl, *volume, vectorField, radius, *size, parameters);
     	} else {
 			*volume = runSphereSegmentation(*ocl,*volume, radius, *size, parameters);
     	}
-		output->setSegmentation(volume);
+		setSegmentationOutput(ocl, volume, size, parameters, output);
     }
 
 
     if(getParamStr(parameters, "storage-dir") != "off") {
-        writeDataToDisk(output, getParamStr(parameters, "storage-dir"), getParamStr(parameters, "storage-name"));
+        writeDataToDisk(output, parameters);
     }
 
 }
@@ -1358,68 +1912,326 @@ void __stdcall unmapRawfile(cl_mem memobj, void * user_data) {
     delete[] file;
 }
 
-template <class T> 
-float getMaximum(void * data, const int totalSize) {
-    T * newDataPointer = (T *)data;
-    T maximum = std::numeric_limits<T>::min();
-    for(int i = 0; i < totalSize; i++) 
-        maximum = std::max(maximum, newDataPointer[i]);
+/*
+ * Find the region to crop to from the number of scan lines inside the body
+ * for each slice in the x, y and z directions. Sets size to the size of the
+ * cropped volume and shiftVector to its offset in the original volume.
+ */
+static void findCropRegion(short * scanLinesX, short * scanLinesY, short * scanLinesZ, int minScanLines, std::string cropping_start_z, SIPL::int3 * size, SIPL::int3 * shiftVector) {
+    int x1 = 0,x2 = size->x,y1 = 0,y2 = size->y,z1 = 0,z2 = size->z;
+    int startSlice, a;
+	if(cropping_start_z == "middle") {
+		startSlice = size->z / 2;
+		a = -1;
+	} else {
+		startSlice = 0;
+		a = 1;
+	}
 
-    return (float)maximum;
+#pragma omp parallel sections
+{
+#pragma omp section
+{
+    for(int sliceNr = 0; sliceNr < size->x; sliceNr++) {
+        if(scanLinesX[sliceNr] > minScanLines) {
+            x1 = sliceNr;
+            break;
+        }
+    }
 }
 
-template <class T> 
-float getMinimum(void * data, const int totalSize) {
-    T * newDataPointer = (T *)data;
-    T minimum = std::numeric_limits<T>::max();
-    for(int i = 0; i < totalSize; i++) 
-        minimum = std::min(minimum, newDataPointer[i]);
+#pragma omp section
+{
+    for(int sliceNr = size->x-1; sliceNr > 0; sliceNr--) {
+        if(scanLinesX[sliceNr] > minScanLines) {
+            x2 = sliceNr;
+            break;
+        }
+    }
+}
+#pragma omp section
+{
+    for(int sliceNr = 0; sliceNr < size->y; sliceNr++) {
+        if(scanLinesY[sliceNr] > minScanLines) {
+            y1 = sliceNr;
+            break;
+        }
+    }
+}
+#pragma omp section
+{
+    for(int sliceNr = size->y-1; sliceNr > 0; sliceNr--) {
+        if(scanLinesY[sliceNr] > minScanLines) {
+            y2 = sliceNr;
+            break;
+        }
+    }
+}
 
-    return (float)minimum;
+#pragma omp section
+{
+	for(int sliceNr = startSlice; sliceNr < size->z; sliceNr++) {
+        if(a*scanLinesZ[sliceNr] > a*minScanLines) {
+            z2 = sliceNr;
+            break;
+        }
+    }
 }
+#pragma omp section
+{
+    for(int sliceNr = size->z - startSlice - 1; sliceNr > 0; sliceNr--) {
+        if(a*scanLinesZ[sliceNr] > a*minScanLines) {
+            z1 = sliceNr;
+            break;
+        }
+    }
+}
+}
+	if(cropping_start_z == "end") {
+		int tmp = z1;
+		z1 = z2;
+		z2 = tmp;
+	}
 
-template <typename T>
-void getLimits(paramList parameters, void * data, const int totalSize, float * minimum, float * maximum) {
-    if(getParamStr(parameters, "minimum") != "off") {
-        *minimum = atof(getParamStr(parameters, "minimum").c_str());
-    } else {
-        std::cout << "NOTE: minimum parameter not set, finding minimum automatically." << std::endl;
-        *minimum = getMinimum<T>(data, totalSize);
-        std::cout << "NOTE: minimum found to be " << *minimum << std::endl;
+    int SIZE_X = x2-x1;
+    int SIZE_Y = y2-y1;
+    int SIZE_Z = z2-z1;
+    if(SIZE_X == 0 || SIZE_Y == 0 || SIZE_Z == 0) {
+    	char * str = new char[255];
+    	sprintf(str, "Invalid cropping to new size %d, %d, %d", SIZE_X, SIZE_Y, SIZE_Z);
+    	throw SIPL::SIPLException(str, __LINE__, __FILE__);
     }
-            
-    if(getParamStr(parameters, "maximum") != "off") {
-        *maximum = atof(getParamStr(parameters, "maximum").c_str());
-    } else {
-        std::cout << "NOTE: maximum parameter not set, finding maximum automatically." << std::endl;
-        *maximum = getMaximum<T>(data, totalSize);
-        std::cout << "NOTE: maximum found to be " << *maximum << std::endl;
+    // Make them dividable by 4
+    bool lower = false;
+    while(SIZE_X % 4 != 0 && SIZE_X < size->x) {
+        if(lower && x1 > 0) {
+            x1--;
+        } else if(x2 < size->x) {
+            x2++;
+        }
+        lower = !lower;
+        SIZE_X = x2-x1;
     }
+    if(SIZE_X % 4 != 0) {
+		while(SIZE_X % 4 != 0)
+			SIZE_X--;
+    }
+    while(SIZE_Y % 4 != 0 && SIZE_Y < size->y) {
+        if(lower && y1 > 0) {
+            y1--;
+        } else if(y2 < size->y) {
+            y2++;
+        }
+        lower = !lower;
+        SIZE_Y = y2-y1;
+    }
+    if(SIZE_Y % 4 != 0) {
+		while(SIZE_Y % 4 != 0)
+			SIZE_Y--;
+    }
+    while(SIZE_Z % 4 != 0 && SIZE_Z < size->z) {
+        if(lower && z1 > 0) {
+            z1--;
+        } else if(z2 < size->z) {
+            z2++;
+        }
+        lower = !lower;
+        SIZE_Z = z2-z1;
+    }
+    if(SIZE_Z % 4 != 0) {
+		while(SIZE_Z % 4 != 0)
+			SIZE_Z--;
+    }
+    size->x = SIZE_X;
+    size->y = SIZE_Y;
+    size->z = SIZE_Z;
+    shiftVector->x = x1;
+    shiftVector->y = y1;
+    shiftVector->z = z1;
+
 }
 
-boost::iostreams::mapped_file_source * file;
-Image3D readDatasetAndTransfer(OpenCL &ocl, std::string filename, paramList &parameters, SIPL::int3 * size, TSFOutput * output) {
-    cl_ulong start, end;
-    Event startEvent, endEvent;
-    if(getParamBool(parameters, "timing")) {
-        ocl.queue.enqueueMarker(&startEvent);
+/*
+ * Host version of the cropDatasetLung and cropDatasetThreshold kernels.
+ * All three slice directions are handled in one pass over the volume: a scan
+ * line along z is shared by the x and y slice directions, while a scan line
+ * along x belongs to the z slice direction. Each thread handles one y value,
+ * which keeps the memory access sequential.
+ */
+template <class T>
+void cropDatasetOnHost(const T * data, SIPL::int3 size, bool lung, float threshold, int type, short * scanLinesX, short * scanLinesY, short * scanLinesZ) {
+    const int Wlimit = 30;
+    const int Blimit = 30;
+    short HUlimit = -150;
+    if(type == 2)
+    	HUlimit += 1024;
+
+    // Whether the scan line along z at (x,y) and along x at (y,z) is inside
+    char * insideXY = new char[size.x*size.y];
+    char * insideYZ = new char[size.y*size.z];
+
+#pragma omp parallel for
+    for(int y = 0; y < size.y; y++) {
+        // State of the scan lines along z for each x in this row
+        int * Wcount = new int[size.x]();
+        int * Bcount = new int[size.x]();
+        int * whiteAreas = new int[size.x]();
+        int * blackAreas = new int[size.x]();
+        bool * found = new bool[size.x]();
+        for(int z = 0; z < size.z; z++) {
+            const T * row = &data[(::size_t)y*size.x + (::size_t)z*size.x*size.y];
+            int currentWcount = 0, currentBcount = 0, detectedWhiteAreas = 0, detectedBlackAreas = 0;
+            bool rowFound = false;
+            for(int x = 0; x < size.x; x++) {
+                if(lung) {
+                    const bool white = (short)row[x] > HUlimit;
+                    // Scan line along x
+                    if(white) {
+                        if(currentWcount == Wlimit) {
+                            detectedWhiteAreas++;
+                            currentBcount = 0;
+                        }
+                        currentWcount++;
+                    } else {
+                        if(currentBcount == Blimit) {
+                            detectedBlackAreas++;
+                            currentWcount = 0;
+                        }
+                        currentBcount++;
+                    }
+                    // Scan line along z
+                    if(white) {
+                        if(Wcount[x] == Wlimit) {
+                            whiteAreas[x]++;
+                            Bcount[x] = 0;
+                        }
+                        Wcount[x]++;
+                    } else {
+                        if(Bcount[x] == Blimit) {
+                            blackAreas[x]++;
+                            Wcount[x] = 0;
+                        }
+                        Bcount[x]++;
+                    }
+                } else if(row[x] > threshold) {
+                    rowFound = true;
+                    found[x] = true;
+                }
+            }
+            if(lung) {
+                insideYZ[y+z*size.y] = (detectedWhiteAreas == 2 && detectedBlackAreas == 1) ||
+                    (detectedBlackAreas > 1 && detectedWhiteAreas > 1);
+            } else {
+                insideYZ[y+z*size.y] = rowFound;
+            }
+        }
+        for(int x = 0; x < size.x; x++) {
+            if(lung) {
+                insideXY[x+y*size.x] = (whiteAreas[x] == 2 && blackAreas[x] == 1) ||
+                    (blackAreas[x] > 1 && whiteAreas[x] > 1);
+            } else {
+                insideXY[x+y*size.x] = found[x];
+            }
+        }
+        delete[] Wcount;
+        delete[] Bcount;
+        delete[] whiteAreas;
+        delete[] blackAreas;
+        delete[] found;
     }
+
+    // Count the scan lines inside for each slice
+#pragma omp parallel for
+    for(int x = 0; x < size.x; x++) {
+        short scanLines = 0;
+        for(int y = 0; y < size.y; y++)
+            scanLines += insideXY[x+y*size.x];
+        scanLinesX[x] = scanLines;
+    }
+#pragma omp parallel for
+    for(int y = 0; y < size.y; y++) {
+        short scanLines = 0;
+        for(int x = 0; x < size.x; x++)
+            scanLines += insideXY[x+y*size.x];
+        scanLinesY[y] = scanLines;
+    }
+#pragma omp parallel for
+    for(int z = 0; z < size.z; z++) {
+        short scanLines = 0;
+        for(int y = 0; y < size.y; y++)
+            scanLines += insideYZ[y+z*size.y];
+        scanLinesZ[z] = scanLines;
+    }
+
+    delete[] insideXY;
+    delete[] insideYZ;
+}
+
+/*
+ * Inflate a zlib compressed raw file (CompressedData = True) into
+ * destination in chunks. A zlib stream can only be decoded sequentially, so
+ * the parallelism is in computing the statistics of each chunk.
+ */
+static void inflateRawFile(std::string filename, char * destination, ::size_t bytes, ::size_t elementSize, IntensityStatisticsAccumulator * accumulator, bool timing) {
     INIT_TIMER
-    START_TIMER
-    // Read mhd file, determine file type
+    std::ifstream compressedFile(filename.c_str(), std::ios_base::in | std::ios_base::binary);
+    if(!compressedFile) {
+    	throw SIPL::IOException(filename.c_str(), __LINE__, __FILE__);
+    }
+    boost::iostreams::filtering_istream stream;
+    stream.push(boost::iostreams::zlib_decompressor());
+    stream.push(compressedFile);
+
+    const ::size_t chunkSize = 4*1024*1024;
+    ::size_t bytesRead = 0, bytesProcessed = 0;
+    try {
+        while(bytesRead < bytes) {
+            stream.read(destination + bytesRead, std::min(chunkSize, bytes - bytesRead));
+            std::streamsize count = stream.gcount();
+            if(count <= 0)
+                break;
+            bytesRead += count;
+            if(accumulator != NULL) {
+                // Only whole elements are added
+                ::size_t bytesComplete = bytesRead - bytesRead % elementSize;
+                accumulator->add(destination + bytesProcessed, (bytesComplete - bytesProcessed) / elementSize);
+                bytesProcessed = bytesComplete;
+            }
+        }
+    } catch(boost::iostreams::zlib_error &e) {
+    	std::string str = "Error decompressing " + filename;
+    	throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
+    }
+    if(bytesRead != bytes) {
+    	std::string str = "Compressed data file " + filename + " is smaller than the volume size";
+    	throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
+    }
+    if(timing) {
+        STOP_TIMER("decompressing dataset")
+    }
+}
+
+boost::iostreams::mapped_file_source * file;
+// Read mhd file, determine file type
+static void readMetaImageHeader(std::string filename, std::string &typeName, std::string &rawFilename, SIPL::int3 * size, SIPL::float3 &spacing, bool &compressed) {
     std::fstream mhdFile;
     mhdFile.open(filename.c_str(), std::fstream::in);
     if(!mhdFile) {
     	throw SIPL::IOException(filename.c_str(), __LINE__, __FILE__);
     }
-    std::string typeName = "";
-    std::string rawFilename = "";
+    typeName = "";
+    rawFilename = "";
     bool typeFound = false, sizeFound = false, rawFilenameFound = false;
-    SIPL::float3 spacing(1,1,1);
+    compressed = false;
+    spacing = SIPL::float3(1,1,1);
     do {
         std::string line;
         std::getline(mhdFile, line);
-        if(line.substr(0, 11) == "ElementType") {
+        if(line.substr(0, 18) == "CompressedDataSize") {
+            // Not needed, the stream is inflated until the volume is full
+        } else if(line.substr(0, 14) == "CompressedData") {
+            compressed = line.substr(14+3, 4) == "True";
+        } else if(line.substr(0, 11) == "ElementType") {
             typeName = line.substr(11+3);
             typeFound = true;
         } else if(line.substr(0, 15) == "ElementDataFile") {
@@ -1471,79 +2283,218 @@ Image3D readDatasetAndTransfer(OpenCL &ocl, std::string filename, paramList &par
     if(!typeFound || !sizeFound || !rawFilenameFound) {
         throw SIPL::SIPLException("Error reading mhd file. Type, filename or size not found", __LINE__, __FILE__);
     }
+}
+
+Image3D readDatasetAndTransfer(OpenCL &ocl, std::string filename, paramList &parameters, SIPL::int3 * size, TSFOutput * output) {
+    std::string typeName, rawFilename;
+    SIPL::float3 spacing;
+    bool compressed;
+    readMetaImageHeader(filename, typeName, rawFilename, size, spacing, compressed);
+
+    ::size_t elementSize;
+    if(typeName == "MET_SHORT" || typeName == "MET_USHORT") {
+        elementSize = sizeof(short);
+    } else if(typeName == "MET_CHAR" || typeName == "MET_UCHAR") {
+        elementSize = sizeof(char);
+    } else if(typeName == "MET_FLOAT") {
+        elementSize = sizeof(float);
+    } else {
+    	std::string str = "unsupported data type " + typeName;
+    	throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
+    }
+    const ::size_t dataSize = (::size_t)size->x*size->y*size->z*elementSize;
+
+    // Intensity statistics are cached next to the raw file
+    IntensityStatistics statistics;
+    bool hasStatistics = false, computeStatistics = false;
+    std::string cacheFilename = rawFilename + ".stats";
+    std::string cacheKey;
+    if(needsIntensityStatistics(parameters)) {
+        cacheKey = getIntensityStatisticsCacheKey(rawFilename, typeName);
+        if(getParamBool(parameters, "intensity-statistics-cache") && statistics.load(cacheFilename, cacheKey)) {
+            std::cout << "NOTE: Using cached intensity statistics from " << cacheFilename << std::endl;
+            hasStatistics = true;
+        } else {
+            computeStatistics = true;
+        }
+    }
+
+    if(compressed) {
+        // Inflate into pinned staging memory, computing the statistics of
+        // each chunk while it is still in cache
+        Buffer staging = Buffer(ocl.context, CL_MEM_READ_ONLY | CL_MEM_ALLOC_HOST_PTR, dataSize);
+        void * stagingData = ocl.queue.enqueueMapBuffer(staging, CL_TRUE, CL_MAP_WRITE, 0, dataSize);
+        IntensityStatisticsAccumulator accumulator(typeName);
+        inflateRawFile(rawFilename, (char *)stagingData, dataSize, elementSize, computeStatistics ? &accumulator : NULL, getParamBool(parameters, "timing"));
+        if(computeStatistics) {
+            statistics = accumulator.getStatistics();
+            if(getParamBool(parameters, "intensity-statistics-cache"))
+                statistics.save(cacheFilename, cacheKey);
+            hasStatistics = true;
+        }
+
+        Image3D dataset = transferDataset(ocl, stagingData, typeName, spacing, parameters, size, output, hasStatistics ? &statistics : NULL);
+
+        // The staging memory can be released when the device is done with it
+        ocl.queue.finish();
+        ocl.queue.enqueueUnmapMemObject(staging, stagingData);
+        return dataset;
+    }
+
+    // Memory map the raw file and hand it to transferDataset
+    file = new boost::iostreams::mapped_file_source[1];
+    file->open(rawFilename, dataSize);
+
+    if(computeStatistics) {
+        statistics = computeIntensityStatistics(file->data(), typeName, size->x*size->y*size->z);
+        if(getParamBool(parameters, "intensity-statistics-cache"))
+            statistics.save(cacheFilename, cacheKey);
+        hasStatistics = true;
+    }
+
+    Image3D dataset = transferDataset(ocl, file->data(), typeName, spacing, parameters, size, output, hasStatistics ? &statistics : NULL);
+
+    // The mapping must live as long as the device may still read from it
+    dataset.setDestructorCallback((void (__stdcall *)(cl_mem,void *))unmapRawfile, (void *)(file));
+    return dataset;
+}
+
+Image3D transferDataset(OpenCL &ocl, const void * voxels, std::string typeName, SIPL::float3 spacing, paramList &parameters, SIPL::int3 * size, TSFOutput * output, const IntensityStatistics * statistics) {
+    cl_ulong start, end;
+    Event startEvent, endEvent;
+    if(getParamBool(parameters, "timing")) {
+        ocl.queue.enqueueMarker(&startEvent);
+    }
 
-    // Read dataset by memory mapping the file and transfer to device
     Image3D dataset;
     int type = 0;
-    file = new boost::iostreams::mapped_file_source[1];
-    void * data;
-    cl::size_t<3> offset;
-    offset[0] = 0;
-    offset[1] = 0;
-    offset[2] = 0;
-    cl::size_t<3> region2;
-    region2[0] = size->x;
-    region2[1] = size->y;
-    region2[2] = size->z;
+    void * data = const_cast<void *>(voxels);
     float minimum = 0.0f, maximum = 1.0f;
     const int totalSize = size->x*size->y*size->z;
     ImageFormat imageFormat;
 
+    IntensityStatistics computedStatistics;
+    if(statistics == NULL && needsIntensityStatistics(parameters)) {
+        computedStatistics = computeIntensityStatistics(data, typeName, totalSize);
+        statistics = &computedStatistics;
+    }
+    getIntensityLimits(parameters, statistics, &minimum, &maximum);
+
     if(typeName == "MET_SHORT") {
         type = 1;
-        file->open(rawFilename, size->x*size->y*size->z*sizeof(short));
-        data = (void *)file->data();
         imageFormat = ImageFormat(CL_R, CL_SIGNED_INT16);
-        getLimits<short>(parameters, data, totalSize, &minimum, &maximum);
     } else if(typeName == "MET_USHORT") {
         type = 2;
-        file->open(rawFilename, size->x*size->y*size->z*sizeof(short));
-        data = (void *)file->data();
         imageFormat = ImageFormat(CL_R, CL_UNSIGNED_INT16);
-        getLimits<unsigned short>(parameters, data, totalSize, &minimum, &maximum);
 
         if(getParamStr(parameters, "parameters") == "Lung-Airways-CT" || getParamStr(parameters, "parameters") == "AAA-Vessels-CT") {
         	// If parameter preset is airway and the volume loaded is unsigned;
-        	// Change min and max to be unsigned as well, and change Threshold in cropping
+        	// Change min and max to be unsigned as well, and change Threshold in cropping.
+        	// Limits found from the statistics of the volume are already unsigned.
 			char * str = new char[255];
-        	minimum = atof(parameters.strings["minimum"].get().c_str())+1024.0f;
-        	sprintf(str, "%f", minimum);
-        	parameters.strings["minimum"].set(str);
-			maximum = atof(parameters.strings["maximum"].get().c_str())+1024.0f;
-        	sprintf(str, "%f", maximum);
-        	parameters.strings["maximum"].set(str);
+			if(isFixedIntensityLimit(parameters.strings["minimum"].get())) {
+				minimum = atof(parameters.strings["minimum"].get().c_str())+1024.0f;
+				sprintf(str, "%f", minimum);
+				parameters.strings["minimum"].set(str);
+			}
+			if(isFixedIntensityLimit(parameters.strings["maximum"].get())) {
+				maximum = atof(parameters.strings["maximum"].get().c_str())+1024.0f;
+				sprintf(str, "%f", maximum);
+				parameters.strings["maximum"].set(str);
+			}
         }
 
     } else if(typeName == "MET_CHAR") {
         type = 1;
-        file->open(rawFilename, size->x*size->y*size->z*sizeof(char));
-        data = (void *)file->data();
         imageFormat = ImageFormat(CL_R, CL_SIGNED_INT8);
-        getLimits<char>(parameters, data, totalSize, &minimum, &maximum);
     } else if(typeName == "MET_UCHAR") {
         type = 2;
-        file->open(rawFilename, size->x*size->y*size->z*sizeof(char));
-        data = (void *)file->data();
         imageFormat = ImageFormat(CL_R, CL_UNSIGNED_INT8);
-        getLimits<unsigned char>(parameters, data, totalSize, &minimum, &maximum);
     } else if(typeName == "MET_FLOAT") {
         type = 3;
-        file->open(rawFilename, size->x*size->y*size->z*sizeof(float));
-        data = (void *)file->data();
         imageFormat = ImageFormat(CL_R, CL_FLOAT);
-        getLimits<float>(parameters, data, totalSize, &minimum, &maximum);
     } else {
     	std::string str = "unsupported data type " + typeName;
     	throw SIPL::SIPLException(str.c_str(), __LINE__, __FILE__);
     }
-    dataset = Image3D(
-            ocl.context,
-            CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
-            imageFormat,
-            size->x, size->y, size->z,
-            0,0,
-            data
-    );
+
+    std::string cropping = getParamStr(parameters, "cropping");
+    SIPL::int3 shiftVector;
+    const bool hostCropping = (cropping == "lung" || cropping == "threshold") && getParamBool(parameters, "host-cropping");
+    if(hostCropping) {
+        // Find the cropping region on the host and only transfer that region
+        INIT_TIMER
+        std::cout << "performing cropping on host" << std::endl;
+        int minScanLines;
+        std::string cropping_start_z;
+        if(cropping == "lung") {
+			minScanLines = getParam(parameters, "min-scan-lines-lung");
+			cropping_start_z = "middle";
+        } else {
+			minScanLines = getParam(parameters, "min-scan-lines-threshold");
+			cropping_start_z = getParamStr(parameters, "cropping-start-z");
+        }
+        const float threshold = getParam(parameters, "cropping-threshold");
+        short * scanLinesX = new short[size->x];
+        short * scanLinesY = new short[size->y];
+        short * scanLinesZ = new short[size->z];
+        ::size_t elementSize;
+        if(typeName == "MET_SHORT") {
+            cropDatasetOnHost<short>((short *)data, *size, cropping == "lung", threshold, type, scanLinesX, scanLinesY, scanLinesZ);
+            elementSize = sizeof(short);
+        } else if(typeName == "MET_USHORT") {
+            cropDatasetOnHost<unsigned short>((unsigned short *)data, *size, cropping == "lung", threshold, type, scanLinesX, scanLinesY, scanLinesZ);
+            elementSize = sizeof(short);
+        } else if(typeName == "MET_CHAR") {
+            cropDatasetOnHost<char>((char *)data, *size, cropping == "lung", threshold, type, scanLinesX, scanLinesY, scanLinesZ);
+            elementSize = sizeof(char);
+        } else if(typeName == "MET_UCHAR") {
+            cropDatasetOnHost<unsigned char>((unsigned char *)data, *size, cropping == "lung", threshold, type, scanLinesX, scanLinesY, scanLinesZ);
+            elementSize = sizeof(char);
+        } else {
+            cropDatasetOnHost<float>((float *)data, *size, cropping == "lung", threshold, type, scanLinesX, scanLinesY, scanLinesZ);
+            elementSize = sizeof(float);
+        }
+        const SIPL::int3 originalSize = *size;
+        findCropRegion(scanLinesX, scanLinesY, scanLinesZ, minScanLines, cropping_start_z, size, &shiftVector);
+        delete[] scanLinesX;
+        delete[] scanLinesY;
+        delete[] scanLinesZ;
+        if(getParamBool(parameters, "timing")) {
+            STOP_TIMER("cropping on host")
+        }
+        std::cout << "Dataset cropped to " << size->x << ", " << size->y << ", " << size->z << std::endl;
+
+        // Strided write of the cropped region
+        dataset = Image3D(ocl.context, CL_MEM_READ_ONLY, imageFormat, size->x, size->y, size->z);
+        const char * regionStart = (const char *)data + elementSize*(
+                shiftVector.x +
+                (::size_t)shiftVector.y*originalSize.x +
+                (::size_t)shiftVector.z*originalSize.x*originalSize.y);
+        ocl.queue.enqueueWriteImage(
+                dataset,
+                CL_FALSE,
+                oul::createOrigoRegion(),
+                oul::createRegion(size->x, size->y, size->z),
+                elementSize*originalSize.x,
+                elementSize*originalSize.x*originalSize.y,
+                (void *)regionStart
+        );
+    } else {
+        // On CPU devices the image can use the caller's memory directly instead
+        // of making a copy of the entire volume. The image is read only.
+        cl_mem_flags hostPtrFlag = CL_MEM_COPY_HOST_PTR;
+        if(ocl.device.getInfo<CL_DEVICE_TYPE>() == CL_DEVICE_TYPE_CPU)
+            hostPtrFlag = CL_MEM_USE_HOST_PTR;
+        dataset = Image3D(
+                ocl.context,
+                CL_MEM_READ_ONLY | hostPtrFlag,
+                imageFormat,
+                size->x, size->y, size->z,
+                0,0,
+                data
+        );
+    }
 
 
     std::cout << "Dataset of size " << size->x << " " << size->y << " " << size->z << " loaded" << std::endl;
@@ -1556,20 +2507,20 @@ Image3D readDatasetAndTransfer(OpenCL &ocl, std::string filename, paramList &par
         ocl.queue.enqueueMarker(&startEvent);
     }
     // Perform cropping if required
-    std::string cropping = getParamStr(parameters, "cropping");
-    SIPL::int3 shiftVector;
-    if(cropping == "lung" || cropping == "threshold") {
+    if(hostCropping) {
+        // Already cropped on the host
+    } else if(cropping == "lung" || cropping == "threshold") {
         std::cout << "performing cropping" << std::endl;
         Kernel cropDatasetKernel;
         int minScanLines;
         std::string cropping_start_z;
         if(cropping == "lung") {
-			cropDatasetKernel = Kernel(ocl.program, "cropDatasetLung");
+			cropDatasetKernel = getSpecializedKernel(ocl, "cropDatasetLung", getKernelDefine("DATASET_TYPE", type), parameters);
 			minScanLines = getParam(parameters, "min-scan-lines-lung");
 			cropping_start_z = "middle";
 			cropDatasetKernel.setArg(3, type);
         } else if(cropping == "threshold") {
-        	cropDatasetKernel = Kernel(ocl.program, "cropDatasetThreshold");
+        	cropDatasetKernel = getSpecializedKernel(ocl, "cropDatasetThreshold", getKernelDefine("DATASET_TYPE", type), parameters);
 			minScanLines = getParam(parameters, "min-scan-lines-threshold");
 			cropDatasetKernel.setArg(3, getParam(parameters, "cropping-threshold"));
 			cropDatasetKernel.setArg(4, type);
@@ -1611,158 +2562,27 @@ Image3D readDatasetAndTransfer(OpenCL &ocl, std::string filename, paramList &par
         ocl.queue.enqueueReadBuffer(scanLinesInsideY, CL_FALSE, 0, sizeof(short)*size->y, scanLinesY);
         ocl.queue.enqueueReadBuffer(scanLinesInsideZ, CL_FALSE, 0, sizeof(short)*size->z, scanLinesZ);
 
-        int x1 = 0,x2 = size->x,y1 = 0,y2 = size->y,z1 = 0,z2 = size->z;
         ocl.queue.finish();
-        int startSlice, a;
-		if(cropping_start_z == "middle") {
-			startSlice = size->z / 2;
-			a = -1;
-		} else {
-			startSlice = 0;
-			a = 1;
-		}
-
-#pragma omp parallel sections
-{
-#pragma omp section
-{
-        for(int sliceNr = 0; sliceNr < size->x; sliceNr++) {
-            if(scanLinesX[sliceNr] > minScanLines) {
-                x1 = sliceNr;
-                break;
-            }
-        }
-}
-
-#pragma omp section
-{
-        for(int sliceNr = size->x-1; sliceNr > 0; sliceNr--) {
-            if(scanLinesX[sliceNr] > minScanLines) {
-                x2 = sliceNr;
-                break;
-            }
-        }
-}
-#pragma omp section
-{
-        for(int sliceNr = 0; sliceNr < size->y; sliceNr++) {
-            if(scanLinesY[sliceNr] > minScanLines) {
-                y1 = sliceNr;
-                break;
-            }
-        }
-}
-#pragma omp section
-{
-        for(int sliceNr = size->y-1; sliceNr > 0; sliceNr--) {
-            if(scanLinesY[sliceNr] > minScanLines) {
-                y2 = sliceNr;
-                break;
-            }
-        }
-}
-
-#pragma omp section
-{
-		for(int sliceNr = startSlice; sliceNr < size->z; sliceNr++) {
-            if(a*scanLinesZ[sliceNr] > a*minScanLines) {
-                z2 = sliceNr;
-                break;
-            }
-        }
-}
-#pragma omp section
-{
-        for(int sliceNr = size->z - startSlice - 1; sliceNr > 0; sliceNr--) {
-            if(a*scanLinesZ[sliceNr] > a*minScanLines) {
-                z1 = sliceNr;
-                break;
-            }
-        }
-}
-}
-		if(cropping_start_z == "end") {
-			int tmp = z1;
-			z1 = z2;
-			z2 = tmp;
-		}
-
+        findCropRegion(scanLinesX, scanLinesY, scanLinesZ, minScanLines, cropping_start_z, size, &shiftVector);
         delete[] scanLinesX;
         delete[] scanLinesY;
         delete[] scanLinesZ;
 
-        int SIZE_X = x2-x1;
-        int SIZE_Y = y2-y1;
-        int SIZE_Z = z2-z1;
-        if(SIZE_X == 0 || SIZE_Y == 0 || SIZE_Z == 0) {
-        	char * str = new char[255];
-        	sprintf(str, "Invalid cropping to new size %d, %d, %d", SIZE_X, SIZE_Y, SIZE_Z);
-        	throw SIPL::SIPLException(str, __LINE__, __FILE__);
-        }
-	    // Make them dividable by 4
-	    bool lower = false;
-	    while(SIZE_X % 4 != 0 && SIZE_X < size->x) {
-            if(lower && x1 > 0) {
-                x1--;
-            } else if(x2 < size->x) {
-                x2++;
-            }
-            lower = !lower;
-            SIZE_X = x2-x1;
-	    }
-	    if(SIZE_X % 4 != 0) {
-			while(SIZE_X % 4 != 0)
-				SIZE_X--;
-	    }
-	    while(SIZE_Y % 4 != 0 && SIZE_Y < size->y) {
-            if(lower && y1 > 0) {
-                y1--;
-            } else if(y2 < size->y) {
-                y2++;
-            }
-            lower = !lower;
-            SIZE_Y = y2-y1;
-	    }
-	    if(SIZE_Y % 4 != 0) {
-			while(SIZE_Y % 4 != 0)
-				SIZE_Y--;
-	    }
-	    while(SIZE_Z % 4 != 0 && SIZE_Z < size->z) {
-            if(lower && z1 > 0) {
-                z1--;
-            } else if(z2 < size->z) {
-                z2++;
-            }
-            lower = !lower;
-            SIZE_Z = z2-z1;
-	    }
-	    if(SIZE_Z % 4 != 0) {
-			while(SIZE_Z % 4 != 0)
-				SIZE_Z--;
-	    }
-        size->x = SIZE_X;
-        size->y = SIZE_Y;
-        size->z = SIZE_Z;
- 
-
-        std::cout << "Dataset cropped to " << SIZE_X << ", " << SIZE_Y << ", " << SIZE_Z << std::endl;
-        Image3D imageHUvolume = Image3D(ocl.context, CL_MEM_READ_ONLY, imageFormat, SIZE_X, SIZE_Y, SIZE_Z);
+        std::cout << "Dataset cropped to " << size->x << ", " << size->y << ", " << size->z << std::endl;
+        Image3D imageHUvolume = Image3D(ocl.context, CL_MEM_READ_ONLY, imageFormat, size->x, size->y, size->z);
 
         cl::size_t<3> offset;
         offset[0] = 0;
         offset[1] = 0;
         offset[2] = 0;
         cl::size_t<3> region;
-        region[0] = SIZE_X;
-        region[1] = SIZE_Y;
-        region[2] = SIZE_Z;
+        region[0] = size->x;
+        region[1] = size->y;
+        region[2] = size->z;
         cl::size_t<3> srcOffset;
-        srcOffset[0] = x1;
-        srcOffset[1] = y1;
-        srcOffset[2] = z1;
-        shiftVector.x = x1;
-        shiftVector.y = y1;
-        shiftVector.z = z1;
+        srcOffset[0] = shiftVector.x;
+        srcOffset[1] = shiftVector.y;
+        srcOffset[2] = shiftVector.z;
         ocl.queue.enqueueCopyImage(dataset, imageHUvolume, srcOffset, offset, region);
         dataset = imageHUvolume;
         if(getParamBool(parameters, "timing")) {
@@ -1834,7 +2654,7 @@ Image3D readDatasetAndTransfer(OpenCL &ocl, std::string filename, paramList &par
 
     // Run toFloat kernel
 
-    Kernel toFloatKernel = Kernel(ocl.program, "toFloat");
+    Kernel toFloatKernel = getSpecializedKernel(ocl, "toFloat", getKernelDefine("DATASET_TYPE", type), parameters);
     Image3D convertedDataset = Image3D(
         ocl.context,
         CL_MEM_READ_ONLY,
@@ -1901,7 +2721,6 @@ Image3D readDatasetAndTransfer(OpenCL &ocl, std::string filename, paramList &par
         ocl.queue.enqueueMarker(&startEvent);
     }
 
-    dataset.setDestructorCallback((void (__stdcall *)(cl_mem,void *))unmapRawfile, (void *)(file));
     // Return dataset
     return convertedDataset;
 }
@@ -18,6 +18,8 @@ using boost::unordered_map;
 #include "parameters.hpp"
 #include "SIPL/Exceptions.hpp"
 #include "inputOutput.hpp"
+#include "intensityStatistics.hpp"
+#include "parameterSweep.hpp"
 
 typedef struct TubeSegmentation {
     float *Fx, *Fy, *Fz; // The GVF vector field
@@ -27,6 +29,8 @@ typedef struct TubeSegmentation {
     char *centerline;
     char *segmentation;
     float *intensity;
+    int *directionBricks; // The tube direction field, NULL if it is not used
+    short *directions;
 } TubeSegmentation;
 
 
@@ -37,13 +41,45 @@ void print(paramList parameters);
 
 cl::Image3D readDatasetAndTransfer(OpenCL &ocl, std::string, paramList &parameters, SIPL::int3 *, TSFOutput *);
 
+/*
+ * Transfer a volume that is already in host memory to the device.
+ * typeName is a MetaImage element type (MET_SHORT, MET_USHORT, MET_CHAR,
+ * MET_UCHAR or MET_FLOAT) and size must contain the size of the volume.
+ * Intensity statistics are computed from the data if needed and not given.
+ */
+cl::Image3D transferDataset(OpenCL &ocl, const void * voxels, std::string typeName, SIPL::float3 spacing, paramList &parameters, SIPL::int3 * size, TSFOutput *, const IntensityStatistics * statistics = NULL);
+
 void runCircleFittingAndRidgeTraversal(OpenCL *, cl::Image3D *dataset, SIPL::int3 * size, paramList &parameters, TSFOutput *);
 
 void runCircleFittingAndNewCenterlineAlg(OpenCL *, cl::Image3D *dataset, SIPL::int3 * size, paramList &parameters, TSFOutput *);
 
 void runCircleFittingAndTest(OpenCL *, cl::Image3D *dataset, SIPL::int3 * size, paramList &parameters, TSFOutput *);
 
+/*
+ * Centerline extraction and segmentation on the results of the circle fitting
+ * method. The output takes ownership of TDF. The images are only read, so
+ * calls on different command queues may share them.
+ */
+void runNewCenterlineAlgAndSegmentation(OpenCL *, SIPL::int3 * size, paramList &parameters, TSFOutput *, cl::Image3D &vectorField, cl::Image3D * TDF, cl::Image3D &radius);
+
+void runRidgeTraversalAndSegmentation(OpenCL *, SIPL::int3 * size, paramList &parameters, TSFOutput *, cl::Image3D &vectorField, cl::Image3D * TDF, cl::Image3D &radius);
+
 
 TSFOutput * run(std::string filename, paramList &parameters, std::string kernel_dir);
 
+/*
+ * Run on a volume owned by the caller. The buffer must stay valid until run
+ * returns, as CPU devices will read from it directly without copying it.
+ */
+TSFOutput * run(const void * voxels, SIPL::int3 size, SIPL::float3 spacing, std::string elementType, paramList &parameters, std::string kernel_dir);
+
+/*
+ * Run every point of a parameter grid on a dataset. Reading, GVF and TDF are
+ * done once for all points that share their parameters, and the centerline
+ * extraction and segmentation of these points run concurrently on the same
+ * device, sweep-threads at a time. The results are in the order of the grid
+ * and scored by scorer if it is given.
+ */
+std::vector<TSFSweepResult> runParameterSweep(std::string filename, paramList &parameters, const TSFParameterGrid &grid, std::string kernel_dir, TSFSweepScorer * scorer = NULL);
+
 #endif
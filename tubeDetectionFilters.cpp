@@ -1,5 +1,9 @@
 #include "tubeDetectionFilters.hpp"
 #include <algorithm>
+#include <iostream>
+#include "OpenCLUtilityLibrary/HistogramPyramids.hpp"
+#include "timing.hpp"
+#include "specializedKernels.hpp"
 
 #undef min
 #undef max
@@ -59,14 +63,23 @@ void runSplineTDF(
     );
 }
 
-void runCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorField, Buffer * TDF, Buffer * radius, float radiusMin, float radiusMax, float radiusStep) {
-    Kernel circleFittingTDFKernel(ocl.program, "circleFittingTDF");
+void runCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorField, Buffer * TDF, Buffer * radius, float radiusMin, float radiusMax, float radiusStep, paramList &parameters) {
+    INIT_TIMER
+    if(getParamBool(parameters, "timing")) {
+        ocl.queue.finish();
+        START_TIMER
+    }
+    Kernel circleFittingTDFKernel = getSpecializedKernel(ocl, "circleFittingTDF",
+            getKernelDefine("TDF_RADIUS_MIN", radiusMin) + getKernelDefine("TDF_RADIUS_MAX", radiusMax) + getKernelDefine("TDF_RADIUS_STEP", radiusStep),
+            parameters);
     circleFittingTDFKernel.setArg(0, *vectorField);
     circleFittingTDFKernel.setArg(1, *TDF);
     circleFittingTDFKernel.setArg(2, *radius);
     circleFittingTDFKernel.setArg(3, radiusMin);
     circleFittingTDFKernel.setArg(4, radiusMax);
     circleFittingTDFKernel.setArg(5, radiusStep);
+    circleFittingTDFKernel.setArg(6, (int)getParam(parameters, "tdf-coarse-radius-step"));
+    circleFittingTDFKernel.setArg(7, getParamBool(parameters, "tdf-reduced-samples") ? 1 : 0);
 
     ocl.queue.enqueueNDRangeKernel(
             circleFittingTDFKernel,
@@ -74,6 +87,110 @@ void runCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorField, B
             NDRange(size.x,size.y,size.z),
             NDRange(4,4,4)
     );
+    if(getParamBool(parameters, "timing")) {
+        ocl.queue.finish();
+        STOP_TIMER("dense TDF")
+    }
+}
+
+void runMultiScaleCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorFieldSmall, Image3D * vectorFieldLarge, Buffer * TDF, Buffer * radius, float radiusMinSmall, float radiusMaxSmall, float radiusStepSmall, float radiusMinLarge, float radiusMaxLarge, float radiusStepLarge, int coarseRadiusStep, bool reducedSamples) {
+    Kernel circleFittingTDFKernel(ocl.program, "circleFittingTDFMultiScale");
+    circleFittingTDFKernel.setArg(0, *vectorFieldSmall);
+    circleFittingTDFKernel.setArg(1, *vectorFieldLarge);
+    circleFittingTDFKernel.setArg(2, *TDF);
+    circleFittingTDFKernel.setArg(3, *radius);
+    circleFittingTDFKernel.setArg(4, radiusMinSmall);
+    circleFittingTDFKernel.setArg(5, radiusMaxSmall);
+    circleFittingTDFKernel.setArg(6, radiusStepSmall);
+    circleFittingTDFKernel.setArg(7, radiusMinLarge);
+    circleFittingTDFKernel.setArg(8, radiusMaxLarge);
+    circleFittingTDFKernel.setArg(9, radiusStepLarge);
+    circleFittingTDFKernel.setArg(10, coarseRadiusStep);
+    circleFittingTDFKernel.setArg(11, reducedSamples ? 1 : 0);
 
+    ocl.queue.enqueueNDRangeKernel(
+            circleFittingTDFKernel,
+            NullRange,
+            NDRange(size.x,size.y,size.z),
+            NDRange(4,4,4)
+    );
 }
 
+void runSparseCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorField, Buffer * TDF, Buffer * radius, float radiusMin, float radiusMax, float radiusStep, paramList &parameters) {
+    // Work queued before is not part of the timing
+    if(getParamBool(parameters, "timing"))
+        ocl.queue.finish();
+    INIT_TIMER
+    const int totalSize = size.x*size.y*size.z;
+    Kernel markKernel(ocl.program, "markPlausibleTubeVoxels");
+    markKernel.setArg(0, *vectorField);
+    markKernel.setArg(2, *TDF);
+    markKernel.setArg(3, *radius);
+    markKernel.setArg(4, (float)getParam(parameters, "tdf-sparse-threshold"));
+
+    // Compact the positions of the plausible voxels
+    Buffer positions;
+    int sum = 0;
+    if(!getParamBool(parameters, "3d_write")) {
+        Buffer plausible(ocl.context, CL_MEM_READ_WRITE, sizeof(char)*totalSize);
+        markKernel.setArg(1, plausible);
+        ocl.queue.enqueueNDRangeKernel(
+                markKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NullRange
+        );
+        oul::HistogramPyramid3DBuffer hp(ocl.oulContext);
+        hp.create(plausible, size.x, size.y, size.z);
+        sum = hp.getSum();
+        if(sum > 0)
+            positions = hp.createPositionBuffer();
+        hp.deleteHPlevels();
+    } else {
+        Image3D plausible(ocl.context, CL_MEM_READ_WRITE, ImageFormat(CL_R, CL_SIGNED_INT8), size.x, size.y, size.z);
+        markKernel.setArg(1, plausible);
+        ocl.queue.enqueueNDRangeKernel(
+                markKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NullRange
+        );
+        oul::HistogramPyramid3D hp(ocl.oulContext);
+        hp.create(plausible, size.x, size.y, size.z);
+        sum = hp.getSum();
+        if(sum > 0)
+            positions = hp.createPositionBuffer();
+        hp.deleteHPlevels();
+    }
+    std::cout << "NOTE: Circle fitting TDF evaluated for " << sum << " of " << totalSize << " voxels (" << 100.0f*sum/totalSize << " %)" << std::endl;
+    if(getParamBool(parameters, "timing")) {
+        ocl.queue.finish();
+        STOP_TIMER("sparse TDF pre-pass")
+        START_TIMER
+    }
+    if(sum == 0)
+        return;
+
+    Kernel circleFittingTDFKernel(ocl.program, "circleFittingTDFSparse");
+    circleFittingTDFKernel.setArg(0, *vectorField);
+    circleFittingTDFKernel.setArg(1, *TDF);
+    circleFittingTDFKernel.setArg(2, *radius);
+    circleFittingTDFKernel.setArg(3, radiusMin);
+    circleFittingTDFKernel.setArg(4, radiusMax);
+    circleFittingTDFKernel.setArg(5, radiusStep);
+    circleFittingTDFKernel.setArg(6, (int)getParam(parameters, "tdf-coarse-radius-step"));
+    circleFittingTDFKernel.setArg(7, getParamBool(parameters, "tdf-reduced-samples") ? 1 : 0);
+    circleFittingTDFKernel.setArg(8, positions);
+    circleFittingTDFKernel.setArg(9, sum);
+    const int workGroupSize = 64;
+    ocl.queue.enqueueNDRangeKernel(
+            circleFittingTDFKernel,
+            NullRange,
+            NDRange(((sum + workGroupSize - 1) / workGroupSize) * workGroupSize),
+            NDRange(workGroupSize)
+    );
+    if(getParamBool(parameters, "timing")) {
+        ocl.queue.finish();
+        STOP_TIMER("sparse TDF")
+    }
+}
@@ -1,5 +1,6 @@
 #include "commons.hpp"
 #include "SIPL/Types.hpp"
+#include "parameters.hpp"
 using namespace cl;
 
 void runSplineTDF(
@@ -12,4 +13,18 @@ void runSplineTDF(
         float radiusMax,
         float radiusStep
         );
-void runCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorField, Buffer * TDF, Buffer * radius, float radiusMin, float radiusMax, float radiusStep);
+// Uses tdf-coarse-radius-step and tdf-reduced-samples
+void runCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorField, Buffer * TDF, Buffer * radius, float radiusMin, float radiusMax, float radiusStep, paramList &parameters);
+
+/*
+ * Circle fitting TDF of the small scale vector field and the GVF vector field
+ * in one pass, keeping the radius with the highest TDF of the two
+ */
+void runMultiScaleCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorFieldSmall, Image3D * vectorFieldLarge, Buffer * TDF, Buffer * radius, float radiusMinSmall, float radiusMaxSmall, float radiusStepSmall, float radiusMinLarge, float radiusMaxLarge, float radiusStepLarge, int coarseRadiusStep, bool reducedSamples);
+
+/*
+ * Circle fitting TDF of only the voxels where the divergence of the vector
+ * field is below -tdf-sparse-threshold. The other voxels get a TDF and radius
+ * of zero.
+ */
+void runSparseCircleFittingTDF(OpenCL &ocl, SIPL::int3 &size, Image3D * vectorField, Buffer * TDF, Buffer * radius, float radiusMin, float radiusMax, float radiusStep, paramList &parameters);
@@ -0,0 +1,121 @@
+#include "tubeDirectionField.hpp"
+#include <algorithm>
+#include <iostream>
+#include <vector>
+#include "timing.hpp"
+
+static SIPL::int3 getTubeDirectionBricks(SIPL::int3 size) {
+    return SIPL::int3(
+            (size.x + TUBE_DIRECTION_BRICK_SIZE - 1) / TUBE_DIRECTION_BRICK_SIZE,
+            (size.y + TUBE_DIRECTION_BRICK_SIZE - 1) / TUBE_DIRECTION_BRICK_SIZE,
+            (size.z + TUBE_DIRECTION_BRICK_SIZE - 1) / TUBE_DIRECTION_BRICK_SIZE
+    );
+}
+
+static const int brickVoxels = TUBE_DIRECTION_BRICK_SIZE*TUBE_DIRECTION_BRICK_SIZE*TUBE_DIRECTION_BRICK_SIZE;
+
+TubeDirectionField createTubeDirectionField(OpenCL &ocl, SIPL::int3 size, paramList &parameters, Image3D &vectorField, Image3D &TDF) {
+    TubeDirectionField field;
+    field.enabled = getParamBool(parameters, "tube-direction-field");
+    field.nrOfSlots = 0;
+    if(!field.enabled)
+        return field;
+
+    INIT_TIMER
+    // The lowest TDF at which the centerline extraction methods ask for the
+    // tube direction. createGraph uses a fixed threshold of 0.5.
+    const float threshold = std::min(std::min((float)getParam(parameters, "tdf-high"), (float)getParam(parameters, "tdf-low")), 0.5f);
+    const SIPL::int3 bricks = getTubeDirectionBricks(size);
+    const int nrOfBricks = bricks.x*bricks.y*bricks.z;
+    std::vector<int> brickTable(nrOfBricks);
+    field.brickTable = Buffer(ocl.context, CL_MEM_READ_WRITE, sizeof(int)*nrOfBricks);
+
+    const ::size_t denseSize = (::size_t)nrOfBricks*brickVoxels*3*sizeof(short);
+    const ::size_t budget = std::min(
+            (::size_t)ocl.device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>(),
+            (::size_t)(ocl.device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 8)
+    );
+    if(denseSize <= budget) {
+        for(int i = 0; i < nrOfBricks; i++)
+            brickTable[i] = i;
+        field.nrOfSlots = nrOfBricks;
+    } else {
+        // Mark the bricks with a voxel above the threshold and give them a slot each
+        std::fill(brickTable.begin(), brickTable.end(), 0);
+        ocl.queue.enqueueWriteBuffer(field.brickTable, CL_TRUE, 0, sizeof(int)*nrOfBricks, &brickTable[0]);
+        Kernel markKernel(ocl.program, "markTubeDirectionBricks");
+        markKernel.setArg(0, TDF);
+        markKernel.setArg(1, field.brickTable);
+        markKernel.setArg(2, threshold);
+        ocl.queue.enqueueNDRangeKernel(
+                markKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NullRange
+        );
+        ocl.queue.enqueueReadBuffer(field.brickTable, CL_TRUE, 0, sizeof(int)*nrOfBricks, &brickTable[0]);
+        for(int i = 0; i < nrOfBricks; i++)
+            brickTable[i] = brickTable[i] == 0 ? -1 : field.nrOfSlots++;
+        std::cout << "NOTE: Storing the tube direction of " << field.nrOfSlots << " of " << nrOfBricks << " bricks." << std::endl;
+    }
+    ocl.queue.enqueueWriteBuffer(field.brickTable, CL_TRUE, 0, sizeof(int)*nrOfBricks, &brickTable[0]);
+    field.directions = Buffer(ocl.context, CL_MEM_READ_WRITE, sizeof(short)*3*brickVoxels*std::max(field.nrOfSlots, 1));
+
+    if(field.nrOfSlots > 0) {
+        Kernel directionKernel(ocl.program, "createTubeDirectionField");
+        directionKernel.setArg(0, vectorField);
+        directionKernel.setArg(1, TDF);
+        directionKernel.setArg(2, field.brickTable);
+        directionKernel.setArg(3, field.directions);
+        directionKernel.setArg(4, threshold);
+        ocl.queue.enqueueNDRangeKernel(
+                directionKernel,
+                NullRange,
+                NDRange(size.x,size.y,size.z),
+                NullRange
+        );
+    }
+    if(getParamBool(parameters, "timing")) {
+        ocl.queue.finish();
+        STOP_TIMER("tube direction field")
+    }
+    return field;
+}
+
+void setTubeDirectionFieldArgs(OpenCL &ocl, Kernel &kernel, int index, TubeDirectionField &field) {
+    if(!field.enabled) {
+        // The kernels do not read the buffers, but they must be valid
+        field.brickTable = Buffer(ocl.context, CL_MEM_READ_ONLY, sizeof(int));
+        field.directions = Buffer(ocl.context, CL_MEM_READ_ONLY, sizeof(short)*3);
+    }
+    kernel.setArg(index, field.brickTable);
+    kernel.setArg(index+1, field.directions);
+    kernel.setArg(index+2, field.enabled ? 1 : 0);
+}
+
+void transferTubeDirectionField(OpenCL &ocl, SIPL::int3 size, TubeDirectionField &field, int ** brickTable, short ** directions) {
+    if(!field.enabled) {
+        *brickTable = NULL;
+        *directions = NULL;
+        return;
+    }
+    const SIPL::int3 bricks = getTubeDirectionBricks(size);
+    const int nrOfBricks = bricks.x*bricks.y*bricks.z;
+    *brickTable = new int[nrOfBricks];
+    *directions = new short[(::size_t)std::max(field.nrOfSlots, 1)*brickVoxels*3];
+    ocl.queue.enqueueReadBuffer(field.brickTable, CL_FALSE, 0, sizeof(int)*nrOfBricks, *brickTable);
+    if(field.nrOfSlots > 0)
+        ocl.queue.enqueueReadBuffer(field.directions, CL_FALSE, 0, sizeof(short)*3*brickVoxels*field.nrOfSlots, *directions);
+    ocl.queue.finish();
+}
+
+int getTubeDirectionIndex(const int * brickTable, SIPL::int3 pos, SIPL::int3 size) {
+    const SIPL::int3 bricks = getTubeDirectionBricks(size);
+    const int brick = pos.x/TUBE_DIRECTION_BRICK_SIZE +
+            (pos.y/TUBE_DIRECTION_BRICK_SIZE + (pos.z/TUBE_DIRECTION_BRICK_SIZE)*bricks.y)*bricks.x;
+    const int slot = brickTable[brick];
+    if(slot < 0)
+        return -1;
+    return slot*brickVoxels + pos.x%TUBE_DIRECTION_BRICK_SIZE +
+            (pos.y%TUBE_DIRECTION_BRICK_SIZE + (pos.z%TUBE_DIRECTION_BRICK_SIZE)*TUBE_DIRECTION_BRICK_SIZE)*TUBE_DIRECTION_BRICK_SIZE;
+}
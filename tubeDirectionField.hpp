@@ -0,0 +1,42 @@
+#ifndef TUBE_DIRECTION_FIELD_H
+#define TUBE_DIRECTION_FIELD_H
+#include "commons.hpp"
+#include "SIPL/Types.hpp"
+#include "parameters.hpp"
+using namespace cl;
+
+#define TUBE_DIRECTION_BRICK_SIZE 4
+
+/*
+ * The tube direction (the eigenvector e1 of the Hessian of the vector field)
+ * of the voxels with a TDF above a threshold, computed once and shared by the
+ * centerline extraction steps. The directions are stored as three 16 bit
+ * signed normalized integers per voxel in bricks of 4x4x4 voxels. The brick
+ * table has the slot of each brick in the directions buffer, or -1 if the
+ * brick is not stored. A zero direction is not stored and has to be computed
+ * from the vector field.
+ */
+typedef struct TubeDirectionField {
+    bool enabled;
+    int nrOfSlots;
+    Buffer brickTable;
+    Buffer directions;
+} TubeDirectionField;
+
+/*
+ * The field is only created if tube-direction-field is set. All bricks are
+ * stored if they fit in the memory budget of the device, otherwise only the
+ * bricks with a voxel above the threshold.
+ */
+TubeDirectionField createTubeDirectionField(OpenCL &ocl, SIPL::int3 size, paramList &parameters, Image3D &vectorField, Image3D &TDF);
+
+// Set the brick table, directions and whether the field is enabled as the arguments index to index+2
+void setTubeDirectionFieldArgs(OpenCL &ocl, Kernel &kernel, int index, TubeDirectionField &field);
+
+// Copy the field to host arrays, which are set to NULL if the field is not enabled
+void transferTubeDirectionField(OpenCL &ocl, SIPL::int3 size, TubeDirectionField &field, int ** brickTable, short ** directions);
+
+// Index of the direction of pos in the directions array, or -1 if its brick is not stored
+int getTubeDirectionIndex(const int * brickTable, SIPL::int3 pos, SIPL::int3 size);
+
+#endif
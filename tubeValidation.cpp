@@ -1,19 +1,8 @@
-#include "../SIPL/Core.hpp"
-#include "../tube-segmentation.hpp"
+#include "tubeValidation.hpp"
 #include <iostream>
-#include <queue>
-#include <vector>
-#include <string>
+#include <cstring>
 using namespace SIPL;
 
-typedef struct TubeValidation {
-	float averageDistanceFromCenterline;
-	float percentageExtractedCenterlines;
-	float recall;
-	float precision;
-	unsigned int incorrectCenterpoints;
-} TubeValidation;
-
 TubeValidation getValidationMeasures(
 		Volume<char> * realCenterlines,
 		Volume<char> * eCenterlines,
@@ -135,6 +124,9 @@ TubeValidation getValidationMeasures(
 	result.precision = (float)truePositives / (truePositives+falsePositives);
 	std::cout << "Recall: " << result.recall << std::endl;
 	std::cout << "Precision: " << result.precision << std::endl;
+	delete detectedCenterlines;
+	if(!visualize) // The window may still show it
+		delete visualization;
 	return result;
 }
 
@@ -158,3 +150,46 @@ TubeValidation validateTube(TSFOutput * output, std::string segmentationPath, st
 	return result;
 
 }
+
+ValidationScorer::ValidationScorer(std::string segmentationPath, std::string centerlinePath) {
+	original = new Volume<char>(segmentationPath.c_str());
+	realCenterlines = new Volume<char>(centerlinePath.c_str());
+}
+
+ValidationScorer::~ValidationScorer() {
+	delete original;
+	delete realCenterlines;
+}
+
+std::vector<std::string> ValidationScorer::getNames() {
+	std::vector<std::string> names;
+	names.push_back("average-distance");
+	names.push_back("extracted-centerlines");
+	names.push_back("recall");
+	names.push_back("precision");
+	names.push_back("incorrect-centerpoints");
+	return names;
+}
+
+std::vector<float> ValidationScorer::score(TSFOutput * output) {
+	SIPL::int3 size = *(output->getSize());
+	Volume<char> * extractedCenterlines = new Volume<char>(size);
+	Volume<char> * segmentation = new Volume<char>(size);
+	memcpy(extractedCenterlines->getData(), output->getCenterlineVoxels(), extractedCenterlines->getTotalSize());
+	if(output->hasSegmentation()) {
+		memcpy(segmentation->getData(), output->getSegmentation(), segmentation->getTotalSize());
+	} else {
+		segmentation->fill(0);
+	}
+	TubeValidation result = getValidationMeasures(realCenterlines, extractedCenterlines, original, segmentation, false);
+	delete extractedCenterlines;
+	delete segmentation;
+
+	std::vector<float> measures;
+	measures.push_back(result.averageDistanceFromCenterline);
+	measures.push_back(result.percentageExtractedCenterlines);
+	measures.push_back(result.recall);
+	measures.push_back(result.precision);
+	measures.push_back(result.incorrectCenterpoints);
+	return measures;
+}
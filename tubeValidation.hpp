@@ -0,0 +1,46 @@
+#ifndef TUBE_VALIDATION_H
+#define TUBE_VALIDATION_H
+
+#include <string>
+#include <vector>
+#include "SIPL/Core.hpp"
+#include "tube-segmentation.hpp"
+#include "parameterSweep.hpp"
+
+typedef struct TubeValidation {
+	float averageDistanceFromCenterline;
+	float percentageExtractedCenterlines;
+	float recall;
+	float precision;
+	unsigned int incorrectCenterpoints;
+} TubeValidation;
+
+/*
+ * Compares extracted centerlines and segmentation with the real ones and
+ * prints the result. A centerpoint is correct if a real centerpoint is
+ * within 4 voxels.
+ */
+TubeValidation getValidationMeasures(
+		SIPL::Volume<char> * realCenterlines,
+		SIPL::Volume<char> * eCenterlines,
+		SIPL::Volume<char> * original,
+		SIPL::Volume<char> * segmentation,
+		bool visualize
+		);
+
+// Validates the result of a run against the volumes in the given .mhd files
+TubeValidation validateTube(TSFOutput * output, std::string segmentationPath, std::string centerlinePath);
+
+// Scores the points of a sweep against a reference segmentation and centerline
+class ValidationScorer : public TSFSweepScorer {
+public:
+	ValidationScorer(std::string segmentationPath, std::string centerlinePath);
+	~ValidationScorer();
+	std::vector<std::string> getNames();
+	std::vector<float> score(TSFOutput * output);
+private:
+	SIPL::Volume<char> * original;
+	SIPL::Volume<char> * realCenterlines;
+};
+
+#endif